@@ -629,7 +629,7 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
         [](common_params & params, const std::string & value) {
             params.lookup_cache_static = value;
         }
-    ).set_examples({LLAMA_EXAMPLE_LOOKUP}));
+    ).set_examples({LLAMA_EXAMPLE_LOOKUP, LLAMA_EXAMPLE_SERVER}));
     add_opt(common_arg(
         {"-lcd", "--lookup-cache-dynamic"}, "FNAME",
         "path to dynamic lookup cache to use for lookup decoding (updated by generation)",
@@ -710,6 +710,20 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.sampling.no_perf = true;
         }
     ).set_env("LLAMA_ARG_NO_PERF"));
+    add_opt(common_arg(
+        {"--trace"}, "FNAME",
+        "profile the graph splits, the copies between the backends and the synchronization waits, and save them as Chrome trace JSON on exit (default: none)",
+        [](common_params & params, const std::string & value) {
+            params.trace_file = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_MAIN, LLAMA_EXAMPLE_SERVER}));
+    add_opt(common_arg(
+        {"--trace-nodes"},
+        string_format("with --trace, profile each node instead of each split, which is slower (default: %s)", params.trace_nodes ? "true" : "false"),
+        [](common_params & params) {
+            params.trace_nodes = true;
+        }
+    ).set_examples({LLAMA_EXAMPLE_MAIN, LLAMA_EXAMPLE_SERVER}));
     add_opt(common_arg(
         {"-f", "--file"}, "FNAME",
         "a file containing the prompt (default: none)",
@@ -878,6 +892,13 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.warmup = false;
         }
     ).set_examples({LLAMA_EXAMPLE_MAIN, LLAMA_EXAMPLE_SERVER, LLAMA_EXAMPLE_EMBEDDING}));
+    add_opt(common_arg(
+        {"--warmup-async"},
+        "instead of the warmup run, read the model weights in the background, layer by layer, while the model is already in use (the warmup run is still done when the weights are not memory mapped)",
+        [](common_params & params) {
+            params.warmup_async = true;
+        }
+    ).set_examples({LLAMA_EXAMPLE_MAIN, LLAMA_EXAMPLE_SERVER, LLAMA_EXAMPLE_EMBEDDING}).set_env("LLAMA_ARG_WARMUP_ASYNC"));
     add_opt(common_arg(
         {"--spm-infill"},
         string_format(
@@ -1125,6 +1146,13 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.sampling.grammar = value;
         }
     ).set_sparam());
+    add_opt(common_arg(
+        {"--grammar-async"},
+        string_format("compute the grammar mask of the next token on a worker thread while its logits are computed (default: %s)", params.sampling.grammar_async ? "enabled" : "disabled"),
+        [](common_params & params) {
+            params.sampling.grammar_async = true;
+        }
+    ).set_sparam());
     add_opt(common_arg(
         {"--grammar-file"}, "FNAME",
         "file to read grammar from",
@@ -2235,13 +2263,30 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.speculative.n_min = value;
         }
     ).set_examples({LLAMA_EXAMPLE_SPECULATIVE, LLAMA_EXAMPLE_LOOKUP, LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_DRAFT_MIN"));
+    add_opt(common_arg(
+        {"--draft-lookup"},
+        "draft from the n-grams of the prompt, of the generated text and of --lookup-cache-static when there is no draft model (default: disabled)",
+        [](common_params & params) {
+            params.speculative.lookup = true;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_DRAFT_LOOKUP"));
+    add_opt(common_arg(
+        {"--draft-n-seq"}, "N",
+        string_format("max number of draft branches for tree speculative decoding (default: %d, 1 = linear draft)", params.speculative.n_seq),
+        [](common_params & params, int value) {
+            if (value < 1) {
+                throw std::invalid_argument("invalid value");
+            }
+            params.speculative.n_seq = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_DRAFT_N_SEQ"));
     add_opt(common_arg(
         {"--draft-p-split"}, "P",
         string_format("speculative decoding split probability (default: %.1f)", (double)params.speculative.p_split),
         [](common_params & params, const std::string & value) {
             params.speculative.p_split = std::stof(value);
         }
-    ).set_examples({LLAMA_EXAMPLE_SPECULATIVE}).set_env("LLAMA_ARG_DRAFT_P_SPLIT"));
+    ).set_examples({LLAMA_EXAMPLE_SPECULATIVE, LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_DRAFT_P_SPLIT"));
     add_opt(common_arg(
         {"--draft-p-min"}, "P",
         string_format("minimum speculative decoding probability (greedy) (default: %.1f)", (double)params.speculative.p_min),
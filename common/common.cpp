@@ -1027,7 +1027,14 @@ struct common_init_result common_init_from_params(common_params & params) {
         params.sampling.dry_penalty_last_n = llama_n_ctx(lctx);
     }
 
-    if (params.warmup) {
+    // the weights are read in the background while the model is already being used
+    // without memory mapped weights to prefetch, the model is warmed up with an empty run instead
+    if (params.warmup && params.warmup_async && !llama_model_prefetch(model, params.cpuparams.n_threads)) {
+        LOG_INF("%s: nothing to prefetch in the background, warming up synchronously\n", __func__);
+        params.warmup_async = false;
+    }
+
+    if (params.warmup && !params.warmup_async) {
         LOG_WRN("%s: warming up the model with an empty run - please wait ... (--no-warmup to disable)\n", __func__);
 
         std::vector<llama_token> tmp;
@@ -1062,6 +1069,11 @@ struct common_init_result common_init_from_params(common_params & params) {
         llama_perf_context_reset(lctx);
     }
 
+    // the warmup is not profiled
+    if (!params.trace_file.empty()) {
+        llama_perf_trace_start(lctx, params.trace_nodes);
+    }
+
     iparams.model.reset(model);
     iparams.context.reset(lctx);
 
@@ -1092,6 +1104,7 @@ struct llama_model_params common_model_params_to_llama(common_params & params) {
     mparams.use_mmap        = params.use_mmap;
     mparams.use_mlock       = params.use_mlock;
     mparams.check_tensors   = params.check_tensors;
+    mparams.defer_prefetch  = params.warmup && params.warmup_async;
     if (params.kv_overrides.empty()) {
         mparams.kv_overrides = NULL;
     } else {
@@ -1130,6 +1143,8 @@ struct llama_context_params common_context_params_to_llama(const common_params &
     cparams.offload_kqv       = !params.no_kv_offload;
     cparams.flash_attn        = params.flash_attn;
     cparams.no_perf           = params.no_perf;
+    cparams.collect_imatrix   = params.collect_imatrix;
+    cparams.collect_imatrix_output = params.collect_imatrix && params.process_output;
 
     if (params.reranking) {
         cparams.embeddings    = true;
@@ -1708,14 +1723,15 @@ std::vector<llama_token> common_tokenize(
     const struct llama_vocab * vocab,
            const std::string & text,
                         bool   add_special,
-                        bool   parse_special) {
+                        bool   parse_special,
+                     int32_t   n_threads) {
     // upper limit for the number of tokens
     int n_tokens = text.length() + 2 * add_special;
     std::vector<llama_token> result(n_tokens);
-    n_tokens = llama_tokenize(vocab, text.data(), text.length(), result.data(), result.size(), add_special, parse_special);
+    n_tokens = llama_tokenize_parallel(vocab, text.data(), text.length(), result.data(), result.size(), add_special, parse_special, n_threads);
     if (n_tokens < 0) {
         result.resize(-n_tokens);
-        int check = llama_tokenize(vocab, text.data(), text.length(), result.data(), result.size(), add_special, parse_special);
+        int check = llama_tokenize_parallel(vocab, text.data(), text.length(), result.data(), result.size(), add_special, parse_special, n_threads);
         GGML_ASSERT(check == -n_tokens);
     } else {
         result.resize(n_tokens);
@@ -154,7 +154,8 @@ struct common_params_sampling {
         COMMON_SAMPLER_TYPE_TEMPERATURE,
     };
 
-    std::string grammar; // optional BNF-like grammar to constrain sampling
+    std::string grammar;               // optional BNF-like grammar to constrain sampling
+    bool        grammar_async = false; // compute the grammar mask of the next token while its logits are computed
 
     std::vector<llama_logit_bias> logit_bias; // logit biases to apply
 
@@ -169,9 +170,12 @@ struct common_params_speculative {
     int32_t n_max        =    16; // maximum number of tokens to draft during speculative decoding
     int32_t n_min        =     5; // minimum number of draft tokens to use for speculative decoding
     int32_t n_gpu_layers =    -1; // number of layers to store in VRAM for the draft model (-1 - use default)
+    int32_t n_seq        =     1; // max number of draft branches for tree speculation (1 = linear draft)
     float   p_split      =  0.1f; // speculative decoding split probability
     float   p_min        =  0.9f; // minimum speculative decoding probability (greedy)
 
+    bool lookup = false; // draft from the n-grams of the context when there is no draft model
+
     struct cpu_params cpuparams;
     struct cpu_params cpuparams_batch;
 
@@ -252,6 +256,7 @@ struct common_params {
     std::string lookup_cache_static  = ""; // path of static ngram cache file for lookup decoding           // NOLINT
     std::string lookup_cache_dynamic = ""; // path of dynamic ngram cache file for lookup decoding          // NOLINT
     std::string logits_file          = ""; // file for saving *all* logits                                  // NOLINT
+    std::string trace_file           = ""; // file for saving the scheduler profile as Chrome trace JSON    // NOLINT
 
     std::vector<std::string> in_files;   // all input files
     std::vector<std::string> antiprompt; // strings upon which more user input is prompted (a.k.a. reverse prompts)
@@ -295,6 +300,7 @@ struct common_params {
     bool cont_batching     = true;  // insert new sequences for decoding on-the-fly
     bool flash_attn        = false; // flash attention
     bool no_perf           = false; // disable performance metrics
+    bool trace_nodes       = false; // profile each node instead of each split
     bool ctx_shift         = true;  // context shift on inifinite text generation
 
     bool input_prefix_bos  = false; // prefix BOS to user inputs, preceding input_prefix
@@ -306,6 +312,7 @@ struct common_params {
     bool dump_kv_cache     = false; // dump the KV cache contents for debugging purposes
     bool no_kv_offload     = false; // disable KV offloading
     bool warmup            = true;  // warmup run
+    bool warmup_async      = false; // prefetch the model weights in the background instead of the warmup run
     bool check_tensors     = false; // validate tensor data
 
     ggml_type cache_type_k = GGML_TYPE_F16; // KV cache data type for the K
@@ -381,6 +388,7 @@ struct common_params {
 
     bool process_output = false; // collect data for the output tensor
     bool compute_ppl    = true;  // whether to compute perplexity
+    bool collect_imatrix = false; // accumulate the activation statistics in the compute graph
 
     // cvector-generator params
     int n_pca_batch = 100;
@@ -567,11 +575,13 @@ std::vector<llama_token> common_tokenize(
                         bool   add_special,
                         bool   parse_special = false);
 
+// n_threads > 1: long texts are tokenized in parallel, with the same result
 std::vector<llama_token> common_tokenize(
     const struct llama_vocab * vocab,
            const std::string & text,
                         bool   add_special,
-                        bool   parse_special = false);
+                        bool   parse_special = false,
+                     int32_t   n_threads = 1);
 
 // tokenizes a token into a piece, optionally renders special/control tokens
 // should work similar to Python's `tokenizer.id_to_piece`
@@ -695,5 +705,6 @@ namespace {
 const char * const LLM_KV_SPLIT_NO            = "split.no";
 const char * const LLM_KV_SPLIT_COUNT         = "split.count";
 const char * const LLM_KV_SPLIT_TENSORS_COUNT = "split.tensors.count";
+const char * const LLM_KV_SPLIT_TENSORS_XXH64 = "split.tensors.xxh64"; // XXH64 of the data of each tensor of the split, in order
 
 }
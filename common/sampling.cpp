@@ -2,7 +2,13 @@
 
 #include "common.h"
 
+#include <atomic>
 #include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
 #include <unordered_map>
 
 // the ring buffer works similarly to std::deque, but with a fixed capacity
@@ -98,6 +104,137 @@ struct ring_buffer {
     std::vector<T> data;
 };
 
+struct common_grammar_mask;
+
+// helper threads shared by the grammar masks of all the samplers
+// a thread is added only when a job is queued while all the threads are busy, up to the number of hardware threads
+struct common_grammar_pool {
+    static common_grammar_pool & get() {
+        static common_grammar_pool pool;
+        return pool;
+    }
+
+    ~common_grammar_pool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        cv_job.notify_all();
+
+        for (auto & worker : workers) {
+            worker.join();
+        }
+    }
+
+    void submit(common_grammar_mask * mask);
+
+    // wait for the job of mask submitted last
+    void wait(const common_grammar_mask * mask);
+
+private:
+    void run();
+
+    std::vector<std::thread> workers;
+
+    std::mutex              mutex;
+    std::condition_variable cv_job;
+    std::condition_variable cv_done;
+
+    std::deque<common_grammar_mask *> jobs;
+
+    size_t n_idle = 0;
+    bool   stop   = false;
+};
+
+// tokens allowed by a grammar sampler in its current state, computed on the shared grammar helper threads
+struct common_grammar_mask {
+    ~common_grammar_mask() {
+        wait();
+    }
+
+    // start computing the mask of the current state of grmr
+    // the grammar must not be modified until wait() returns
+    void start(const struct llama_sampler * grmr) {
+        wait();
+
+        ready = false;
+
+        job = grmr;
+        common_grammar_pool::get().submit(this);
+
+        pending = true;
+    }
+
+    // wait for the pending job, returns true if the mask matches the current grammar state
+    bool wait() {
+        if (pending) {
+            common_grammar_pool::get().wait(this);
+
+            pending = false;
+            ready   = true;
+        }
+
+        return ready;
+    }
+
+    std::vector<uint64_t> mask;
+
+    bool ready = false;
+
+private:
+    friend struct common_grammar_pool;
+
+    const struct llama_sampler * job = nullptr;
+
+    bool pending = false;
+    bool busy    = false; // guarded by the mutex of the pool
+};
+
+void common_grammar_pool::submit(common_grammar_mask * mask) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        mask->busy = true;
+        jobs.push_back(mask);
+
+        const size_t n_max = std::max(1u, std::thread::hardware_concurrency());
+        if (jobs.size() > n_idle && workers.size() < n_max) {
+            workers.emplace_back([this]() { run(); });
+        }
+    }
+    cv_job.notify_one();
+}
+
+void common_grammar_pool::wait(const common_grammar_mask * mask) {
+    std::unique_lock<std::mutex> lock(mutex);
+    cv_done.wait(lock, [&]() { return !mask->busy; });
+}
+
+void common_grammar_pool::run() {
+    std::unique_lock<std::mutex> lock(mutex);
+
+    while (true) {
+        n_idle++;
+        cv_job.wait(lock, [&]() { return stop || !jobs.empty(); });
+        n_idle--;
+        if (stop) {
+            return;
+        }
+
+        common_grammar_mask * mask = jobs.front();
+        jobs.pop_front();
+        lock.unlock();
+
+        if (!llama_sampler_grammar_get_bitmask(mask->job, mask->mask.data(), mask->mask.size())) {
+            std::fill(mask->mask.begin(), mask->mask.end(), ~uint64_t(0));
+        }
+
+        lock.lock();
+        mask->busy = false;
+        cv_done.notify_all();
+    }
+}
+
 struct common_sampler {
     common_params_sampling params;
 
@@ -110,22 +247,45 @@ struct common_sampler {
 
     llama_token_data_array cur_p;
 
-    void set_logits(struct llama_context * ctx, int idx) {
-        const auto * logits = llama_get_logits_ith(ctx, idx);
-
-        const llama_model * model = llama_get_model(ctx);
-        const llama_vocab * vocab = llama_model_get_vocab(model);
-
-        const int n_vocab = llama_vocab_n_tokens(vocab);
+    // tokens allowed by the grammar in its current state (grammar_async)
+    common_grammar_mask grmr_mask;
 
+    // if mask is not null, the logits of the tokens not in the mask are set to -INFINITY
+    void set_logits(const float * logits, int n_vocab, const uint64_t * mask = nullptr) {
         cur.resize(n_vocab);
 
-        for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
-            cur[token_id] = llama_token_data{token_id, logits[token_id], 0.0f};
+        if (mask) {
+            for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
+                const bool allowed = (mask[token_id / 64] >> (token_id % 64)) & 1;
+                cur[token_id] = llama_token_data{token_id, allowed ? logits[token_id] : -INFINITY, 0.0f};
+            }
+        } else {
+            for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
+                cur[token_id] = llama_token_data{token_id, logits[token_id], 0.0f};
+            }
         }
 
         cur_p = { cur.data(), cur.size(), -1, false };
     }
+
+    // wait for the grammar mask, returns true if it matches the current grammar state
+    bool grammar_mask_wait() {
+        return grmr_mask.wait();
+    }
+
+    // start computing the grammar mask of the current grammar state
+    // the grammar must not be modified until grammar_mask_wait() returns
+    void grammar_mask_start() {
+        grmr_mask.wait();
+
+        grmr_mask.ready = false;
+
+        if (!params.grammar_async || params.grammar.empty()) {
+            return;
+        }
+
+        grmr_mask.start(grmr);
+    }
 };
 
 std::string common_params_sampling::print() const {
@@ -152,12 +312,13 @@ struct common_sampler * common_sampler_init(const struct llama_model * model, co
     lparams.no_perf = params.no_perf;
 
     auto * result = new common_sampler {
-        /* .params = */ params,
-        /* .grmr   = */ llama_sampler_init_grammar(vocab, params.grammar.c_str(), "root"),
-        /* .chain  = */ llama_sampler_chain_init(lparams),
-        /* .prev   = */ ring_buffer<llama_token>(std::max(32, params.n_prev)),
-        /* .cur    = */ {},
-        /* .cur_p  = */ {},
+        /* .params    = */ params,
+        /* .grmr      = */ llama_sampler_init_grammar(vocab, params.grammar.c_str(), "root"),
+        /* .chain     = */ llama_sampler_chain_init(lparams),
+        /* .prev      = */ ring_buffer<llama_token>(std::max(32, params.n_prev)),
+        /* .cur       = */ {},
+        /* .cur_p     = */ {},
+        /* .grmr_mask = */ {},
     };
 
     llama_sampler_chain_add(result->chain,
@@ -219,11 +380,16 @@ struct common_sampler * common_sampler_init(const struct llama_model * model, co
         GGML_ASSERT(false && "unknown mirostat version");
     }
 
+    result->grmr_mask.mask.resize((llama_vocab_n_tokens(vocab) + 63)/64);
+    result->grammar_mask_start();
+
     return result;
 }
 
 void common_sampler_free(struct common_sampler * gsmpl) {
     if (gsmpl) {
+        gsmpl->grammar_mask_wait();
+
         llama_sampler_free(gsmpl->grmr);
 
         llama_sampler_free(gsmpl->chain);
@@ -234,7 +400,11 @@ void common_sampler_free(struct common_sampler * gsmpl) {
 
 void common_sampler_accept(struct common_sampler * gsmpl, llama_token token, bool accept_grammar) {
     if (accept_grammar) {
+        gsmpl->grammar_mask_wait();
+
         llama_sampler_accept(gsmpl->grmr, token);
+
+        gsmpl->grammar_mask_start();
     }
 
     llama_sampler_accept(gsmpl->chain, token);
@@ -243,20 +413,32 @@ void common_sampler_accept(struct common_sampler * gsmpl, llama_token token, boo
 }
 
 void common_sampler_reset(struct common_sampler * gsmpl) {
+    gsmpl->grammar_mask_wait();
+
     llama_sampler_reset(gsmpl->grmr);
 
     llama_sampler_reset(gsmpl->chain);
+
+    gsmpl->grammar_mask_start();
 }
 
 struct common_sampler * common_sampler_clone(common_sampler * gsmpl) {
-    return new common_sampler {
-        /* .params = */ gsmpl->params,
-        /* .grmr   = */ llama_sampler_clone(gsmpl->grmr),
-        /* .chain  = */ llama_sampler_clone(gsmpl->chain),
-        /* .prev   = */ gsmpl->prev,
-        /* .cur    = */ gsmpl->cur,
-        /* .cur_p  = */ gsmpl->cur_p,
+    const bool mask_ready = gsmpl->grammar_mask_wait();
+
+    auto * result = new common_sampler {
+        /* .params    = */ gsmpl->params,
+        /* .grmr      = */ llama_sampler_clone(gsmpl->grmr),
+        /* .chain     = */ llama_sampler_clone(gsmpl->chain),
+        /* .prev      = */ gsmpl->prev,
+        /* .cur       = */ gsmpl->cur,
+        /* .cur_p     = */ gsmpl->cur_p,
+        /* .grmr_mask = */ {},
     };
+
+    result->grmr_mask.mask  = gsmpl->grmr_mask.mask;
+    result->grmr_mask.ready = mask_ready;
+
+    return result;
 }
 
 void common_perf_print(const struct llama_context * ctx, const struct common_sampler * gsmpl) {
@@ -270,13 +452,25 @@ void common_perf_print(const struct llama_context * ctx, const struct common_sam
     }
 }
 
-llama_token common_sampler_sample(struct common_sampler * gsmpl, struct llama_context * ctx, int idx, bool grammar_first) {
-    gsmpl->set_logits(ctx, idx);
-
+// does not touch the context, so that the outputs of a batch can be sampled in parallel
+static llama_token common_sampler_sample_logits(struct common_sampler * gsmpl, const float * logits, int n_vocab, bool grammar_first) {
     auto & grmr  = gsmpl->grmr;
     auto & chain = gsmpl->chain;
     auto & cur_p = gsmpl->cur_p; // initialized by set_logits
 
+    if (gsmpl->grammar_mask_wait()) {
+        // the grammar mask was computed in the background, apply it together with the logits
+        gsmpl->set_logits(logits, n_vocab, gsmpl->grmr_mask.mask.data());
+
+        llama_sampler_apply(chain, &cur_p);
+
+        GGML_ASSERT(cur_p.selected != -1 && "no selected token during sampling - check your sampling configuration");
+
+        return cur_p.data[cur_p.selected].id;
+    }
+
+    gsmpl->set_logits(logits, n_vocab);
+
     if (grammar_first) {
         llama_sampler_apply(grmr, &cur_p);
     }
@@ -306,7 +500,7 @@ llama_token common_sampler_sample(struct common_sampler * gsmpl, struct llama_co
 
     // resampling:
     // if the token is not valid, sample again, but first apply the grammar sampler and then the sampling chain
-    gsmpl->set_logits(ctx, idx);
+    gsmpl->set_logits(logits, n_vocab);
 
     llama_sampler_apply(grmr,  &cur_p);
     llama_sampler_apply(chain, &cur_p);
@@ -316,6 +510,145 @@ llama_token common_sampler_sample(struct common_sampler * gsmpl, struct llama_co
     return cur_p.data[cur_p.selected].id;
 }
 
+llama_token common_sampler_sample(struct common_sampler * gsmpl, struct llama_context * ctx, int idx, bool grammar_first) {
+    const llama_vocab * vocab = llama_model_get_vocab(llama_get_model(ctx));
+
+    return common_sampler_sample_logits(gsmpl, llama_get_logits_ith(ctx, idx), llama_vocab_n_tokens(vocab), grammar_first);
+}
+
+struct common_sampler_threadpool {
+    common_sampler_threadpool(int n_threads) {
+        for (int i = 1; i < n_threads; ++i) {
+            workers.emplace_back([this]() {
+                uint64_t seen = 0;
+
+                while (true) {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    cv_start.wait(lock, [&]() { return stop || generation != seen; });
+                    if (stop) {
+                        return;
+                    }
+                    seen = generation;
+                    lock.unlock();
+
+                    run();
+
+                    lock.lock();
+                    if (--n_active == 0) {
+                        cv_done.notify_one();
+                    }
+                }
+            });
+        }
+    }
+
+    ~common_sampler_threadpool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        cv_start.notify_all();
+
+        for (auto & worker : workers) {
+            worker.join();
+        }
+    }
+
+    // calls f(i) for all i in [0, n), on the workers and the calling thread
+    void parallel_for(int n, const std::function<void(int)> & f) {
+        if (workers.empty() || n <= 1) {
+            for (int i = 0; i < n; ++i) {
+                f(i);
+            }
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job      = &f;
+            n_jobs   = n;
+            next     = 0;
+            n_active = workers.size();
+            generation++;
+        }
+        cv_start.notify_all();
+
+        run();
+
+        std::unique_lock<std::mutex> lock(mutex);
+        cv_done.wait(lock, [&]() { return n_active == 0; });
+        job = nullptr;
+    }
+
+private:
+    void run() {
+        for (int i = next++; i < n_jobs; i = next++) {
+            (*job)(i);
+        }
+    }
+
+    std::vector<std::thread> workers;
+
+    std::mutex              mutex;
+    std::condition_variable cv_start;
+    std::condition_variable cv_done;
+
+    const std::function<void(int)> * job = nullptr;
+
+    int              n_jobs = 0;
+    std::atomic<int> next   { 0 };
+
+    size_t   n_active   = 0;
+    uint64_t generation = 0;
+    bool     stop       = false;
+};
+
+struct common_sampler_threadpool * common_sampler_threadpool_init(int n_threads) {
+    return new common_sampler_threadpool(std::max(n_threads, 1));
+}
+
+void common_sampler_threadpool_free(struct common_sampler_threadpool * tp) {
+    delete tp;
+}
+
+std::vector<llama_token> common_sampler_sample_and_accept_batch(
+        struct common_sampler_threadpool   * tp,
+        const std::vector<common_sampler *> & gsmpls,
+        struct llama_context                * ctx,
+        const std::vector<int>              & idxs,
+        bool                                  grammar_first) {
+    GGML_ASSERT(gsmpls.size() == idxs.size());
+
+    const llama_vocab * vocab = llama_model_get_vocab(llama_get_model(ctx));
+
+    const int n_vocab = llama_vocab_n_tokens(vocab);
+    const int n       = gsmpls.size();
+
+    // llama_get_logits_ith synchronizes the context, so the logits are fetched before going parallel
+    std::vector<const float *> logits(n);
+    for (int i = 0; i < n; ++i) {
+        logits[i] = llama_get_logits_ith(ctx, idxs[i]);
+    }
+
+    std::vector<llama_token> result(n);
+
+    const std::function<void(int)> sample = [&](int i) {
+        result[i] = common_sampler_sample_logits(gsmpls[i], logits[i], n_vocab, grammar_first);
+
+        common_sampler_accept(gsmpls[i], result[i], true);
+    };
+
+    if (tp) {
+        tp->parallel_for(n, sample);
+    } else {
+        for (int i = 0; i < n; ++i) {
+            sample(i);
+        }
+    }
+
+    return result;
+}
+
 std::vector<llama_token> common_sampler_sample_and_accept_n(struct common_sampler * gsmpl, struct llama_context * ctx, const std::vector<int> & idxs, const llama_tokens & draft, bool grammar_first) {
     GGML_ASSERT(idxs.size() == draft.size() + 1 && "idxs.size() must be draft.size() + 1");
 
@@ -33,6 +33,7 @@
 //
 
 struct common_sampler;
+struct common_sampler_threadpool;
 
 // llama_sampler API overloads
 
@@ -58,6 +59,9 @@ void common_perf_print(const struct llama_context * ctx, const struct common_sam
 // if grammar_first is true, the grammar is applied before the samplers (slower)
 // useful in cases where all the resulting candidates (not just the sampled one) must fit the grammar
 //
+// with params.grammar_async, the grammar mask of the next token is computed on helper threads shared by all the samplers
+// after each accepted token (typically while the logits are computed) and applied together with the logits, as with grammar_first
+//
 llama_token common_sampler_sample(struct common_sampler * gsmpl, struct llama_context * ctx, int idx, bool grammar_first = false);
 
 // generalized version of common_sampler_sample
@@ -81,6 +85,26 @@ std::vector<llama_token> common_sampler_sample_and_accept_n(struct common_sample
 // assume idxs == [ 0, 1, 2, ..., draft.size() ]
 std::vector<llama_token> common_sampler_sample_and_accept_n(struct common_sampler * gsmpl, struct llama_context * ctx, const llama_tokens & draft, bool grammar_first = false);
 
+// persistent worker threads for sampling the outputs of a batch in parallel
+// n_threads includes the calling thread
+struct common_sampler_threadpool * common_sampler_threadpool_init(int n_threads);
+
+void common_sampler_threadpool_free(struct common_sampler_threadpool * tp);
+
+// batched version of common_sampler_sample + common_sampler_accept for multiple sequences:
+//
+// samples output idxs[i] of ctx with gsmpls[i] and accepts the token, for all i in parallel on tp
+// the samplers must be distinct - the grammar, penalties, DRY, etc. state is per sequence
+// if tp is nullptr, the outputs are sampled on the calling thread
+//
+// returns the sampled tokens, in the order of gsmpls
+std::vector<llama_token> common_sampler_sample_and_accept_batch(
+        struct common_sampler_threadpool   * tp,
+        const std::vector<common_sampler *> & gsmpls,
+        struct llama_context                * ctx,
+        const std::vector<int>              & idxs,
+        bool                                  grammar_first = false);
+
 uint32_t common_sampler_get_seed(const struct common_sampler * gsmpl);
 
 // helpers
@@ -22,7 +22,7 @@ struct common_speculative * common_speculative_init(
     auto * result = new common_speculative {
         /* .ctx    = */ ctx_dft,
         /* .smpl   = */ nullptr,
-        /* .batch  = */ llama_batch_init(llama_n_batch(ctx_dft), 0, 1),
+        /* .batch  = */ llama_batch_init(llama_n_batch(ctx_dft), 0, llama_n_seq_max(ctx_dft)),
         /* .prompt = */ {},
     };
 
@@ -138,6 +138,25 @@ llama_tokens common_speculative_gen_draft(
         struct common_speculative_params params,
         const llama_tokens & prompt_tgt,
         llama_token id_last) {
+    params.n_seq = 1;
+
+    const auto tree = common_speculative_gen_draft_tree(spec, params, prompt_tgt, id_last);
+
+    llama_tokens result;
+    result.reserve(tree.size());
+
+    for (const auto & node : tree) {
+        result.push_back(node.id);
+    }
+
+    return result;
+}
+
+common_speculative_tree common_speculative_gen_draft_tree(
+        struct common_speculative * spec,
+        struct common_speculative_params params,
+        const llama_tokens & prompt_tgt,
+        llama_token id_last) {
     auto & batch  = spec->batch;
     auto & ctx    = spec->ctx;
     auto & smpl   = spec->smpl;
@@ -168,9 +187,17 @@ llama_tokens common_speculative_gen_draft(
 
     LOG_DBG("%s: reuse_i = %d, reuse_n = %d, prompt = %d\n", __func__, reuse_i, reuse_n, (int) prompt.size());
 
-    llama_tokens result;
+    GGML_ASSERT(params.n_seq >= 1 && params.n_seq <= (int) llama_n_seq_max(ctx));
+
+    common_speculative_tree result;
     result.reserve(params.n_draft);
 
+    auto add_node = [&](llama_token id, int32_t parent, llama_seq_id seq) {
+        const int32_t depth = parent < 0 ? 1 : result[parent].depth + 1;
+        result.push_back({ id, parent, depth, { seq } });
+        return (int32_t) result.size() - 1;
+    };
+
     if (reuse_n == 0) {
         llama_kv_cache_clear(ctx);
 
@@ -180,7 +207,7 @@ llama_tokens common_speculative_gen_draft(
         // target model agreed with it. in this case, we simply pass back the previous results to save compute
         if (reuse_i + reuse_n < (int) prompt.size() && prompt[reuse_i + reuse_n] == id_last) {
             for (int i = reuse_i + reuse_n + 1; i < (int) prompt.size(); ++i) {
-                result.push_back(prompt[i]);
+                add_node(prompt[i], (int32_t) result.size() - 1, 0);
 
                 if (params.n_draft <= (int) result.size()) {
                     break;
@@ -236,41 +263,159 @@ llama_tokens common_speculative_gen_draft(
 
     common_sampler_reset(smpl);
 
+    // the draft branches - branch s is decoded in sequence s of the draft context
+    // branch 0 follows the most probable tokens and is the only one kept in the context after drafting
+    struct draft_branch {
+        int32_t node;    // last node of the branch, -1 for the root
+        int32_t i_batch; // output of the last node in the batch
+        bool    active;
+    };
+
+    std::vector<draft_branch> branches = { { -1, 0, true } };
+
     // sample n_draft tokens from the draft model
     for (int i = 0; i < params.n_draft; ++i) {
         common_batch_clear(batch);
 
-        common_sampler_sample(smpl, ctx, 0, true);
+        // the branches created during this step are already in the batch
+        const int n_branches = branches.size();
 
-        const auto * cur_p = common_sampler_get_candidates(smpl);
+        int32_t node_main = -1;
 
-        for (int k = 0; k < std::min(3, (int) cur_p->size); ++k) {
-            LOG_DBG(" - draft candidate %3d, pos %3d: %6d (%8.3f) '%s'\n",
-                    k, i, cur_p->data[k].id, cur_p->data[k].p, common_token_to_piece(ctx, cur_p->data[k].id).c_str());
-        }
+        for (int s = 0; s < n_branches && (int) result.size() < params.n_draft; ++s) {
+            if (!branches[s].active) {
+                continue;
+            }
+
+            common_sampler_sample(smpl, ctx, branches[s].i_batch, true);
+
+            const auto * cur_p = common_sampler_get_candidates(smpl);
+
+            for (int k = 0; k < std::min(3, (int) cur_p->size); ++k) {
+                LOG_DBG(" - draft candidate %3d, seq %d, pos %3d: %6d (%8.3f) '%s'\n",
+                        k, s, i, cur_p->data[k].id, cur_p->data[k].p, common_token_to_piece(ctx, cur_p->data[k].id).c_str());
+            }
+
+            // only collect very high-confidence draft tokens
+            if (cur_p->data[0].p < params.p_min) {
+                branches[s].active = false;
+                continue;
+            }
 
-        // add drafted token for each sequence
-        const llama_token id = cur_p->data[0].id;
+            // start new branches for the likely alternatives, leaving room for the most probable token
+            for (int f = 1; f < (int) cur_p->size && (int) branches.size() < params.n_seq && (int) result.size() + 1 < params.n_draft; ++f) {
+                if (cur_p->data[f].p <= params.p_split) {
+                    break;
+                }
+
+                const llama_seq_id s_new = branches.size();
+
+                llama_kv_cache_seq_rm(ctx, s_new, -1, -1);
+                llama_kv_cache_seq_cp(ctx, s, s_new, -1, -1);
+
+                for (int32_t j = branches[s].node; j >= 0; j = result[j].parent) {
+                    result[j].seqs.push_back(s_new);
+                }
+
+                const int32_t node = add_node(cur_p->data[f].id, branches[s].node, s_new);
+
+                common_batch_add(batch, result[node].id, n_past + result[node].depth, { s_new }, true);
+
+                branches.push_back({ node, batch.n_tokens - 1, true });
+
+                LOG_DBG("%s: split seq %d at pos %d into seq %d: %6d (%8.3f) '%s'\n", __func__, s, i, s_new,
+                        cur_p->data[f].id, cur_p->data[f].p, common_token_to_piece(ctx, cur_p->data[f].id).c_str());
+            }
 
-        // only collect very high-confidence draft tokens
-        if (cur_p->data[0].p < params.p_min) {
+            // add drafted token for each sequence
+            const llama_token id = cur_p->data[0].id;
+
+            if (s == 0) {
+                common_sampler_accept(smpl, id, true);
+            }
+
+            const int32_t node = add_node(id, branches[s].node, s);
+
+            branches[s].node = node;
+
+            if (s == 0) {
+                node_main = node;
+            }
+
+            if (params.n_draft <= (int) result.size()) {
+                break;
+            }
+
+            common_batch_add(batch, id, n_past + result[node].depth, { s }, true);
+
+            branches[s].i_batch = batch.n_tokens - 1;
+        }
+
+        if (batch.n_tokens == 0 || params.n_draft <= (int) result.size()) {
             break;
         }
 
+        // evaluate the drafted tokens on the draft model
+        llama_decode(ctx, batch);
+
+        if (node_main >= 0) {
+            prompt.push_back(result[node_main].id);
+        }
+    }
+
+    // only the main branch is kept for reuse in the next draft
+    for (int s = 1; s < (int) branches.size(); ++s) {
+        llama_kv_cache_seq_rm(ctx, s, -1, -1);
+    }
+
+    return result;
+}
+
+int32_t common_speculative_tree_n_seq(const common_speculative_tree & tree) {
+    int32_t n_seq = 1;
+
+    for (const auto & node : tree) {
+        n_seq = std::max(n_seq, node.seqs.back() + 1);
+    }
+
+    return n_seq;
+}
+
+std::vector<llama_token> common_speculative_accept_tree(
+        struct common_sampler * smpl,
+        struct llama_context * ctx,
+        const common_speculative_tree & tree,
+        llama_seq_id & seq_accepted,
+        bool grammar_first) {
+    std::vector<llama_token> result;
+
+    seq_accepted = 0;
+
+    int32_t cur = -1;
+
+    while (true) {
+        const llama_token id = common_sampler_sample(smpl, ctx, cur + 1, grammar_first);
+
         common_sampler_accept(smpl, id, true);
 
         result.push_back(id);
 
-        if (params.n_draft <= (int) result.size()) {
-            break;
+        // the children of a node come after it
+        int32_t next = -1;
+        for (int32_t j = cur + 1; j < (int32_t) tree.size(); ++j) {
+            if (tree[j].parent == cur && tree[j].id == id) {
+                next = j;
+                break;
+            }
         }
 
-        common_batch_add(batch, id, n_past + i + 1, { 0 }, true);
+        if (next < 0) {
+            break;
+        }
 
-        // evaluate the drafted tokens on the draft model
-        llama_decode(ctx, batch);
+        cur = next;
 
-        prompt.push_back(id);
+        seq_accepted = tree[cur].seqs[0];
     }
 
     return result;
@@ -10,8 +10,24 @@ struct common_speculative_params {
     int n_reuse = 256;
 
     float p_min = 0.9f; // min probabiliy required to accept a token in the draft
+
+    int   n_seq   = 1;    // max number of draft branches (requires n_seq_max >= n_seq in the draft context)
+    float p_split = 0.1f; // min probability of an alternative token to start a new branch
 };
 
+// a drafted token in a tree of drafts
+// the root of the tree is the last sampled token, which is not part of the tree
+struct common_speculative_node {
+    llama_token id;
+
+    int32_t parent; // index of the parent node, -1 for the children of the root
+    int32_t depth;  // distance from the root, starting at 1
+
+    std::vector<llama_seq_id> seqs; // the branches that go through this node, in increasing order
+};
+
+using common_speculative_tree = std::vector<common_speculative_node>;
+
 struct common_speculative * common_speculative_init(struct llama_context * ctx_dft);
 
 void common_speculative_free(struct common_speculative * spec);
@@ -26,3 +42,31 @@ llama_tokens common_speculative_gen_draft(
         struct common_speculative_params   params,
                       const llama_tokens & prompt,
                              llama_token   id_last);
+
+// sample a tree of up to n_draft tokens in up to n_seq branches using the draft model
+// a branch is split when an alternative to its most probable token has a probability above p_split
+// the nodes are ordered so that the parents come before their children
+// with n_seq == 1, the tree is the linear draft of common_speculative_gen_draft
+common_speculative_tree common_speculative_gen_draft_tree(
+               struct common_speculative * spec,
+        struct common_speculative_params   params,
+                      const llama_tokens & prompt,
+                             llama_token   id_last);
+
+// number of branches in the tree
+int32_t common_speculative_tree_n_seq(const common_speculative_tree & tree);
+
+// verify a tree of drafts with the target model
+//
+// the logits of the root must be at idx 0 of the last batch and the logits of node i at idx i + 1
+// samples from the root down the tree and accepts the tokens as long as they match a child of the current node
+//
+// returns the accepted draft tokens followed by the next sampled token (at least 1 token)
+// seq_accepted is set to a branch that contains all the accepted draft tokens
+//
+std::vector<llama_token> common_speculative_accept_tree(
+                struct common_sampler * smpl,
+                 struct llama_context * ctx,
+        const common_speculative_tree & tree,
+                         llama_seq_id & seq_accepted,
+                                  bool  grammar_first = false);
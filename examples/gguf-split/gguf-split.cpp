@@ -3,15 +3,23 @@
 #include "llama.h"
 #include "common.h"
 
+#include "xxhash/xxhash.h"
+
 #include <algorithm>
+#include <atomic>
+#include <cerrno>
 #include <cinttypes>
 #include <climits>
 #include <cstdio>
 #include <cstdlib>
+#include <exception>
 #include <stdexcept>
 #include <cstring>
 #include <fstream>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 #if defined(_WIN32)
@@ -20,6 +28,9 @@
         #define PATH_MAX MAX_PATH
     #endif
     #include <io.h>
+#else
+    #include <fcntl.h>
+    #include <unistd.h>
 #endif
 
 enum split_operation : uint8_t {
@@ -43,6 +54,7 @@ struct split_params {
     std::string output;
     bool no_tensor_first_split = false;
     bool dry_run = false;
+    int n_threads = std::max(1u, std::thread::hardware_concurrency());
 };
 
 static void split_print_usage(const char * executable) {
@@ -61,6 +73,7 @@ static void split_print_usage(const char * executable) {
     printf("  --split-max-size N(M|G) max size per split\n");
     printf("  --no-tensor-first-split do not add tensors to the first split (disabled by default)\n");
     printf("  --dry-run               only print out a split plan and exit, without writing any new files\n");
+    printf("  --threads N             number of threads used to copy the tensor data (default: %d)\n", default_params.n_threads);
     printf("\n");
 }
 
@@ -143,6 +156,13 @@ static void split_params_parse_ex(int argc, const char ** argv, split_params & p
             }
             params.mode = MODE_SIZE;
             params.n_bytes_split = split_str_to_n_bytes(argv[arg_idx]);
+        } else if (arg == "--threads") {
+            if (++arg_idx >= argc) {
+                invalid_param = true;
+                break;
+            }
+            arg_found = true;
+            params.n_threads = std::max(1, atoi(argv[arg_idx]));
         }
 
         if (!arg_found) {
@@ -184,16 +204,278 @@ static bool split_params_parse(int argc, const char ** argv, split_params & para
     return result;
 }
 
-static void zeros(std::ofstream & file, size_t n) {
-    char zero = 0;
-    for (size_t i = 0; i < n; ++i) {
-        file.write(&zero, 1);
+// copy of the data of one tensor from an input file to an output file
+struct copy_job {
+    int      i_input;
+    int      i_output;
+    size_t   in_offset;
+    size_t   out_offset;
+    size_t   n_bytes;
+    bool     hash  = true; // compute the hash of the copied data
+    uint64_t xxh64 = 0;
+};
+
+// copies tensor data between files at given offsets, one instance per thread
+// on Linux, the output is written with copy_file_range when the filesystem supports it, which avoids a copy through user
+// space and allows reflinks, and the copied range is read back from the page cache to hash it; otherwise the data is read
+// in chunks, hashed and written from the same buffer
+struct tensor_copier {
+    static constexpr size_t CHUNK_SIZE = 16u*1024*1024;
+
+    std::vector<uint8_t> buf;
+
+#if defined(_WIN32)
+    std::vector<std::unique_ptr<std::ifstream>> f_inputs;
+    std::vector<std::unique_ptr<std::fstream>>  f_outputs;
+#else
+    std::vector<int> fd_inputs;
+    std::vector<int> fd_outputs;
+    bool use_copy_file_range = true;
+#endif
+
+    tensor_copier(const std::vector<std::string> & inputs, const std::vector<std::string> & outputs) : buf(CHUNK_SIZE) {
+#if defined(_WIN32)
+        for (const auto & path : inputs) {
+            f_inputs.emplace_back(new std::ifstream(path, std::ios::binary));
+            if (!f_inputs.back()->is_open()) {
+                throw std::runtime_error("failed to open " + path);
+            }
+            f_inputs.back()->exceptions(std::ifstream::failbit);
+        }
+        for (const auto & path : outputs) {
+            f_outputs.emplace_back(new std::fstream(path, std::ios::in | std::ios::out | std::ios::binary));
+            if (!f_outputs.back()->is_open()) {
+                throw std::runtime_error("failed to open " + path);
+            }
+            f_outputs.back()->exceptions(std::fstream::failbit);
+        }
+#else
+        for (const auto & path : inputs) {
+            fd_inputs.push_back(open(path.c_str(), O_RDONLY));
+            if (fd_inputs.back() < 0) {
+                throw std::runtime_error("failed to open " + path + ": " + strerror(errno));
+            }
+        }
+        for (const auto & path : outputs) {
+            fd_outputs.push_back(open(path.c_str(), O_RDWR));
+            if (fd_outputs.back() < 0) {
+                throw std::runtime_error("failed to open " + path + ": " + strerror(errno));
+            }
+        }
+#endif
+    }
+
+    ~tensor_copier() {
+#if !defined(_WIN32)
+        for (int fd : fd_inputs) {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+        for (int fd : fd_outputs) {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+#endif
+    }
+
+    void read_at(int i_input, size_t offset, uint8_t * dst, size_t n) {
+#if defined(_WIN32)
+        auto & f = *f_inputs[i_input];
+        f.seekg(offset);
+        f.read((char *) dst, n);
+#else
+        while (n > 0) {
+            const ssize_t ret = pread(fd_inputs[i_input], dst, n, offset);
+            if (ret <= 0) {
+                throw std::runtime_error(std::string("read error: ") + (ret == 0 ? "unexpected end of file" : strerror(errno)));
+            }
+            dst    += ret;
+            offset += ret;
+            n      -= ret;
+        }
+#endif
+    }
+
+    void write_at(int i_output, size_t offset, const uint8_t * src, size_t n) {
+#if defined(_WIN32)
+        auto & f = *f_outputs[i_output];
+        f.seekp(offset);
+        f.write((const char *) src, n);
+#else
+        while (n > 0) {
+            const ssize_t ret = pwrite(fd_outputs[i_output], src, n, offset);
+            if (ret < 0) {
+                throw std::runtime_error(std::string("write error: ") + strerror(errno));
+            }
+            src    += ret;
+            offset += ret;
+            n      -= ret;
+        }
+#endif
+    }
+
+    // returns false if the data has to be written from user space instead
+    bool copy_range(int i_input, size_t in_offset, int i_output, size_t out_offset, size_t n) {
+#if defined(__linux__)
+        if (!use_copy_file_range) {
+            return false;
+        }
+        loff_t off_in  = in_offset;
+        loff_t off_out = out_offset;
+        while (n > 0) {
+            const ssize_t ret = copy_file_range(fd_inputs[i_input], &off_in, fd_outputs[i_output], &off_out, n, 0);
+            if (ret <= 0) {
+                if (ret < 0 && errno != EXDEV && errno != ENOSYS && errno != EOPNOTSUPP && errno != EINVAL) {
+                    throw std::runtime_error(std::string("copy_file_range error: ") + strerror(errno));
+                }
+                // not supported between these files - write the remaining data from user space
+                use_copy_file_range = false;
+                return false;
+            }
+            n -= ret;
+        }
+        return true;
+#else
+        GGML_UNUSED(i_input);
+        GGML_UNUSED(in_offset);
+        GGML_UNUSED(i_output);
+        GGML_UNUSED(out_offset);
+        GGML_UNUSED(n);
+        return false;
+#endif
+    }
+
+    // hash of a range of an output file that was written with copy_range
+    uint64_t hash_output(int i_output, size_t offset, size_t n) {
+        XXH64_state_t * state = XXH64_createState();
+        XXH64_reset(state, 0);
+
+#if !defined(_WIN32)
+        while (n > 0) {
+            const ssize_t ret = pread(fd_outputs[i_output], buf.data(), std::min(buf.size(), n), offset);
+            if (ret <= 0) {
+                XXH64_freeState(state);
+                throw std::runtime_error(std::string("read error: ") + (ret == 0 ? "unexpected end of file" : strerror(errno)));
+            }
+            XXH64_update(state, buf.data(), ret);
+            offset += ret;
+            n      -= ret;
+        }
+#else
+        GGML_UNUSED(i_output);
+        GGML_UNUSED(offset);
+        GGML_UNUSED(n);
+#endif
+
+        const uint64_t res = XXH64_digest(state);
+        XXH64_freeState(state);
+        return res;
+    }
+
+    void copy(copy_job & job) {
+        if (copy_range(job.i_input, job.in_offset, job.i_output, job.out_offset, job.n_bytes)) {
+            job.xxh64 = job.hash ? hash_output(job.i_output, job.out_offset, job.n_bytes) : 0;
+            return;
+        }
+
+        XXH64_state_t * state = XXH64_createState();
+        XXH64_reset(state, 0);
+
+        for (size_t done = 0; done < job.n_bytes; ) {
+            const size_t n = std::min(buf.size(), job.n_bytes - done);
+
+            read_at(job.i_input, job.in_offset + done, buf.data(), n);
+            if (job.hash) {
+                XXH64_update(state, buf.data(), n);
+            }
+            write_at(job.i_output, job.out_offset + done, buf.data(), n);
+
+            done += n;
+        }
+
+        job.xxh64 = job.hash ? XXH64_digest(state) : 0;
+        XXH64_freeState(state);
+    }
+};
+
+// run the copy jobs in n_threads threads, the largest tensors first
+static void copy_tensors(const std::vector<std::string> & inputs, const std::vector<std::string> & outputs, std::vector<copy_job> & jobs, int n_threads) {
+    std::vector<copy_job *> order;
+    for (auto & job : jobs) {
+        order.push_back(&job);
+    }
+    std::sort(order.begin(), order.end(), [](const copy_job * a, const copy_job * b) { return a->n_bytes > b->n_bytes; });
+
+    std::atomic<size_t> next{0};
+    std::mutex          mutex;
+    std::exception_ptr  error;
+
+    auto worker = [&]() {
+        try {
+            tensor_copier copier(inputs, outputs);
+            while (true) {
+                const size_t i = next++;
+                if (i >= order.size()) {
+                    break;
+                }
+                copier.copy(*order[i]);
+            }
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(mutex);
+            error = std::current_exception();
+            next  = order.size();
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (int i = 1; i < std::min<int>(n_threads, order.size()); ++i) {
+        workers.emplace_back(worker);
+    }
+    worker();
+    for (auto & w : workers) {
+        w.join();
+    }
+
+    if (error) {
+        std::rethrow_exception(error);
     }
 }
 
+// create the output file with the metadata of ctx_out, the tensor data is written later at the offsets given by ctx_out
+static void create_output(const std::string & path, const struct gguf_context * ctx_out) {
+    std::ofstream fout(path, std::ios::binary);
+    fout.exceptions(std::ofstream::failbit); // fail fast on write errors
+
+    std::vector<uint8_t> data(gguf_get_meta_size(ctx_out));
+    gguf_get_meta_data(ctx_out, data.data());
+    fout.write((const char *) data.data(), data.size());
+
+    // extend the file to its final size, the padding of the tensor data stays zero
+    size_t size = data.size();
+    for (int64_t i = 0; i < gguf_get_n_tensors(ctx_out); ++i) {
+        size = std::max(size, data.size() + gguf_get_tensor_offset(ctx_out, i) + GGML_PAD(gguf_get_tensor_size(ctx_out, i), GGUF_DEFAULT_ALIGNMENT));
+    }
+    if (size > data.size()) {
+        fout.seekp(size - 1);
+        fout.put(0);
+    }
+}
+
+// overwrite the metadata at the beginning of the file, once the checksums are known
+static void update_output_meta(const std::string & path, const struct gguf_context * ctx_out) {
+    std::fstream fout(path, std::ios::in | std::ios::out | std::ios::binary);
+    fout.exceptions(std::fstream::failbit);
+
+    std::vector<uint8_t> data(gguf_get_meta_size(ctx_out));
+    gguf_get_meta_data(ctx_out, data.data());
+    fout.seekp(0);
+    fout.write((const char *) data.data(), data.size());
+}
+
 struct split_strategy {
     const split_params params;
-    std::ifstream & f_input;
     struct gguf_context * ctx_gguf;
     struct ggml_context * ctx_meta = NULL;
     const int n_tensors;
@@ -201,15 +483,10 @@ struct split_strategy {
     // one ctx_out per one output file
     std::vector<struct gguf_context *> ctx_outs;
 
-    // temporary buffer for reading in tensor data
-    std::vector<uint8_t> read_buf;
-
     split_strategy(const split_params & params,
-            std::ifstream & f_input,
             struct gguf_context * ctx_gguf,
             struct ggml_context * ctx_meta) :
         params(params),
-        f_input(f_input),
         ctx_gguf(ctx_gguf),
         ctx_meta(ctx_meta),
         n_tensors(gguf_get_n_tensors(ctx_gguf)) {
@@ -263,9 +540,14 @@ struct split_strategy {
         // push the last ctx_out
         ctx_outs.push_back(ctx_out);
 
-        // set the correct n_split for all ctx_out
+        // set the correct n_split for all ctx_out, reserve the space of the checksums
         for (auto & ctx : ctx_outs) {
             gguf_set_val_u16(ctx, LLM_KV_SPLIT_COUNT, ctx_outs.size());
+
+            const std::vector<uint64_t> xxh64(gguf_get_n_tensors(ctx), 0);
+            if (!xxh64.empty()) {
+                gguf_set_arr_data(ctx, LLM_KV_SPLIT_TENSORS_XXH64, GGUF_TYPE_UINT64, xxh64.data(), xxh64.size());
+            }
         }
     }
 
@@ -304,56 +586,62 @@ struct split_strategy {
     }
 
     void write() {
-        int i_split = 0;
-        int n_split = ctx_outs.size();
-        for (auto & ctx_out : ctx_outs) {
+        const int n_split = ctx_outs.size();
+
+        std::vector<std::string> split_paths;
+        for (int i_split = 0; i_split < n_split; ++i_split) {
             // construct file path
             char split_path[PATH_MAX] = {0};
             llama_split_path(split_path, sizeof(split_path), params.output.c_str(), i_split, n_split);
+            split_paths.push_back(split_path);
+        }
 
-            // open the output file
-            printf("Writing file %s ... ", split_path);
-            fflush(stdout);
-            std::ofstream fout = std::ofstream(split_path, std::ios::binary);
-            fout.exceptions(std::ofstream::failbit); // fail fast on write errors
+        // create the files with the metadata, and collect the copies of all the tensors
+        std::vector<copy_job> jobs;
+        for (int i_split = 0; i_split < n_split; ++i_split) {
+            auto * ctx_out = ctx_outs[i_split];
 
-            // write metadata
-            std::vector<uint8_t> data(gguf_get_meta_size(ctx_out));
-            gguf_get_meta_data(ctx_out, data.data());
-            fout.write((const char *)data.data(), data.size());
+            printf("Writing file %s\n", split_paths[i_split].c_str());
+            create_output(split_paths[i_split], ctx_out);
 
-            // write tensors
+            const size_t meta_size = gguf_get_meta_size(ctx_out);
             for (int i = 0; i < gguf_get_n_tensors(ctx_out); ++i) {
-                // read tensor meta and prepare buffer
                 const char * t_name = gguf_get_tensor_name(ctx_out, i);
                 struct ggml_tensor * t = ggml_get_tensor(ctx_meta, t_name);
-                auto n_bytes = ggml_nbytes(t);
-                read_buf.resize(n_bytes);
 
-                // calculate offset
                 auto i_tensor_in = gguf_find_tensor(ctx_gguf, t_name); // idx of tensor in the input file
-                auto offset = gguf_get_data_offset(ctx_gguf) + gguf_get_tensor_offset(ctx_gguf, i_tensor_in);
 
-                // copy tensor from input to output file
-                copy_file_to_file(f_input, fout, offset, n_bytes);
-                zeros(fout, GGML_PAD(n_bytes, GGUF_DEFAULT_ALIGNMENT) - n_bytes);
+                copy_job job;
+                job.i_input    = 0;
+                job.i_output   = i_split;
+                job.in_offset  = gguf_get_data_offset(ctx_gguf) + gguf_get_tensor_offset(ctx_gguf, i_tensor_in);
+                job.out_offset = meta_size + gguf_get_tensor_offset(ctx_out, i);
+                job.n_bytes    = ggml_nbytes(t);
+                jobs.push_back(job);
             }
-
-            printf("done\n");
-            // close the file
-            fout.close();
-            i_split++;
         }
-    }
 
-    void copy_file_to_file(std::ifstream & f_in, std::ofstream & f_out, const size_t in_offset, const size_t len) {
-        // TODO: detect OS and use copy_file_range() here for better performance
-        if (read_buf.size() < len) {
-            read_buf.resize(len);
+        // copy the tensor data of all splits in parallel
+        printf("Copying %zu tensors with %d threads ... ", jobs.size(), params.n_threads);
+        fflush(stdout);
+        copy_tensors({ params.input }, split_paths, jobs, params.n_threads);
+        printf("done\n");
+
+        // store the checksums
+        size_t i_job = 0;
+        for (int i_split = 0; i_split < n_split; ++i_split) {
+            auto * ctx_out = ctx_outs[i_split];
+
+            std::vector<uint64_t> xxh64(gguf_get_n_tensors(ctx_out));
+            for (auto & h : xxh64) {
+                h = jobs[i_job++].xxh64;
+            }
+            if (!xxh64.empty()) {
+                gguf_set_arr_data(ctx_out, LLM_KV_SPLIT_TENSORS_XXH64, GGUF_TYPE_UINT64, xxh64.data(), xxh64.size());
+            }
+
+            update_output_meta(split_paths[i_split], ctx_out);
         }
-        f_in.seekg(in_offset);
-        f_in.read((char *)read_buf.data(), len);
-        f_out.write((const char *)read_buf.data(), len);
     }
 };
 
@@ -365,12 +653,6 @@ static void gguf_split(const split_params & split_params) {
         /*.ctx      = */ &ctx_meta,
     };
 
-    std::ifstream f_input(split_params.input.c_str(), std::ios::binary);
-    if (!f_input.is_open()) {
-        fprintf(stderr, "%s:  failed to open input GGUF from %s\n", __func__, split_params.input.c_str());
-        exit(EXIT_FAILURE);
-    }
-
     auto * ctx_gguf = gguf_init_from_file(split_params.input.c_str(), params);
     if (!ctx_gguf) {
         fprintf(stderr, "%s:  failed to load input GGUF from %s\n", __func__, split_params.input.c_str());
@@ -378,18 +660,22 @@ static void gguf_split(const split_params & split_params) {
     }
 
     // prepare the strategy
-    split_strategy strategy(split_params, f_input, ctx_gguf, ctx_meta);
+    split_strategy strategy(split_params, ctx_gguf, ctx_meta);
     int n_split = strategy.ctx_outs.size();
     strategy.print_info();
 
     if (!split_params.dry_run) {
         // write all output splits
-        strategy.write();
+        try {
+            strategy.write();
+        } catch (const std::exception & e) {
+            fprintf(stderr, "%s: failed to write the splits: %s\n", __func__, e.what());
+            exit(EXIT_FAILURE);
+        }
     }
 
     // done, clean up
     gguf_free(ctx_gguf);
-    f_input.close();
 
     fprintf(stderr, "%s: %d gguf split written with a total of %d tensors.\n",
             __func__, n_split, strategy.n_tensors);
@@ -408,14 +694,11 @@ static void gguf_merge(const split_params & split_params) {
         exit(EXIT_FAILURE);
     }
 
-    std::ofstream fout(split_params.output.c_str(), std::ios::binary);
-    fout.exceptions(std::ofstream::failbit); // fail fast on write errors
-
     auto * ctx_out = gguf_init_empty();
 
-    std::vector<uint8_t> read_data;
     std::vector<ggml_context *> ctx_metas;
     std::vector<gguf_context *> ctx_ggufs;
+    std::vector<std::string>    split_paths;
 
     char split_path[PATH_MAX] = {0};
     strncpy(split_path, split_params.input.c_str(), sizeof(split_path) - 1);
@@ -453,7 +736,6 @@ static void gguf_merge(const split_params & split_params) {
                 gguf_free(ctx_gguf);
                 ggml_free(ctx_meta);
                 gguf_free(ctx_out);
-                fout.close();
                 exit(EXIT_FAILURE);
             }
 
@@ -466,7 +748,6 @@ static void gguf_merge(const split_params & split_params) {
                 gguf_free(ctx_gguf);
                 ggml_free(ctx_meta);
                 gguf_free(ctx_out);
-                fout.close();
                 exit(EXIT_FAILURE);
             }
 
@@ -479,16 +760,17 @@ static void gguf_merge(const split_params & split_params) {
                 gguf_free(ctx_gguf);
                 ggml_free(ctx_meta);
                 gguf_free(ctx_out);
-                fout.close();
                 exit(EXIT_FAILURE);
             }
 
             // Do not trigger merge if we try to merge again the output
             gguf_set_val_u16(ctx_gguf, LLM_KV_SPLIT_COUNT, 0);
 
-            // Set metadata from the first split
+            // Set metadata from the first split, the checksums only apply to the split
             gguf_set_kv(ctx_out, ctx_gguf);
+            gguf_remove_key(ctx_out, LLM_KV_SPLIT_TENSORS_XXH64);
         }
+        split_paths.push_back(split_path);
 
         auto n_tensors = gguf_get_n_tensors(ctx_gguf);
         for (int i_tensor = 0; i_tensor < n_tensors; i_tensor++) {
@@ -501,66 +783,79 @@ static void gguf_merge(const split_params & split_params) {
         fprintf(stderr, "\033[3Ddone\n");
     }
 
-    // placeholder for the meta data
-    {
-        auto meta_size = gguf_get_meta_size(ctx_out);
-        ::zeros(fout, meta_size);
-    }
+    // write the metadata, the tensor data is copied at the offsets computed by ctx_out
+    std::vector<copy_job> jobs;
+    std::vector<uint64_t> xxh64_expected; // only valid for the jobs with hash set, the splits without checksums are not verified
+    std::vector<std::string> tensor_names;
+    try {
+        create_output(split_params.output, ctx_out);
 
-    // Write tensors data
-    for (int i_split = 0; i_split < n_split; i_split++) {
-        llama_split_path(split_path, sizeof(split_path), split_prefix, i_split, n_split);
-        std::ifstream f_input(split_path, std::ios::binary);
-        if (!f_input.is_open()) {
-            fprintf(stderr, "%s:  failed to open input GGUF from %s\n", __func__, split_path);
-            for (uint32_t i = 0; i < ctx_ggufs.size(); i++) {
-                gguf_free(ctx_ggufs[i]);
-                ggml_free(ctx_metas[i]);
-            }
-            gguf_free(ctx_out);
-            fout.close();
-            exit(EXIT_FAILURE);
-        }
-        fprintf(stderr, "%s: writing tensors %s ...", __func__, split_path);
+        const size_t meta_size = gguf_get_meta_size(ctx_out);
+        for (int i_split = 0; i_split < n_split; i_split++) {
+            auto * ctx_gguf = ctx_ggufs[i_split];
+            auto * ctx_meta = ctx_metas[i_split];
 
-        auto * ctx_gguf = ctx_ggufs[i_split];
-        auto * ctx_meta = ctx_metas[i_split];
+            const int64_t key_xxh64 = gguf_find_key(ctx_gguf, LLM_KV_SPLIT_TENSORS_XXH64);
+            const auto n_tensors = gguf_get_n_tensors(ctx_gguf);
 
-        auto n_tensors = gguf_get_n_tensors(ctx_gguf);
-        for (int i_tensor = 0; i_tensor < n_tensors; i_tensor++) {
-            const char * t_name = gguf_get_tensor_name(ctx_gguf, i_tensor);
-            struct ggml_tensor * t = ggml_get_tensor(ctx_meta, t_name);
+            const bool has_xxh64 = key_xxh64 >= 0 &&
+                gguf_get_arr_type(ctx_gguf, key_xxh64) == GGUF_TYPE_UINT64 &&
+                gguf_get_arr_n(ctx_gguf, key_xxh64) == (size_t) n_tensors;
 
-            auto n_bytes = ggml_nbytes(t);
+            for (int i_tensor = 0; i_tensor < n_tensors; i_tensor++) {
+                const char * t_name = gguf_get_tensor_name(ctx_gguf, i_tensor);
+                struct ggml_tensor * t = ggml_get_tensor(ctx_meta, t_name);
 
-            if (read_data.size() < n_bytes) {
-                read_data.resize(n_bytes);
+                copy_job job;
+                job.i_input    = i_split;
+                job.i_output   = 0;
+                job.in_offset  = gguf_get_data_offset(ctx_gguf) + gguf_get_tensor_offset(ctx_gguf, i_tensor);
+                job.out_offset = meta_size + gguf_get_tensor_offset(ctx_out, gguf_find_tensor(ctx_out, t_name));
+                job.n_bytes    = ggml_nbytes(t);
+                job.hash       = has_xxh64;
+                jobs.push_back(job);
+
+                tensor_names.push_back(t_name);
+                xxh64_expected.push_back(has_xxh64 ? ((const uint64_t *) gguf_get_arr_data(ctx_gguf, key_xxh64))[i_tensor] : 0);
             }
-
-            auto offset = gguf_get_data_offset(ctx_gguf) + gguf_get_tensor_offset(ctx_gguf, i_tensor);
-            f_input.seekg(offset);
-            f_input.read((char *)read_data.data(), n_bytes);
-
-            // write tensor data + padding
-            fout.write((const char *)read_data.data(), n_bytes);
-            zeros(fout, GGML_PAD(n_bytes, GGUF_DEFAULT_ALIGNMENT) - n_bytes);
         }
 
-        gguf_free(ctx_gguf);
-        ggml_free(ctx_meta);
-        f_input.close();
+        fprintf(stderr, "%s: copying %zu tensors with %d threads ...", __func__, jobs.size(), split_params.n_threads);
+        copy_tensors(split_paths, { split_params.output }, jobs, split_params.n_threads);
         fprintf(stderr, "\033[3Ddone\n");
+    } catch (const std::exception & e) {
+        fprintf(stderr, "\n%s: failed to write %s: %s\n", __func__, split_params.output.c_str(), e.what());
+        std::remove(split_params.output.c_str());
+        exit(EXIT_FAILURE);
+    }
+
+    // verify the data against the checksums of the splits
+    int n_verified = 0;
+    int n_mismatch = 0;
+    for (size_t i = 0; i < jobs.size(); ++i) {
+        if (!jobs[i].hash) {
+            continue;
+        }
+        n_verified++;
+        if (jobs[i].xxh64 != xxh64_expected[i]) {
+            fprintf(stderr, "%s: checksum mismatch for tensor %s in %s\n", __func__, tensor_names[i].c_str(), split_paths[jobs[i].i_input].c_str());
+            n_mismatch++;
+        }
+    }
+    if (n_verified > 0) {
+        fprintf(stderr, "%s: verified the checksums of %d tensors\n", __func__, n_verified);
     }
 
-    {
-        // go back to beginning of file and write the updated metadata
-        fout.seekp(0);
-        std::vector<uint8_t> data(gguf_get_meta_size(ctx_out));
-        gguf_get_meta_data(ctx_out, data.data());
-        fout.write((const char *)data.data(), data.size());
+    for (uint32_t i = 0; i < ctx_ggufs.size(); i++) {
+        gguf_free(ctx_ggufs[i]);
+        ggml_free(ctx_metas[i]);
+    }
+    gguf_free(ctx_out);
 
-        fout.close();
-        gguf_free(ctx_out);
+    if (n_mismatch > 0) {
+        fprintf(stderr, "%s: %d tensors do not match their checksum, the input is corrupted, removing %s\n", __func__, n_mismatch, split_params.output.c_str());
+        std::remove(split_params.output.c_str());
+        exit(EXIT_FAILURE);
     }
 
     fprintf(stderr, "%s: %s merged from %d split with %d tensors.\n",
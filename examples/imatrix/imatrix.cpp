@@ -37,170 +37,76 @@ class IMatrixCollector {
 public:
     IMatrixCollector() = default;
     void set_params(common_params params) { m_params = std::move(params); }
-    bool collect_imatrix(struct ggml_tensor * t, bool ask, void * user_data);
+    bool collect_imatrix(llama_context * ctx, int n_chunks);
     void save_imatrix(int ncall = -1) const;
     bool load_imatrix(const char * fname);
 private:
+    void add_stats(const char * name, const float * values, const int64_t * counts, int64_t n_per_row, int64_t n_mat);
+
     std::unordered_map<std::string, Stats> m_stats;
     common_params                          m_params;
-    std::mutex                             m_mutex;
     int                                    m_last_call = 0;
-    std::vector<float>                     m_src1_data;
-    std::vector<char>                      m_ids; // the expert ids from ggml_mul_mat_id
+    int                                    m_n_chunks  = 0; // number of chunks in the statistics being added
 };
 
-// remove any prefix and suffixes from the name
-// CUDA0#blk.0.attn_k.weight#0 => blk.0.attn_k.weight
-static std::string filter_tensor_name(const char * name) {
-    std::string wname;
-    const char * p = strchr(name, '#');
-    if (p != NULL) {
-        p = p + 1;
-        const char * q = strchr(p, '#');
-        if (q != NULL) {
-            wname = std::string(p, q - p);
-        } else {
-            wname = p;
-        }
-    } else {
-        wname = name;
-    }
-    return wname;
-}
-
-bool IMatrixCollector::collect_imatrix(struct ggml_tensor * t, bool ask, void * user_data) {
-    GGML_UNUSED(user_data);
+// the statistics are accumulated in the compute graph by libllama and read back once per group of chunks
+bool IMatrixCollector::collect_imatrix(llama_context * ctx, int n_chunks) {
+    m_n_chunks = n_chunks;
 
-    const struct ggml_tensor * src0 = t->src[0];
-    const struct ggml_tensor * src1 = t->src[1];
-    std::string wname = filter_tensor_name(src0->name);
+    const auto cb = [](const char * name, const float * values, const int64_t * counts, int64_t n_per_row, int64_t n_mat, void * user_data) {
+        static_cast<IMatrixCollector *>(user_data)->add_stats(name, values, counts, n_per_row, n_mat);
+    };
 
-    // when ask is true, the scheduler wants to know if we are interested in data from this tensor
-    // if we return true, a follow-up call will be made with ask=false in which we can do the actual collection
-    if (ask) {
-        if (t->op == GGML_OP_MUL_MAT_ID) return true; // collect all indirect matrix multiplications
-        if (t->op != GGML_OP_MUL_MAT) return false;
-        // why are small batches ignored (<16 tokens)?
-        if (src1->ne[1] < 16 || src1->type != GGML_TYPE_F32) return false;
-        if (!(wname.substr(0, 4) == "blk." || (m_params.process_output && wname == "output.weight"))) return false;
-        return true;
+    if (llama_imatrix_read(ctx, cb, this) < 0) {
+        LOG_ERR("%s: the context does not collect activation statistics\n", __func__);
+        return false;
     }
 
-    std::lock_guard<std::mutex> lock(m_mutex);
-
-    // copy the data from the GPU memory if needed
-    const bool is_host = ggml_backend_buffer_is_host(src1->buffer);
+    const int prev_call = m_last_call;
+    m_last_call += n_chunks;
 
-    if (!is_host) {
-        m_src1_data.resize(ggml_nelements(src1));
-        ggml_backend_tensor_get(src1, m_src1_data.data(), 0, ggml_nbytes(src1));
+    if (m_last_call/m_params.n_out_freq != prev_call/m_params.n_out_freq) {
+        save_imatrix();
+    }
+    if (m_params.n_save_freq > 0 && m_last_call/m_params.n_save_freq != prev_call/m_params.n_save_freq) {
+        save_imatrix(m_last_call);
     }
 
-    const float * data = is_host ? (const float *) src1->data : m_src1_data.data();
-
-    // this has been adapted to the new format of storing merged experts in a single 3d tensor
-    // ref: https://github.com/ggerganov/llama.cpp/pull/6387
-    if (t->op == GGML_OP_MUL_MAT_ID) {
-        //   ids  -> [n_experts_used, n_tokens]
-        //   src1 -> [cols, n_expert_used, n_tokens]
-        const ggml_tensor * ids = t->src[2];
-        const int n_as = src0->ne[2];
-        const int n_ids = ids->ne[0];
-
-        // the top-k selected expert ids are stored in the ids tensor
-        // for simplicity, always copy ids to host, because it is small
-        // take into account that ids is not contiguous!
+    return true;
+}
 
-        GGML_ASSERT(ids->ne[1] == src1->ne[2]);
+void IMatrixCollector::add_stats(const char * name, const float * values, const int64_t * counts, int64_t n_per_row, int64_t n_mat) {
+    const std::string wname = name;
 
-        m_ids.resize(ggml_nbytes(ids));
-        ggml_backend_tensor_get(ids, m_ids.data(), 0, ggml_nbytes(ids));
+    if (wname == "output.weight" && !m_params.process_output) {
+        return;
+    }
 
-        auto & e = m_stats[wname];
+    auto & e = m_stats[wname];
+    if (e.values.empty()) {
+        e.values.resize(n_per_row*n_mat, 0);
+        e.counts.resize(n_per_row*n_mat, 0);
+    }
+    else if (e.values.size() != (size_t)(n_per_row*n_mat)) {
+        LOG_ERR("%s: inconsistent size for %s (%d vs %d)\n", __func__, wname.c_str(), (int)e.values.size(), (int)(n_per_row*n_mat));
+        exit(1); //GGML_ABORT("fatal error");
+    }
 
-        ++e.ncall;
+    e.ncall += m_n_chunks;
+    LOG_DBGV(2, "%s[%d]: %32s, %5d x %5d\n", __func__, m_last_call, wname.c_str(), (int)n_per_row, (int)n_mat);
 
-        if (e.values.empty()) {
-            e.values.resize(src1->ne[0]*n_as, 0);
-            e.counts.resize(src1->ne[0]*n_as, 0);
-        }
-        else if (e.values.size() != (size_t)src1->ne[0]*n_as) {
-            LOG_ERR("%s: inconsistent size for %s (%d vs %d)\n", __func__, wname.c_str(), (int)e.values.size(), (int)src1->ne[0]*n_as);
-            exit(1); //GGML_ABORT("fatal error");
-        }
-        LOG_DBGV(2, "%s[%d]: %32s, %s, %5d x %5d, %d\n", __func__, m_last_call, wname.c_str(), ggml_op_name(t->op), (int)src1->ne[0], (int)src1->ne[2], (int)src1->type);
-        // loop over all possible experts, regardless if they are used or not in the batch
-        for (int ex = 0; ex < n_as; ++ex) {
-            size_t e_start = ex*src1->ne[0];
-
-            for (int idx = 0; idx < n_ids; ++idx) {
-                for (int row = 0; row < (int)src1->ne[2]; ++row) {
-                    const int excur = *(const int32_t *) (m_ids.data() + row*ids->nb[1] + idx*ids->nb[0]);
-
-                    GGML_ASSERT(excur >= 0 && excur < n_as); // sanity check
-
-                    if (excur != ex) continue;
-
-                    const int64_t i11 = idx % src1->ne[1];
-                    const int64_t i12 = row;
-                    const float * x = (const float *)((const char *)data + i11*src1->nb[1] + i12*src1->nb[2]);
-
-                    for (int j = 0; j < (int)src1->ne[0]; ++j) {
-                        e.values[e_start + j] += x[j]*x[j];
-                        e.counts[e_start + j]++;
-                        if (!std::isfinite(e.values[e_start + j])) {
-                            LOG("\n");
-                            LOG_ERR("%f detected in %s\n", e.values[e_start + j], wname.c_str());
-                            exit(1);
-                        }
-                    }
-                }
-            }
-            if (e.ncall > m_last_call) {
-                m_last_call = e.ncall;
-                if (m_last_call % m_params.n_out_freq == 0) {
-                    save_imatrix();
-                }
-                if (m_params.n_save_freq > 0 && m_last_call%m_params.n_save_freq == 0) {
-                    save_imatrix(m_last_call);
-                }
-            }
-        }
-    } else {
-        auto & e = m_stats[wname];
-        if (e.values.empty()) {
-            e.values.resize(src1->ne[0], 0);
-            e.counts.resize(src1->ne[0], 0);
-        }
-        else if (e.values.size() != (size_t)src1->ne[0]) {
-            LOG_ERR("%s: inconsistent size for %s (%d vs %d)\n", __func__, wname.c_str(), (int)e.values.size(), (int)src1->ne[0]);
-            exit(1); //GGML_ABORT("fatal error");
-        }
-        ++e.ncall;
-        LOG_DBGV(2, "%s[%d]: %32s, %s, %5d x %5d, %d\n", __func__, m_last_call, wname.c_str(), ggml_op_name(t->op), (int)src1->ne[0], (int)src1->ne[1], (int)src1->type);
-        for (int row = 0; row < (int)src1->ne[1]; ++row) {
-            const float * x = data + row * src1->ne[0];
-            for (int j = 0; j < (int)src1->ne[0]; ++j) {
-                e.values[j] += x[j]*x[j];
-                e.counts[j]++;
-                if (!std::isfinite(e.values[j])) {
-                    LOG_ERR("%f detected in %s\n", e.values[j], wname.c_str());
-                    exit(1);
-                }
-            }
-        }
-        if (e.ncall > m_last_call) {
-            m_last_call = e.ncall;
-            if (m_last_call % m_params.n_out_freq == 0) {
-                save_imatrix();
-            }
-            if (m_params.n_save_freq > 0 && m_last_call%m_params.n_save_freq == 0) {
-                save_imatrix(m_last_call);
+    for (int64_t ex = 0; ex < n_mat; ++ex) {
+        const int64_t e_start = ex*n_per_row;
+        for (int64_t j = 0; j < n_per_row; ++j) {
+            e.values[e_start + j] += values[e_start + j];
+            e.counts[e_start + j] += counts[ex];
+            if (!std::isfinite(e.values[e_start + j])) {
+                LOG("\n");
+                LOG_ERR("%f detected in %s\n", e.values[e_start + j], wname.c_str());
+                exit(1);
             }
         }
     }
-
-    return true;
 }
 
 void IMatrixCollector::save_imatrix(int ncall) const {
@@ -350,10 +256,6 @@ bool IMatrixCollector::load_imatrix(const char * fname) {
 
 static IMatrixCollector g_collector;
 
-static bool ik_collect_imatrix(struct ggml_tensor * t, bool ask, void * user_data) {
-    return g_collector.collect_imatrix(t, ask, user_data);
-}
-
 
 struct results_log_softmax {
     double log_softmax;
@@ -432,7 +334,10 @@ static bool compute_imatrix(llama_context * ctx, const common_params & params) {
     const llama_vocab * vocab = llama_model_get_vocab(model);
 
     const bool add_bos = llama_vocab_get_add_bos(vocab);
-    const int n_ctx = llama_n_ctx(ctx);
+
+    // each sequence processes its own chunk of n_ctx tokens
+    const int n_seq = std::max(1, params.n_parallel);
+    const int n_ctx = params.n_ctx / n_seq;
 
     GGML_ASSERT(!llama_vocab_get_add_eos(vocab));
 
@@ -473,11 +378,13 @@ static bool compute_imatrix(llama_context * ctx, const common_params & params) {
     const int n_vocab = llama_vocab_n_tokens(vocab);
     const int n_batch = params.n_batch;
 
+    GGML_ASSERT(n_batch < n_ctx || n_batch % n_ctx == 0);
+
     int count = 0;
     double nll = 0.0;
     double nll2 = 0.0;
 
-    LOG_INF("%s: computing over %d chunks with batch_size %d\n", __func__, n_chunk, n_batch);
+    LOG_INF("%s: computing over %d chunks, n_ctx=%d, batch_size=%d, n_seq=%d\n", __func__, n_chunk, n_ctx, n_batch, n_seq);
 
     std::vector<std::thread> workers(std::thread::hardware_concurrency() - 1);
 
@@ -488,34 +395,41 @@ static bool compute_imatrix(llama_context * ctx, const common_params & params) {
         logits.reserve((size_t)n_ctx * n_vocab);
     }
 
-    for (int i = 0; i < n_chunk; ++i) {
+    llama_batch batch = llama_batch_init(std::min(n_batch, n_ctx*n_seq), 0, 1);
+
+    for (int i = 0; i < n_chunk; i += n_seq) {
         const int start =     i * n_ctx;
         const int end   = start + n_ctx;
 
-        std::vector<float> logits;
+        const int n_seq_batch = std::min(n_seq, n_chunk - i);
 
         const auto t_start = std::chrono::high_resolution_clock::now();
 
         // clear the KV cache
         llama_kv_cache_clear(ctx);
 
-        llama_batch batch = llama_batch_init(n_batch, 0, 1);
-
         for (int j = 0; j < num_batches; ++j) {
             const int batch_start = start + j * n_batch;
             const int batch_size  = std::min(end - batch_start, n_batch);
 
-            // save original token and restore it after eval
-            const auto token_org = tokens[batch_start];
+            common_batch_clear(batch);
+            for (int seq = 0; seq < n_seq_batch; seq++) {
+                const int seq_start = batch_start + seq*n_ctx;
+
+                // save original token and restore it after eval
+                const auto token_org = tokens[seq_start];
 
-            // add BOS token for the first batch of each chunk
-            if (add_bos && j == 0) {
-                tokens[batch_start] = llama_vocab_bos(vocab);
-            }
+                // add BOS token for the first batch of each chunk
+                if (add_bos && j == 0) {
+                    tokens[seq_start] = llama_vocab_bos(vocab);
+                }
 
-            common_batch_clear(batch);
-            for (int i = 0; i < batch_size; i++) {
-                common_batch_add(batch, tokens[batch_start + i], j*n_batch + i, {0}, true);
+                for (int k = 0; k < batch_size; k++) {
+                    common_batch_add(batch, tokens[seq_start + k], j*n_batch + k, { seq }, true);
+                }
+
+                // restore the original token in case it was set to BOS
+                tokens[seq_start] = token_org;
             }
 
             if (llama_decode(ctx, batch)) {
@@ -524,23 +438,23 @@ static bool compute_imatrix(llama_context * ctx, const common_params & params) {
                 return false;
             }
 
-            // restore the original token in case it was set to BOS
-            tokens[batch_start] = token_org;
-
             if (params.compute_ppl && num_batches > 1) {
                 const auto * batch_logits = llama_get_logits(ctx);
                 logits.insert(logits.end(), batch_logits, batch_logits + batch_size * n_vocab);
             }
         }
 
-        llama_batch_free(batch);
+        if (!g_collector.collect_imatrix(ctx, n_seq_batch)) {
+            llama_batch_free(batch);
+            return false;
+        }
 
         const auto t_end = std::chrono::high_resolution_clock::now();
 
         if (i == 0) {
             const float t_total = std::chrono::duration<float>(t_end - t_start).count();
             LOG_INF("%s: %.2f seconds per pass - ETA ", __func__, t_total);
-            int total_seconds = (int)(t_total * n_chunk);
+            int total_seconds = (int)(t_total * n_chunk / n_seq);
             if (total_seconds >= 60*60) {
                 LOG("%d hours ", total_seconds / (60*60));
                 total_seconds = total_seconds % (60*60);
@@ -550,17 +464,23 @@ static bool compute_imatrix(llama_context * ctx, const common_params & params) {
 
         if (params.compute_ppl) {
             const int first = n_ctx/2;
-            const auto * all_logits = num_batches > 1 ? logits.data() : llama_get_logits(ctx);
-            process_logits(n_vocab, all_logits + first*n_vocab, tokens.data() + start + first, n_ctx - 1 - first,
-                    workers, nll, nll2, logit_history.data() + start + first, prob_history.data() + start + first);
-            count += n_ctx - first - 1;
-
-            LOG("[%d]%.4lf,", i + 1, std::exp(nll / count));
+            for (int seq = 0; seq < n_seq_batch; seq++) {
+                const float * all_logits = num_batches > 1 ? logits.data() : llama_get_logits_ith(ctx, seq*n_ctx);
+                const int seq_start = start + seq*n_ctx;
+                process_logits(n_vocab, all_logits + first*n_vocab, tokens.data() + seq_start + first, n_ctx - 1 - first,
+                        workers, nll, nll2, logit_history.data() + seq_start + first, prob_history.data() + seq_start + first);
+                count += n_ctx - first - 1;
+
+                LOG("[%d]%.4lf,", i + seq + 1, std::exp(nll / count));
+            }
             fflush(stdout);
 
             logits.clear();
         }
     }
+
+    llama_batch_free(batch);
+
     LOG("\n");
 
     if (params.compute_ppl) {
@@ -592,7 +512,21 @@ int main(int argc, char ** argv) {
 
     common_init();
 
-    params.n_batch = std::min(params.n_batch, params.n_ctx);
+    const int32_t n_ctx = params.n_ctx;
+
+    if (n_ctx <= 0) {
+        LOG_ERR("%s: imatrix tool requires '--ctx-size' > 0\n", __func__);
+        return 1;
+    }
+
+    // process several chunks in parallel when the batch fits more than one
+    {
+        const int32_t n_seq = std::max(1, params.n_batch / n_ctx);
+
+        params.n_parallel = n_seq;
+        params.n_ctx      = n_seq * n_ctx;
+        params.n_batch    = std::min(params.n_batch, n_seq * n_ctx);
+    }
 
     g_collector.set_params(params);
 
@@ -612,10 +546,8 @@ int main(int argc, char ** argv) {
     llama_backend_init();
     llama_numa_init(params.numa);
 
-    // pass the callback to the backend scheduler
-    // it will be executed for each node during the graph computation
-    params.cb_eval = ik_collect_imatrix;
-    params.cb_eval_user_data = NULL;
+    // accumulate the activation statistics in the compute graph
+    params.collect_imatrix = true;
     params.warmup = false;
 
     // init
@@ -630,9 +562,9 @@ int main(int argc, char ** argv) {
     }
 
     const int n_ctx_train = llama_model_n_ctx_train(model);
-    if (params.n_ctx > n_ctx_train) {
+    if (n_ctx > n_ctx_train) {
         LOG_WRN("%s: model was trained on only %d context tokens (%d specified)\n",
-                __func__, n_ctx_train, params.n_ctx);
+                __func__, n_ctx_train, n_ctx);
     }
 
     // print system information
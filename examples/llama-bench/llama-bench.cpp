@@ -183,6 +183,8 @@ struct cmd_params {
     int                              delay;
     bool                             verbose;
     bool                             progress;
+    std::string                      trace_file;
+    bool                             trace_nodes;
     output_formats                   output_format;
     output_formats                   output_format_stderr;
 };
@@ -215,6 +217,8 @@ static const cmd_params cmd_params_defaults = {
     /* delay                */ 0,
     /* verbose              */ false,
     /* progress             */ false,
+    /* trace_file           */ "",
+    /* trace_nodes          */ false,
     /* output_format        */ MARKDOWN,
     /* output_format_stderr */ NONE,
 };
@@ -274,6 +278,8 @@ static void print_usage(int /* argc */, char ** argv) {
            output_format_str(cmd_params_defaults.output_format_stderr));
     printf("  -v, --verbose                             (default: %s)\n", cmd_params_defaults.verbose ? "1" : "0");
     printf("  --progress                                (default: %s)\n", cmd_params_defaults.progress ? "1" : "0");
+    printf("  --trace <filename>                        (default: none)\n");
+    printf("  --trace-nodes <0|1>                       (default: %s)\n", cmd_params_defaults.trace_nodes ? "1" : "0");
     printf("\n");
     printf(
         "Multiple values can be given for each parameter by separating them with ',' or by specifying the parameter "
@@ -324,6 +330,8 @@ static cmd_params parse_cmd_params(int argc, char ** argv) {
     params.prio                 = cmd_params_defaults.prio;
     params.delay                = cmd_params_defaults.delay;
     params.progress             = cmd_params_defaults.progress;
+    params.trace_file           = cmd_params_defaults.trace_file;
+    params.trace_nodes          = cmd_params_defaults.trace_nodes;
 
     for (int i = 1; i < argc; i++) {
         arg = argv[i];
@@ -591,6 +599,18 @@ static cmd_params parse_cmd_params(int argc, char ** argv) {
             params.verbose = true;
         } else if (arg == "--progress") {
             params.progress = true;
+        } else if (arg == "--trace") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.trace_file = argv[i];
+        } else if (arg == "--trace-nodes") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.trace_nodes = std::stoi(argv[i]);
         } else {
             invalid_param = true;
             break;
@@ -1450,6 +1470,19 @@ static void test_prompt(llama_context * ctx, int n_prompt, int n_batch, int n_th
     llama_synchronize(ctx);
 }
 
+// one trace file for each test when there are several: trace.json -> trace-2.json
+static std::string trace_file_name(const std::string & fname, int idx, size_t count) {
+    if (count == 1) {
+        return fname;
+    }
+    size_t pos = fname.rfind('.');
+    const size_t sep = fname.find_last_of("/\\");
+    if (pos == std::string::npos || (sep != std::string::npos && pos < sep)) {
+        pos = fname.size();
+    }
+    return fname.substr(0, pos) + "-" + std::to_string(idx) + fname.substr(pos);
+}
+
 static void test_gen(llama_context * ctx, int n_gen, int n_threads) {
     llama_set_n_threads(ctx, n_threads, n_threads);
 
@@ -1640,6 +1673,23 @@ int main(int argc, char ** argv) {
             t.samples_ns.push_back(t_ns);
         }
 
+        // the profiled run is not part of the samples, since the profiling synchronizes the backends
+        if (!params.trace_file.empty()) {
+            if (params.progress) {
+                fprintf(stderr, "llama-bench: benchmark %d/%zu: profiled run\n", params_idx, params_count);
+            }
+            llama_kv_cache_clear(ctx);
+            llama_perf_trace_start(ctx, params.trace_nodes);
+            if (t.n_prompt > 0) {
+                test_prompt(ctx, t.n_prompt, t.n_batch, t.n_threads);
+            }
+            if (t.n_gen > 0) {
+                test_gen(ctx, t.n_gen, t.n_threads);
+            }
+            llama_perf_trace_write(ctx, trace_file_name(params.trace_file, params_idx, params_count).c_str());
+            llama_perf_trace_stop(ctx);
+        }
+
         if (p) {
             p->print_test(t);
             fflush(p->fout);
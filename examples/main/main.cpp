@@ -42,6 +42,7 @@ static std::ostringstream       * g_output_ss;
 static std::vector<llama_token> * g_output_tokens;
 static bool is_interacting  = false;
 static bool need_insert_eot = false;
+static volatile sig_atomic_t is_interrupted = 0;
 
 static void print_usage(int argc, char ** argv) {
     (void) argc;
@@ -70,6 +71,9 @@ static void sigint_handler(int signo) {
         if (!is_interacting && g_params->interactive) {
             is_interacting  = true;
             need_insert_eot = true;
+        } else if (!g_params->trace_file.empty() && !is_interrupted) {
+            // the trace is written by the main loop, a second interrupt exits immediately
+            is_interrupted = 1;
         } else {
             console::cleanup();
             LOG("\n");
@@ -530,6 +534,11 @@ int main(int argc, char ** argv) {
     }
 
     while ((n_remain != 0 && !is_antiprompt) || params.interactive) {
+        if (is_interrupted) {
+            LOG("\nInterrupted by user\n");
+            break;
+        }
+
         // predict
         if (!embd.empty()) {
             // Note: (n_ctx - 4) here is to match the logic for commandline prompt handling via
@@ -914,6 +923,10 @@ int main(int argc, char ** argv) {
     LOG("\n\n");
     common_perf_print(ctx, smpl);
 
+    if (!params.trace_file.empty()) {
+        llama_perf_trace_write(ctx, params.trace_file.c_str());
+    }
+
     common_sampler_free(smpl);
 
     llama_backend_free();
@@ -921,5 +934,5 @@ int main(int argc, char ** argv) {
     ggml_threadpool_free_fn(threadpool);
     ggml_threadpool_free_fn(threadpool_batch);
 
-    return 0;
+    return is_interrupted ? 130 : 0;
 }
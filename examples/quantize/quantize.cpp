@@ -104,7 +104,7 @@ static bool try_parse_ftype(const std::string & ftype_str_in, llama_ftype & ftyp
 //
 [[noreturn]]
 static void usage(const char * executable) {
-    printf("usage: %s [--help] [--allow-requantize] [--leave-output-tensor] [--pure] [--imatrix] [--include-weights] [--exclude-weights] [--output-tensor-type] [--token-embedding-type] [--override-kv] model-f32.gguf [model-quant.gguf] type [nthreads]\n\n", executable);
+    printf("usage: %s [--help] [--allow-requantize] [--leave-output-tensor] [--pure] [--imatrix] [--include-weights] [--exclude-weights] [--output-tensor-type] [--token-embedding-type] [--target-bpw] [--target-size] [--override-kv] model-f32.gguf [model-quant.gguf] type [nthreads]\n\n", executable);
     printf("  --allow-requantize: Allows requantizing tensors that have already been quantized. Warning: This can severely reduce quality compared to quantizing from 16bit or 32bit\n");
     printf("  --leave-output-tensor: Will leave output.weight un(re)quantized. Increases model size but may also increase quality, especially when requantizing\n");
     printf("  --pure: Disable k-quant mixtures and quantize all tensors to the same type\n");
@@ -114,6 +114,9 @@ static void usage(const char * executable) {
     printf("  --output-tensor-type ggml_type: use this ggml_type for the output.weight tensor\n");
     printf("  --token-embedding-type ggml_type: use this ggml_type for the token embeddings tensor\n");
     printf("  --keep-split: will generate quantized model in the same shards as input\n");
+    printf("  --target-bpw bpw: search per-tensor quantization types that minimize the importance-weighted error at this average bits per weight\n");
+    printf("  --target-size size: same as --target-bpw, but for a target model size, e.g. 4096M or 7.5G\n");
+    printf("      The search measures the error of each tensor against all candidate types and works best with --imatrix\n");
     printf("  --override-kv KEY=TYPE:VALUE\n");
     printf("      Advanced option to override model metadata by key in the quantized model. May be specified multiple times.\n");
     printf("Note: --include-weights and --exclude-weights cannot be used together\n");
@@ -129,6 +132,45 @@ static void usage(const char * executable) {
     exit(1);
 }
 
+static bool parse_target_bpw(const char * data, float & target_bpw) {
+    try {
+        target_bpw = std::stof(data);
+    } catch (...) {
+        return false;
+    }
+    if (target_bpw <= 0.0f) {
+        printf("\n%s: invalid target bpw '%s'\n\n", __func__, data);
+        return false;
+    }
+    return true;
+}
+
+// parses a size in bytes with an optional K, M or G suffix (powers of 1024)
+static bool parse_target_size(const char * data, uint64_t & target_size) {
+    double size;
+    size_t pos;
+    try {
+        size = std::stod(data, &pos);
+    } catch (...) {
+        return false;
+    }
+    switch (std::toupper(data[pos])) {
+        case 'K': size *= 1024.0;                   break;
+        case 'M': size *= 1024.0*1024.0;            break;
+        case 'G': size *= 1024.0*1024.0*1024.0;     break;
+        case 0:                                     break;
+        default:
+            printf("\n%s: invalid target size '%s'\n\n", __func__, data);
+            return false;
+    }
+    if (size <= 0.0) {
+        printf("\n%s: invalid target size '%s'\n\n", __func__, data);
+        return false;
+    }
+    target_size = (uint64_t) size;
+    return true;
+}
+
 static int load_imatrix(const std::string & imatrix_file, std::string & imatrix_dataset, std::unordered_map<std::string, std::vector<float>> & imatrix_data) {
     std::ifstream in(imatrix_file.c_str(), std::ios::binary);
     if (!in) {
@@ -304,6 +346,14 @@ int main(int argc, char ** argv) {
             }
         } else if (strcmp(argv[arg_idx], "--keep-split") == 0) {
             params.keep_split = true;
+        } else if (strcmp(argv[arg_idx], "--target-bpw") == 0) {
+            if (arg_idx == argc-1 || !parse_target_bpw(argv[++arg_idx], params.target_bpw)) {
+                usage(argv[0]);
+            }
+        } else if (strcmp(argv[arg_idx], "--target-size") == 0) {
+            if (arg_idx == argc-1 || !parse_target_size(argv[++arg_idx], params.target_size)) {
+                usage(argv[0]);
+            }
         } else {
             usage(argv[0]);
         }
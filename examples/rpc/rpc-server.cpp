@@ -1,4 +1,5 @@
 #include "ggml-cpu.h"
+#include "common.h"
 
 #ifdef GGML_USE_CUDA
 #include "ggml-cuda.h"
@@ -29,6 +30,7 @@ struct rpc_server_params {
     std::string host        = "127.0.0.1";
     int         port        = 50052;
     size_t      backend_mem = 0;
+    bool        use_cache   = false;
 };
 
 static void print_usage(int /*argc*/, char ** argv, rpc_server_params params) {
@@ -38,6 +40,7 @@ static void print_usage(int /*argc*/, char ** argv, rpc_server_params params) {
     fprintf(stderr, "  -H HOST, --host HOST  host to bind to (default: %s)\n", params.host.c_str());
     fprintf(stderr, "  -p PORT, --port PORT  port to bind to (default: %d)\n", params.port);
     fprintf(stderr, "  -m MEM, --mem MEM     backend memory size (in MB)\n");
+    fprintf(stderr, "  -c,     --cache       enable the local cache of the tensor data (default: %s)\n", params.use_cache ? "enabled" : "disabled");
     fprintf(stderr, "\n");
 }
 
@@ -63,6 +66,8 @@ static bool rpc_server_params_parse(int argc, char ** argv, rpc_server_params &
                 return false;
             }
             params.backend_mem = std::stoul(argv[i]) * 1024 * 1024;
+        } else if (arg == "-c" || arg == "--cache") {
+            params.use_cache = true;
         } else if (arg == "-h" || arg == "--help") {
             print_usage(argc, argv, params);
             exit(0);
@@ -164,8 +169,17 @@ int main(int argc, char * argv[]) {
     } else {
         get_backend_memory(&free_mem, &total_mem);
     }
+    std::string cache_dir;
+    if (params.use_cache) {
+        cache_dir = fs_get_cache_directory() + "rpc" + DIRECTORY_SEPARATOR;
+        if (!fs_create_directory_with_parents(cache_dir)) {
+            fprintf(stderr, "Failed to create cache directory: %s\n", cache_dir.c_str());
+            return 1;
+        }
+        printf("Using cache directory: %s\n", cache_dir.c_str());
+    }
     printf("Starting RPC server on %s, backend memory: %zu MB\n", endpoint.c_str(), free_mem / (1024 * 1024));
-    ggml_backend_rpc_start_server(backend, endpoint.c_str(), free_mem, total_mem);
+    ggml_backend_rpc_start_server(backend, endpoint.c_str(), cache_dir.empty() ? nullptr : cache_dir.c_str(), free_mem, total_mem);
     ggml_backend_free(backend);
     return 0;
 }
@@ -5,6 +5,7 @@
 #include "json-schema-to-grammar.h"
 #include "llama.h"
 #include "log.h"
+#include "ngram-cache.h"
 #include "sampling.h"
 #include "speculative.h"
 
@@ -24,6 +25,7 @@
 #include <cstddef>
 #include <cinttypes>
 #include <deque>
+#include <fstream>
 #include <memory>
 #include <mutex>
 #include <signal.h>
@@ -164,10 +166,13 @@ struct slot_params {
             {"n_probs",                   sampling.n_probs},
             {"min_keep",                  sampling.min_keep},
             {"grammar",                   sampling.grammar},
+            {"grammar_async",             sampling.grammar_async},
             {"samplers",                  samplers},
             {"speculative.n_max",         speculative.n_max},
             {"speculative.n_min",         speculative.n_min},
             {"speculative.p_min",         speculative.p_min},
+            {"speculative.n_seq",         speculative.n_seq},
+            {"speculative.p_split",       speculative.p_split},
             {"timings_per_token",         timings_per_token},
             {"post_sampling_probs",       post_sampling_probs},
             {"lora",                      lora},
@@ -263,10 +268,16 @@ struct server_task {
         params.speculative.n_max = json_value(data, "speculative.n_max", defaults.speculative.n_max);
         params.speculative.p_min = json_value(data, "speculative.p_min", defaults.speculative.p_min);
 
+        params.speculative.n_seq   = json_value(data, "speculative.n_seq",   defaults.speculative.n_seq);
+        params.speculative.p_split = json_value(data, "speculative.p_split", defaults.speculative.p_split);
+
         params.speculative.n_min = std::min(params.speculative.n_max, params.speculative.n_min);
         params.speculative.n_min = std::max(params.speculative.n_min, 2);
         params.speculative.n_max = std::max(params.speculative.n_max, 0);
 
+        // the contexts have room for the branches of the server params only
+        params.speculative.n_seq = std::clamp(params.speculative.n_seq, 1, defaults.speculative.n_seq);
+
         // Use OpenAI API logprobs only if n_probs wasn't provided
         if (data.contains("logprobs") && params.sampling.n_probs == defaults.sampling.n_probs){
             params.sampling.n_probs = json_value(data, "logprobs", defaults.sampling.n_probs);
@@ -333,6 +344,8 @@ struct server_task {
             params.sampling.grammar = json_value(data, "grammar", defaults.sampling.grammar);
         }
 
+        params.sampling.grammar_async = json_value(data, "grammar_async", defaults.sampling.grammar_async);
+
         {
             params.sampling.logit_bias.clear();
             params.ignore_eos = json_value(data, "ignore_eos", false);
@@ -1141,6 +1154,16 @@ struct server_slot {
 
     common_speculative * spec = nullptr;
 
+    // speculative decoding with the n-grams of the context instead of a draft model
+    bool lookup = false;
+
+    common_ngram_cache lookup_cache; // n-grams of lookup_inp
+    llama_tokens       lookup_inp;   // prompt and generated tokens, must only be appended to
+
+    // decayed number of checked and accepted draft tokens, for the draft length
+    float lookup_n_checked  = 0.0f;
+    float lookup_n_accepted = 0.0f;
+
     std::vector<common_adapter_lora_info> lora;
 
     // the index relative to completion multi-task request
@@ -1216,8 +1239,13 @@ struct server_slot {
         n_sent_text        = 0;
         task_type          = SERVER_TASK_TYPE_COMPLETION;
 
+        lookup_n_checked   = 0.0f;
+        lookup_n_accepted  = 0.0f;
+
         generated_tokens.clear();
         generated_token_probs.clear();
+
+        lookup_reset();
     }
 
     bool is_non_causal() const {
@@ -1250,7 +1278,55 @@ struct server_slot {
     }
 
     bool can_speculate() const {
-        return ctx_dft && params.speculative.n_max > 0 && params.cache_prompt;
+        return (ctx_dft || lookup) && params.speculative.n_max > 0 && params.cache_prompt;
+    }
+
+    void lookup_reset() {
+        lookup_cache.clear();
+        lookup_inp.clear();
+    }
+
+    // draft with the n-grams of the tokens so far, followed by the last sampled token id
+    llama_tokens lookup_draft(common_ngram_cache & cache_static, llama_token id, int n_draft_min, int n_draft_max) {
+        // the cached tokens may have changed (e.g. context shift) - start over
+        if (lookup_inp.size() > cache_tokens.size() || (!lookup_inp.empty() && lookup_inp.back() != cache_tokens[lookup_inp.size() - 1])) {
+            lookup_reset();
+        }
+
+        const int n_new = cache_tokens.size() - lookup_inp.size();
+        if (n_new > 0) {
+            lookup_inp.insert(lookup_inp.end(), cache_tokens.end() - n_new, cache_tokens.end());
+            common_ngram_cache_update(lookup_cache, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, lookup_inp, n_new, false);
+        }
+
+        // draft about twice the expected number of accepted tokens, given the recent acceptance rate
+        int n_draft = n_draft_max;
+        if (lookup_n_checked > 0.0f) {
+            const float p_accept = std::min(lookup_n_accepted/lookup_n_checked, 0.95f);
+            n_draft = std::clamp(1 + (int) (2.0f*p_accept/(1.0f - p_accept)), n_draft_min, n_draft_max);
+        }
+
+        // the last sampled token is not part of the cache yet
+        common_ngram_cache nc_dynamic;
+
+        llama_tokens draft = { id };
+
+        lookup_inp.push_back(id);
+        common_ngram_cache_draft(lookup_inp, draft, n_draft, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX,
+                lookup_cache, nc_dynamic, cache_static);
+        lookup_inp.pop_back();
+
+        draft.erase(draft.begin());
+
+        return draft;
+    }
+
+    void lookup_accept(int n_draft, int n_accepted) {
+        // the first rejected token counts as checked
+        const int n_checked = n_accepted < n_draft ? n_accepted + 1 : n_accepted;
+
+        lookup_n_checked  = 0.9f*lookup_n_checked  + n_checked;
+        lookup_n_accepted = 0.9f*lookup_n_accepted + n_accepted;
     }
 
     void add_token(const completion_token_output & token) {
@@ -1722,6 +1798,12 @@ struct server_context {
 
     common_chat_templates chat_templates;
 
+    // workers for sampling the slots in parallel
+    common_sampler_threadpool * smpl_pool = nullptr;
+
+    // n-grams of a text corpus for the lookup speculation of the slots (--lookup-cache-static)
+    common_ngram_cache lookup_cache_static;
+
     ~server_context() {
         // Clear any sampling context
         for (server_slot & slot : slots) {
@@ -1738,6 +1820,8 @@ struct server_context {
         }
 
         llama_batch_free(batch);
+
+        common_sampler_threadpool_free(smpl_pool);
     }
 
     bool load_model(const common_params & params) {
@@ -1745,7 +1829,18 @@ struct server_context {
 
         params_base = params;
 
-        llama_init = common_init_from_params(params_base);
+        const bool has_draft = !params_base.speculative.model.empty() || !params_base.speculative.hf_repo.empty();
+
+        {
+            auto params_tgt = params_base;
+
+            // the draft branches of each slot are verified in sequences of their own
+            if (has_draft) {
+                params_tgt.n_parallel = params_base.n_parallel*params_base.speculative.n_seq;
+            }
+
+            llama_init = common_init_from_params(params_tgt);
+        }
 
         model = llama_init.model.get();
         ctx   = llama_init.context.get();
@@ -1762,7 +1857,7 @@ struct server_context {
         add_bos_token = llama_vocab_get_add_bos(vocab);
         has_eos_token = llama_vocab_eos(vocab) != LLAMA_TOKEN_NULL;
 
-        if (!params_base.speculative.model.empty() || !params_base.speculative.hf_repo.empty()) {
+        if (has_draft) {
             SRV_INF("loading draft model '%s'\n", params_base.speculative.model.c_str());
 
             auto params_dft = params_base;
@@ -1774,7 +1869,7 @@ struct server_context {
             params_dft.model_url    = params_base.speculative.model_url;
             params_dft.n_ctx        = params_base.speculative.n_ctx == 0 ? params_base.n_ctx / params_base.n_parallel : params_base.speculative.n_ctx;
             params_dft.n_gpu_layers = params_base.speculative.n_gpu_layers;
-            params_dft.n_parallel   = 1;
+            params_dft.n_parallel   = params_base.speculative.n_seq;
 
             llama_init_dft = common_init_from_params(params_dft);
 
@@ -1804,6 +1899,17 @@ struct server_context {
             llama_init_dft.context.reset();
         }
 
+        if (!has_draft && params_base.speculative.lookup && !params_base.lookup_cache_static.empty()) {
+            SRV_INF("loading static lookup cache '%s'\n", params_base.lookup_cache_static.c_str());
+
+            try {
+                lookup_cache_static = common_ngram_cache_load(params_base.lookup_cache_static);
+            } catch (std::ifstream::failure const &) {
+                SRV_ERR("failed to open static lookup cache: %s\n", params_base.lookup_cache_static.c_str());
+                return false;
+            }
+        }
+
         chat_templates = common_chat_templates_from_model(model, params_base.chat_template);
         GGML_ASSERT(chat_templates.template_default.get() != nullptr);
 
@@ -1853,7 +1959,7 @@ struct server_context {
             slot.n_predict = params_base.n_predict;
 
             if (model_dft) {
-                slot.batch_spec = llama_batch_init(params_base.speculative.n_max + 1, 0, 1);
+                slot.batch_spec = llama_batch_init(params_base.speculative.n_max + 1, 0, params_base.speculative.n_seq);
 
                 slot.ctx_dft = llama_init_from_model(model_dft, cparams_dft);
                 if (slot.ctx_dft == nullptr) {
@@ -1866,6 +1972,10 @@ struct server_context {
                     SRV_ERR("%s", "failed to create speculator\n");
                     return;
                 }
+            } else if (params_base.speculative.lookup) {
+                slot.batch_spec = llama_batch_init(params_base.speculative.n_max + 1, 0, 1);
+
+                slot.lookup = true;
             }
 
             SLT_INF(slot, "new slot n_ctx_slot = %d\n", slot.n_ctx);
@@ -1883,6 +1993,10 @@ struct server_context {
 
         default_generation_settings_for_props = slots[0].to_json();
 
+        if (params_base.n_parallel > 1) {
+            smpl_pool = common_sampler_threadpool_init(std::min(params_base.cpuparams.n_threads, params_base.n_parallel));
+        }
+
         // the update_slots() logic will always submit a maximum of n_batch or n_parallel tokens
         // note that n_batch can be > n_ctx (e.g. for non-causal attention models such as BERT where the KV cache is not used)
         {
@@ -2006,10 +2120,10 @@ struct server_context {
             }
         }
 
-        if (slot.ctx_dft) {
+        if (slot.ctx_dft || slot.lookup) {
             llama_batch_free(slot.batch_spec);
 
-            slot.batch_spec = llama_batch_init(slot.params.speculative.n_max + 1, 0, 1);
+            slot.batch_spec = llama_batch_init(slot.params.speculative.n_max + 1, 0, params_base.speculative.n_seq);
         }
 
         slot.state = SLOT_STATE_STARTED;
@@ -2701,6 +2815,11 @@ struct server_context {
         }
     }
 
+    // sequence of the target context for the draft branch s of a slot - branch 0 is the sequence of the slot
+    llama_seq_id spec_seq_id(const server_slot & slot, llama_seq_id s) const {
+        return s == 0 ? slot.id : params_base.n_parallel + slot.id*(params_base.speculative.n_seq - 1) + s - 1;
+    }
+
     void update_slots() {
         // check if all slots are idle
         {
@@ -2764,6 +2883,8 @@ struct server_context {
                 slot.n_past -= n_discard;
 
                 slot.truncated = true;
+
+                slot.lookup_reset();
             }
         }
 
@@ -3087,6 +3208,10 @@ struct server_context {
                 continue; // continue loop of n_batch
             }
 
+            std::vector<server_slot *>    slots_sample;
+            std::vector<common_sampler *> smpls;
+            std::vector<int>              idxs;
+
             for (auto & slot : slots) {
                 if (slot.i_batch < (int) i || slot.i_batch >= (int) (i + n_tokens)) {
                     continue; // continue loop of slots
@@ -3114,13 +3239,22 @@ struct server_context {
                     continue; // continue loop of slots
                 }
 
-                const int tok_idx = slot.i_batch - i;
+                slots_sample.push_back(&slot);
+                smpls       .push_back(slot.smpl);
+                idxs        .push_back(slot.i_batch - i);
+            }
 
-                llama_token id = common_sampler_sample(slot.smpl, ctx, tok_idx);
+            // sample the outputs of all the slots at once - the samplers are independent
+            const std::vector<llama_token> ids = common_sampler_sample_and_accept_batch(smpl_pool, smpls, ctx, idxs);
 
-                slot.i_batch = -1;
+            for (size_t k = 0; k < slots_sample.size(); ++k) {
+                server_slot & slot = *slots_sample[k];
+
+                const int tok_idx = idxs[k];
 
-                common_sampler_accept(slot.smpl, id, true);
+                const llama_token id = ids[k];
+
+                slot.i_batch = -1;
 
                 slot.n_decoded += 1;
 
@@ -3184,12 +3318,24 @@ struct server_context {
 
                 llama_token id = slot.sampled;
 
-                struct common_speculative_params params_spec;
-                params_spec.n_draft   = n_draft_max;
-                params_spec.n_reuse   = llama_n_ctx(slot.ctx_dft) - slot.params.speculative.n_max;
-                params_spec.p_min     = slot.params.speculative.p_min;
+                common_speculative_tree draft;
 
-                llama_tokens draft = common_speculative_gen_draft(slot.spec, params_spec, slot.cache_tokens, id);
+                if (slot.ctx_dft) {
+                    struct common_speculative_params params_spec;
+                    params_spec.n_draft   = n_draft_max;
+                    params_spec.n_reuse   = llama_n_ctx(slot.ctx_dft) - slot.params.speculative.n_max;
+                    params_spec.p_min     = slot.params.speculative.p_min;
+                    params_spec.n_seq     = slot.params.speculative.n_seq;
+                    params_spec.p_split   = slot.params.speculative.p_split;
+
+                    draft = common_speculative_gen_draft_tree(slot.spec, params_spec, slot.cache_tokens, id);
+                } else {
+                    const llama_tokens draft_lookup = slot.lookup_draft(lookup_cache_static, id, slot.params.speculative.n_min, n_draft_max);
+
+                    for (size_t i = 0; i < draft_lookup.size(); ++i) {
+                        draft.push_back({ draft_lookup[i], (int32_t) i - 1, (int32_t) i + 1, { 0 } });
+                    }
+                }
 
                 // ignore small drafts
                 if (slot.params.speculative.n_min > (int) draft.size()) {
@@ -3198,20 +3344,56 @@ struct server_context {
                     continue;
                 }
 
-                // construct the speculation batch
+                const int32_t n_seq_draft = common_speculative_tree_n_seq(draft);
+
+                // the branches attend to the context of the slot and to their own nodes only
+                std::vector<llama_seq_id> seq_ids(n_seq_draft);
+                for (llama_seq_id s = 0; s < n_seq_draft; ++s) {
+                    seq_ids[s] = spec_seq_id(slot, s);
+
+                    if (s > 0) {
+                        llama_kv_cache_seq_rm(ctx, seq_ids[s], -1, -1);
+                        llama_kv_cache_seq_cp(ctx, slot.id, seq_ids[s], -1, -1);
+                    }
+                }
+
+                // construct the speculation batch - the last sampled token is shared by all branches
                 common_batch_clear(slot.batch_spec);
-                common_batch_add  (slot.batch_spec, id, slot.n_past, { slot.id }, true);
+                common_batch_add  (slot.batch_spec, id, slot.n_past, seq_ids, true);
+
+                std::vector<llama_seq_id> node_seq_ids;
 
-                for (size_t i = 0; i < draft.size(); ++i) {
-                    common_batch_add(slot.batch_spec, draft[i], slot.n_past + 1 + i, { slot.id }, true);
+                for (const auto & node : draft) {
+                    node_seq_ids.clear();
+                    for (const llama_seq_id s : node.seqs) {
+                        node_seq_ids.push_back(seq_ids[s]);
+                    }
+
+                    common_batch_add(slot.batch_spec, node.id, slot.n_past + node.depth, node_seq_ids, true);
                 }
 
-                SLT_DBG(slot, "decoding speculative batch, size = %d\n", slot.batch_spec.n_tokens);
+                SLT_DBG(slot, "decoding speculative batch, size = %d, branches = %d\n", slot.batch_spec.n_tokens, n_seq_draft);
 
                 llama_decode(ctx, slot.batch_spec);
 
                 // the accepted tokens from the speculation
-                const auto ids = common_sampler_sample_and_accept_n(slot.smpl, ctx, draft);
+                llama_seq_id seq_accepted = 0;
+
+                const auto ids = common_speculative_accept_tree(slot.smpl, ctx, draft, seq_accepted);
+
+                if (slot.lookup) {
+                    slot.lookup_accept(draft.size(), ids.size() - 1);
+                }
+
+                // move the accepted path to the sequence of the slot and drop the other branches
+                if (seq_accepted != 0) {
+                    llama_kv_cache_seq_rm(ctx, slot.id, slot.n_past, -1);
+                    llama_kv_cache_seq_cp(ctx, seq_ids[seq_accepted], slot.id, slot.n_past, slot.n_past + ids.size());
+                }
+
+                for (llama_seq_id s = 1; s < n_seq_draft; ++s) {
+                    llama_kv_cache_seq_rm(ctx, seq_ids[s], -1, -1);
+                }
 
                 slot.n_past    += ids.size();
                 slot.n_decoded += ids.size();
@@ -3240,7 +3422,7 @@ struct server_context {
                     }
                 }
 
-                SLT_DBG(slot, "accepted %d/%d draft tokens, new n_past = %d\n", (int) ids.size() - 1, (int) draft.size(), slot.n_past);
+                SLT_DBG(slot, "accepted %d/%d draft tokens in branch %d, new n_past = %d\n", (int) ids.size() - 1, (int) draft.size(), seq_accepted, slot.n_past);
             }
         }
 
@@ -3464,6 +3646,14 @@ int main(int argc, char ** argv) {
     const auto handle_health = [&](const httplib::Request &, httplib::Response & res) {
         // error and loading states are handled by middleware
         json health = {{"status", "ok"}};
+        if (ctx_server.params_base.warmup && ctx_server.params_base.warmup_async) {
+            // the weights are still being read in the background, requests are served meanwhile
+            const float progress = llama_model_prefetch_progress(ctx_server.model);
+            health["warmup"] = {
+                {"progress", progress},
+                {"done",     progress >= 1.0f},
+            };
+        }
         res_ok(res, health);
     };
 
@@ -3763,7 +3953,7 @@ int main(int argc, char ** argv) {
         std::vector<server_task> tasks;
 
         try {
-            std::vector<llama_tokens> tokenized_prompts = tokenize_input_prompts(ctx_server.vocab, data.at("prompt"), true, true);
+            std::vector<llama_tokens> tokenized_prompts = tokenize_input_prompts(ctx_server.vocab, data.at("prompt"), true, true, ctx_server.params_base.cpuparams_batch.n_threads);
             tasks.reserve(tokenized_prompts.size());
             for (size_t i = 0; i < tokenized_prompts.size(); i++) {
                 server_task task = server_task(type);
@@ -3926,7 +4116,7 @@ int main(int argc, char ** argv) {
         data["input_extra"] = input_extra; // default to empty array if it's not exist
 
         std::string prompt = json_value(data, "prompt", std::string());
-        std::vector<llama_tokens> tokenized_prompts = tokenize_input_prompts(ctx_server.vocab, prompt, false, true);
+        std::vector<llama_tokens> tokenized_prompts = tokenize_input_prompts(ctx_server.vocab, prompt, false, true, ctx_server.params_base.cpuparams_batch.n_threads);
         SRV_DBG("creating infill tasks, n_prompts = %d\n", (int) tokenized_prompts.size());
         data["prompt"] = format_infill(
             ctx_server.vocab,
@@ -3991,7 +4181,7 @@ int main(int argc, char ** argv) {
             const bool add_special = json_value(body, "add_special", false);
             const bool with_pieces = json_value(body, "with_pieces", false);
 
-            llama_tokens tokens = tokenize_mixed(ctx_server.vocab, body.at("content"), add_special, true);
+            llama_tokens tokens = tokenize_mixed(ctx_server.vocab, body.at("content"), add_special, true, ctx_server.params_base.cpuparams_batch.n_threads);
 
             if (with_pieces) {
                 for (const auto& token : tokens) {
@@ -4067,7 +4257,7 @@ int main(int argc, char ** argv) {
             }
         }
 
-        std::vector<llama_tokens> tokenized_prompts = tokenize_input_prompts(ctx_server.vocab, prompt, true, true);
+        std::vector<llama_tokens> tokenized_prompts = tokenize_input_prompts(ctx_server.vocab, prompt, true, true, ctx_server.params_base.cpuparams_batch.n_threads);
         for (const auto & tokens : tokenized_prompts) {
             // this check is necessary for models that do not add BOS token to the input
             if (tokens.empty()) {
@@ -4167,14 +4357,14 @@ int main(int argc, char ** argv) {
             return;
         }
 
-        llama_tokens tokenized_query = tokenize_input_prompts(ctx_server.vocab, query, /* add_special */ false, true)[0];
+        llama_tokens tokenized_query = tokenize_input_prompts(ctx_server.vocab, query, /* add_special */ false, true, ctx_server.params_base.cpuparams_batch.n_threads)[0];
 
         // create and queue the task
         json responses = json::array();
         bool error = false;
         {
             std::vector<server_task> tasks;
-            std::vector<llama_tokens> tokenized_docs = tokenize_input_prompts(ctx_server.vocab, documents, /* add_special */ false, true);
+            std::vector<llama_tokens> tokenized_docs = tokenize_input_prompts(ctx_server.vocab, documents, /* add_special */ false, true, ctx_server.params_base.cpuparams_batch.n_threads);
             tasks.reserve(tokenized_docs.size());
             for (size_t i = 0; i < tokenized_docs.size(); i++) {
                 server_task task   = server_task(SERVER_TASK_TYPE_RERANK);
@@ -4388,10 +4578,7 @@ int main(int argc, char ** argv) {
         ctx_server.queue_tasks.terminate();
     };
 
-    LOG_INF("%s: server is listening on http://%s:%d - starting the main loop\n", __func__, params.hostname.c_str(), params.port);
-
-    ctx_server.queue_tasks.start_loop();
-
+    // the handlers are installed before the main loop, so that an interrupt ends the loop and the server shuts down cleanly
 #if defined (__unix__) || (defined (__APPLE__) && defined (__MACH__))
     struct sigaction sigint_action;
     sigint_action.sa_handler = signal_handler;
@@ -4406,6 +4593,14 @@ int main(int argc, char ** argv) {
     SetConsoleCtrlHandler(reinterpret_cast<PHANDLER_ROUTINE>(console_ctrl_handler), true);
 #endif
 
+    LOG_INF("%s: server is listening on http://%s:%d - starting the main loop\n", __func__, params.hostname.c_str(), params.port);
+
+    ctx_server.queue_tasks.start_loop();
+
+    if (!params.trace_file.empty()) {
+        llama_perf_trace_write(ctx_server.ctx, params.trace_file.c_str());
+    }
+
     clean_up();
     t.join();
 
@@ -192,6 +192,8 @@ extern "C" {
     typedef ggml_backend_buffer_type_t * (*ggml_backend_dev_get_extra_bufts_t)(ggml_backend_dev_t device);
     // Set the abort callback for the backend
     typedef void                         (*ggml_backend_set_abort_callback_t)(ggml_backend_t backend, ggml_abort_callback abort_callback, void * abort_callback_data);
+    // Get and clear the first failure of the graphs computed asynchronously by the backend, that were completed when the backend was last synchronized
+    typedef enum ggml_status             (*ggml_backend_pop_status_t)(ggml_backend_t backend);
     // Get a list of feature flags supported by the backend (returns a NULL-terminated array)
     struct ggml_backend_feature {
         const char * name;
@@ -302,6 +304,11 @@ extern "C" {
     GGML_API int                  ggml_backend_sched_get_n_splits(ggml_backend_sched_t sched);
     GGML_API int                  ggml_backend_sched_get_n_copies(ggml_backend_sched_t sched);
 
+    // with pipeline parallelism, the backends without async compute or events run on a worker thread of the scheduler,
+    // unless another backend uses the same buffer type
+    // time spent computing by such a backend since the creation of the scheduler, -1 for the other backends
+    GGML_API int64_t              ggml_backend_sched_get_busy_us(ggml_backend_sched_t sched, ggml_backend_t backend);
+
     GGML_API size_t               ggml_backend_sched_get_buffer_size(ggml_backend_sched_t sched, ggml_backend_t backend);
 
     GGML_API void                 ggml_backend_sched_set_tensor_backend(ggml_backend_sched_t sched, struct ggml_tensor * node, ggml_backend_t backend);
@@ -311,7 +318,8 @@ extern "C" {
     GGML_API bool                 ggml_backend_sched_alloc_graph(ggml_backend_sched_t sched, struct ggml_cgraph * graph); // returns success
     GGML_API enum ggml_status     ggml_backend_sched_graph_compute(ggml_backend_sched_t sched, struct ggml_cgraph * graph);
     GGML_API enum ggml_status     ggml_backend_sched_graph_compute_async(ggml_backend_sched_t sched, struct ggml_cgraph * graph);
-    GGML_API void                 ggml_backend_sched_synchronize(ggml_backend_sched_t sched);
+    // returns the first failure of the graphs computed asynchronously since the last call
+    GGML_API enum ggml_status     ggml_backend_sched_synchronize(ggml_backend_sched_t sched);
 
     // Reset all assignments and allocators - must be called before changing the node backends or allocating a new graph.
     // This in effect deallocates all tensors that were previously allocated and leaves them with dangling pointers.
@@ -321,6 +329,22 @@ extern "C" {
     // Set a callback to be called for each resulting node during graph compute
     GGML_API void                 ggml_backend_sched_set_eval_callback(ggml_backend_sched_t sched, ggml_backend_sched_eval_callback callback, void * user_data);
 
+    // Profiling of the graph computations
+    // records the allocation and the compute of the graphs, the compute of each split (or of each node), the input copies between the backends
+    // with their size, and the time spent waiting for the backends
+    // the backends are synchronized after each split (or node) to time it, so the profiled computations do not overlap
+    enum ggml_backend_sched_profile_mode {
+        GGML_BACKEND_SCHED_PROFILE_NONE,
+        GGML_BACKEND_SCHED_PROFILE_SPLITS,
+        GGML_BACKEND_SCHED_PROFILE_NODES,
+    };
+
+    // GGML_BACKEND_SCHED_PROFILE_NONE discards the recorded events
+    GGML_API void                 ggml_backend_sched_set_profile(ggml_backend_sched_t sched, enum ggml_backend_sched_profile_mode mode);
+
+    // Write the recorded events in the Chrome trace JSON format (chrome://tracing, ui.perfetto.dev), log a summary and clear the events
+    GGML_API bool                 ggml_backend_sched_write_trace(ggml_backend_sched_t sched, const char * fname); // returns success
+
     //
     // Utils
     //
@@ -343,9 +343,20 @@ struct hash_node {
     int n_views;
     int buffer_id;
     size_t offset; // offset within the buffer
+    int block;     // 1-based index of the memory block in ggml_gallocr::blocks, 0 if none
     bool allocated;
 };
 
+// a range of a buffer used by one tensor, or by a chain of tensors computed inplace
+// live from the step it is allocated to the step it is freed (inclusive)
+struct alloc_block {
+    struct ggml_dyn_tallocr * alloc;
+    size_t size;   // aligned
+    size_t offset;
+    int start;
+    int end;       // INT_MAX if never freed
+};
+
 struct tensor_alloc {
     int buffer_id;
     size_t offset;
@@ -375,6 +386,17 @@ struct ggml_gallocr {
 
     struct leaf_alloc * leaf_allocs; // [n_leafs]
     int n_leafs;
+
+    // lifetimes recorded while allocating the measure graph, used to plan the offsets
+    struct alloc_block * blocks; // [n_blocks]
+    int n_blocks;
+    int blocks_size;
+    int step; // 0 for the leafs and inputs, i + 1 for node i
+
+    // last planned offsets and buffer sizes, reused while the lifetimes of the blocks stay the same
+    struct alloc_block * plan_blocks; // [plan_n_blocks]
+    int plan_n_blocks;
+    size_t * plan_max_sizes; // [n_buffers]
 };
 
 ggml_gallocr_t ggml_gallocr_new_n(ggml_backend_buffer_type_t * bufts, int n_bufs) {
@@ -457,6 +479,9 @@ void ggml_gallocr_free(ggml_gallocr_t galloc) {
     free(galloc->buf_tallocs);
     free(galloc->node_allocs);
     free(galloc->leaf_allocs);
+    free(galloc->blocks);
+    free(galloc->plan_blocks);
+    free(galloc->plan_max_sizes);
     free(galloc);
 }
 
@@ -475,6 +500,26 @@ static bool ggml_gallocr_is_allocated(ggml_gallocr_t galloc, struct ggml_tensor
     return t->data != NULL || ggml_gallocr_hash_get(galloc, t)->allocated;
 }
 
+static int ggml_gallocr_new_block(ggml_gallocr_t galloc, int buffer_id, size_t size, size_t offset) {
+    if (galloc->n_blocks == galloc->blocks_size) {
+        galloc->blocks_size = MAX(2*galloc->blocks_size, 256);
+        galloc->blocks = realloc(galloc->blocks, galloc->blocks_size * sizeof(struct alloc_block));
+        GGML_ASSERT(galloc->blocks != NULL);
+    }
+
+    struct ggml_dyn_tallocr * alloc = galloc->buf_tallocs[buffer_id];
+
+    galloc->blocks[galloc->n_blocks] = (struct alloc_block) {
+        /*.alloc  =*/ alloc,
+        /*.size   =*/ aligned_offset(NULL, size, alloc->alignment),
+        /*.offset =*/ offset,
+        /*.start  =*/ galloc->step,
+        /*.end    =*/ INT_MAX,
+    };
+
+    return ++galloc->n_blocks;
+}
+
 static void ggml_gallocr_allocate_node(ggml_gallocr_t galloc, struct ggml_tensor * node, int buffer_id) {
     GGML_ASSERT(buffer_id >= 0);
     struct hash_node * hn = ggml_gallocr_hash_get(galloc, node);
@@ -518,6 +563,7 @@ static void ggml_gallocr_allocate_node(ggml_gallocr_t galloc, struct ggml_tensor
                             assert(view_src_hn->offset == p_hn->offset);
                             hn->buffer_id = p_hn->buffer_id;
                             hn->offset = p_hn->offset;
+                            hn->block = view_src_hn->block;
                             p_hn->allocated = false; // avoid freeing the parent
                             view_src_hn->allocated = false;
                             return;
@@ -526,6 +572,7 @@ static void ggml_gallocr_allocate_node(ggml_gallocr_t galloc, struct ggml_tensor
                         AT_PRINTF("reusing parent %s for %s\n", parent->name, node->name);
                         hn->buffer_id = p_hn->buffer_id;
                         hn->offset = p_hn->offset;
+                        hn->block = p_hn->block;
                         p_hn->allocated = false; // avoid freeing the parent
                         return;
                     }
@@ -539,6 +586,7 @@ static void ggml_gallocr_allocate_node(ggml_gallocr_t galloc, struct ggml_tensor
         size_t offset = ggml_dyn_tallocr_alloc(alloc, size, node);
         hn->buffer_id = buffer_id;
         hn->offset = offset;
+        hn->block = ggml_gallocr_new_block(galloc, buffer_id, size, offset);
     }
 }
 
@@ -557,6 +605,10 @@ static void ggml_gallocr_free_node(ggml_gallocr_t galloc, struct ggml_tensor * n
     size_t size = ggml_backend_buft_get_alloc_size(buft, node);
     ggml_dyn_tallocr_free_tensor(alloc, offset, size, node);
     hn->allocated = false;
+
+    if (hn->block > 0) {
+        galloc->blocks[hn->block - 1].end = galloc->step;
+    }
 }
 
 static int get_node_buffer_id(const int * node_buffer_ids, int i) {
@@ -568,6 +620,9 @@ static void ggml_gallocr_alloc_graph_impl(ggml_gallocr_t galloc, struct ggml_cgr
     ggml_hash_set_reset(&galloc->hash_set);
     memset(galloc->hash_values, 0, sizeof(struct hash_node) * galloc->hash_set.size);
 
+    galloc->n_blocks = 0;
+    galloc->step     = 0;
+
     // allocate leafs
     // these may be tensors that the application is not using in the graph, but may still want to allocate for other purposes
     for (int i = 0; i < graph->n_leafs; i++) {
@@ -613,6 +668,8 @@ static void ggml_gallocr_alloc_graph_impl(ggml_gallocr_t galloc, struct ggml_cgr
         struct ggml_tensor * node = graph->nodes[i];
         int buffer_id = get_node_buffer_id(node_buffer_ids, i);
 
+        galloc->step = i + 1;
+
         // allocate parents (only leafs need to be allocated at this point)
         for (int j = 0; j < GGML_MAX_SRC; j++) {
             struct ggml_tensor * parent = node->src[j];
@@ -670,6 +727,302 @@ static void ggml_gallocr_alloc_graph_impl(ggml_gallocr_t galloc, struct ggml_cgr
     }
 }
 
+// offset planner
+//
+// the greedy allocation above places each tensor when it is created, without knowing what comes later
+// once the lifetimes of all the blocks are known, the offsets can be assigned again as an interval packing problem:
+// blocks that are live at the same time must not overlap, and the buffer size is the highest end of a block
+// the lower bound is the largest total size of the blocks that are live at the same step
+
+// blocks with up to this many entries in a buffer are also searched exhaustively
+#define GGML_ALLOC_EXACT_MAX_BLOCKS 10
+// maximum number of partial placements visited by the exhaustive search
+#define GGML_ALLOC_EXACT_MAX_STEPS  (1 << 18)
+
+static bool alloc_block_overlap(const struct alloc_block * a, const struct alloc_block * b) {
+    return a->start <= b->end && b->start <= a->end;
+}
+
+static int alloc_block_cmp_offset(const void * a, const void * b) {
+    const struct alloc_block * ba = *(const struct alloc_block * const *) a;
+    const struct alloc_block * bb = *(const struct alloc_block * const *) b;
+    return (ba->offset > bb->offset) - (ba->offset < bb->offset);
+}
+
+// blocks sorted by decreasing size, then by start
+static int alloc_block_cmp_size(const void * a, const void * b) {
+    const struct alloc_block * ba = *(const struct alloc_block * const *) a;
+    const struct alloc_block * bb = *(const struct alloc_block * const *) b;
+    if (ba->size != bb->size) {
+        return ba->size < bb->size ? 1 : -1;
+    }
+    return (ba->start > bb->start) - (ba->start < bb->start);
+}
+
+// lowest offset (first_fit) or smallest gap (best fit) where block fits among the placed blocks that are live at the same time
+static size_t alloc_block_find_offset(struct alloc_block * block, struct alloc_block ** placed, int n_placed, struct alloc_block ** tmp, bool first_fit) {
+    int n = 0;
+    for (int i = 0; i < n_placed; i++) {
+        if (alloc_block_overlap(block, placed[i])) {
+            tmp[n++] = placed[i];
+        }
+    }
+    qsort(tmp, n, sizeof(struct alloc_block *), alloc_block_cmp_offset);
+
+    size_t best_offset = SIZE_MAX;
+    size_t best_gap    = SIZE_MAX;
+    size_t prev_end    = 0;
+    for (int i = 0; i < n; i++) {
+        if (tmp[i]->offset >= prev_end + block->size) {
+            const size_t gap = tmp[i]->offset - prev_end;
+            if (first_fit) {
+                return prev_end;
+            }
+            if (gap < best_gap) {
+                best_gap    = gap;
+                best_offset = prev_end;
+            }
+        }
+        prev_end = MAX(prev_end, tmp[i]->offset + tmp[i]->size);
+    }
+
+    return best_offset != SIZE_MAX ? best_offset : prev_end;
+}
+
+struct alloc_search {
+    struct alloc_block ** blocks;
+    struct alloc_block ** placed;
+    struct alloc_block ** tmp;
+    size_t * offsets;      // offsets of the best placement found
+    bool   * used;
+    int      n_blocks;
+    size_t   best;
+    size_t   lower_bound;
+    int      n_steps;
+};
+
+// every packing can be reproduced by placing the blocks by increasing offset at the lowest offset where they fit
+// so trying all the orders with first fit finds an optimal packing
+static void alloc_search_rec(struct alloc_search * search, int n_placed, size_t size) {
+    if (n_placed == search->n_blocks) {
+        search->best = size;
+        for (int i = 0; i < search->n_blocks; i++) {
+            search->offsets[i] = search->blocks[i]->offset;
+        }
+        return;
+    }
+
+    for (int i = 0; i < search->n_blocks && search->best > search->lower_bound && search->n_steps < GGML_ALLOC_EXACT_MAX_STEPS; i++) {
+        if (search->used[i]) {
+            continue;
+        }
+
+        struct alloc_block * block = search->blocks[i];
+        block->offset = alloc_block_find_offset(block, search->placed, n_placed, search->tmp, true);
+
+        const size_t new_size = MAX(size, block->offset + block->size);
+        if (new_size >= search->best) {
+            continue;
+        }
+
+        search->n_steps++;
+
+        search->used[i] = true;
+        search->placed[n_placed] = block;
+        alloc_search_rec(search, n_placed + 1, new_size);
+        search->used[i] = false;
+    }
+}
+
+// assign the offsets of the blocks of one allocator, returns the size of the buffer
+static size_t ggml_gallocr_plan_blocks(struct alloc_block ** blocks, int n_blocks, size_t lower_bound) {
+    struct alloc_block ** placed = malloc(2 * n_blocks * sizeof(struct alloc_block *));
+    GGML_ASSERT(placed != NULL);
+    struct alloc_block ** tmp = placed + n_blocks;
+
+    // greedy by size: the largest blocks are placed first, each in the smallest gap where it fits
+    qsort(blocks, n_blocks, sizeof(struct alloc_block *), alloc_block_cmp_size);
+
+    size_t size = 0;
+    for (int i = 0; i < n_blocks; i++) {
+        blocks[i]->offset = alloc_block_find_offset(blocks[i], placed, i, tmp, false);
+        placed[i] = blocks[i];
+        size = MAX(size, blocks[i]->offset + blocks[i]->size);
+    }
+
+    if (n_blocks <= GGML_ALLOC_EXACT_MAX_BLOCKS && size > lower_bound) {
+        size_t * offsets = malloc(n_blocks * sizeof(size_t));
+        bool   * used    = calloc(n_blocks, sizeof(bool));
+        GGML_ASSERT(offsets != NULL && used != NULL);
+
+        for (int i = 0; i < n_blocks; i++) {
+            offsets[i] = blocks[i]->offset;
+        }
+
+        struct alloc_search search = {
+            /*.blocks      =*/ blocks,
+            /*.placed      =*/ placed,
+            /*.tmp         =*/ tmp,
+            /*.offsets     =*/ offsets,
+            /*.used        =*/ used,
+            /*.n_blocks    =*/ n_blocks,
+            /*.best        =*/ size,
+            /*.lower_bound =*/ lower_bound,
+            /*.n_steps     =*/ 0,
+        };
+
+        alloc_search_rec(&search, 0, 0);
+
+        for (int i = 0; i < n_blocks; i++) {
+            blocks[i]->offset = offsets[i];
+        }
+        size = search.best;
+
+        free(offsets);
+        free(used);
+    }
+
+    free(placed);
+
+    return size;
+}
+
+// largest total size of the blocks that are live at the same step
+static size_t ggml_gallocr_blocks_lower_bound(struct alloc_block ** blocks, int n_blocks, int n_steps) {
+    int64_t * delta = calloc(n_steps + 2, sizeof(int64_t));
+    GGML_ASSERT(delta != NULL);
+
+    for (int i = 0; i < n_blocks; i++) {
+        delta[blocks[i]->start] += blocks[i]->size;
+        if (blocks[i]->end <= n_steps) {
+            delta[blocks[i]->end + 1] -= blocks[i]->size;
+        }
+    }
+
+    size_t max_live = 0;
+    int64_t live = 0;
+    for (int i = 0; i <= n_steps; i++) {
+        live += delta[i];
+        max_live = MAX(max_live, (size_t) live);
+    }
+
+    free(delta);
+
+    return max_live;
+}
+
+// the graphs of the same shape have the same blocks - in the same order, since they are recorded while allocating
+static bool ggml_gallocr_plan_cached(ggml_gallocr_t galloc) {
+    if (galloc->plan_n_blocks != galloc->n_blocks) {
+        return false;
+    }
+
+    for (int i = 0; i < galloc->n_blocks; i++) {
+        const struct alloc_block * a = &galloc->blocks[i];
+        const struct alloc_block * b = &galloc->plan_blocks[i];
+        if (a->alloc != b->alloc || a->size != b->size || a->start != b->start || a->end != b->end) {
+            return false;
+        }
+    }
+
+    for (int i = 0; i < galloc->n_blocks; i++) {
+        galloc->blocks[i].offset = galloc->plan_blocks[i].offset;
+    }
+    for (int i = 0; i < galloc->n_buffers; i++) {
+        galloc->buf_tallocs[i]->max_size = galloc->plan_max_sizes[i];
+    }
+
+    return true;
+}
+
+static void ggml_gallocr_plan(ggml_gallocr_t galloc, int n_steps) {
+    if (galloc->n_blocks == 0) {
+        return;
+    }
+
+    // the offsets only need to be planned if the greedy allocation does not fit in the current buffers
+    // this is the case for the re-reserves done when the graph changes, after a reserve with the worst-case graph
+    bool fits = true;
+    for (int i = 0; i < galloc->n_buffers; i++) {
+        const size_t cur_size = galloc->buffers[i] ? ggml_backend_buffer_get_size(galloc->buffers[i]) : 0;
+        if (ggml_dyn_tallocr_max_size(galloc->buf_tallocs[i]) > cur_size) {
+            fits = false;
+            break;
+        }
+    }
+    if (fits || ggml_gallocr_plan_cached(galloc)) {
+        return;
+    }
+
+    struct alloc_block ** blocks = malloc(galloc->n_blocks * sizeof(struct alloc_block *));
+    size_t * greedy_offsets = malloc(galloc->n_blocks * sizeof(size_t));
+    GGML_ASSERT(blocks != NULL && greedy_offsets != NULL);
+
+    for (int i = 0; i < galloc->n_buffers; i++) {
+        struct ggml_dyn_tallocr * alloc = galloc->buf_tallocs[i];
+
+        // the allocator may be shared by several buffers of the same type
+        bool done = false;
+        for (int j = 0; j < i; j++) {
+            if (galloc->buf_tallocs[j] == alloc) {
+                done = true;
+                break;
+            }
+        }
+        if (done) {
+            continue;
+        }
+
+        int n_blocks = 0;
+        for (int j = 0; j < galloc->n_blocks; j++) {
+            if (galloc->blocks[j].alloc == alloc) {
+                blocks[n_blocks++] = &galloc->blocks[j];
+            }
+        }
+        if (n_blocks == 0) {
+            continue;
+        }
+
+        for (int j = 0; j < n_blocks; j++) {
+            greedy_offsets[blocks[j] - galloc->blocks] = blocks[j]->offset;
+        }
+
+        const size_t greedy_size = ggml_dyn_tallocr_max_size(alloc);
+        const size_t lower_bound = ggml_gallocr_blocks_lower_bound(blocks, n_blocks, n_steps);
+        const size_t plan_size   = ggml_gallocr_plan_blocks(blocks, n_blocks, lower_bound);
+
+        if (plan_size < greedy_size) {
+            alloc->max_size = plan_size;
+        } else {
+            // keep the greedy allocation
+            for (int j = 0; j < n_blocks; j++) {
+                blocks[j]->offset = greedy_offsets[blocks[j] - galloc->blocks];
+            }
+        }
+
+        GGML_LOG_DEBUG("%s: %s: %d blocks, greedy %.2f MiB, planned %.2f MiB, lower bound %.2f MiB\n", __func__,
+                ggml_backend_buft_name(galloc->bufts[i]), n_blocks,
+                greedy_size / 1024.0 / 1024.0, plan_size / 1024.0 / 1024.0, lower_bound / 1024.0 / 1024.0);
+
+    }
+
+    free(greedy_offsets);
+    free(blocks);
+
+    galloc->plan_blocks = realloc(galloc->plan_blocks, galloc->n_blocks * sizeof(struct alloc_block));
+    GGML_ASSERT(galloc->plan_blocks != NULL);
+    memcpy(galloc->plan_blocks, galloc->blocks, galloc->n_blocks * sizeof(struct alloc_block));
+    galloc->plan_n_blocks = galloc->n_blocks;
+
+    if (galloc->plan_max_sizes == NULL) {
+        galloc->plan_max_sizes = calloc(galloc->n_buffers, sizeof(size_t));
+        GGML_ASSERT(galloc->plan_max_sizes != NULL);
+    }
+    for (int i = 0; i < galloc->n_buffers; i++) {
+        galloc->plan_max_sizes[i] = ggml_dyn_tallocr_max_size(galloc->buf_tallocs[i]);
+    }
+}
+
 bool ggml_gallocr_reserve_n(ggml_gallocr_t galloc, struct ggml_cgraph * graph, const int * node_buffer_ids, const int * leaf_buffer_ids) {
     size_t min_hash_size = graph->n_nodes + graph->n_leafs;
     // add 25% margin to avoid hash collisions
@@ -694,6 +1047,15 @@ bool ggml_gallocr_reserve_n(ggml_gallocr_t galloc, struct ggml_cgraph * graph, c
     // allocate in hash table
     ggml_gallocr_alloc_graph_impl(galloc, graph, node_buffer_ids, leaf_buffer_ids);
 
+    // assign the offsets again from the lifetimes of the tensors
+    ggml_gallocr_plan(galloc, graph->n_nodes);
+    for (size_t i = 0; i < galloc->hash_set.size; i++) {
+        struct hash_node * hn = &galloc->hash_values[i];
+        if (ggml_bitset_get(galloc->hash_set.used, i) && hn->block > 0) {
+            hn->offset = galloc->blocks[hn->block - 1].offset;
+        }
+    }
+
     // set the node_allocs from the hash table
     if (galloc->n_nodes < graph->n_nodes) {
         free(galloc->node_allocs);
@@ -822,7 +1184,7 @@ static bool ggml_gallocr_node_needs_realloc(ggml_gallocr_t galloc, struct ggml_t
     return talloc->size_max >= node_size;
 }
 
-static bool ggml_gallocr_needs_realloc(ggml_gallocr_t galloc, struct ggml_cgraph * graph) {
+bool ggml_gallocr_needs_realloc(ggml_gallocr_t galloc, struct ggml_cgraph * graph) {
     if (galloc->n_nodes != graph->n_nodes) {
 #ifndef NDEBUG
         GGML_LOG_DEBUG("%s: graph has different number of nodes\n", __func__);
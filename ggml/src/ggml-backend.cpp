@@ -14,12 +14,21 @@
 #include "ggml-impl.h"
 
 #include <assert.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #ifdef __APPLE__
@@ -322,9 +331,30 @@ enum ggml_status ggml_backend_graph_plan_compute(ggml_backend_t backend, ggml_ba
     return backend->iface.graph_plan_compute(backend, plan);
 }
 
+// the function of the backend that reports the failures of its asynchronous graph computes, NULL if it reports them when computing
+static ggml_backend_pop_status_t ggml_backend_get_pop_status_fn(ggml_backend_t backend) {
+    if (backend->device == NULL) {
+        return NULL;
+    }
+    ggml_backend_reg_t reg = ggml_backend_dev_backend_reg(backend->device);
+    if (reg == NULL) {
+        return NULL;
+    }
+    return (ggml_backend_pop_status_t) ggml_backend_reg_get_proc_address(reg, "ggml_backend_pop_status");
+}
+
 enum ggml_status ggml_backend_graph_compute(ggml_backend_t backend, struct ggml_cgraph * cgraph) {
     enum ggml_status err = ggml_backend_graph_compute_async(backend, cgraph);
     ggml_backend_synchronize(backend);
+
+    ggml_backend_pop_status_t pop_status_fn = ggml_backend_get_pop_status_fn(backend);
+    if (pop_status_fn != NULL) {
+        enum ggml_status status = pop_status_fn(backend);
+        if (err == GGML_STATUS_SUCCESS) {
+            err = status;
+        }
+    }
+
     return err;
 }
 
@@ -604,6 +634,249 @@ static bool ggml_is_view_op(enum ggml_op op) {
     return op == GGML_OP_VIEW || op == GGML_OP_RESHAPE || op == GGML_OP_PERMUTE || op == GGML_OP_TRANSPOSE;
 }
 
+// scheduler workers
+
+// with pipeline parallelism, the backends that do not support async compute or events are run on a worker thread,
+// unless they share their buffer type with another backend, in which case they are run synchronously
+// the scheduler uses a proxy backend that queues the operations in order, and the number of completed tasks in place of events
+
+struct ggml_backend_sched_worker;
+
+struct ggml_backend_sched_task {
+    std::function<void()> fn;
+
+    // tasks of other workers that must be completed first
+    std::vector<std::pair<ggml_backend_sched_worker *, uint64_t>> deps;
+};
+
+struct ggml_backend_sched_worker {
+    ggml_backend_t backend; // the wrapped backend
+    ggml_backend_t proxy;
+
+    std::thread             thread;
+    std::mutex              mutex;
+    std::condition_variable cond_task;
+    std::condition_variable cond_done;
+
+    std::deque<ggml_backend_sched_task> tasks;
+    uint64_t n_submitted = 0;
+    uint64_t n_done      = 0;
+    bool     stop        = false;
+
+    // dependencies of the next task
+    std::vector<std::pair<ggml_backend_sched_worker *, uint64_t>> deps;
+
+    // the first failure of a graph compute, collected by the scheduler when it synchronizes
+    enum ggml_status status = GGML_STATUS_SUCCESS;
+
+    // time spent running the tasks
+    int64_t t_busy_us = 0;
+};
+
+// the tensors of a graph, the caller can rebuild its graph as soon as the compute is queued
+struct ggml_backend_sched_worker_graph {
+    std::vector<ggml_tensor>   tensors;
+    std::vector<ggml_tensor *> nodes;
+    struct ggml_cgraph         graph;
+};
+
+static void ggml_backend_sched_worker_wait(ggml_backend_sched_worker * w, uint64_t n) {
+    std::unique_lock<std::mutex> lock(w->mutex);
+    w->cond_done.wait(lock, [&] { return w->n_done >= n; });
+}
+
+static void ggml_backend_sched_worker_main(ggml_backend_sched_worker * w) {
+    std::unique_lock<std::mutex> lock(w->mutex);
+    while (true) {
+        w->cond_task.wait(lock, [&] { return w->stop || !w->tasks.empty(); });
+        if (w->tasks.empty()) {
+            break;
+        }
+        ggml_backend_sched_task task = std::move(w->tasks.front());
+        w->tasks.pop_front();
+        lock.unlock();
+
+        for (auto & dep : task.deps) {
+            ggml_backend_sched_worker_wait(dep.first, dep.second);
+        }
+
+        const int64_t t_start_us = ggml_time_us();
+        task.fn();
+        const int64_t t_end_us = ggml_time_us();
+
+        lock.lock();
+        w->t_busy_us += t_end_us - t_start_us;
+        w->n_done++;
+        w->cond_done.notify_all();
+    }
+}
+
+// returns the number of the task, to wait for its completion
+static uint64_t ggml_backend_sched_worker_submit(ggml_backend_sched_worker * w, std::function<void()> fn) {
+    std::lock_guard<std::mutex> lock(w->mutex);
+    w->tasks.push_back({ std::move(fn), std::move(w->deps) });
+    w->deps.clear();
+    w->cond_task.notify_one();
+    return ++w->n_submitted;
+}
+
+static uint64_t ggml_backend_sched_worker_n_submitted(ggml_backend_sched_worker * w) {
+    std::lock_guard<std::mutex> lock(w->mutex);
+    return w->n_submitted;
+}
+
+// returns and clears the first failure of the graphs computed so far
+static enum ggml_status ggml_backend_sched_worker_pop_status(ggml_backend_sched_worker * w) {
+    std::lock_guard<std::mutex> lock(w->mutex);
+    enum ggml_status status = w->status;
+    w->status = GGML_STATUS_SUCCESS;
+    return status;
+}
+
+// a copy of the tensor that does not depend on other tensors
+static ggml_tensor ggml_backend_sched_worker_tensor(const ggml_tensor * t) {
+    ggml_tensor res = *t;
+    if (res.view_src) {
+        res.buffer = res.view_src->buffer;
+    }
+    res.view_src = NULL;
+    for (int j = 0; j < GGML_MAX_SRC; j++) {
+        res.src[j] = NULL;
+    }
+    return res;
+}
+
+// copies the nodes of the graph and their sources
+static std::shared_ptr<ggml_backend_sched_worker_graph> ggml_backend_sched_worker_graph_copy(const struct ggml_cgraph * cgraph) {
+    auto res = std::make_shared<ggml_backend_sched_worker_graph>();
+
+    std::unordered_map<const ggml_tensor *, size_t> ids;
+    auto add = [&](const ggml_tensor * t) {
+        if (t != NULL && ids.emplace(t, res->tensors.size()).second) {
+            res->tensors.push_back(ggml_backend_sched_worker_tensor(t));
+        }
+    };
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        add(cgraph->nodes[i]);
+        for (int j = 0; j < GGML_MAX_SRC; j++) {
+            add(cgraph->nodes[i]->src[j]);
+        }
+    }
+
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        const ggml_tensor * node = cgraph->nodes[i];
+        ggml_tensor * copy = &res->tensors[ids.at(node)];
+        for (int j = 0; j < GGML_MAX_SRC; j++) {
+            if (node->src[j]) {
+                copy->src[j] = &res->tensors[ids.at(node->src[j])];
+            }
+        }
+        res->nodes.push_back(copy);
+    }
+
+    res->graph = *cgraph;
+    res->graph.size      = cgraph->n_nodes;
+    res->graph.n_leafs   = 0;
+    res->graph.nodes     = res->nodes.data();
+    res->graph.grads     = NULL;
+    res->graph.grad_accs = NULL;
+    res->graph.leafs     = NULL;
+    res->graph.visited_hash_set = { 0, NULL, NULL };
+
+    return res;
+}
+
+static const char * ggml_backend_sched_worker_get_name(ggml_backend_t backend) {
+    ggml_backend_sched_worker * w = (ggml_backend_sched_worker *) backend->context;
+    return ggml_backend_name(w->backend);
+}
+
+static void ggml_backend_sched_worker_free(ggml_backend_t backend) {
+    ggml_backend_sched_worker * w = (ggml_backend_sched_worker *) backend->context;
+    {
+        std::lock_guard<std::mutex> lock(w->mutex);
+        w->stop = true;
+        w->cond_task.notify_one();
+    }
+    w->thread.join();
+    delete w;
+    delete backend;
+}
+
+static void ggml_backend_sched_worker_set_tensor_async(ggml_backend_t backend, ggml_tensor * tensor, const void * data, size_t offset, size_t size) {
+    ggml_backend_sched_worker * w = (ggml_backend_sched_worker *) backend->context;
+    ggml_tensor t = ggml_backend_sched_worker_tensor(tensor);
+    ggml_backend_sched_worker_submit(w, [t, data, offset, size]() mutable {
+        ggml_backend_tensor_set(&t, data, offset, size);
+    });
+}
+
+static void ggml_backend_sched_worker_get_tensor_async(ggml_backend_t backend, const ggml_tensor * tensor, void * data, size_t offset, size_t size) {
+    ggml_backend_sched_worker * w = (ggml_backend_sched_worker *) backend->context;
+    ggml_tensor t = ggml_backend_sched_worker_tensor(tensor);
+    ggml_backend_sched_worker_submit(w, [t, data, offset, size]() {
+        ggml_backend_tensor_get(&t, data, offset, size);
+    });
+}
+
+static void ggml_backend_sched_worker_synchronize(ggml_backend_t backend) {
+    ggml_backend_sched_worker * w = (ggml_backend_sched_worker *) backend->context;
+    ggml_backend_sched_worker_wait(w, ggml_backend_sched_worker_n_submitted(w));
+    ggml_backend_synchronize(w->backend);
+}
+
+static enum ggml_status ggml_backend_sched_worker_graph_compute(ggml_backend_t backend, struct ggml_cgraph * cgraph) {
+    ggml_backend_sched_worker * w = (ggml_backend_sched_worker *) backend->context;
+
+    auto graph = ggml_backend_sched_worker_graph_copy(cgraph);
+    ggml_backend_sched_worker_submit(w, [w, graph]() {
+        enum ggml_status status = ggml_backend_graph_compute(w->backend, &graph->graph);
+        if (status != GGML_STATUS_SUCCESS) {
+            std::lock_guard<std::mutex> lock(w->mutex);
+            if (w->status == GGML_STATUS_SUCCESS) {
+                w->status = status;
+            }
+        }
+    });
+
+    // a failure is collected by the scheduler, see ggml_backend_sched_pop_status
+    return GGML_STATUS_SUCCESS;
+}
+
+static const struct ggml_backend_i ggml_backend_sched_worker_i = {
+    /* .get_name                = */ ggml_backend_sched_worker_get_name,
+    /* .free                    = */ ggml_backend_sched_worker_free,
+    /* .set_tensor_async        = */ ggml_backend_sched_worker_set_tensor_async,
+    /* .get_tensor_async        = */ ggml_backend_sched_worker_get_tensor_async,
+    /* .cpy_tensor_async        = */ NULL,
+    /* .synchronize             = */ ggml_backend_sched_worker_synchronize,
+    /* .graph_plan_create       = */ NULL,
+    /* .graph_plan_free         = */ NULL,
+    /* .graph_plan_update       = */ NULL,
+    /* .graph_plan_compute      = */ NULL,
+    /* .graph_compute           = */ ggml_backend_sched_worker_graph_compute,
+    /* .event_record            = */ NULL,
+    /* .event_wait              = */ NULL,
+};
+
+static ggml_guid_t ggml_backend_sched_worker_guid(void) {
+    static ggml_guid guid = { 0x5c, 0x1e, 0x0d, 0x83, 0x27, 0x4b, 0x4e, 0x61, 0x9a, 0x2f, 0xd3, 0x70, 0x18, 0xe6, 0xb5, 0x4c };
+    return &guid;
+}
+
+static ggml_backend_sched_worker * ggml_backend_sched_worker_new(ggml_backend_t backend) {
+    ggml_backend_sched_worker * w = new ggml_backend_sched_worker;
+    w->backend = backend;
+    w->proxy   = new ggml_backend {
+        /* .guid      = */ ggml_backend_sched_worker_guid(),
+        /* .interface = */ ggml_backend_sched_worker_i,
+        /* .device    = */ backend->device,
+        /* .context   = */ w,
+    };
+    w->thread = std::thread(ggml_backend_sched_worker_main, w);
+    return w;
+}
+
 // scheduler
 
 #ifndef GGML_SCHED_MAX_BACKENDS
@@ -628,6 +901,65 @@ struct ggml_backend_sched_split {
     struct ggml_cgraph graph;
 };
 
+// a source of a graph node replaced by the copy of the input in the backend of the split
+struct ggml_backend_sched_src_copy {
+    struct ggml_tensor * node;
+    int src;
+    struct ggml_tensor * copy;
+};
+
+// a backend assigned by the user with ggml_backend_sched_set_tensor_backend
+struct ggml_backend_sched_user_assignment {
+    struct ggml_tensor * tensor;
+    int backend_id;
+};
+
+// profiling
+
+// the oldest events are kept when a long run exceeds this, about 64 MiB of events
+#define GGML_SCHED_PROFILE_MAX_EVENTS (1 << 20)
+
+enum ggml_backend_sched_profile_event_type {
+    GGML_SCHED_PROFILE_GRAPH,
+    GGML_SCHED_PROFILE_ALLOC,
+    GGML_SCHED_PROFILE_SPLIT,
+    GGML_SCHED_PROFILE_NODE,
+    GGML_SCHED_PROFILE_COPY,
+    GGML_SCHED_PROFILE_WAIT,
+};
+
+struct ggml_backend_sched_profile_event {
+    enum ggml_backend_sched_profile_event_type type;
+
+    int backend_id;     // the backend that computes, receives the copy or is waited for, -1 for the graphs
+    int src_backend_id; // the source of a copy
+    int split_id;       // splits and nodes
+    int n_nodes;        // graphs and splits
+    int n_splits;       // graphs
+
+    int64_t t_start_us;
+    int64_t t_end_us;
+
+    size_t nbytes;      // the size of the copied tensor or of the output of the node
+
+    const char * name;  // the copied tensor or the node, interned by the profile
+    const char * op;    // nodes
+};
+
+struct ggml_backend_sched_profile {
+    enum ggml_backend_sched_profile_mode mode;
+
+    int64_t t_start_us;
+
+    // the copies queued on the worker threads are recorded concurrently
+    std::mutex mutex;
+    std::vector<ggml_backend_sched_profile_event> events;
+    int64_t n_dropped = 0;
+
+    // the names of the events, the same nodes and copies are recorded for every graph
+    std::unordered_set<std::string> names;
+};
+
 struct ggml_backend_sched {
     bool is_reset; // true if the scheduler has been reset since the last graph split
     bool is_alloc;
@@ -664,11 +996,38 @@ struct ggml_backend_sched {
     struct ggml_tensor * graph_inputs[GGML_SCHED_MAX_SPLIT_INPUTS];
     int n_graph_inputs;
 
+    // functions of the backends that report the failures of their asynchronous graph computes, NULL otherwise
+    ggml_backend_pop_status_t pop_status_fns[GGML_SCHED_MAX_BACKENDS];
+    // worker threads of the backends without async compute or events, NULL otherwise
+    ggml_backend_sched_worker * workers[GGML_SCHED_MAX_BACKENDS];
+    // last task of the worker that used each copy of its split inputs, in place of the events
+    uint64_t worker_marks[GGML_SCHED_MAX_BACKENDS][GGML_SCHED_MAX_COPIES];
+    // last task of each worker in the graph that used each copy of the graph inputs
+    uint64_t worker_graph_marks[GGML_SCHED_MAX_COPIES][GGML_SCHED_MAX_BACKENDS];
+
+    // split plan of the last graph, reused for the next graph with the same structure and user assignments
+    // not used with pipeline parallelism, since the input copies rotate
+    bool     plan_valid;
+    uint64_t plan_hash;
+    // the hash tables still hold the assignments and copies of the last graph, they are cleared by the next split if the graph changes
+    bool     plan_stale;
+    struct ggml_backend_sched_src_copy * src_copies;
+    int n_src_copies;
+    int src_copies_capacity;
+
+    // the user assignments since the last reset, applied again when the hash tables are cleared
+    struct ggml_backend_sched_user_assignment * user_assignments;
+    int n_user_assignments;
+    int user_assignments_capacity;
+
     struct ggml_context * ctx;
 
     ggml_backend_sched_eval_callback callback_eval;
     void * callback_eval_user_data;
 
+    // NULL unless profiling is enabled
+    struct ggml_backend_sched_profile * profile;
+
     char * context_buffer;
     size_t context_buffer_size;
 
@@ -683,7 +1042,7 @@ struct ggml_backend_sched {
 // returns the priority of the backend, lower id is higher priority
 static int ggml_backend_sched_backend_id(ggml_backend_sched_t sched, ggml_backend_t backend) {
     for (int i = 0; i < sched->n_backends; i++) {
-        if (sched->backends[i] == backend) {
+        if (sched->backends[i] == backend || (sched->workers[i] && sched->workers[i]->backend == backend)) {
             return i;
         }
     }
@@ -843,6 +1202,10 @@ static bool ggml_backend_sched_buffer_supported(ggml_backend_sched_t sched, stru
             tensor_backend_id = tensor_backend_id(t->view_src);
         }
         if (tensor_backend_id != -1) {
+            // the worker threads compute the splits concurrently, so the tensors computed by another worker are always copied
+            if (tensor_backend_id != backend_id && (sched->workers[tensor_backend_id] != NULL || sched->workers[backend_id] != NULL)) {
+                return false;
+            }
             buft = sched->bufts[tensor_backend_id];
         }
     }
@@ -857,11 +1220,116 @@ static void ggml_backend_sched_set_if_supported(ggml_backend_sched_t sched, stru
     }
 }
 
+// split plan cache
+
+static void ggml_backend_sched_clear_assignments(ggml_backend_sched_t sched) {
+    ggml_hash_set_reset(&sched->hash_set);
+    memset(sched->hv_tensor_backend_ids, -1, sched->hash_set.size * sizeof(sched->hv_tensor_backend_ids[0]));
+    memset(sched->hv_tensor_copies,       0, sched->hash_set.size * sched->n_backends * sched->n_copies * sizeof(struct ggml_tensor *));
+    sched->plan_valid = false;
+    sched->plan_stale = false;
+
+    for (int i = 0; i < sched->n_user_assignments; i++) {
+        tensor_backend_id(sched->user_assignments[i].tensor) = sched->user_assignments[i].backend_id;
+    }
+}
+
+static inline uint64_t ggml_backend_sched_hash_combine(uint64_t h, uint64_t v) {
+    return h ^ (v + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2));
+}
+
+static uint64_t ggml_backend_sched_hash_tensor(uint64_t h, const struct ggml_tensor * t) {
+    // the assignment depends on the identity of the tensors and their buffers, the op and the shape (e.g. offload_op), but not on the data
+    h = ggml_backend_sched_hash_combine(h, (uint64_t) (uintptr_t) t);
+    h = ggml_backend_sched_hash_combine(h, ((uint64_t) t->op << 40) | ((uint64_t) t->type << 32) | (uint64_t) t->flags);
+    for (int d = 0; d < GGML_MAX_DIMS; d++) {
+        h = ggml_backend_sched_hash_combine(h, (uint64_t) t->ne[d]);
+        h = ggml_backend_sched_hash_combine(h, (uint64_t) t->nb[d]);
+    }
+    const struct ggml_tensor * bufs[2] = { t, t->view_src };
+    for (const struct ggml_tensor * b : bufs) {
+        if (b != NULL && b->buffer != NULL) {
+            h = ggml_backend_sched_hash_combine(h, (uint64_t) (uintptr_t) b->buffer);
+            h = ggml_backend_sched_hash_combine(h, (uint64_t) (uintptr_t) b->buffer->buft);
+            h = ggml_backend_sched_hash_combine(h, (uint64_t) b->buffer->usage);
+        }
+    }
+    h = ggml_backend_sched_hash_combine(h, (uint64_t) (uintptr_t) t->view_src);
+    for (int j = 0; j < GGML_MAX_SRC; j++) {
+        h = ggml_backend_sched_hash_combine(h, (uint64_t) (uintptr_t) t->src[j]);
+    }
+    // the offsets of the views are not relevant
+    if (!ggml_is_view_op(t->op)) {
+        for (size_t k = 0; k < GGML_MAX_OP_PARAMS / sizeof(int32_t); k++) {
+            h = ggml_backend_sched_hash_combine(h, (uint64_t) (uint32_t) t->op_params[k]);
+        }
+    }
+    return h;
+}
+
+// fingerprint of the structure of the graph and of the user assignments
+static uint64_t ggml_backend_sched_hash_graph(ggml_backend_sched_t sched, const struct ggml_cgraph * graph) {
+    uint64_t h = ggml_backend_sched_hash_combine(graph->n_nodes, graph->n_leafs);
+    for (int i = 0; i < graph->n_leafs; i++) {
+        h = ggml_backend_sched_hash_tensor(h, graph->leafs[i]);
+    }
+    for (int i = 0; i < graph->n_nodes; i++) {
+        h = ggml_backend_sched_hash_tensor(h, graph->nodes[i]);
+    }
+    for (int i = 0; i < sched->n_user_assignments; i++) {
+        h = ggml_backend_sched_hash_combine(h, (uint64_t) (uintptr_t) sched->user_assignments[i].tensor);
+        h = ggml_backend_sched_hash_combine(h, (uint64_t) sched->user_assignments[i].backend_id);
+    }
+    return h;
+}
+
+// applies the split plan of the last graph to a graph with the same structure, which may have been rebuilt in the same memory
+static void ggml_backend_sched_reuse_plan(ggml_backend_sched_t sched, struct ggml_cgraph * graph) {
+    sched->is_reset = false;
+
+    for (int i = 0; i < sched->n_src_copies; i++) {
+        const struct ggml_backend_sched_src_copy & sc = sched->src_copies[i];
+        sc.node->src[sc.src] = sc.copy;
+    }
+
+    // the input copies and their dependencies are allocated again with the graph
+    for (struct ggml_tensor * t = ggml_get_first_tensor(sched->ctx); t != NULL; t = ggml_get_next_tensor(sched->ctx, t)) {
+        t->buffer = NULL;
+        t->data   = t->view_src != NULL && t->view_src->data != NULL ? (char *) t->view_src->data + t->view_offs : NULL;
+    }
+
+    for (int i = 0; i < sched->n_splits; i++) {
+        struct ggml_backend_sched_split * split = &sched->splits[i];
+        split->graph = ggml_graph_view(graph, split->i_start, split->i_end);
+    }
+
+    // same assignments as the last graph
+    memcpy(sched->prev_node_backend_ids, sched->node_backend_ids, sched->graph.n_nodes * sizeof(sched->node_backend_ids[0]));
+    memcpy(sched->prev_leaf_backend_ids, sched->leaf_backend_ids, sched->graph.n_leafs * sizeof(sched->leaf_backend_ids[0]));
+
+    if (sched->debug) {
+        ggml_backend_sched_print_assignments(sched, graph);
+    }
+}
+
 // assigns backends to ops and splits the graph into subgraphs that can be computed on the same backend
 static void ggml_backend_sched_split_graph(ggml_backend_sched_t sched, struct ggml_cgraph * graph) {
+    const uint64_t plan_hash = sched->n_copies == 1 ? ggml_backend_sched_hash_graph(sched, graph) : 0;
+
+    if (sched->plan_valid && sched->plan_hash == plan_hash) {
+        ggml_backend_sched_reuse_plan(sched, graph);
+        return;
+    }
+
+    if (sched->plan_stale) {
+        ggml_backend_sched_clear_assignments(sched);
+    }
+    sched->plan_valid = false;
+
     // reset splits
     sched->n_splits = 0;
     sched->n_graph_inputs = 0;
+    sched->n_src_copies = 0;
     sched->is_reset = false;
 
     struct ggml_init_params params = {
@@ -1210,6 +1678,14 @@ static void ggml_backend_sched_split_graph(ggml_backend_sched_t sched, struct gg
                         split->inputs[n_inputs] = src;
                     }
                     node->src[j] = tensor_id_copy(src_id, cur_backend_id, sched->cur_copy);
+
+                    if (sched->n_src_copies == sched->src_copies_capacity) {
+                        sched->src_copies_capacity = std::max(2*sched->src_copies_capacity, 64);
+                        sched->src_copies = (ggml_backend_sched_src_copy *)
+                            realloc(sched->src_copies, sched->src_copies_capacity * sizeof(struct ggml_backend_sched_src_copy));
+                        GGML_ASSERT(sched->src_copies != NULL);
+                    }
+                    sched->src_copies[sched->n_src_copies++] = { node, j, node->src[j] };
                 }
             }
         }
@@ -1312,6 +1788,33 @@ static void ggml_backend_sched_split_graph(ggml_backend_sched_t sched, struct gg
         assert(graph_copy->size > graph_copy->n_leafs);
         graph_copy->leafs[graph_copy->n_leafs++] = leaf;
     }
+
+    sched->plan_valid = sched->n_copies == 1;
+    sched->plan_hash  = plan_hash;
+}
+
+// waits for the backends, their failures are kept for ggml_backend_sched_synchronize
+static void ggml_backend_sched_synchronize_backends(ggml_backend_sched_t sched) {
+    for (int i = 0; i < sched->n_backends; i++) {
+        ggml_backend_synchronize(sched->backends[i]);
+    }
+}
+
+// returns and clears the first failure of the graphs computed asynchronously by the worker threads and the backends
+static enum ggml_status ggml_backend_sched_pop_status(ggml_backend_sched_t sched) {
+    enum ggml_status status = GGML_STATUS_SUCCESS;
+    for (int b = 0; b < sched->n_backends; b++) {
+        enum ggml_status s = GGML_STATUS_SUCCESS;
+        if (sched->workers[b] != NULL) {
+            s = ggml_backend_sched_worker_pop_status(sched->workers[b]);
+        } else if (sched->pop_status_fns[b] != NULL) {
+            s = sched->pop_status_fns[b](sched->backends[b]);
+        }
+        if (status == GGML_STATUS_SUCCESS) {
+            status = s;
+        }
+    }
+    return status;
 }
 
 static bool ggml_backend_sched_alloc_splits(ggml_backend_sched_t sched) {
@@ -1336,7 +1839,7 @@ static bool ggml_backend_sched_alloc_splits(ggml_backend_sched_t sched) {
     // allocate graph
     if (backend_ids_changed || !ggml_gallocr_alloc_graph(sched->galloc, &sched->graph)) {
         // the re-allocation may cause the split inputs to be moved to a different address
-        ggml_backend_sched_synchronize(sched);
+        ggml_backend_sched_synchronize_backends(sched);
 #ifndef NDEBUG
         GGML_LOG_DEBUG("%s: failed to allocate graph, reserving (backend_ids_changed = %d)\n", __func__, backend_ids_changed);
 #endif
@@ -1350,50 +1853,190 @@ static bool ggml_backend_sched_alloc_splits(ggml_backend_sched_t sched) {
     return true;
 }
 
+// profiling, the helpers do nothing when the profile is NULL
+
+static int64_t ggml_backend_sched_profile_begin(const struct ggml_backend_sched_profile * profile) {
+    return profile != NULL ? ggml_time_us() : 0;
+}
+
+// an event from t_start_us to now
+static ggml_backend_sched_profile_event ggml_backend_sched_profile_event_init(
+        enum ggml_backend_sched_profile_event_type type, int backend_id, int64_t t_start_us) {
+    ggml_backend_sched_profile_event ev;
+    ev.type           = type;
+    ev.backend_id     = backend_id;
+    ev.src_backend_id = -1;
+    ev.split_id       = -1;
+    ev.n_nodes        = 0;
+    ev.n_splits       = 0;
+    ev.t_start_us     = t_start_us;
+    ev.t_end_us       = ggml_time_us();
+    ev.nbytes         = 0;
+    ev.name           = NULL;
+    ev.op             = NULL;
+    return ev;
+}
+
+// returns the end of the event, which is the start of the next one
+static int64_t ggml_backend_sched_profile_record(struct ggml_backend_sched_profile * profile, ggml_backend_sched_profile_event && ev) {
+    const int64_t t_end_us = ev.t_end_us;
+
+    std::lock_guard<std::mutex> lock(profile->mutex);
+    if (profile->events.size() >= GGML_SCHED_PROFILE_MAX_EVENTS) {
+        profile->n_dropped++;
+    } else {
+        if (ev.name != NULL) {
+            // the tensor may not outlive the graph
+            ev.name = profile->names.insert(ev.name).first->c_str();
+        }
+        profile->events.push_back(std::move(ev));
+    }
+
+    return t_end_us;
+}
+
+static int64_t ggml_backend_sched_profile_wait(struct ggml_backend_sched_profile * profile, int backend_id, int64_t t_start_us) {
+    if (profile == NULL) {
+        return 0;
+    }
+    ggml_backend_sched_profile_event ev = ggml_backend_sched_profile_event_init(GGML_SCHED_PROFILE_WAIT, backend_id, t_start_us);
+    if (ev.t_end_us == t_start_us) {
+        // the backend was idle
+        return t_start_us;
+    }
+    return ggml_backend_sched_profile_record(profile, std::move(ev));
+}
+
+static int64_t ggml_backend_sched_profile_copy(struct ggml_backend_sched_profile * profile, const struct ggml_tensor * src,
+        int src_backend_id, int dst_backend_id, int64_t t_start_us) {
+    if (profile == NULL) {
+        return 0;
+    }
+    ggml_backend_sched_profile_event ev = ggml_backend_sched_profile_event_init(GGML_SCHED_PROFILE_COPY, dst_backend_id, t_start_us);
+    ev.src_backend_id = src_backend_id;
+    ev.nbytes         = ggml_nbytes(src);
+    ev.name           = src->name;
+    return ggml_backend_sched_profile_record(profile, std::move(ev));
+}
+
+// computes the nodes of a split one at a time to time them, the views are computed together with the next node
+static enum ggml_status ggml_backend_sched_profile_compute_nodes(ggml_backend_sched_t sched, int split_id) {
+    struct ggml_backend_sched_split * split = &sched->splits[split_id];
+    ggml_backend_t split_backend = sched->backends[split->backend_id];
+
+    int j0 = 0;
+    for (int j = 0; j < split->graph.n_nodes; j++) {
+        struct ggml_tensor * node = split->graph.nodes[j];
+        if (ggml_is_view_op(node->op) && j < split->graph.n_nodes - 1) {
+            continue;
+        }
+
+        const int64_t t_start_us = ggml_time_us();
+
+        struct ggml_cgraph gv = ggml_graph_view(&split->graph, j0, j + 1);
+        enum ggml_status ec = ggml_backend_graph_compute_async(split_backend, &gv);
+        if (ec != GGML_STATUS_SUCCESS) {
+            return ec;
+        }
+        ggml_backend_synchronize(split_backend);
+
+        ggml_backend_sched_profile_event ev = ggml_backend_sched_profile_event_init(GGML_SCHED_PROFILE_NODE, split->backend_id, t_start_us);
+        ev.split_id = split_id;
+        ev.nbytes   = ggml_nbytes(node);
+        ev.name     = node->name;
+        ev.op       = ggml_op_desc(node);
+        ggml_backend_sched_profile_record(sched->profile, std::move(ev));
+
+        j0 = j + 1;
+    }
+
+    return GGML_STATUS_SUCCESS;
+}
+
+// wait until the split backend has finished using the current copy of its inputs
+static void ggml_backend_sched_copy_synchronize(ggml_backend_sched_t sched, int backend_id) {
+    if (sched->events[backend_id][sched->cur_copy] != NULL) {
+        ggml_backend_event_synchronize(sched->events[backend_id][sched->cur_copy]);
+    } else if (sched->workers[backend_id] != NULL) {
+        ggml_backend_sched_worker_wait(sched->workers[backend_id], sched->worker_marks[backend_id][sched->cur_copy]);
+    } else {
+        ggml_backend_synchronize(sched->backends[backend_id]);
+    }
+}
+
 static enum ggml_status ggml_backend_sched_compute_splits(ggml_backend_sched_t sched) {
     struct ggml_backend_sched_split * splits = sched->splits;
+    struct ggml_backend_sched_profile * profile = sched->profile;
 
     for (int i = 0; i < sched->n_splits; i++) {
         struct ggml_backend_sched_split * split = &splits[i];
         int split_backend_id = split->backend_id;
         ggml_backend_t split_backend = sched->backends[split_backend_id];
+        ggml_backend_sched_worker * split_worker = sched->workers[split_backend_id];
 
         // copy the input tensors to the split backend
         for (int j = 0; j < split->n_inputs; j++) {
-            ggml_backend_t input_backend = ggml_backend_sched_get_tensor_backend(sched, split->inputs[j]);
             struct ggml_tensor * input = split->inputs[j];
             struct ggml_tensor * input_cpy = tensor_copy(input, split_backend_id, sched->cur_copy);
+            const int input_backend_id = tensor_backend_id(input);
+            ggml_backend_t input_backend = sched->backends[input_backend_id];
+            ggml_backend_sched_worker * input_worker = sched->workers[input_backend_id];
+
+            int64_t t_us = ggml_backend_sched_profile_begin(profile);
 
             if (input->flags & GGML_TENSOR_FLAG_INPUT) {
                 // inputs from the user must be copied immediately to prevent the user overwriting the data before the copy is done
-                if (sched->events[split_backend_id][sched->cur_copy] != NULL) {
-                    ggml_backend_event_synchronize(sched->events[split_backend_id][sched->cur_copy]);
-                } else {
-                    ggml_backend_synchronize(split_backend);
-                }
+                ggml_backend_sched_copy_synchronize(sched, split_backend_id);
+                t_us = ggml_backend_sched_profile_wait(profile, split_backend_id, t_us);
                 ggml_backend_tensor_copy(input, input_cpy);
+                ggml_backend_sched_profile_copy(profile, input, input_backend_id, split_backend_id, t_us);
+            } else if (split_worker != NULL && input_worker != NULL) {
+                // the copy is queued on the worker that computes the input, after the split backend has finished using the input copy
+                ggml_tensor src = ggml_backend_sched_worker_tensor(input);
+                ggml_tensor dst = ggml_backend_sched_worker_tensor(input_cpy);
+                input_worker->deps.emplace_back(split_worker, sched->worker_marks[split_backend_id][sched->cur_copy]);
+                const uint64_t n = ggml_backend_sched_worker_submit(input_worker, [src, dst, profile, input_backend_id, split_backend_id]() mutable {
+                    const int64_t t_start_us = ggml_backend_sched_profile_begin(profile);
+                    ggml_backend_tensor_copy(&src, &dst);
+                    ggml_backend_sched_profile_copy(profile, &src, input_backend_id, split_backend_id, t_start_us);
+                });
+                split_worker->deps.emplace_back(input_worker, n);
             } else {
+                if (input_worker != NULL) {
+                    // other backends can only read the input after the worker has computed it
+                    ggml_backend_synchronize(input_backend);
+                    t_us = ggml_backend_sched_profile_wait(profile, input_backend_id, t_us);
+                }
                 // wait for the split backend to finish using the input before overwriting it
                 if (sched->events[split_backend_id][sched->cur_copy] != NULL) {
                     ggml_backend_event_wait(split_backend, sched->events[split_backend_id][sched->cur_copy]);
-                } else {
+                } else if (split_worker == NULL) {
                     ggml_backend_synchronize(split_backend);
+                    t_us = ggml_backend_sched_profile_wait(profile, split_backend_id, t_us);
                 }
                 // try async copy, but if not possible, we can still use a sync copy without synchronizing the dst backend, since we handle the synchronization here with multiple copies and events
                 // TODO: add public function to facilitate this, since applications do not have direct access to the backend interface
                 if (!split_backend->iface.cpy_tensor_async || !split_backend->iface.cpy_tensor_async(input_backend, split_backend, input, input_cpy)) {
                     ggml_backend_synchronize(input_backend);
-                    if (sched->events[split_backend_id][sched->cur_copy] != NULL) {
-                        ggml_backend_event_synchronize(sched->events[split_backend_id][sched->cur_copy]);
-                    } else {
-                        ggml_backend_synchronize(split_backend);
-                    }
+                    ggml_backend_sched_copy_synchronize(sched, split_backend_id);
+                    t_us = ggml_backend_sched_profile_wait(profile, input_backend_id, t_us);
                     ggml_backend_tensor_copy(input, input_cpy);
+                } else if (profile != NULL) {
+                    // time the async copy until its completion
+                    ggml_backend_synchronize(split_backend);
                 }
+                ggml_backend_sched_profile_copy(profile, input, input_backend_id, split_backend_id, t_us);
             }
         }
 
-        if (!sched->callback_eval) {
+        const int64_t t_split_us = ggml_backend_sched_profile_begin(profile);
+
+        if (!sched->callback_eval && profile != NULL && profile->mode == GGML_BACKEND_SCHED_PROFILE_NODES) {
+            enum ggml_status ec = ggml_backend_sched_profile_compute_nodes(sched, i);
+            if (ec != GGML_STATUS_SUCCESS) {
+                return ec;
+            }
+        } else if (!sched->callback_eval) {
             enum ggml_status ec = ggml_backend_graph_compute_async(split_backend, &split->graph);
             if (ec != GGML_STATUS_SUCCESS) {
                 return ec;
@@ -1432,14 +2075,32 @@ static enum ggml_status ggml_backend_sched_compute_splits(ggml_backend_sched_t s
             }
         }
 
+        if (profile != NULL) {
+            // the split is timed until the backend has computed it
+            ggml_backend_synchronize(split_backend);
+
+            ggml_backend_sched_profile_event ev = ggml_backend_sched_profile_event_init(GGML_SCHED_PROFILE_SPLIT, split_backend_id, t_split_us);
+            ev.split_id = i;
+            ev.n_nodes  = split->graph.n_nodes;
+            ggml_backend_sched_profile_record(profile, std::move(ev));
+        }
+
         // record the event of this copy
         if (split->n_inputs > 0) {
             if (sched->events[split_backend_id][sched->cur_copy] != NULL) {
                 ggml_backend_event_record(sched->events[split_backend_id][sched->cur_copy], split_backend);
+            } else if (split_worker != NULL) {
+                sched->worker_marks[split_backend_id][sched->cur_copy] = ggml_backend_sched_worker_n_submitted(split_worker);
             }
         }
     }
 
+    for (int b = 0; b < sched->n_backends; b++) {
+        if (sched->workers[b] != NULL) {
+            sched->worker_graph_marks[sched->cur_copy][b] = ggml_backend_sched_worker_n_submitted(sched->workers[b]);
+        }
+    }
+
     sched->cur_copy = (sched->cur_copy + 1) % sched->n_copies;
 
     return GGML_STATUS_SUCCESS;
@@ -1486,10 +2147,28 @@ ggml_backend_sched_t ggml_backend_sched_new(
         sched->backends[b] = backends[b];
         sched->bufts[b] = bufts ? bufts[b] : ggml_backend_get_default_buffer_type(backends[b]);
         GGML_ASSERT(ggml_backend_supports_buft(backends[b], sched->bufts[b]));
+        sched->pop_status_fns[b] = ggml_backend_get_pop_status_fn(backends[b]);
 
         if (sched->n_copies > 1) {
-            for (int c = 0; c < sched->n_copies; c++) {
-                sched->events[b][c] = ggml_backend_event_new(backends[b]->device);
+            ggml_backend_dev_props props = {};
+            if (backends[b]->device) {
+                ggml_backend_dev_get_props(backends[b]->device, &props);
+            }
+            // the backends with the same buffer type share a compute buffer, so they cannot compute concurrently
+            bool shared_buft = false;
+            for (int j = 0; j < n_backends; j++) {
+                if (j != b && (bufts ? bufts[j] : ggml_backend_get_default_buffer_type(backends[j])) == sched->bufts[b]) {
+                    shared_buft = true;
+                }
+            }
+            if (props.caps.async && props.caps.events) {
+                for (int c = 0; c < sched->n_copies; c++) {
+                    sched->events[b][c] = ggml_backend_event_new(backends[b]->device);
+                }
+            } else if (!shared_buft) {
+                // run the backend on a worker thread, so that it can compute a split while the other backends compute the next ones
+                sched->workers[b] = ggml_backend_sched_worker_new(backends[b]);
+                sched->backends[b] = sched->workers[b]->proxy;
             }
         }
     }
@@ -1509,7 +2188,11 @@ void ggml_backend_sched_free(ggml_backend_sched_t sched) {
         for (int c = 0; c < sched->n_copies; c++) {
             ggml_backend_event_free(sched->events[b][c]);
         }
+        if (sched->workers[b] != NULL) {
+            ggml_backend_free(sched->workers[b]->proxy);
+        }
     }
+    delete sched->profile;
     ggml_gallocr_free(sched->galloc);
     ggml_free(sched->ctx);
     ggml_hash_set_free(&sched->hash_set);
@@ -1523,15 +2206,21 @@ void ggml_backend_sched_free(ggml_backend_sched_t sched) {
     free(sched->context_buffer);
     free(sched->graph.nodes);
     free(sched->graph.leafs);
+    free(sched->src_copies);
+    free(sched->user_assignments);
     free(sched);
 }
 
 void ggml_backend_sched_reset(ggml_backend_sched_t sched) {
     // reset state for the next run
     if (!sched->is_reset) {
-        ggml_hash_set_reset(&sched->hash_set);
-        memset(sched->hv_tensor_backend_ids, -1, sched->hash_set.size * sizeof(sched->hv_tensor_backend_ids[0]));
-        memset(sched->hv_tensor_copies,       0, sched->hash_set.size * sched->n_backends * sched->n_copies * sizeof(struct ggml_tensor *));
+        sched->n_user_assignments = 0;
+        if (sched->plan_valid) {
+            // keep the hash tables for the split plan, the next split clears them if the graph is different
+            sched->plan_stale = true;
+        } else {
+            ggml_backend_sched_clear_assignments(sched);
+        }
         sched->is_reset = true;
     }
     sched->is_alloc = false;
@@ -1542,7 +2231,7 @@ bool ggml_backend_sched_reserve(ggml_backend_sched_t sched, struct ggml_cgraph *
 
     ggml_backend_sched_split_graph(sched, measure_graph);
 
-    ggml_backend_sched_synchronize(sched);
+    ggml_backend_sched_synchronize_backends(sched);
 
     if (!ggml_gallocr_reserve_n(sched->galloc, &sched->graph, sched->node_backend_ids, sched->leaf_backend_ids)) {
         return false;
@@ -1556,8 +2245,24 @@ bool ggml_backend_sched_reserve(ggml_backend_sched_t sched, struct ggml_cgraph *
 bool ggml_backend_sched_alloc_graph(ggml_backend_sched_t sched, struct ggml_cgraph * graph) {
     GGML_ASSERT((int)sched->hash_set.size >= graph->n_nodes + graph->n_leafs);
 
+    const int64_t t_start_us = ggml_backend_sched_profile_begin(sched->profile);
+
     ggml_backend_sched_split_graph(sched, graph);
 
+    if (sched->n_copies > 1) {
+        // the previous graphs may still be computing: the buffers can only be reused with the same allocation
+        if (ggml_gallocr_needs_realloc(sched->galloc, &sched->graph)) {
+            ggml_backend_sched_synchronize_backends(sched);
+        }
+
+        // the caller sets the graph inputs of the current copy after this call
+        for (int b = 0; b < sched->n_backends; b++) {
+            if (sched->workers[b] != NULL) {
+                ggml_backend_sched_worker_wait(sched->workers[b], sched->worker_graph_marks[sched->cur_copy][b]);
+            }
+        }
+    }
+
 
     if (!ggml_backend_sched_alloc_splits(sched)) {
         return false;
@@ -1565,13 +2270,20 @@ bool ggml_backend_sched_alloc_graph(ggml_backend_sched_t sched, struct ggml_cgra
 
     sched->is_alloc = true;
 
+    if (sched->profile != NULL) {
+        ggml_backend_sched_profile_event ev = ggml_backend_sched_profile_event_init(GGML_SCHED_PROFILE_ALLOC, -1, t_start_us);
+        ev.n_nodes  = sched->graph.n_nodes;
+        ev.n_splits = sched->n_splits;
+        ggml_backend_sched_profile_record(sched->profile, std::move(ev));
+    }
+
     return true;
 }
 
 enum ggml_status ggml_backend_sched_graph_compute(ggml_backend_sched_t sched, struct ggml_cgraph * graph) {
     enum ggml_status err = ggml_backend_sched_graph_compute_async(sched, graph);
-    ggml_backend_sched_synchronize(sched);
-    return err;
+    enum ggml_status status = ggml_backend_sched_synchronize(sched);
+    return err != GGML_STATUS_SUCCESS ? err : status;
 }
 
 enum ggml_status ggml_backend_sched_graph_compute_async(ggml_backend_sched_t sched, struct ggml_cgraph * graph) {
@@ -1585,13 +2297,30 @@ enum ggml_status ggml_backend_sched_graph_compute_async(ggml_backend_sched_t sch
         }
     }
 
-    return ggml_backend_sched_compute_splits(sched);
-}
+    const int64_t t_start_us = ggml_backend_sched_profile_begin(sched->profile);
 
-void ggml_backend_sched_synchronize(ggml_backend_sched_t sched) {
-    for (int i = 0; i < sched->n_backends; i++) {
-        ggml_backend_synchronize(sched->backends[i]);
+    enum ggml_status ec = ggml_backend_sched_compute_splits(sched);
+
+    // the failures of the previous graphs that the worker threads and the backends have already computed
+    enum ggml_status ec_workers = ggml_backend_sched_pop_status(sched);
+    if (ec == GGML_STATUS_SUCCESS) {
+        ec = ec_workers;
+    }
+
+    if (sched->profile != NULL) {
+        ggml_backend_sched_profile_event ev = ggml_backend_sched_profile_event_init(GGML_SCHED_PROFILE_GRAPH, -1, t_start_us);
+        ev.n_nodes  = sched->graph.n_nodes;
+        ev.n_splits = sched->n_splits;
+        ggml_backend_sched_profile_record(sched->profile, std::move(ev));
     }
+
+    return ec;
+}
+
+enum ggml_status ggml_backend_sched_synchronize(ggml_backend_sched_t sched) {
+    ggml_backend_sched_synchronize_backends(sched);
+
+    return ggml_backend_sched_pop_status(sched);
 }
 
 void ggml_backend_sched_set_eval_callback(ggml_backend_sched_t sched, ggml_backend_sched_eval_callback callback, void * user_data) {
@@ -1599,6 +2328,162 @@ void ggml_backend_sched_set_eval_callback(ggml_backend_sched_t sched, ggml_backe
     sched->callback_eval_user_data = user_data;
 }
 
+void ggml_backend_sched_set_profile(ggml_backend_sched_t sched, enum ggml_backend_sched_profile_mode mode) {
+    // the worker threads may still record copies
+    ggml_backend_sched_synchronize_backends(sched);
+
+    if (mode == GGML_BACKEND_SCHED_PROFILE_NONE) {
+        delete sched->profile;
+        sched->profile = NULL;
+        return;
+    }
+
+    if (sched->profile == NULL) {
+        sched->profile = new ggml_backend_sched_profile;
+        sched->profile->t_start_us = ggml_time_us();
+    }
+    sched->profile->mode = mode;
+}
+
+static void ggml_backend_sched_trace_write_str(FILE * f, const char * str) {
+    fputc('"', f);
+    for (const char * c = str; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            fputc('\\', f);
+            fputc(*c, f);
+        } else if ((unsigned char) *c < 0x20) {
+            fprintf(f, "\\u%04x", *c);
+        } else {
+            fputc(*c, f);
+        }
+    }
+    fputc('"', f);
+}
+
+bool ggml_backend_sched_write_trace(ggml_backend_sched_t sched, const char * fname) {
+    struct ggml_backend_sched_profile * profile = sched->profile;
+    if (profile == NULL) {
+        GGML_LOG_ERROR("%s: profiling is not enabled\n", __func__);
+        return false;
+    }
+
+    ggml_backend_sched_synchronize_backends(sched);
+
+    FILE * f = ggml_fopen(fname, "wb");
+    if (f == NULL) {
+        GGML_LOG_ERROR("%s: failed to open %s\n", __func__, fname);
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(profile->mutex);
+
+    // one track for each backend and one for the graphs, which is the last one
+    const int tid_graph = sched->n_backends;
+
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":0,\"args\":{\"name\":\"ggml_backend_sched\"}}");
+    for (int b = 0; b <= sched->n_backends; b++) {
+        fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%d,\"args\":{\"name\":", b);
+        ggml_backend_sched_trace_write_str(f, b < sched->n_backends ? ggml_backend_name(sched->backends[b]) : "graph");
+        fprintf(f, "}}");
+        fprintf(f, ",\n{\"name\":\"thread_sort_index\",\"ph\":\"M\",\"pid\":0,\"tid\":%d,\"args\":{\"sort_index\":%d}}", b, b == tid_graph ? -1 : b);
+    }
+
+    static const char * cats[] = { "graph", "alloc", "split", "node", "copy", "wait" };
+
+    // totals for the summary
+    std::vector<int64_t> t_compute_us(sched->n_backends, 0);
+    std::vector<int64_t> t_copy_us   (sched->n_backends, 0);
+    std::vector<int64_t> t_wait_us   (sched->n_backends, 0);
+    std::vector<size_t>  copy_bytes  (sched->n_backends, 0);
+    int64_t t_graph_us = 0;
+    int64_t t_alloc_us = 0;
+    int     n_graphs   = 0;
+
+    for (const auto & ev : profile->events) {
+        const int64_t dur_us = ev.t_end_us - ev.t_start_us;
+
+        fprintf(f, ",\n{\"name\":");
+        switch (ev.type) {
+            case GGML_SCHED_PROFILE_GRAPH:
+                ggml_backend_sched_trace_write_str(f, "compute");
+                t_graph_us += dur_us;
+                n_graphs++;
+                break;
+            case GGML_SCHED_PROFILE_ALLOC:
+                ggml_backend_sched_trace_write_str(f, "alloc");
+                t_alloc_us += dur_us;
+                break;
+            case GGML_SCHED_PROFILE_SPLIT:
+                fprintf(f, "\"split #%d\"", ev.split_id);
+                t_compute_us[ev.backend_id] += dur_us;
+                break;
+            case GGML_SCHED_PROFILE_NODE:
+                ggml_backend_sched_trace_write_str(f, ev.op);
+                break;
+            case GGML_SCHED_PROFILE_COPY:
+                ggml_backend_sched_trace_write_str(f, (std::string("copy ") + ev.name).c_str());
+                t_copy_us[ev.backend_id] += dur_us;
+                copy_bytes[ev.backend_id] += ev.nbytes;
+                break;
+            case GGML_SCHED_PROFILE_WAIT:
+                fprintf(f, "\"wait\"");
+                t_wait_us[ev.backend_id] += dur_us;
+                break;
+        }
+        fprintf(f, ",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%d,\"ts\":%" PRId64 ",\"dur\":%" PRId64 ",\"args\":{",
+                cats[ev.type], ev.backend_id < 0 ? tid_graph : ev.backend_id, ev.t_start_us - profile->t_start_us, dur_us);
+        switch (ev.type) {
+            case GGML_SCHED_PROFILE_GRAPH:
+            case GGML_SCHED_PROFILE_ALLOC:
+                fprintf(f, "\"n_nodes\":%d,\"n_splits\":%d", ev.n_nodes, ev.n_splits);
+                break;
+            case GGML_SCHED_PROFILE_SPLIT:
+                fprintf(f, "\"n_nodes\":%d", ev.n_nodes);
+                break;
+            case GGML_SCHED_PROFILE_NODE:
+                fprintf(f, "\"tensor\":");
+                ggml_backend_sched_trace_write_str(f, ev.name);
+                fprintf(f, ",\"split\":%d,\"bytes\":%zu", ev.split_id, ev.nbytes);
+                break;
+            case GGML_SCHED_PROFILE_COPY:
+                fprintf(f, "\"src\":");
+                ggml_backend_sched_trace_write_str(f, ggml_backend_name(sched->backends[ev.src_backend_id]));
+                fprintf(f, ",\"bytes\":%zu", ev.nbytes);
+                break;
+            case GGML_SCHED_PROFILE_WAIT:
+                break;
+        }
+        fprintf(f, "}}");
+    }
+
+    fprintf(f, "\n]}\n");
+
+    const bool ok = ferror(f) == 0;
+    fclose(f);
+
+    if (!ok) {
+        GGML_LOG_ERROR("%s: failed to write %s\n", __func__, fname);
+        return false;
+    }
+
+    GGML_LOG_INFO("%s: %zu events written to %s, %" PRId64 " dropped\n", __func__, profile->events.size(), fname, profile->n_dropped);
+    if (profile->n_dropped > 0) {
+        GGML_LOG_WARN("%s: %" PRId64 " events were dropped after the first %d\n", __func__, profile->n_dropped, GGML_SCHED_PROFILE_MAX_EVENTS);
+    }
+    GGML_LOG_INFO("%s: %d graphs: alloc %.2f ms, compute %.2f ms\n", __func__, n_graphs, t_alloc_us/1000.0, t_graph_us/1000.0);
+    for (int b = 0; b < sched->n_backends; b++) {
+        GGML_LOG_INFO("%s: %10s: compute %10.2f ms, copies to the backend %10.2f ms (%8.2f MiB), waits %10.2f ms\n", __func__,
+                ggml_backend_name(sched->backends[b]), t_compute_us[b]/1000.0, t_copy_us[b]/1000.0, copy_bytes[b]/1024.0/1024.0, t_wait_us[b]/1000.0);
+    }
+
+    profile->events.clear();
+    profile->names.clear();
+    profile->n_dropped = 0;
+
+    return true;
+}
+
 int ggml_backend_sched_get_n_splits(ggml_backend_sched_t sched) {
     return sched->n_splits;
 }
@@ -1607,6 +2492,19 @@ int ggml_backend_sched_get_n_copies(ggml_backend_sched_t sched) {
     return sched->n_copies;
 }
 
+int64_t ggml_backend_sched_get_busy_us(ggml_backend_sched_t sched, ggml_backend_t backend) {
+    int backend_index = ggml_backend_sched_backend_id(sched, backend);
+    GGML_ASSERT(backend_index >= 0 && backend_index < sched->n_backends);
+
+    ggml_backend_sched_worker * w = sched->workers[backend_index];
+    if (w == NULL) {
+        return -1;
+    }
+
+    std::lock_guard<std::mutex> lock(w->mutex);
+    return w->t_busy_us;
+}
+
 int ggml_backend_sched_get_n_backends(ggml_backend_sched_t sched) {
     return sched->n_backends;
 }
@@ -1626,9 +2524,21 @@ size_t ggml_backend_sched_get_buffer_size(ggml_backend_sched_t sched, ggml_backe
 void ggml_backend_sched_set_tensor_backend(ggml_backend_sched_t sched, struct ggml_tensor * node, ggml_backend_t backend) {
     int backend_index = ggml_backend_sched_backend_id(sched, backend);
     GGML_ASSERT(backend_index >= 0 && backend_index < sched->n_backends);
+    // a tensor that is not in the last graph cannot match its split plan
+    if (sched->plan_stale && !ggml_hash_contains(&sched->hash_set, node)) {
+        ggml_backend_sched_clear_assignments(sched);
+    }
     tensor_backend_id(node) = backend_index;
     SET_CAUSE(node, "usr");
     sched->is_reset = false;
+
+    if (sched->n_user_assignments == sched->user_assignments_capacity) {
+        sched->user_assignments_capacity = std::max(2*sched->user_assignments_capacity, 64);
+        sched->user_assignments = (ggml_backend_sched_user_assignment *)
+            realloc(sched->user_assignments, sched->user_assignments_capacity * sizeof(struct ggml_backend_sched_user_assignment));
+        GGML_ASSERT(sched->user_assignments != NULL);
+    }
+    sched->user_assignments[sched->n_user_assignments++] = { node, backend_index };
 }
 
 ggml_backend_t ggml_backend_sched_get_tensor_backend(ggml_backend_sched_t sched, struct ggml_tensor * node) {
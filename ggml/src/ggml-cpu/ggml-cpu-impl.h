@@ -381,6 +381,10 @@ static __m256 __lasx_xvreplfr2vr_s(float val) {
 // TODO: move to ggml-threading
 void ggml_barrier(struct ggml_threadpool * tp);
 
+// chunk counter of the threadpool, for work distribution in the ops that are not in ggml-cpu.c
+void ggml_threadpool_chunk_set(struct ggml_threadpool * tp, int value);
+int  ggml_threadpool_chunk_add(struct ggml_threadpool * tp, int value);
+
 #ifdef __cplusplus
 }
 #endif
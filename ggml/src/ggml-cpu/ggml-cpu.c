@@ -2270,6 +2270,14 @@ void ggml_barrier(struct ggml_threadpool * tp) {
 #endif
 }
 
+void ggml_threadpool_chunk_set(struct ggml_threadpool * tp, int value) {
+    atomic_store_explicit(&tp->current_chunk, value, memory_order_relaxed);
+}
+
+int ggml_threadpool_chunk_add(struct ggml_threadpool * tp, int value) {
+    return atomic_fetch_add_explicit(&tp->current_chunk, value, memory_order_relaxed);
+}
+
 #if defined(__gnu_linux__)
 static cpu_set_t ggml_get_numa_affinity(void) {
     cpu_set_t cpuset;
@@ -10753,6 +10761,26 @@ static void ggml_compute_forward_timestep_embedding(
 
 // ggml_compute_forward_argsort
 
+// restore the heap property of idx[root..n) - for ascending order the heap is a max-heap, for descending order a min-heap
+static inline void ggml_argsort_sift_down(int32_t * idx, const float * val, int64_t root, int64_t n, bool asc) {
+    const int32_t x = idx[root];
+    while (true) {
+        int64_t child = 2*root + 1;
+        if (child >= n) {
+            break;
+        }
+        if (child + 1 < n && (asc ? val[idx[child + 1]] > val[idx[child]] : val[idx[child + 1]] < val[idx[child]])) {
+            child++;
+        }
+        if (!(asc ? val[idx[child]] > val[x] : val[idx[child]] < val[x])) {
+            break;
+        }
+        idx[root] = idx[child];
+        root = child;
+    }
+    idx[root] = x;
+}
+
 static void ggml_compute_forward_argsort_f32(
     const struct ggml_compute_params * params,
     struct ggml_tensor * dst) {
@@ -10770,6 +10798,8 @@ static void ggml_compute_forward_argsort_f32(
 
     enum ggml_sort_order order = (enum ggml_sort_order) ggml_get_op_params_i32(dst, 0);
 
+    const bool asc = order == GGML_SORT_ORDER_ASC;
+
     for (int64_t i = ith; i < nr; i += nth) {
         int32_t * dst_data = (int32_t *)((char *) dst->data + i*nb1);
         const float * src_data = (float *)((char *) src0->data + i*nb01);
@@ -10778,16 +10808,15 @@ static void ggml_compute_forward_argsort_f32(
             dst_data[j] = j;
         }
 
-        // C doesn't have a functional sort, so we do a bubble sort instead
-        for (int64_t j = 0; j < ne0; j++) {
-            for (int64_t k = j + 1; k < ne0; k++) {
-                if ((order == GGML_SORT_ORDER_ASC  && src_data[dst_data[j]] > src_data[dst_data[k]]) ||
-                    (order == GGML_SORT_ORDER_DESC && src_data[dst_data[j]] < src_data[dst_data[k]])) {
-                    int32_t tmp = dst_data[j];
-                    dst_data[j] = dst_data[k];
-                    dst_data[k] = tmp;
-                }
-            }
+        // C doesn't have a functional sort, so we do a heap sort instead
+        for (int64_t j = ne0/2 - 1; j >= 0; j--) {
+            ggml_argsort_sift_down(dst_data, src_data, j, ne0, asc);
+        }
+        for (int64_t j = ne0 - 1; j > 0; j--) {
+            const int32_t tmp = dst_data[0];
+            dst_data[0] = dst_data[j];
+            dst_data[j] = tmp;
+            ggml_argsort_sift_down(dst_data, src_data, 0, j, asc);
         }
     }
 }
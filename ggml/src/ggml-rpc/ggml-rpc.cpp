@@ -3,10 +3,13 @@
 #include "ggml-backend-impl.h"
 
 #include <cinttypes>
+#include <deque>
 #include <string>
 #include <vector>
 #include <memory>
 #include <mutex>
+#include <filesystem>
+#include <fstream>
 #include <unordered_map>
 #include <unordered_set>
 #ifdef _WIN32
@@ -27,6 +30,14 @@
 #endif
 #include <cstring>
 
+// clients exchange the tensor data with servers on the same host through POSIX shared memory
+#if !defined(_WIN32) && !defined(__ANDROID__)
+#  define GGML_RPC_SHM
+#  include <fcntl.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#endif
+
 #ifdef _WIN32
 typedef SOCKET sockfd_t;
 using ssize_t = __int64;
@@ -34,20 +45,6 @@ using ssize_t = __int64;
 typedef int sockfd_t;
 #endif
 
-// cross-platform socket
-struct socket_t {
-    sockfd_t fd;
-    socket_t(sockfd_t fd) : fd(fd) {}
-    ~socket_t() {
-        GGML_PRINT_DEBUG("[%s] closing socket %d\n", __func__, this->fd);
-#ifdef _WIN32
-        closesocket(this->fd);
-#else
-        close(this->fd);
-#endif
-    }
-};
-
 // all RPC structures must be packed
 #pragma pack(push, 1)
 // ggml_tensor is serialized into rpc_tensor
@@ -86,6 +83,14 @@ enum rpc_cmd {
     RPC_CMD_GET_DEVICE_MEMORY,
     RPC_CMD_INIT_TENSOR,
     RPC_CMD_GET_ALLOC_SIZE,
+    RPC_CMD_SET_TENSOR_HASH,
+    RPC_CMD_GRAPH_REGISTER,
+    RPC_CMD_GRAPH_RECOMPUTE,
+    RPC_CMD_GRAPH_FREE,
+    RPC_CMD_ATTACH_SHM,
+    RPC_CMD_SET_TENSOR_SHM,
+    RPC_CMD_GET_TENSOR_SHM,
+    RPC_CMD_HAS_CACHE,
     RPC_CMD_COUNT,
 };
 
@@ -135,6 +140,21 @@ struct rpc_msg_buffer_clear_req {
     uint8_t value;
 };
 
+struct rpc_msg_set_tensor_hash_req {
+    rpc_tensor tensor;
+    uint64_t offset;
+    uint64_t size;
+    uint64_t hash;
+};
+
+struct rpc_msg_set_tensor_hash_rsp {
+    uint8_t result;
+};
+
+struct rpc_msg_has_cache_rsp {
+    uint8_t result;
+};
+
 struct rpc_msg_get_tensor_req {
     rpc_tensor tensor;
     uint64_t offset;
@@ -154,6 +174,36 @@ struct rpc_msg_graph_compute_rsp {
     uint8_t result;
 };
 
+struct rpc_msg_graph_register_rsp {
+    uint64_t graph_id;
+};
+
+struct rpc_msg_graph_recompute_rsp {
+    uint8_t found;     // 0 if the graph is not registered (anymore) or the changes do not apply to it
+    uint8_t result;
+};
+
+struct rpc_msg_graph_free_req {
+    uint64_t graph_id;
+};
+
+struct rpc_msg_attach_shm_req {
+    char name[64];
+    uint64_t size;
+};
+
+struct rpc_msg_attach_shm_rsp {
+    uint8_t result;
+};
+
+// the data of RPC_CMD_SET_TENSOR_SHM and RPC_CMD_GET_TENSOR_SHM is at shm_offset in the shared memory of the connection
+struct rpc_msg_tensor_shm_req {
+    rpc_tensor tensor;
+    uint64_t offset;
+    uint64_t size;
+    uint64_t shm_offset;
+};
+
 struct rpc_msg_get_device_memory_rsp {
     uint64_t free_mem;
     uint64_t total_mem;
@@ -174,6 +224,64 @@ struct ggml_backend_rpc_buffer_type_context {
     size_t max_size;
 };
 
+// a graph registered on the server, as last computed
+struct rpc_graph_entry {
+    uint64_t id;
+    uint64_t last_use;
+    std::vector<uint64_t>   nodes;
+    std::vector<rpc_tensor> tensors;
+};
+
+// the reply of a command that was sent without waiting for it
+struct rpc_pending_reply {
+    enum rpc_cmd cmd;
+    void * output;
+    size_t output_size;
+    rpc_msg_graph_recompute_rsp compute_rsp; // the output of RPC_CMD_GRAPH_RECOMPUTE
+    const void * copy_src;                   // copied to output once the command is done (RPC_CMD_GET_TENSOR_SHM)
+    size_t copy_size;
+};
+
+// cross-platform socket
+struct socket_t {
+    sockfd_t fd;
+    socket_t(sockfd_t fd) : fd(fd) {}
+    ~socket_t() {
+        GGML_PRINT_DEBUG("[%s] closing socket %d\n", __func__, this->fd);
+#ifdef _WIN32
+        closesocket(this->fd);
+#else
+        close(this->fd);
+#endif
+#ifdef GGML_RPC_SHM
+        if (shm_ptr != nullptr) {
+            munmap(shm_ptr, shm_size);
+        }
+#endif
+    }
+
+    // client side state of the connection
+    // the server executes the commands in order, so the replies of the pending commands arrive before the reply of the next command
+    std::deque<rpc_pending_reply> pending;
+    size_t   pending_size = 0; // size of the pending replies
+    uint64_t n_sent = 0;
+    uint64_t n_recv = 0;
+    enum ggml_status compute_status = GGML_STATUS_SUCCESS; // first failure of an async graph compute, see ggml_backend_rpc_pop_status
+
+    // the graphs registered by this connection
+    std::vector<rpc_graph_entry> graphs;
+    uint64_t n_compute = 0;
+
+    // memory shared with a server on the same host, nullptr otherwise
+    // the payloads are allocated one after the other and the space is reused when no command is pending
+    void * shm_ptr = nullptr;
+    size_t shm_size = 0;
+    size_t shm_offset = 0;
+
+    // the server keeps a cache of the tensor data, asked once at connect time
+    bool has_cache = false;
+};
+
 struct ggml_backend_rpc_context {
     std::string endpoint;
     std::string name;
@@ -185,6 +293,12 @@ struct ggml_backend_rpc_buffer_context {
     uint64_t remote_ptr;
 };
 
+// the point of a connection after the commands sent before the event was recorded
+struct rpc_event {
+    std::shared_ptr<socket_t> sock;
+    uint64_t n_sent;
+};
+
 // RPC helper functions
 
 static std::shared_ptr<socket_t> make_socket(sockfd_t fd) {
@@ -224,6 +338,10 @@ static std::shared_ptr<socket_t> socket_connect(const char * host, int port) {
         fprintf(stderr, "Failed to set TCP_NODELAY\n");
         return nullptr;
     }
+#ifdef SO_NOSIGPIPE
+    int flag = 1;
+    setsockopt(sockfd, SOL_SOCKET, SO_NOSIGPIPE, &flag, sizeof(flag));
+#endif
     addr.sin_family = AF_INET;
     addr.sin_port = htons(port);
     struct hostent * server = gethostbyname(host);
@@ -279,10 +397,17 @@ static std::shared_ptr<socket_t> create_server_socket(const char * host, int por
     return sock;
 }
 
+// a connection closed by the peer, e.g. a server that does not know a command, is reported as a failure instead of SIGPIPE
+#ifdef MSG_NOSIGNAL
+static const int SEND_FLAGS = MSG_NOSIGNAL;
+#else
+static const int SEND_FLAGS = 0;
+#endif
+
 static bool send_data(sockfd_t sockfd, const void * data, size_t size) {
     size_t bytes_sent = 0;
     while (bytes_sent < size) {
-        ssize_t n = send(sockfd, (const char *)data + bytes_sent, size - bytes_sent, 0);
+        ssize_t n = send(sockfd, (const char *)data + bytes_sent, size - bytes_sent, SEND_FLAGS);
         if (n < 0) {
             return false;
         }
@@ -335,6 +460,119 @@ static bool recv_msg(sockfd_t sockfd, std::vector<uint8_t> & input) {
     return recv_data(sockfd, input.data(), size);
 }
 
+// payloads larger than this are sent by hash first, so that the server can load them from its cache
+static const size_t HASH_THRESHOLD = 10 * 1024 * 1024;
+
+// number of registered graphs kept by the client per connection, the server accepts a few more until their free arrives
+static const size_t MAX_GRAPHS_CLIENT = 8;
+static const size_t MAX_GRAPHS_SERVER = 64;
+
+// limits of the commands in flight on a connection, the unread replies must fit in the socket buffers
+// otherwise the server could block on sending a reply while the client blocks on sending the next command
+static const size_t MAX_PENDING      = 256;
+static const size_t MAX_PENDING_SIZE = 32 * 1024;
+
+// size of the memory shared with a local server, larger payloads are sent in pieces
+static const size_t SHM_SIZE = 64 * 1024 * 1024;
+
+// XXH64 with seed 0, the same as the xxhash library used by gguf-hash, the data can be given in pieces
+struct rpc_hasher {
+    static constexpr uint64_t P1 = 0x9E3779B185EBCA87ULL;
+    static constexpr uint64_t P2 = 0xC2B2AE3D27D4EB4FULL;
+    static constexpr uint64_t P3 = 0x165667B19E3779F9ULL;
+    static constexpr uint64_t P4 = 0x85EBCA77C2B2AE63ULL;
+    static constexpr uint64_t P5 = 0x27D4EB2F165667C5ULL;
+
+    uint64_t v[4]  = { P1 + P2, P2, 0, 0 - P1 };
+    uint64_t total = 0;
+
+    // the bytes that do not fill a stripe of 32 bytes yet
+    uint8_t tail[32];
+    size_t  n_tail = 0;
+
+    static uint64_t rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+    static uint64_t read64(const uint8_t * p) { uint64_t v; memcpy(&v, p, sizeof(v)); return v; }
+    static uint32_t read32(const uint8_t * p) { uint32_t v; memcpy(&v, p, sizeof(v)); return v; }
+    static uint64_t xxh_round(uint64_t acc, uint64_t input) { return rotl(acc + input*P2, 31)*P1; }
+    static uint64_t merge(uint64_t acc, uint64_t val) { return (acc ^ xxh_round(0, val))*P1 + P4; }
+
+    void stripe(const uint8_t * p) {
+        v[0] = xxh_round(v[0], read64(p));
+        v[1] = xxh_round(v[1], read64(p + 8));
+        v[2] = xxh_round(v[2], read64(p + 16));
+        v[3] = xxh_round(v[3], read64(p + 24));
+    }
+
+    void update(const void * data, size_t size) {
+        const uint8_t * p   = (const uint8_t *) data;
+        const uint8_t * end = p + size;
+
+        total += size;
+
+        if (n_tail > 0) {
+            const size_t n = std::min(sizeof(tail) - n_tail, size);
+            memcpy(tail + n_tail, p, n);
+            n_tail += n;
+            p      += n;
+            if (n_tail < sizeof(tail)) {
+                return;
+            }
+            stripe(tail);
+            n_tail = 0;
+        }
+        for (; p + 32 <= end; p += 32) {
+            stripe(p);
+        }
+        n_tail = end - p;
+        memcpy(tail, p, n_tail);
+    }
+
+    uint64_t digest() const {
+        uint64_t h;
+        if (total >= 32) {
+            h = rotl(v[0], 1) + rotl(v[1], 7) + rotl(v[2], 12) + rotl(v[3], 18);
+            h = merge(h, v[0]);
+            h = merge(h, v[1]);
+            h = merge(h, v[2]);
+            h = merge(h, v[3]);
+        } else {
+            h = P5;
+        }
+
+        h += total;
+
+        const uint8_t * p   = tail;
+        const uint8_t * end = tail + n_tail;
+        for (; p + 8 <= end; p += 8) {
+            h ^= xxh_round(0, read64(p));
+            h  = rotl(h, 27)*P1 + P4;
+        }
+        if (p + 4 <= end) {
+            h ^= (uint64_t) read32(p)*P1;
+            h  = rotl(h, 23)*P2 + P3;
+            p += 4;
+        }
+        for (; p < end; p++) {
+            h ^= (*p)*P5;
+            h  = rotl(h, 11)*P1;
+        }
+
+        h ^= h >> 33;
+        h *= P2;
+        h ^= h >> 29;
+        h *= P3;
+        h ^= h >> 32;
+
+        return h;
+    }
+};
+
+static uint64_t rpc_hash(const void * data, size_t size) {
+    rpc_hasher hasher;
+    hasher.update(data, size);
+    return hasher.digest();
+}
+
 static bool parse_endpoint(const std::string & endpoint, std::string & host, int & port) {
     size_t pos = endpoint.find(':');
     if (pos == std::string::npos) {
@@ -347,7 +585,7 @@ static bool parse_endpoint(const std::string & endpoint, std::string & host, int
 
 // RPC request : | rpc_cmd (1 byte) | request_size (8 bytes) | request_data (request_size bytes) |
 // RPC response: | response_size (8 bytes) | response_data (response_size bytes) |
-static bool send_rpc_cmd(const std::shared_ptr<socket_t> & sock, enum rpc_cmd cmd, const void * input, size_t input_size, void * output, size_t output_size) {
+static bool send_rpc_request(const std::shared_ptr<socket_t> & sock, enum rpc_cmd cmd, const void * input, size_t input_size) {
     uint8_t cmd_byte = cmd;
     if (!send_data(sock->fd, &cmd_byte, sizeof(cmd_byte))) {
         return false;
@@ -358,6 +596,11 @@ static bool send_rpc_cmd(const std::shared_ptr<socket_t> & sock, enum rpc_cmd cm
     if (!send_data(sock->fd, input, input_size)) {
         return false;
     }
+    sock->n_sent++;
+    return true;
+}
+
+static bool recv_rpc_response(const std::shared_ptr<socket_t> & sock, void * output, size_t output_size) {
     // TODO: currently the output_size is always known, do we need support for commands with variable output size?
     // even if we do, we can skip sending output_size from the server for commands with known output size
     uint64_t out_size;
@@ -370,9 +613,134 @@ static bool send_rpc_cmd(const std::shared_ptr<socket_t> & sock, enum rpc_cmd cm
     if (!recv_data(sock->fd, output, output_size)) {
         return false;
     }
+    sock->n_recv++;
+    return true;
+}
+
+// receive the replies of the pending commands until the command number n_sent is done
+static bool wait_rpc_cmds(const std::shared_ptr<socket_t> & sock, uint64_t n_sent = UINT64_MAX) {
+    while (!sock->pending.empty() && sock->n_recv < n_sent) {
+        rpc_pending_reply & reply = sock->pending.front();
+        void * output = reply.cmd == RPC_CMD_GRAPH_RECOMPUTE ? &reply.compute_rsp : reply.output;
+        if (!recv_rpc_response(sock, output, reply.output_size)) {
+            return false;
+        }
+        if (reply.cmd == RPC_CMD_GRAPH_RECOMPUTE) {
+            // the client only recomputes the graphs it did not free, and the server only drops them with their buffers
+            ggml_status status = reply.compute_rsp.found ? (enum ggml_status)reply.compute_rsp.result : GGML_STATUS_FAILED;
+            if (status != GGML_STATUS_SUCCESS && sock->compute_status == GGML_STATUS_SUCCESS) {
+                GGML_LOG_ERROR("%s: graph compute failed with status %d\n", __func__, status);
+                sock->compute_status = status;
+            }
+        }
+        if (reply.copy_size > 0) {
+            memcpy(reply.output, reply.copy_src, reply.copy_size);
+        }
+        sock->pending_size -= reply.output_size + sizeof(uint64_t);
+        sock->pending.pop_front();
+    }
+    if (sock->pending.empty()) {
+        sock->shm_offset = 0;
+    }
+    return true;
+}
+
+static bool send_rpc_cmd(const std::shared_ptr<socket_t> & sock, enum rpc_cmd cmd, const void * input, size_t input_size, void * output, size_t output_size) {
+    if (!send_rpc_request(sock, cmd, input, input_size)) {
+        return false;
+    }
+    if (!wait_rpc_cmds(sock)) {
+        return false;
+    }
+    return recv_rpc_response(sock, output, output_size);
+}
+
+// send a command without waiting for its response, which is written to output by wait_rpc_cmds
+// output must stay valid until then
+static bool send_rpc_cmd_async(const std::shared_ptr<socket_t> & sock, enum rpc_cmd cmd, const void * input, size_t input_size, void * output, size_t output_size,
+                               const void * copy_src = nullptr, size_t copy_size = 0) {
+    const size_t reply_size = output_size + sizeof(uint64_t);
+    if (sock->pending.size() >= MAX_PENDING || sock->pending_size + reply_size > MAX_PENDING_SIZE) {
+        if (!wait_rpc_cmds(sock)) {
+            return false;
+        }
+    }
+    if (reply_size > MAX_PENDING_SIZE) {
+        return send_rpc_cmd(sock, cmd, input, input_size, output, output_size);
+    }
+    if (!send_rpc_request(sock, cmd, input, input_size)) {
+        return false;
+    }
+    sock->pending.push_back({ cmd, output, output_size, {}, copy_src, copy_size });
+    sock->pending_size += reply_size;
     return true;
 }
 
+// space for a payload of the given size in the shared memory of the connection
+static void * shm_alloc(const std::shared_ptr<socket_t> & sock, size_t size, uint64_t & shm_offset) {
+    GGML_ASSERT(sock->shm_ptr != nullptr && size <= sock->shm_size);
+    size_t offset = GGML_PAD(sock->shm_offset, 64);
+    if (offset + size > sock->shm_size) {
+        // wait until the pending commands are done with their payloads
+        bool status = wait_rpc_cmds(sock);
+        GGML_ASSERT(status);
+        offset = 0;
+    }
+    sock->shm_offset = offset + size;
+    shm_offset = offset;
+    return (char *) sock->shm_ptr + offset;
+}
+
+#ifdef GGML_RPC_SHM
+static bool is_local_host(const std::string & host) {
+    return host == "127.0.0.1" || host == "localhost" || host == "::1";
+}
+
+// share memory with a server on the same host, the server fails to open it otherwise
+// returns false if the connection was closed by a server that does not support shared memory
+static bool attach_shm(const std::shared_ptr<socket_t> & sock) {
+    static int counter = 0;
+    rpc_msg_attach_shm_req request = {};
+    snprintf(request.name, sizeof(request.name), "/ggml-rpc-%d-%d", (int) getpid(), counter++);
+    request.size = SHM_SIZE;
+
+    int fd = shm_open(request.name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0) {
+        return true;
+    }
+    void * ptr = MAP_FAILED;
+#ifdef __linux__
+    // reserve the pages, so that a full /dev/shm is detected here instead of by a SIGBUS later
+    if (posix_fallocate(fd, 0, SHM_SIZE) == 0)
+#else
+    if (ftruncate(fd, SHM_SIZE) == 0)
+#endif
+    {
+        ptr = mmap(nullptr, SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+
+    rpc_msg_attach_shm_rsp response = {};
+    bool status = true;
+    if (ptr != MAP_FAILED) {
+        status = send_rpc_cmd(sock, RPC_CMD_ATTACH_SHM, &request, sizeof(request), &response, sizeof(response));
+    }
+    // both sides have mapped it, the name is not needed anymore
+    shm_unlink(request.name);
+
+    if (!status || !response.result) {
+        if (ptr != MAP_FAILED) {
+            munmap(ptr, SHM_SIZE);
+        }
+        return status;
+    }
+    GGML_PRINT_DEBUG("[%s] using %s\n", __func__, request.name);
+    sock->shm_ptr  = ptr;
+    sock->shm_size = SHM_SIZE;
+    return true;
+}
+#endif
+
 // RPC client-side implementation
 
 static std::shared_ptr<socket_t> get_socket(const std::string & endpoint) {
@@ -409,6 +777,31 @@ static std::shared_ptr<socket_t> get_socket(const std::string & endpoint) {
         return nullptr;
     }
     GGML_PRINT_DEBUG("[%s] connected to %s, sockfd=%d\n", __func__, endpoint.c_str(), sock->fd);
+    // the capabilities of the server are probed with optional commands: a server that does not know a command closes the
+    // connection, in which case the client reconnects without the capability
+#ifdef GGML_RPC_SHM
+    if (is_local_host(host) && getenv("GGML_RPC_NO_SHM") == nullptr && !attach_shm(sock)) {
+        GGML_PRINT_DEBUG("[%s] %s does not support shared memory\n", __func__, endpoint.c_str());
+        sock = socket_connect(host.c_str(), port);
+        if (sock == nullptr) {
+            return nullptr;
+        }
+    }
+#endif
+    // without a cache on the server, the large tensors are sent without hashing them first
+    // the payloads in shared memory are not cached, the server is on the same host
+    if (sock->shm_ptr == nullptr) {
+        rpc_msg_has_cache_rsp response;
+        if (send_rpc_cmd(sock, RPC_CMD_HAS_CACHE, nullptr, 0, &response, sizeof(response))) {
+            sock->has_cache = response.result;
+        } else {
+            GGML_PRINT_DEBUG("[%s] %s does not report a cache\n", __func__, endpoint.c_str());
+            sock = socket_connect(host.c_str(), port);
+            if (sock == nullptr) {
+                return nullptr;
+            }
+        }
+    }
     sockets[endpoint] = sock;
     return sock;
 }
@@ -418,6 +811,18 @@ static void ggml_backend_rpc_buffer_free_buffer(ggml_backend_buffer_t buffer) {
     rpc_msg_free_buffer_req request = {ctx->remote_ptr};
     bool status = send_rpc_cmd(ctx->sock, RPC_CMD_FREE_BUFFER, &request, sizeof(request), nullptr, 0);
     GGML_ASSERT(status);
+    // the server drops the graphs with tensors in the buffer
+    auto & graphs = ctx->sock->graphs;
+    for (auto it = graphs.begin(); it != graphs.end(); ) {
+        bool uses_buffer = false;
+        for (const auto & t : it->tensors) {
+            if (t.buffer == ctx->remote_ptr) {
+                uses_buffer = true;
+                break;
+            }
+        }
+        it = uses_buffer ? graphs.erase(it) : it + 1;
+    }
     delete ctx;
 }
 
@@ -435,7 +840,7 @@ static void * ggml_backend_rpc_buffer_get_base(ggml_backend_buffer_t buffer) {
 }
 
 static rpc_tensor serialize_tensor(const ggml_tensor * tensor) {
-    rpc_tensor result;
+    rpc_tensor result = {};
     result.id = reinterpret_cast<uint64_t>(tensor);
     result.type = tensor->type;
     if (tensor->buffer) {
@@ -480,8 +885,37 @@ static void ggml_backend_rpc_buffer_init_tensor(ggml_backend_buffer_t buffer, gg
     }
 }
 
-static void ggml_backend_rpc_buffer_set_tensor(ggml_backend_buffer_t buffer, ggml_tensor * tensor, const void * data, size_t offset, size_t size) {
-    ggml_backend_rpc_buffer_context * ctx = (ggml_backend_rpc_buffer_context *)buffer->context;
+static void set_tensor(const std::shared_ptr<socket_t> & sock, ggml_tensor * tensor, const void * data, size_t offset, size_t size, bool async) {
+    if (sock->has_cache && size > HASH_THRESHOLD) {
+        // the server may have the data in its cache already
+        rpc_msg_set_tensor_hash_req request;
+        request.tensor = serialize_tensor(tensor);
+        request.offset = offset;
+        request.size   = size;
+        request.hash   = rpc_hash(data, size);
+        rpc_msg_set_tensor_hash_rsp response;
+        bool status = send_rpc_cmd(sock, RPC_CMD_SET_TENSOR_HASH, &request, sizeof(request), &response, sizeof(response));
+        GGML_ASSERT(status);
+        if (response.result) {
+            return;
+        }
+    }
+    if (sock->shm_ptr != nullptr) {
+        // the data goes through the shared memory, in pieces if it does not fit
+        for (size_t done = 0; done < size; ) {
+            rpc_msg_tensor_shm_req request;
+            request.tensor = serialize_tensor(tensor);
+            request.offset = offset + done;
+            request.size   = std::min(size - done, sock->shm_size);
+            void * dst = shm_alloc(sock, request.size, request.shm_offset);
+            memcpy(dst, (const char *) data + done, request.size);
+            bool status = async ? send_rpc_cmd_async(sock, RPC_CMD_SET_TENSOR_SHM, &request, sizeof(request), nullptr, 0)
+                                : send_rpc_cmd      (sock, RPC_CMD_SET_TENSOR_SHM, &request, sizeof(request), nullptr, 0);
+            GGML_ASSERT(status);
+            done += request.size;
+        }
+        return;
+    }
     // input serialization format: | rpc_tensor | offset (8 bytes) | data (size bytes) |
     size_t input_size = sizeof(rpc_tensor) + sizeof(uint64_t) + size;
     std::vector<uint8_t> input(input_size, 0);
@@ -489,20 +923,51 @@ static void ggml_backend_rpc_buffer_set_tensor(ggml_backend_buffer_t buffer, ggm
     memcpy(input.data(), &rpc_tensor, sizeof(rpc_tensor));
     memcpy(input.data() + sizeof(rpc_tensor), &offset, sizeof(offset));
     memcpy(input.data() + sizeof(rpc_tensor) + sizeof(offset), data, size);
-    bool status = send_rpc_cmd(ctx->sock, RPC_CMD_SET_TENSOR, input.data(), input.size(), nullptr, 0);
+    bool status = async ? send_rpc_cmd_async(sock, RPC_CMD_SET_TENSOR, input.data(), input.size(), nullptr, 0)
+                        : send_rpc_cmd      (sock, RPC_CMD_SET_TENSOR, input.data(), input.size(), nullptr, 0);
     GGML_ASSERT(status);
 }
 
-static void ggml_backend_rpc_buffer_get_tensor(ggml_backend_buffer_t buffer, const ggml_tensor * tensor, void * data, size_t offset, size_t size) {
+static void ggml_backend_rpc_buffer_set_tensor(ggml_backend_buffer_t buffer, ggml_tensor * tensor, const void * data, size_t offset, size_t size) {
     ggml_backend_rpc_buffer_context * ctx = (ggml_backend_rpc_buffer_context *)buffer->context;
+    set_tensor(ctx->sock, tensor, data, offset, size, false);
+}
+
+static void get_tensor(const std::shared_ptr<socket_t> & sock, const ggml_tensor * tensor, void * data, size_t offset, size_t size, bool async) {
+    if (sock->shm_ptr != nullptr) {
+        for (size_t done = 0; done < size; ) {
+            rpc_msg_tensor_shm_req request;
+            request.tensor = serialize_tensor(tensor);
+            request.offset = offset + done;
+            request.size   = std::min(size - done, sock->shm_size);
+            const void * src = shm_alloc(sock, request.size, request.shm_offset);
+            void * dst = (char *) data + done;
+            if (async) {
+                bool status = send_rpc_cmd_async(sock, RPC_CMD_GET_TENSOR_SHM, &request, sizeof(request), dst, 0, src, request.size);
+                GGML_ASSERT(status);
+            } else {
+                bool status = send_rpc_cmd(sock, RPC_CMD_GET_TENSOR_SHM, &request, sizeof(request), nullptr, 0);
+                GGML_ASSERT(status);
+                memcpy(dst, src, request.size);
+            }
+            done += request.size;
+        }
+        return;
+    }
     rpc_msg_get_tensor_req request;
     request.tensor = serialize_tensor(tensor);
     request.offset = offset;
     request.size = size;
-    bool status = send_rpc_cmd(ctx->sock, RPC_CMD_GET_TENSOR, &request, sizeof(request), data, size);
+    bool status = async ? send_rpc_cmd_async(sock, RPC_CMD_GET_TENSOR, &request, sizeof(request), data, size)
+                        : send_rpc_cmd      (sock, RPC_CMD_GET_TENSOR, &request, sizeof(request), data, size);
     GGML_ASSERT(status);
 }
 
+static void ggml_backend_rpc_buffer_get_tensor(ggml_backend_buffer_t buffer, const ggml_tensor * tensor, void * data, size_t offset, size_t size) {
+    ggml_backend_rpc_buffer_context * ctx = (ggml_backend_rpc_buffer_context *)buffer->context;
+    get_tensor(ctx->sock, tensor, data, offset, size, false);
+}
+
 static bool ggml_backend_rpc_buffer_cpy_tensor(ggml_backend_buffer_t buffer, const ggml_tensor * src, ggml_tensor * dst) {
     // check if src and dst are on the same server
     ggml_backend_buffer_t src_buffer = src->buffer;
@@ -630,8 +1095,10 @@ static void ggml_backend_rpc_free(ggml_backend_t backend) {
 }
 
 static void ggml_backend_rpc_synchronize(ggml_backend_t backend) {
-    GGML_UNUSED(backend);
-    // this is no-op because we don't have any async operations
+    ggml_backend_rpc_context * rpc_ctx = (ggml_backend_rpc_context *)backend->context;
+    auto sock = get_socket(rpc_ctx->endpoint);
+    bool status = wait_rpc_cmds(sock);
+    GGML_ASSERT(status);
 }
 
 static void add_tensor(ggml_tensor * tensor, std::vector<rpc_tensor> & tensors, std::unordered_set<ggml_tensor*> & visited) {
@@ -649,53 +1116,195 @@ static void add_tensor(ggml_tensor * tensor, std::vector<rpc_tensor> & tensors,
     tensors.push_back(serialize_tensor(tensor));
 }
 
-static void serialize_graph(const ggml_cgraph * cgraph, std::vector<uint8_t> & output) {
-    uint32_t n_nodes = cgraph->n_nodes;
-    std::vector<rpc_tensor> tensors;
+static void collect_graph(const ggml_cgraph * cgraph, std::vector<uint64_t> & nodes, std::vector<rpc_tensor> & tensors) {
     std::unordered_set<ggml_tensor*> visited;
-    for (uint32_t i = 0; i < n_nodes; i++) {
+    nodes.resize(cgraph->n_nodes);
+    tensors.clear();
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        nodes[i] = reinterpret_cast<uint64_t>(cgraph->nodes[i]);
         add_tensor(cgraph->nodes[i], tensors, visited);
     }
+}
+
+static void serialize_graph(const std::vector<uint64_t> & nodes, const std::vector<rpc_tensor> & tensors, std::vector<uint8_t> & output) {
+    uint32_t n_nodes = nodes.size();
     // serialization format:
     // | n_nodes (4 bytes) | nodes (n_nodes * sizeof(uint64_t) | n_tensors (4 bytes) | tensors (n_tensors * sizeof(rpc_tensor)) |
     uint32_t n_tensors = tensors.size();
     int output_size = sizeof(uint32_t) + n_nodes * sizeof(uint64_t) + sizeof(uint32_t) + n_tensors * sizeof(rpc_tensor);
     output.resize(output_size, 0);
     memcpy(output.data(), &n_nodes, sizeof(n_nodes));
-    for (uint32_t i = 0; i < n_nodes; i++) {
-        memcpy(output.data() + sizeof(n_nodes) + i * sizeof(uint64_t), &cgraph->nodes[i], sizeof(uint64_t));
-    }
+    memcpy(output.data() + sizeof(n_nodes), nodes.data(), n_nodes * sizeof(uint64_t));
     uint32_t * out_ntensors = (uint32_t *)(output.data() + sizeof(n_nodes) + n_nodes * sizeof(uint64_t));
     *out_ntensors = n_tensors;
     rpc_tensor * out_tensors = (rpc_tensor *)(output.data() + sizeof(n_nodes) + n_nodes * sizeof(uint64_t) + sizeof(uint32_t));
     memcpy(out_tensors, tensors.data(), n_tensors * sizeof(rpc_tensor));
 }
 
+// the server keeps the tensors of a registered graph and their sources, so only the other fields may change between computes
+static bool same_structure(const rpc_tensor & a, const rpc_tensor & b) {
+    if (a.id != b.id || a.type != b.type || a.op != b.op || a.view_src != b.view_src) {
+        return false;
+    }
+    for (int i = 0; i < GGML_MAX_SRC; i++) {
+        if (a.src[i] != b.src[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// the tensors that changed since the graph was last computed, false if the structure of the graph is different
+static bool graph_delta(const rpc_graph_entry & entry, const std::vector<uint64_t> & nodes, const std::vector<rpc_tensor> & tensors, std::vector<rpc_tensor> & changed) {
+    if (entry.nodes != nodes || entry.tensors.size() != tensors.size()) {
+        return false;
+    }
+    changed.clear();
+    for (size_t i = 0; i < tensors.size(); i++) {
+        if (!same_structure(entry.tensors[i], tensors[i])) {
+            return false;
+        }
+        if (memcmp(&entry.tensors[i], &tensors[i], sizeof(rpc_tensor)) != 0) {
+            changed.push_back(tensors[i]);
+        }
+    }
+    return true;
+}
+
+static bool graph_recompute(const std::shared_ptr<socket_t> & sock, uint64_t graph_id, const std::vector<rpc_tensor> & changed) {
+    // serialization format:
+    // | graph_id (8 bytes) | n_tensors (4 bytes) | tensors (n_tensors * sizeof(rpc_tensor)) |
+    uint32_t n_tensors = changed.size();
+    std::vector<uint8_t> input(sizeof(graph_id) + sizeof(n_tensors) + n_tensors * sizeof(rpc_tensor));
+    memcpy(input.data(), &graph_id, sizeof(graph_id));
+    memcpy(input.data() + sizeof(graph_id), &n_tensors, sizeof(n_tensors));
+    memcpy(input.data() + sizeof(graph_id) + sizeof(n_tensors), changed.data(), n_tensors * sizeof(rpc_tensor));
+    // the result is checked by wait_rpc_cmds
+    return send_rpc_cmd_async(sock, RPC_CMD_GRAPH_RECOMPUTE, input.data(), input.size(), nullptr, sizeof(rpc_msg_graph_recompute_rsp));
+}
+
 static enum ggml_status ggml_backend_rpc_graph_compute(ggml_backend_t backend, ggml_cgraph * cgraph) {
     ggml_backend_rpc_context * rpc_ctx = (ggml_backend_rpc_context *)backend->context;
+    auto sock = get_socket(rpc_ctx->endpoint);
+
+    // the graphs are computed asynchronously, a failure is reported by ggml_backend_rpc_pop_status
+    sock->n_compute++;
+
+    std::vector<uint64_t> nodes;
+    std::vector<rpc_tensor> tensors;
+    collect_graph(cgraph, nodes, tensors);
+
+    // a graph with the same nodes and sources as a registered one is computed by its id, sending only the tensors that changed
+    std::vector<rpc_tensor> changed;
+    for (auto & entry : sock->graphs) {
+        if (graph_delta(entry, nodes, tensors, changed)) {
+            bool status = graph_recompute(sock, entry.id, changed);
+            GGML_ASSERT(status);
+            entry.tensors  = std::move(tensors);
+            entry.last_use = sock->n_compute;
+            return GGML_STATUS_SUCCESS;
+        }
+    }
+
+    if (sock->graphs.size() >= MAX_GRAPHS_CLIENT) {
+        auto lru = sock->graphs.begin();
+        for (auto it = sock->graphs.begin(); it != sock->graphs.end(); ++it) {
+            if (it->last_use < lru->last_use) {
+                lru = it;
+            }
+        }
+        rpc_msg_graph_free_req request = {lru->id};
+        bool status = send_rpc_cmd_async(sock, RPC_CMD_GRAPH_FREE, &request, sizeof(request), nullptr, 0);
+        GGML_ASSERT(status);
+        sock->graphs.erase(lru);
+    }
+
     std::vector<uint8_t> input;
-    serialize_graph(cgraph, input);
-    rpc_msg_graph_compute_rsp response;
+    serialize_graph(nodes, tensors, input);
+    rpc_msg_graph_register_rsp response;
+    bool status = send_rpc_cmd(sock, RPC_CMD_GRAPH_REGISTER, input.data(), input.size(), &response, sizeof(response));
+    GGML_ASSERT(status && response.graph_id != 0);
+    status = graph_recompute(sock, response.graph_id, {});
+    GGML_ASSERT(status);
+
+    sock->graphs.push_back({ response.graph_id, sock->n_compute, std::move(nodes), std::move(tensors) });
+
+    return GGML_STATUS_SUCCESS;
+}
+
+static void ggml_backend_rpc_set_tensor_async(ggml_backend_t backend, ggml_tensor * tensor, const void * data, size_t offset, size_t size) {
+    ggml_backend_buffer_t buf = tensor->view_src ? tensor->view_src->buffer : tensor->buffer;
+    GGML_ASSERT(buf->iface.free_buffer == ggml_backend_rpc_buffer_free_buffer && "unsupported buffer type");
+    ggml_backend_rpc_buffer_context * ctx = (ggml_backend_rpc_buffer_context *)buf->context;
+    set_tensor(ctx->sock, tensor, data, offset, size, true);
+
+    GGML_UNUSED(backend);
+}
+
+static void ggml_backend_rpc_get_tensor_async(ggml_backend_t backend, const ggml_tensor * tensor, void * data, size_t offset, size_t size) {
+    ggml_backend_buffer_t buf = tensor->view_src ? tensor->view_src->buffer : tensor->buffer;
+    GGML_ASSERT(buf->iface.free_buffer == ggml_backend_rpc_buffer_free_buffer && "unsupported buffer type");
+    ggml_backend_rpc_buffer_context * ctx = (ggml_backend_rpc_buffer_context *)buf->context;
+    get_tensor(ctx->sock, tensor, data, offset, size, true);
+
+    GGML_UNUSED(backend);
+}
+
+// the replies of the compute commands are received by synchronize and event_synchronize, or by a later command, which keep the
+// first failure: the scheduler and ggml_backend_graph_compute collect it after synchronizing the backend
+static enum ggml_status ggml_backend_rpc_pop_status(ggml_backend_t backend) {
+    ggml_backend_rpc_context * rpc_ctx = (ggml_backend_rpc_context *)backend->context;
     auto sock = get_socket(rpc_ctx->endpoint);
-    bool status = send_rpc_cmd(sock, RPC_CMD_GRAPH_COMPUTE, input.data(), input.size(), &response, sizeof(response));
+    enum ggml_status status = sock->compute_status;
+    sock->compute_status = GGML_STATUS_SUCCESS;
+    return status;
+}
+
+// only copies from the CPU; the data of src is sent immediately, so src must be final when this is called:
+// the CPU backend computes synchronously, and the scheduler synchronizes the worker thread that computes src before the copy
+// (see ggml_backend_sched_compute_splits), a source computed asynchronously on the CPU by any other means is not supported
+static bool ggml_backend_rpc_cpy_tensor_async(ggml_backend_t backend_src, ggml_backend_t backend_dst, const ggml_tensor * src, ggml_tensor * dst) {
+    ggml_backend_buffer_t buf_src = src->view_src ? src->view_src->buffer : src->buffer;
+    ggml_backend_dev_t dev_src = ggml_backend_get_device(backend_src);
+    if (dev_src == nullptr || ggml_backend_dev_type(dev_src) != GGML_BACKEND_DEVICE_TYPE_CPU || !ggml_backend_buffer_is_host(buf_src)) {
+        return false;
+    }
+    ggml_backend_rpc_set_tensor_async(backend_dst, dst, src->data, 0, ggml_nbytes(src));
+    return true;
+}
+
+static void ggml_backend_rpc_event_record(ggml_backend_t backend, ggml_backend_event_t event) {
+    ggml_backend_rpc_context * rpc_ctx = (ggml_backend_rpc_context *)backend->context;
+    rpc_event * ev = (rpc_event *)event->context;
+    ev->sock   = get_socket(rpc_ctx->endpoint);
+    ev->n_sent = ev->sock->n_sent;
+}
+
+static void ggml_backend_rpc_event_wait(ggml_backend_t backend, ggml_backend_event_t event) {
+    ggml_backend_rpc_context * rpc_ctx = (ggml_backend_rpc_context *)backend->context;
+    rpc_event * ev = (rpc_event *)event->context;
+    if (ev->sock == nullptr || ev->sock == get_socket(rpc_ctx->endpoint)) {
+        // the commands of a connection are executed in order
+        return;
+    }
+    bool status = wait_rpc_cmds(ev->sock, ev->n_sent);
     GGML_ASSERT(status);
-    return (enum ggml_status)response.result;
 }
 
 static ggml_backend_i ggml_backend_rpc_interface = {
     /* .get_name                = */ ggml_backend_rpc_name,
     /* .free                    = */ ggml_backend_rpc_free,
-    /* .set_tensor_async        = */ NULL,
-    /* .get_tensor_async        = */ NULL,
-    /* .cpy_tensor_async        = */ NULL,
+    /* .set_tensor_async        = */ ggml_backend_rpc_set_tensor_async,
+    /* .get_tensor_async        = */ ggml_backend_rpc_get_tensor_async,
+    /* .cpy_tensor_async        = */ ggml_backend_rpc_cpy_tensor_async,
     /* .synchronize             = */ ggml_backend_rpc_synchronize,
     /* .graph_plan_create       = */ NULL,
     /* .graph_plan_free         = */ NULL,
     /* .graph_plan_update       = */ NULL,
     /* .graph_plan_compute      = */ NULL,
     /* .graph_compute           = */ ggml_backend_rpc_graph_compute,
-    /* .event_record            = */ NULL,
-    /* .event_wait              = */ NULL,
+    /* .event_record            = */ ggml_backend_rpc_event_record,
+    /* .event_wait              = */ ggml_backend_rpc_event_wait,
 };
 
 ggml_backend_buffer_type_t ggml_backend_rpc_buffer_type(const char * endpoint) {
@@ -771,7 +1380,9 @@ void ggml_backend_rpc_get_device_memory(const char * endpoint, size_t * free, si
 
 class rpc_server {
 public:
-    rpc_server(ggml_backend_t backend) : backend(backend) {}
+    rpc_server(ggml_backend_t backend, const char * cache_dir)
+        : backend(backend), cache_dir(cache_dir) {
+    }
     ~rpc_server();
 
     void alloc_buffer(const rpc_msg_alloc_buffer_req & request, rpc_msg_alloc_buffer_rsp & response);
@@ -781,22 +1392,49 @@ public:
     bool free_buffer(const rpc_msg_free_buffer_req & request);
     bool buffer_clear(const rpc_msg_buffer_clear_req & request);
     bool set_tensor(const std::vector<uint8_t> & input);
+    bool set_tensor_hash(const rpc_msg_set_tensor_hash_req & request, rpc_msg_set_tensor_hash_rsp & response);
     bool get_tensor(const rpc_msg_get_tensor_req & request, std::vector<uint8_t> & response);
+    void attach_shm(const rpc_msg_attach_shm_req & request, rpc_msg_attach_shm_rsp & response);
+    bool set_tensor_shm(const rpc_msg_tensor_shm_req & request);
+    bool get_tensor_shm(const rpc_msg_tensor_shm_req & request);
     bool copy_tensor(const rpc_msg_copy_tensor_req & request, rpc_msg_copy_tensor_rsp & response);
     bool graph_compute(const std::vector<uint8_t> & input, rpc_msg_graph_compute_rsp & response);
+    bool graph_register(const std::vector<uint8_t> & input, rpc_msg_graph_register_rsp & response);
+    bool graph_recompute(const std::vector<uint8_t> & input, rpc_msg_graph_recompute_rsp & response);
+    void graph_free(const rpc_msg_graph_free_req & request);
     bool init_tensor(const rpc_msg_init_tensor_req & request);
     bool get_alloc_size(const rpc_msg_get_alloc_size_req & request, rpc_msg_get_alloc_size_rsp & response);
 
 private:
+    // a deserialized graph, kept between computes
+    struct graph_entry {
+        struct ggml_context * ctx = nullptr;
+        struct ggml_cgraph * graph = nullptr;
+        std::unordered_map<uint64_t, ggml_tensor*> tensor_map;
+    };
+
     ggml_tensor * deserialize_tensor(struct ggml_context * ctx, const rpc_tensor * tensor);
+    void update_tensor(ggml_tensor * result, const rpc_tensor * tensor);
+    bool deserialize_graph(const std::vector<uint8_t> & input, graph_entry & entry);
     ggml_tensor * create_node(uint64_t id,
                               struct ggml_context * ctx,
                               const std::unordered_map<uint64_t, const rpc_tensor*> & tensor_ptrs,
                               std::unordered_map<uint64_t, struct ggml_tensor*> & tensor_map);
 
+    // file of the cache for a payload
+    std::filesystem::path cache_file(uint64_t hash) const;
 
     ggml_backend_t backend;
+    const char * cache_dir; // nullptr if the cache is disabled
     std::unordered_set<ggml_backend_buffer_t> buffers;
+
+    // registered graphs by id
+    std::unordered_map<uint64_t, graph_entry> graphs;
+
+    // memory shared with a client on the same host
+    void * shm_ptr = nullptr;
+    size_t shm_size = 0;
+    uint64_t next_graph_id = 1;
 };
 
 bool rpc_server::get_alloc_size(const rpc_msg_get_alloc_size_req & request, rpc_msg_get_alloc_size_rsp & response) {
@@ -877,6 +1515,22 @@ bool rpc_server::free_buffer(const rpc_msg_free_buffer_req & request) {
         GGML_LOG_ERROR("[%s] buffer not found\n", __func__);
         return false;
     }
+    // the graphs with tensors in the buffer can not be computed anymore
+    for (auto it = graphs.begin(); it != graphs.end(); ) {
+        bool uses_buffer = false;
+        for (ggml_tensor * t = ggml_get_first_tensor(it->second.ctx); t != nullptr; t = ggml_get_next_tensor(it->second.ctx, t)) {
+            if (t->buffer == buffer) {
+                uses_buffer = true;
+                break;
+            }
+        }
+        if (uses_buffer) {
+            ggml_free(it->second.ctx);
+            it = graphs.erase(it);
+        } else {
+            ++it;
+        }
+    }
     ggml_backend_buffer_free(buffer);
     buffers.erase(buffer);
     return true;
@@ -896,7 +1550,14 @@ bool rpc_server::buffer_clear(const rpc_msg_buffer_clear_req & request) {
 ggml_tensor * rpc_server::deserialize_tensor(struct ggml_context * ctx, const rpc_tensor * tensor) {
     ggml_tensor * result = ggml_new_tensor_4d(ctx, (ggml_type) tensor->type,
         tensor->ne[0], tensor->ne[1], tensor->ne[2], tensor->ne[3]);
+    update_tensor(result, tensor);
+    return result;
+}
+
+// everything but the type and the sources
+void rpc_server::update_tensor(ggml_tensor * result, const rpc_tensor * tensor) {
     for (uint32_t i = 0; i < GGML_MAX_DIMS; i++) {
+        result->ne[i] = tensor->ne[i];
         result->nb[i] = tensor->nb[i];
     }
     result->buffer = reinterpret_cast<ggml_backend_buffer_t>(tensor->buffer);
@@ -918,9 +1579,9 @@ ggml_tensor * rpc_server::deserialize_tensor(struct ggml_context * ctx, const rp
         result->op_params[i] = tensor->op_params[i];
     }
     result->flags = tensor->flags;
+    result->view_offs = tensor->view_offs;
     result->data = reinterpret_cast<void *>(tensor->data);
     ggml_set_name(result, tensor->name);
-    return result;
 }
 
 
@@ -961,6 +1622,103 @@ bool rpc_server::set_tensor(const std::vector<uint8_t> & input) {
     const void * data = input.data() + sizeof(rpc_tensor) + sizeof(offset);
     ggml_backend_tensor_set(tensor, data, offset, size);
     ggml_free(ctx);
+
+    // store the payload in the cache, so that it does not have to be sent again
+    if (cache_dir && size > HASH_THRESHOLD) {
+        const std::filesystem::path path = cache_file(rpc_hash(data, size));
+        std::error_code ec;
+        if (std::filesystem::file_size(path, ec) != size || ec) {
+            // write to a temporary file first, so that an interrupted write is never taken for a cached payload
+            std::filesystem::path tmp = path;
+            tmp += ".tmp";
+            std::ofstream ofs(tmp, std::ios::binary);
+            ofs.write((const char *) data, size);
+            ofs.close();
+            if (ofs) {
+                std::filesystem::rename(tmp, path, ec);
+            }
+            if (!ofs || ec) {
+                GGML_LOG_ERROR("[%s] failed to write %s\n", __func__, path.string().c_str());
+                std::filesystem::remove(tmp, ec);
+            }
+        }
+    }
+    return true;
+}
+
+std::filesystem::path rpc_server::cache_file(uint64_t hash) const {
+    char name[17];
+    snprintf(name, sizeof(name), "%016" PRIx64, hash);
+    return std::filesystem::path(cache_dir) / name;
+}
+
+bool rpc_server::set_tensor_hash(const rpc_msg_set_tensor_hash_req & request, rpc_msg_set_tensor_hash_rsp & response) {
+    response.result = 0;
+    if (!cache_dir) {
+        return true;
+    }
+
+    const std::filesystem::path path = cache_file(request.hash);
+    std::error_code ec;
+    const uintmax_t file_size = std::filesystem::file_size(path, ec);
+    if (ec || file_size != request.size) {
+        return true;
+    }
+
+    struct ggml_init_params params {
+        /*.mem_size   =*/ ggml_tensor_overhead(),
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ true,
+    };
+    struct ggml_context * ctx = ggml_init(params);
+    ggml_tensor * tensor = deserialize_tensor(ctx, &request.tensor);
+    if (tensor == nullptr) {
+        GGML_LOG_ERROR("[%s] error deserializing tensor\n", __func__);
+        ggml_free(ctx);
+        return false;
+    }
+    GGML_PRINT_DEBUG("[%s] buffer: %p, data: %p, offset: %" PRIu64 ", size: %" PRIu64 ", hash: %" PRIx64 "\n", __func__, (void*)tensor->buffer, tensor->data, request.offset, request.size, request.hash);
+
+    // sanitize tensor->data
+    {
+        const size_t p0 = (size_t) ggml_backend_buffer_get_base(tensor->buffer);
+        const size_t p1 = p0 + ggml_backend_buffer_get_size(tensor->buffer);
+
+        if (request.tensor.data + request.offset < p0 || request.tensor.data + request.offset >= p1 || request.size > (p1 - request.tensor.data - request.offset)) {
+            GGML_ABORT("[%s] tensor->data out of bounds\n", __func__);
+        }
+    }
+
+    // copy in chunks to bound the memory used by large tensors
+    // the content is hashed again, so that a corrupted or colliding file is not used
+    std::ifstream ifs(path, std::ios::binary);
+    std::vector<char> chunk(std::min<size_t>(request.size, 64*1024*1024));
+    rpc_hasher hasher;
+    for (size_t done = 0; ifs && done < request.size; ) {
+        const size_t n = std::min<size_t>(chunk.size(), request.size - done);
+        ifs.read(chunk.data(), n);
+        if (!ifs) {
+            break;
+        }
+        hasher.update(chunk.data(), n);
+        ggml_backend_tensor_set(tensor, chunk.data(), request.offset + done, n);
+        done += n;
+    }
+    ggml_free(ctx);
+
+    // the client falls back to sending the data, which overwrites what was set from the file
+    if (!ifs) {
+        GGML_LOG_ERROR("[%s] failed to read %s\n", __func__, path.string().c_str());
+        return true;
+    }
+    if (hasher.digest() != request.hash) {
+        GGML_LOG_ERROR("[%s] %s does not match its hash, removing it\n", __func__, path.string().c_str());
+        ifs.close();
+        std::filesystem::remove(path, ec);
+        return true;
+    }
+
+    response.result = 1;
     return true;
 }
 
@@ -1031,6 +1789,106 @@ bool rpc_server::get_tensor(const rpc_msg_get_tensor_req & request, std::vector<
     return true;
 }
 
+void rpc_server::attach_shm(const rpc_msg_attach_shm_req & request, rpc_msg_attach_shm_rsp & response) {
+    response.result = 0;
+#ifdef GGML_RPC_SHM
+    char name[sizeof(request.name) + 1] = {};
+    memcpy(name, request.name, sizeof(request.name));
+    // only the objects created by clients
+    if (strncmp(name, "/ggml-rpc-", strlen("/ggml-rpc-")) != 0 || shm_ptr != nullptr) {
+        return;
+    }
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0) {
+        // the client is on another host
+        return;
+    }
+    struct stat st;
+    void * ptr = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (uint64_t) st.st_size >= request.size) {
+        ptr = mmap(nullptr, request.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (ptr == MAP_FAILED) {
+        return;
+    }
+    GGML_PRINT_DEBUG("[%s] name: %s, size: %" PRIu64 "\n", __func__, name, request.size);
+    shm_ptr  = ptr;
+    shm_size = request.size;
+    response.result = 1;
+#else
+    GGML_UNUSED(request);
+#endif
+}
+
+bool rpc_server::set_tensor_shm(const rpc_msg_tensor_shm_req & request) {
+    if (shm_ptr == nullptr || request.shm_offset > shm_size || request.size > shm_size - request.shm_offset) {
+        GGML_LOG_ERROR("[%s] invalid shared memory range\n", __func__);
+        return false;
+    }
+    struct ggml_init_params params {
+        /*.mem_size   =*/ ggml_tensor_overhead(),
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ true,
+    };
+    struct ggml_context * ctx = ggml_init(params);
+    ggml_tensor * tensor = deserialize_tensor(ctx, &request.tensor);
+    if (tensor == nullptr) {
+        GGML_LOG_ERROR("[%s] error deserializing tensor\n", __func__);
+        ggml_free(ctx);
+        return false;
+    }
+    GGML_PRINT_DEBUG("[%s] buffer: %p, data: %p, offset: %" PRIu64 ", size: %" PRIu64 ", shm_offset: %" PRIu64 "\n", __func__, (void*)tensor->buffer, tensor->data, request.offset, request.size, request.shm_offset);
+
+    // sanitize tensor->data
+    {
+        const size_t p0 = (size_t) ggml_backend_buffer_get_base(tensor->buffer);
+        const size_t p1 = p0 + ggml_backend_buffer_get_size(tensor->buffer);
+
+        if (request.tensor.data + request.offset < p0 || request.tensor.data + request.offset >= p1 || request.size > (p1 - request.tensor.data - request.offset)) {
+            GGML_ABORT("[%s] tensor->data out of bounds\n", __func__);
+        }
+    }
+
+    ggml_backend_tensor_set(tensor, (const char *) shm_ptr + request.shm_offset, request.offset, request.size);
+    ggml_free(ctx);
+    return true;
+}
+
+bool rpc_server::get_tensor_shm(const rpc_msg_tensor_shm_req & request) {
+    if (shm_ptr == nullptr || request.shm_offset > shm_size || request.size > shm_size - request.shm_offset) {
+        GGML_LOG_ERROR("[%s] invalid shared memory range\n", __func__);
+        return false;
+    }
+    struct ggml_init_params params {
+        /*.mem_size   =*/ ggml_tensor_overhead(),
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ true,
+    };
+    struct ggml_context * ctx = ggml_init(params);
+    ggml_tensor * tensor = deserialize_tensor(ctx, &request.tensor);
+    if (tensor == nullptr) {
+        GGML_LOG_ERROR("[%s] error deserializing tensor\n", __func__);
+        ggml_free(ctx);
+        return false;
+    }
+    GGML_PRINT_DEBUG("[%s] buffer: %p, data: %p, offset: %" PRIu64 ", size: %" PRIu64 ", shm_offset: %" PRIu64 "\n", __func__, (void*)tensor->buffer, tensor->data, request.offset, request.size, request.shm_offset);
+
+    // sanitize tensor->data
+    {
+        const size_t p0 = (size_t) ggml_backend_buffer_get_base(tensor->buffer);
+        const size_t p1 = p0 + ggml_backend_buffer_get_size(tensor->buffer);
+
+        if (request.tensor.data + request.offset < p0 || request.tensor.data + request.offset >= p1 || request.size > (p1 - request.tensor.data - request.offset)) {
+            GGML_ABORT("[%s] tensor->data out of bounds\n", __func__);
+        }
+    }
+
+    ggml_backend_tensor_get(tensor, (char *) shm_ptr + request.shm_offset, request.offset, request.size);
+    ggml_free(ctx);
+    return true;
+}
+
 bool rpc_server::copy_tensor(const rpc_msg_copy_tensor_req & request, rpc_msg_copy_tensor_rsp & response) {
     struct ggml_init_params params {
         /*.mem_size   =*/ 2*ggml_tensor_overhead(),
@@ -1075,7 +1933,7 @@ ggml_tensor * rpc_server::create_node(uint64_t id,
     return result;
 }
 
-bool rpc_server::graph_compute(const std::vector<uint8_t> & input, rpc_msg_graph_compute_rsp & response) {
+bool rpc_server::deserialize_graph(const std::vector<uint8_t> & input, graph_entry & entry) {
     // serialization format:
     // | n_nodes (4 bytes) | nodes (n_nodes * sizeof(uint64_t) | n_tensors (4 bytes) | tensors (n_tensors * sizeof(rpc_tensor)) |
     if (input.size() < sizeof(uint32_t)) {
@@ -1101,33 +1959,128 @@ bool rpc_server::graph_compute(const std::vector<uint8_t> & input, rpc_msg_graph
         /*.mem_buffer =*/ NULL,
         /*.no_alloc   =*/ true,
     };
-    struct ggml_context * ctx = ggml_init(params);
-    struct ggml_cgraph * graph = ggml_new_graph_custom(ctx, n_nodes, false);
-    graph->n_nodes = n_nodes;
+    entry.ctx = ggml_init(params);
+    entry.graph = ggml_new_graph_custom(entry.ctx, n_nodes, false);
+    entry.graph->n_nodes = n_nodes;
     std::unordered_map<uint64_t, const rpc_tensor*> tensor_ptrs;
     for (uint32_t i = 0; i < n_tensors; i++) {
         tensor_ptrs[tensors[i].id] = &tensors[i];
     }
-    std::unordered_map<uint64_t, ggml_tensor*> tensor_map;
     for (uint32_t i = 0; i < n_nodes; i++) {
         int64_t id;
         memcpy(&id, &nodes[i], sizeof(id));
-        graph->nodes[i] = create_node(id, ctx, tensor_ptrs, tensor_map);
+        entry.graph->nodes[i] = create_node(id, entry.ctx, tensor_ptrs, entry.tensor_map);
+    }
+    return true;
+}
+
+bool rpc_server::graph_compute(const std::vector<uint8_t> & input, rpc_msg_graph_compute_rsp & response) {
+    graph_entry entry;
+    if (!deserialize_graph(input, entry)) {
+        return false;
     }
-    ggml_status status = ggml_backend_graph_compute(backend, graph);
+    ggml_status status = ggml_backend_graph_compute(backend, entry.graph);
+    response.result = status;
+    ggml_free(entry.ctx);
+    return true;
+}
+
+bool rpc_server::graph_register(const std::vector<uint8_t> & input, rpc_msg_graph_register_rsp & response) {
+    graph_entry entry;
+    if (!deserialize_graph(input, entry)) {
+        return false;
+    }
+    if (graphs.size() >= MAX_GRAPHS_SERVER) {
+        GGML_LOG_ERROR("[%s] too many graphs\n", __func__);
+        ggml_free(entry.ctx);
+        return false;
+    }
+    response.graph_id = next_graph_id++;
+    GGML_PRINT_DEBUG("[%s] graph_id: %" PRIu64 ", n_nodes: %d\n", __func__, response.graph_id, entry.graph->n_nodes);
+    graphs[response.graph_id] = std::move(entry);
+    return true;
+}
+
+bool rpc_server::graph_recompute(const std::vector<uint8_t> & input, rpc_msg_graph_recompute_rsp & response) {
+    // serialization format:
+    // | graph_id (8 bytes) | n_tensors (4 bytes) | tensors (n_tensors * sizeof(rpc_tensor)) |
+    if (input.size() < sizeof(uint64_t) + sizeof(uint32_t)) {
+        return false;
+    }
+    uint64_t graph_id;
+    memcpy(&graph_id, input.data(), sizeof(graph_id));
+    uint32_t n_tensors;
+    memcpy(&n_tensors, input.data() + sizeof(graph_id), sizeof(n_tensors));
+    if (input.size() < sizeof(graph_id) + sizeof(n_tensors) + n_tensors*sizeof(rpc_tensor)) {
+        return false;
+    }
+    const rpc_tensor * tensors = (const rpc_tensor *)(input.data() + sizeof(graph_id) + sizeof(n_tensors));
+    GGML_PRINT_DEBUG("[%s] graph_id: %" PRIu64 ", n_tensors: %u\n", __func__, graph_id, n_tensors);
+
+    response.found = 0;
+    response.result = GGML_STATUS_FAILED;
+
+    auto it = graphs.find(graph_id);
+    if (it == graphs.end()) {
+        return true;
+    }
+    graph_entry & entry = it->second;
+
+    // only tensors of the graph with the same type and sources can be changed, anything else must be registered again
+    auto find_tensor = [&](uint64_t id) -> ggml_tensor * {
+        auto t = entry.tensor_map.find(id);
+        return t == entry.tensor_map.end() ? nullptr : t->second;
+    };
+    for (uint32_t i = 0; i < n_tensors; i++) {
+        const rpc_tensor * tensor = &tensors[i];
+        ggml_tensor * result = find_tensor(tensor->id);
+        bool same = result != nullptr && result->type == (ggml_type) tensor->type && result->op == (ggml_op) tensor->op &&
+                    result->view_src == (tensor->view_src ? find_tensor(tensor->view_src) : nullptr);
+        for (int j = 0; same && j < GGML_MAX_SRC; j++) {
+            same = result->src[j] == (tensor->src[j] ? find_tensor(tensor->src[j]) : nullptr);
+        }
+        if (!same) {
+            ggml_free(entry.ctx);
+            graphs.erase(it);
+            return true;
+        }
+    }
+    for (uint32_t i = 0; i < n_tensors; i++) {
+        update_tensor(entry.tensor_map.at(tensors[i].id), &tensors[i]);
+    }
+
+    ggml_status status = ggml_backend_graph_compute(backend, entry.graph);
+    response.found = 1;
     response.result = status;
-    ggml_free(ctx);
     return true;
 }
 
+void rpc_server::graph_free(const rpc_msg_graph_free_req & request) {
+    GGML_PRINT_DEBUG("[%s] graph_id: %" PRIu64 "\n", __func__, request.graph_id);
+    // the graph may have been dropped with a buffer already
+    auto it = graphs.find(request.graph_id);
+    if (it != graphs.end()) {
+        ggml_free(it->second.ctx);
+        graphs.erase(it);
+    }
+}
+
 rpc_server::~rpc_server() {
+    for (auto & it : graphs) {
+        ggml_free(it.second.ctx);
+    }
+#ifdef GGML_RPC_SHM
+    if (shm_ptr != nullptr) {
+        munmap(shm_ptr, shm_size);
+    }
+#endif
     for (auto buffer : buffers) {
         ggml_backend_buffer_free(buffer);
     }
 }
 
-static void rpc_serve_client(ggml_backend_t backend, sockfd_t sockfd, size_t free_mem, size_t total_mem) {
-    rpc_server server(backend);
+static void rpc_serve_client(ggml_backend_t backend, const char * cache_dir, sockfd_t sockfd, size_t free_mem, size_t total_mem) {
+    rpc_server server(backend, cache_dir);
     while (true) {
         uint8_t cmd;
         if (!recv_data(sockfd, &cmd, 1)) {
@@ -1238,6 +2191,20 @@ static void rpc_serve_client(ggml_backend_t backend, sockfd_t sockfd, size_t fre
                 }
                 break;
             }
+            case RPC_CMD_SET_TENSOR_HASH: {
+                rpc_msg_set_tensor_hash_req request;
+                if (!recv_msg(sockfd, &request, sizeof(request))) {
+                    return;
+                }
+                rpc_msg_set_tensor_hash_rsp response;
+                if (!server.set_tensor_hash(request, response)) {
+                    return;
+                }
+                if (!send_msg(sockfd, &response, sizeof(response))) {
+                    return;
+                }
+                break;
+            }
             case RPC_CMD_INIT_TENSOR: {
                 rpc_msg_init_tensor_req request;
                 if (!recv_msg(sockfd, &request,sizeof(request))) {
@@ -1293,6 +2260,94 @@ static void rpc_serve_client(ggml_backend_t backend, sockfd_t sockfd, size_t fre
                 }
                 break;
             }
+            case RPC_CMD_GRAPH_REGISTER: {
+                std::vector<uint8_t> input;
+                if (!recv_msg(sockfd, input)) {
+                    return;
+                }
+                rpc_msg_graph_register_rsp response;
+                if (!server.graph_register(input, response)) {
+                    return;
+                }
+                if (!send_msg(sockfd, &response, sizeof(response))) {
+                    return;
+                }
+                break;
+            }
+            case RPC_CMD_GRAPH_RECOMPUTE: {
+                std::vector<uint8_t> input;
+                if (!recv_msg(sockfd, input)) {
+                    return;
+                }
+                rpc_msg_graph_recompute_rsp response;
+                if (!server.graph_recompute(input, response)) {
+                    return;
+                }
+                if (!send_msg(sockfd, &response, sizeof(response))) {
+                    return;
+                }
+                break;
+            }
+            case RPC_CMD_GRAPH_FREE: {
+                rpc_msg_graph_free_req request;
+                if (!recv_msg(sockfd, &request, sizeof(request))) {
+                    return;
+                }
+                server.graph_free(request);
+                if (!send_msg(sockfd, nullptr, 0)) {
+                    return;
+                }
+                break;
+            }
+            case RPC_CMD_ATTACH_SHM: {
+                rpc_msg_attach_shm_req request;
+                if (!recv_msg(sockfd, &request, sizeof(request))) {
+                    return;
+                }
+                rpc_msg_attach_shm_rsp response;
+                server.attach_shm(request, response);
+                if (!send_msg(sockfd, &response, sizeof(response))) {
+                    return;
+                }
+                break;
+            }
+            case RPC_CMD_SET_TENSOR_SHM: {
+                rpc_msg_tensor_shm_req request;
+                if (!recv_msg(sockfd, &request, sizeof(request))) {
+                    return;
+                }
+                if (!server.set_tensor_shm(request)) {
+                    return;
+                }
+                if (!send_msg(sockfd, nullptr, 0)) {
+                    return;
+                }
+                break;
+            }
+            case RPC_CMD_GET_TENSOR_SHM: {
+                rpc_msg_tensor_shm_req request;
+                if (!recv_msg(sockfd, &request, sizeof(request))) {
+                    return;
+                }
+                if (!server.get_tensor_shm(request)) {
+                    return;
+                }
+                if (!send_msg(sockfd, nullptr, 0)) {
+                    return;
+                }
+                break;
+            }
+            case RPC_CMD_HAS_CACHE: {
+                if (!recv_msg(sockfd, nullptr, 0)) {
+                    return;
+                }
+                rpc_msg_has_cache_rsp response;
+                response.result = cache_dir != nullptr;
+                if (!send_msg(sockfd, &response, sizeof(response))) {
+                    return;
+                }
+                break;
+            }
             case RPC_CMD_GET_DEVICE_MEMORY: {
                 if (!recv_msg(sockfd, nullptr, 0)) {
                     return;
@@ -1313,7 +2368,7 @@ static void rpc_serve_client(ggml_backend_t backend, sockfd_t sockfd, size_t fre
     }
 }
 
-void ggml_backend_rpc_start_server(ggml_backend_t backend, const char * endpoint, size_t free_mem, size_t total_mem) {
+void ggml_backend_rpc_start_server(ggml_backend_t backend, const char * endpoint, const char * cache_dir, size_t free_mem, size_t total_mem) {
     std::string host;
     int port;
     if (!parse_endpoint(endpoint, host, port)) {
@@ -1342,7 +2397,7 @@ void ggml_backend_rpc_start_server(ggml_backend_t backend, const char * endpoint
         }
         printf("Accepted client connection, free_mem=%zu, total_mem=%zu\n", free_mem, total_mem);
         fflush(stdout);
-        rpc_serve_client(backend, client_socket->fd, free_mem, total_mem);
+        rpc_serve_client(backend, cache_dir, client_socket->fd, free_mem, total_mem);
         printf("Client connection closed\n");
         fflush(stdout);
     }
@@ -1391,10 +2446,10 @@ static void ggml_backend_rpc_device_get_props(ggml_backend_dev_t dev, struct ggm
     props->type        = ggml_backend_rpc_device_get_type(dev);
     ggml_backend_rpc_device_get_memory(dev, &props->memory_free, &props->memory_total);
     props->caps = {
-        /* .async                 = */ false,
+        /* .async                 = */ true,
         /* .host_buffer           = */ false,
         /* .buffer_from_host_ptr  = */ false,
-        /* .events                = */ false,
+        /* .events                = */ true,
     };
 }
 
@@ -1430,6 +2485,30 @@ static bool ggml_backend_rpc_device_supports_buft(ggml_backend_dev_t dev, ggml_b
     return buft_ctx->endpoint == dev_ctx->endpoint;
 }
 
+static ggml_backend_event_t ggml_backend_rpc_device_event_new(ggml_backend_dev_t dev) {
+    return new ggml_backend_event {
+        /* .device  = */ dev,
+        /* .context = */ new rpc_event { nullptr, 0 },
+    };
+}
+
+static void ggml_backend_rpc_device_event_free(ggml_backend_dev_t dev, ggml_backend_event_t event) {
+    delete (rpc_event *)event->context;
+    delete event;
+
+    GGML_UNUSED(dev);
+}
+
+static void ggml_backend_rpc_device_event_synchronize(ggml_backend_dev_t dev, ggml_backend_event_t event) {
+    rpc_event * ev = (rpc_event *)event->context;
+    if (ev->sock != nullptr) {
+        bool status = wait_rpc_cmds(ev->sock, ev->n_sent);
+        GGML_ASSERT(status);
+    }
+
+    GGML_UNUSED(dev);
+}
+
 static const struct ggml_backend_device_i ggml_backend_rpc_device_i = {
     /* .get_name             = */ ggml_backend_rpc_device_get_name,
     /* .get_description      = */ ggml_backend_rpc_device_get_description,
@@ -1443,9 +2522,9 @@ static const struct ggml_backend_device_i ggml_backend_rpc_device_i = {
     /* .supports_op          = */ ggml_backend_rpc_device_supports_op,
     /* .supports_buft        = */ ggml_backend_rpc_device_supports_buft,
     /* .offload_op           = */ NULL,
-    /* .event_new            = */ NULL,
-    /* .event_free           = */ NULL,
-    /* .event_synchronize    = */ NULL,
+    /* .event_new            = */ ggml_backend_rpc_device_event_new,
+    /* .event_free           = */ ggml_backend_rpc_device_event_free,
+    /* .event_synchronize    = */ ggml_backend_rpc_device_event_synchronize,
 };
 
 // backend reg interface
@@ -1473,6 +2552,9 @@ static void * ggml_backend_rpc_get_proc_address(ggml_backend_reg_t reg, const ch
     if (std::strcmp(name, "ggml_backend_rpc_add_device") == 0) {
         return (void *)ggml_backend_rpc_add_device;
     }
+    if (std::strcmp(name, "ggml_backend_pop_status") == 0) {
+        return (void *)ggml_backend_rpc_pop_status;
+    }
     return NULL;
 
     GGML_UNUSED(reg);
@@ -41,10 +41,10 @@
 #define LLAMA_FILE_MAGIC_GGSQ 0x67677371u // 'ggsq'
 
 #define LLAMA_SESSION_MAGIC   LLAMA_FILE_MAGIC_GGSN
-#define LLAMA_SESSION_VERSION 9
+#define LLAMA_SESSION_VERSION 10
 
 #define LLAMA_STATE_SEQ_MAGIC   LLAMA_FILE_MAGIC_GGSQ
-#define LLAMA_STATE_SEQ_VERSION 2
+#define LLAMA_STATE_SEQ_VERSION 3
 
 #ifdef __cplusplus
 extern "C" {
@@ -304,6 +304,7 @@ extern "C" {
         bool use_mmap;      // use mmap if possible
         bool use_mlock;     // force system to keep model in RAM
         bool check_tensors; // validate model tensor data
+        bool defer_prefetch; // do not read the memory mapped weights ahead during loading, see llama_model_prefetch
     };
 
     // NOTE: changing the default values of parameters marked as [EXPERIMENTAL] may cause crashes or incorrect results in certain configurations
@@ -343,6 +344,8 @@ extern "C" {
         bool offload_kqv; // whether to offload the KQV ops (including the KV cache) to GPU
         bool flash_attn;  // whether to use flash attention [EXPERIMENTAL]
         bool no_perf;     // whether to measure performance timings
+        bool collect_imatrix; // accumulate the activation statistics for an importance matrix, see llama_imatrix_read
+        bool collect_imatrix_output; // with collect_imatrix, also accumulate the statistics of the output tensor
 
         // Abort callback
         // if it returns true, execution of llama_decode() will be aborted
@@ -362,6 +365,8 @@ extern "C" {
         bool only_copy;                      // only copy tensors - ftype, allow_requantize and quantize_output_tensor are ignored
         bool pure;                           // quantize all tensors to the default type
         bool keep_split;                     // quantize to the same number of shards
+        float target_bpw;                    // if > 0, search per-tensor types that minimize the error at this average bits per weight
+        uint64_t target_size;                // if > 0, search per-tensor types that minimize the error at this size in bytes (takes precedence over target_bpw)
         void * imatrix;                      // pointer to importance matrix data
         void * kv_overrides;                 // pointer to vector containing overrides
     } llama_model_quantize_params;
@@ -375,6 +380,14 @@ extern "C" {
         bool no_perf; // whether to measure performance timings
     } llama_sampler_chain_params;
 
+    // sampling stages appended to the compute graph of the decoder, see llama_set_graph_sampling
+    typedef struct llama_graph_sampling_params {
+        int32_t  top_k; // number of candidates returned per output, must be > 0, otherwise graph sampling is disabled
+        float    temp;  // temperature applied to the logits, <= 0 - greedy
+        bool     dist;  // draw a token from the candidates as part of the graph
+        uint32_t seed;  // seed of the RNG used for the draw, LLAMA_DEFAULT_SEED - random
+    } llama_graph_sampling_params;
+
     // used in chat template
     typedef struct llama_chat_message {
         const char * role;
@@ -390,6 +403,7 @@ extern "C" {
     LLAMA_API struct llama_context_params        llama_context_default_params(void);
     LLAMA_API struct llama_sampler_chain_params  llama_sampler_chain_default_params(void);
     LLAMA_API struct llama_model_quantize_params llama_model_quantize_default_params(void);
+    LLAMA_API struct llama_graph_sampling_params llama_graph_sampling_default_params(void);
 
     // Initialize the llama + ggml backend
     // If numa is true, use NUMA optimizations
@@ -529,6 +543,14 @@ extern "C" {
     // Returns true if the model is recurrent (like Mamba, RWKV, etc.)
     LLAMA_API bool llama_model_is_recurrent(const struct llama_model * model);
 
+    // Read the memory mapped weights of the model in background threads, one layer after the other in the order in
+    // which they are used. The model can be used meanwhile: the computations only wait for the weights they access.
+    // Returns false if there is nothing to prefetch (e.g. the weights are not memory mapped or have been offloaded)
+    LLAMA_API bool llama_model_prefetch(struct llama_model * model, int32_t n_threads);
+
+    // Returns the progress of llama_model_prefetch, between 0.0 and 1.0
+    LLAMA_API float llama_model_prefetch_progress(const struct llama_model * model);
+
     // Returns 0 on success
     LLAMA_API uint32_t llama_model_quantize(
             const char * fname_inp,
@@ -580,6 +602,30 @@ extern "C" {
                          int32_t   il_start,
                          int32_t   il_end);
 
+    //
+    // Importance matrix
+    //
+
+    // Called by llama_imatrix_read for each weight with collected statistics
+    //   values: [n_mat][n_per_row] per-column sums of the squared activations multiplied with the weight
+    //   counts: [n_mat] number of activation rows accumulated in values
+    // n_mat is the number of experts for MoE weights and 1 otherwise
+    typedef void (*llama_imatrix_callback)(
+            const char * name,
+           const float * values,
+         const int64_t * counts,
+                 int64_t n_per_row,
+                 int64_t n_mat,
+                  void * user_data);
+
+    // Pass the statistics accumulated since the previous call to the callback and reset them
+    // The statistics are computed by the backends as part of the graph during llama_decode/llama_encode
+    // Requires a context created with llama_context_params.collect_imatrix, returns -1 otherwise
+    LLAMA_API int32_t llama_imatrix_read(
+            struct llama_context * ctx,
+          llama_imatrix_callback   callback,
+                            void * user_data);
+
     //
     // KV cache
     //
@@ -925,6 +971,30 @@ extern "C" {
     // otherwise: float[n_embd] (1-dimensional)
     LLAMA_API float * llama_get_embeddings_seq(struct llama_context * ctx, llama_seq_id seq_id);
 
+    //
+    // Graph sampling
+    //
+
+    // Append temperature, top-k, softmax and optionally a categorical draw to the compute graph of the decoder,
+    // so that only the top candidates of each output are copied back to the host instead of the full logits
+    // While enabled, llama_get_logits/llama_get_logits_ith do not return valid data
+    // Pass NULL to disable
+    LLAMA_API void llama_set_graph_sampling(
+            struct llama_context * ctx,
+      const struct llama_graph_sampling_params * params);
+
+    // Candidates of the ith output sorted by decreasing probability, with the probabilities after temperature and top-k
+    // Returns the number of candidates, or -1 for invalid ids or when graph sampling is disabled
+    LLAMA_API int32_t llama_get_sampled_candidates_ith(
+            struct llama_context * ctx,
+                         int32_t   i,
+               const llama_token ** ids,
+                     const float ** probs);
+
+    // Token drawn for the ith output (the most probable candidate when dist is false or temp <= 0)
+    // Returns LLAMA_TOKEN_NULL for invalid ids or when graph sampling is disabled
+    LLAMA_API llama_token llama_get_sampled_token_ith(struct llama_context * ctx, int32_t i);
+
     //
     // Vocab
     //
@@ -1006,6 +1076,18 @@ extern "C" {
                             bool   add_special,
                             bool   parse_special);
 
+    /// @details Same as llama_tokenize, with long texts split at safe boundaries and tokenized on up to n_threads threads.
+    /// The result is identical to llama_tokenize. Texts that cannot be split safely (e.g. UGM and RWKV vocabs) are tokenized serially.
+    LLAMA_API int32_t llama_tokenize_parallel(
+        const struct llama_vocab * vocab,
+                      const char * text,
+                         int32_t   text_len,
+                     llama_token * tokens,
+                         int32_t   n_tokens_max,
+                            bool   add_special,
+                            bool   parse_special,
+                         int32_t   n_threads);
+
     // Token Id -> Piece.
     // Uses the vocabulary in the provided context.
     // Does not write null terminator to the buffer.
@@ -1199,6 +1281,15 @@ extern "C" {
                           const char * grammar_str,
                           const char * grammar_root);
 
+    /// @details Bitmask of the tokens allowed by a grammar sampler in its current state: token id is allowed iff bit (id % 64) of bitmask[id / 64] is set
+    /// Only reads the state of the sampler, so it can run on another thread while the logits of the next token are computed
+    /// @param n_words Size of bitmask, at least (n_vocab + 63)/64
+    /// @return false if smpl is not a grammar sampler or bitmask is too small
+    LLAMA_API bool llama_sampler_grammar_get_bitmask(
+      const struct llama_sampler * smpl,
+                        uint64_t * bitmask,
+                          size_t   n_words);
+
     /// NOTE: Avoid using on the full vocabulary as searching for repeated tokens can become slow. For example, apply top-k or top-p sampling first.
     LLAMA_API struct llama_sampler * llama_sampler_init_penalties(
                              int32_t   penalty_last_n,   // last n tokens to penalize (0 = disable penalty, -1 = context size)
@@ -1310,6 +1401,15 @@ extern "C" {
     LLAMA_API void                           llama_perf_context_print(const struct llama_context * ctx);
     LLAMA_API void                           llama_perf_context_reset(      struct llama_context * ctx);
 
+    // Profiling of the backend scheduler: records the timings of the graph splits, or of each node with per_node, the copies
+    // between the backends and the synchronization waits
+    // the backends are synchronized after each split or node, so the profiled computations are slower and do not overlap
+    LLAMA_API void llama_perf_trace_start(struct llama_context * ctx, bool per_node);
+    LLAMA_API void llama_perf_trace_stop (struct llama_context * ctx);
+
+    // Write the events recorded since the start or the last write as Chrome trace JSON, viewable with chrome://tracing or ui.perfetto.dev
+    LLAMA_API bool llama_perf_trace_write(struct llama_context * ctx, const char * fname);
+
     // NOTE: the following work only with samplers constructed via llama_sampler_chain_init
     LLAMA_API struct llama_perf_sampler_data llama_perf_sampler      (const struct llama_sampler * chain);
     LLAMA_API void                           llama_perf_sampler_print(const struct llama_sampler * chain);
@@ -5,8 +5,11 @@
 
 #include <cassert>
 #include <cmath>
+#include <condition_variable>
 #include <cstring>
+#include <mutex>
 #include <stdexcept>
+#include <thread>
 
 void llama_set_k_shift(struct llama_context & lctx) {
     const int64_t kv_size = lctx.kv_self.size;
@@ -569,6 +572,9 @@ void llama_output_reorder(struct llama_context & ctx) {
                     std::swap(ctx.embd[i*n_embd + k], ctx.embd[j_min*n_embd + k]);
                 }
             }
+            if (ctx.sampling.enabled() && !ctx.cparams.embeddings) {
+                ctx.sampling.swap_outputs(i, j_min);
+            }
         }
         std::fill(ctx.output_ids.begin(), ctx.output_ids.end(), -1);
         for (int32_t i = 0; i < n_outputs; ++i) {
@@ -640,6 +646,11 @@ void llama_set_abort_callback(struct llama_context * ctx, bool (*abort_callback)
     ctx->abort_callback      = abort_callback;
     ctx->abort_callback_data = abort_callback_data;
 
+    // the backends may still be computing the previous ubatches on the worker threads of the scheduler
+    if (ctx->sched) {
+        ggml_backend_sched_synchronize(ctx->sched.get());
+    }
+
     for (auto & backend : ctx->backends) {
         auto * reg = ggml_backend_dev_backend_reg(ggml_backend_get_device(backend.get()));
         auto * set_abort_callback_fn = (ggml_backend_set_abort_callback_t) ggml_backend_reg_get_proc_address(reg, "ggml_backend_set_abort_callback");
@@ -657,6 +668,18 @@ void llama_set_causal_attn(struct llama_context * ctx, bool causal_attn) {
     ctx->cparams.causal_attn = causal_attn;
 }
 
+int32_t llama_imatrix_read(struct llama_context * ctx, llama_imatrix_callback callback, void * user_data) {
+    if (!ctx->imatrix.enabled()) {
+        return -1;
+    }
+
+    llama_synchronize(ctx);
+
+    ctx->imatrix.read(callback, user_data);
+
+    return 0;
+}
+
 void llama_synchronize(struct llama_context * ctx) {
     ggml_backend_sched_synchronize(ctx->sched.get());
 
@@ -737,6 +760,78 @@ float * llama_get_logits_ith(struct llama_context * ctx, int32_t i) {
     }
 }
 
+void llama_set_graph_sampling(struct llama_context * ctx, const struct llama_graph_sampling_params * params) {
+    llama_synchronize(ctx);
+
+    ctx->sampling.set_params(params, ctx->model.vocab.n_tokens());
+    ctx->graph_cache.invalidate();
+}
+
+// index of the ith output in the buffers of the graph sampling, -1 if invalid
+static int32_t llama_sampled_output_id(struct llama_context * ctx, int32_t i, const char * func) {
+    int32_t j = -1;
+
+    llama_synchronize(ctx);
+
+    try {
+        if (!ctx->sampling.enabled()) {
+            throw std::runtime_error("graph sampling is not enabled");
+        }
+        if (!ctx->sampling.supported()) {
+            throw std::runtime_error("graph sampling is not supported by the output of this model");
+        }
+
+        if (i < 0) {
+            j = ctx->n_outputs + i;
+            if (j < 0) {
+                throw std::runtime_error(format("negative index out of range [0, %d)", ctx->n_outputs));
+            }
+        } else if ((size_t) i >= ctx->output_ids.size()) {
+            throw std::runtime_error(format("out of range [0, %zu)", ctx->output_ids.size()));
+        } else {
+            j = ctx->output_ids[i];
+        }
+
+        if (j < 0) {
+            throw std::runtime_error(format("batch.logits[%d] != true", i));
+        }
+        if (j >= ctx->n_outputs) {
+            // This should not happen
+            throw std::runtime_error(format("corrupt output buffer (j=%d, n_outputs=%d)", j, ctx->n_outputs));
+        }
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("%s: invalid output id %d, reason: %s\n", func, i, err.what());
+        return -1;
+    }
+
+    return j;
+}
+
+int32_t llama_get_sampled_candidates_ith(struct llama_context * ctx, int32_t i, const llama_token ** ids, const float ** probs) {
+    const int32_t j = llama_sampled_output_id(ctx, i, __func__);
+    if (j < 0) {
+        return -1;
+    }
+
+    if (ids) {
+        *ids = ctx->sampling.ids(j);
+    }
+    if (probs) {
+        *probs = ctx->sampling.probs(j);
+    }
+
+    return ctx->sampling.n_candidates();
+}
+
+llama_token llama_get_sampled_token_ith(struct llama_context * ctx, int32_t i) {
+    const int32_t j = llama_sampled_output_id(ctx, i, __func__);
+    if (j < 0) {
+        return LLAMA_TOKEN_NULL;
+    }
+
+    return ctx->sampling.token(j);
+}
+
 float * llama_get_embeddings(struct llama_context * ctx) {
     llama_synchronize(ctx);
 
@@ -832,6 +927,9 @@ struct llama_data_write {
     virtual size_t get_size_written() = 0;
     virtual ~llama_data_write() = default;
 
+    // pad the output so that the next block of KV cache data is aligned (state files only)
+    virtual void align() {}
+
     void write_string(const std::string & str) {
         uint32_t str_size = str.size();
 
@@ -949,6 +1047,8 @@ struct llama_data_write {
             const uint64_t k_size_row = ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa);
             write(&k_size_row, sizeof(k_size_row));
 
+            align();
+
             // Read each range of cells of k_size length each into tmp_buf and write out
             for (const auto & range : cell_ranges) {
                 const size_t range_size = range.second - range.first;
@@ -969,6 +1069,8 @@ struct llama_data_write {
                 const uint64_t v_size_row = ggml_row_size(kv_self.v_l[il]->type, n_embd_v_gqa);
                 write(&v_size_row, sizeof(v_size_row));
 
+                align();
+
                 // Read each range of cells of v_size length each into tmp_buf and write out
                 for (const auto & range : cell_ranges) {
                     const size_t range_size = range.second - range.first;
@@ -993,6 +1095,8 @@ struct llama_data_write {
                 // Write GQA embedding size
                 write(&n_embd_v_gqa, sizeof(n_embd_v_gqa));
 
+                align();
+
                 // For each row, we get the element values of each cell
                 for (uint32_t j = 0; j < n_embd_v_gqa; ++j) {
                     // Read each range of cells of v_size_el length each into tmp_buf and write out
@@ -1053,6 +1157,9 @@ struct llama_data_read {
     virtual size_t get_size_read() = 0;
     virtual ~llama_data_read() = default;
 
+    // skip the padding written by llama_data_write::align()
+    virtual void align() {}
+
     void read_string(std::string & str) {
         uint32_t str_size;
         read_to(&str_size, sizeof(str_size));
@@ -1278,6 +1385,8 @@ struct llama_data_read {
                 return false;
             }
 
+            align();
+
             if (cell_count) {
                 // Read and set the keys for the whole cell range
                 ggml_backend_tensor_set(kv_self.k_l[il], read(cell_count * k_size_row), kv_self.head * k_size_row, cell_count * k_size_row);
@@ -1306,6 +1415,8 @@ struct llama_data_read {
                     return false;
                 }
 
+                align();
+
                 if (cell_count) {
                     // Read and set the values for the whole cell range
                     ggml_backend_tensor_set(kv_self.v_l[il], read(cell_count * v_size_row), kv_self.head * v_size_row, cell_count * v_size_row);
@@ -1342,6 +1453,8 @@ struct llama_data_read {
                     return false;
                 }
 
+                align();
+
                 if (cell_count) {
                     // For each row in the transposed matrix, read the values for the whole cell range
                     for (uint32_t j = 0; j < n_embd_v_gqa; ++j) {
@@ -1448,22 +1561,140 @@ struct llama_data_read_buffer : llama_data_read {
     }
 };
 
+// alignment of the KV cache blocks in state files, so that they can be uploaded directly from a memory mapping
+static const size_t LLAMA_STATE_FILE_ALIGNMENT = 4096;
+
+// previous versions of the state files, with the same layout but without alignment of the KV cache blocks
+static const uint32_t LLAMA_SESSION_VERSION_UNALIGNED   = 9;
+static const uint32_t LLAMA_STATE_SEQ_VERSION_UNALIGNED = 2;
+
+// writes to the file from a background thread, so that copying the data from the backends overlaps with the file I/O
+// the data is staged in two chunks of LLAMA_STATE_WRITE_CHUNK_SIZE bytes: one is filled while the other is written
 struct llama_data_write_file : llama_data_write {
+    static constexpr size_t LLAMA_STATE_WRITE_CHUNK_SIZE = 16u*1024*1024;
+
     llama_file * file;
+    size_t offset_base;  // position of the state data in the file
     size_t size_written = 0;
-    std::vector<uint8_t> temp_buffer;
 
-    llama_data_write_file(llama_file * f) : file(f) {}
+    std::vector<uint8_t> chunks[2];
+    int    cur   = 0;
+    size_t n_cur = 0;
+
+    std::thread             worker;
+    std::mutex              mutex;
+    std::condition_variable cv;
+    bool                    pending = false;
+    size_t                  n_pending = 0;
+    bool                    stop = false;
+    std::exception_ptr      error;
+
+    llama_data_write_file(llama_file * f) : file(f), offset_base(f->tell()) {
+        chunks[0].resize(LLAMA_STATE_WRITE_CHUNK_SIZE);
+        chunks[1].resize(LLAMA_STATE_WRITE_CHUNK_SIZE);
+
+        worker = std::thread([this]() {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (true) {
+                cv.wait(lock, [this]() { return pending || stop; });
+                if (!pending) {
+                    break;
+                }
+
+                const uint8_t * data = chunks[cur ^ 1].data();
+                const size_t    size = n_pending;
+
+                lock.unlock();
+                try {
+                    if (!error) {
+                        file->write_raw(data, size);
+                    }
+                } catch (...) {
+                    error = std::current_exception();
+                }
+                lock.lock();
+
+                pending = false;
+                cv.notify_all();
+            }
+        });
+    }
+
+    ~llama_data_write_file() {
+        if (worker.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stop = true;
+            }
+            cv.notify_all();
+            worker.join();
+        }
+    }
+
+    // hand the current chunk over to the worker thread
+    void submit() {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [this]() { return !pending; });
+        if (error) {
+            std::rethrow_exception(error);
+        }
+        pending   = true;
+        n_pending = n_cur;
+        cur ^= 1;
+        n_cur = 0;
+        cv.notify_all();
+    }
 
     void write(const void * src, size_t size) override {
-        file->write_raw(src, size);
-        size_written += size;
+        const uint8_t * ptr = (const uint8_t *) src;
+        while (size > 0) {
+            const size_t n = std::min(size, LLAMA_STATE_WRITE_CHUNK_SIZE - n_cur);
+            memcpy(chunks[cur].data() + n_cur, ptr, n);
+            ptr   += n;
+            size  -= n;
+            n_cur += n;
+            size_written += n;
+            if (n_cur == LLAMA_STATE_WRITE_CHUNK_SIZE) {
+                submit();
+            }
+        }
     }
 
     void write_tensor_data(const struct ggml_tensor * tensor, size_t offset, size_t size) override {
-        temp_buffer.resize(size);
-        ggml_backend_tensor_get(tensor, temp_buffer.data(), offset, size);
-        write(temp_buffer.data(), temp_buffer.size());
+        while (size > 0) {
+            const size_t n = std::min(size, LLAMA_STATE_WRITE_CHUNK_SIZE - n_cur);
+            ggml_backend_tensor_get(tensor, chunks[cur].data() + n_cur, offset, n);
+            offset += n;
+            size   -= n;
+            n_cur  += n;
+            size_written += n;
+            if (n_cur == LLAMA_STATE_WRITE_CHUNK_SIZE) {
+                submit();
+            }
+        }
+    }
+
+    void align() override {
+        static const uint8_t zeros[LLAMA_STATE_FILE_ALIGNMENT] = {};
+
+        const size_t pos = offset_base + size_written;
+        write(zeros, GGML_PAD(pos, LLAMA_STATE_FILE_ALIGNMENT) - pos);
+    }
+
+    // write the remaining data and wait for the worker thread to finish
+    void flush() {
+        if (n_cur > 0) {
+            submit();
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        cv.notify_all();
+        worker.join();
+        if (error) {
+            std::rethrow_exception(error);
+        }
     }
 
     size_t get_size_written() override {
@@ -1473,10 +1704,11 @@ struct llama_data_write_file : llama_data_write {
 
 struct llama_data_read_file : llama_data_read {
     llama_file * file;
+    size_t alignment;
     size_t size_read = 0;
     std::vector<uint8_t> temp_buffer;
 
-    llama_data_read_file(llama_file * f) : file(f) {}
+    llama_data_read_file(llama_file * f, size_t alignment) : file(f), alignment(alignment) {}
 
     void read_to(void * dst, size_t size) override {
         file->read_raw(dst, size);
@@ -1489,11 +1721,36 @@ struct llama_data_read_file : llama_data_read {
         return temp_buffer.data();
     }
 
+    void align() override {
+        const size_t pos = file->tell();
+        const size_t pad = GGML_PAD(pos, alignment) - pos;
+        if (pad > 0) {
+            file->seek(pad, SEEK_CUR);
+            size_read += pad;
+        }
+    }
+
     size_t get_size_read() override {
         return size_read;
     }
 };
 
+// reads the state directly from a memory mapping of the file, the KV cache data is uploaded to the backends without intermediate copies
+struct llama_data_read_mmap : llama_data_read_buffer {
+    std::unique_ptr<llama_mmap> mapping;
+    size_t offset_base; // position of the state data in the file
+    size_t alignment;
+
+    llama_data_read_mmap(std::unique_ptr<llama_mmap> && m, size_t offset, size_t alignment) :
+        llama_data_read_buffer((const uint8_t *) m->addr() + offset, m->size() - offset),
+        mapping(std::move(m)), offset_base(offset), alignment(alignment) {}
+
+    void align() override {
+        const size_t pos = offset_base + size_read;
+        read(GGML_PAD(pos, alignment) - pos);
+    }
+};
+
 /** copy state data into either a buffer or file depending on the passed in context
  *
  * file context:
@@ -1570,18 +1827,32 @@ size_t llama_state_set_data(struct llama_context * ctx, const uint8_t * src, siz
     }
 }
 
+// memory map the state file when possible, otherwise read it through the file
+static std::unique_ptr<llama_data_read> llama_data_read_from_file(llama_file * file, size_t alignment) {
+    const size_t offset = file->tell();
+
+    if (llama_mmap::SUPPORTED) {
+        try {
+            auto mapping = std::make_unique<llama_mmap>(file, /* prefetch */ 0);
+            return std::make_unique<llama_data_read_mmap>(std::move(mapping), offset, alignment);
+        } catch (const std::exception & err) {
+            LLAMA_LOG_WARN("%s: failed to mmap the state file, falling back to reads: %s\n", __func__, err.what());
+        }
+    }
+
+    return std::make_unique<llama_data_read_file>(file, alignment);
+}
+
 static bool llama_state_load_file_internal(struct llama_context * ctx, const char * path_session, llama_token * tokens_out, size_t n_token_capacity, size_t * n_token_count_out) {
     llama_file file(path_session, "rb");
 
     // sanity checks
-    {
-        const uint32_t magic   = file.read_u32();
-        const uint32_t version = file.read_u32();
+    const uint32_t magic   = file.read_u32();
+    const uint32_t version = file.read_u32();
 
-        if (magic != LLAMA_SESSION_MAGIC || version != LLAMA_SESSION_VERSION) {
-            LLAMA_LOG_ERROR("%s: unknown (magic, version) for session file: %08x, %08x\n", __func__, magic, version);
-            return false;
-        }
+    if (magic != LLAMA_SESSION_MAGIC || (version != LLAMA_SESSION_VERSION && version != LLAMA_SESSION_VERSION_UNALIGNED)) {
+        LLAMA_LOG_ERROR("%s: unknown (magic, version) for session file: %08x, %08x\n", __func__, magic, version);
+        return false;
     }
 
     // load the prompt
@@ -1600,9 +1871,10 @@ static bool llama_state_load_file_internal(struct llama_context * ctx, const cha
     // restore the context state
     {
         const size_t n_state_size_cur = file.size() - file.tell();
+        const size_t alignment = version == LLAMA_SESSION_VERSION ? LLAMA_STATE_FILE_ALIGNMENT : 1;
 
-        llama_data_read_file data_ctx(&file);
-        const size_t n_read = llama_state_set_data_internal(ctx, data_ctx);
+        auto data_ctx = llama_data_read_from_file(&file, alignment);
+        const size_t n_read = llama_state_set_data_internal(ctx, *data_ctx);
 
         if (n_read != n_state_size_cur) {
             LLAMA_LOG_ERROR("%s: did not read all of the session file data! size %zu, got %zu\n", __func__, n_state_size_cur, n_read);
@@ -1634,6 +1906,7 @@ static bool llama_state_save_file_internal(struct llama_context * ctx, const cha
     // save the context state using stream saving
     llama_data_write_file data_ctx(&file);
     llama_state_get_data_internal(ctx, data_ctx);
+    data_ctx.flush();
 
     return true;
 }
@@ -1701,6 +1974,7 @@ static size_t llama_state_seq_save_file_internal(struct llama_context * ctx, con
     // save the context state using stream saving
     llama_data_write_file data_ctx(&file);
     llama_state_seq_get_data_internal(ctx, data_ctx, seq_id);
+    data_ctx.flush();
 
     const size_t res = file.tell();
     GGML_ASSERT(res == sizeof(uint32_t) * 3 + sizeof(llama_token) * n_token_count + data_ctx.get_size_written());
@@ -1711,14 +1985,12 @@ static size_t llama_state_seq_load_file_internal(struct llama_context * ctx, con
     llama_file file(filepath, "rb");
 
     // version checks
-    {
-        const uint32_t magic   = file.read_u32();
-        const uint32_t version = file.read_u32();
+    const uint32_t magic   = file.read_u32();
+    const uint32_t version = file.read_u32();
 
-        if (magic != LLAMA_STATE_SEQ_MAGIC || version != LLAMA_STATE_SEQ_VERSION) {
-            LLAMA_LOG_ERROR("%s: unknown (magic, version) for sequence state file: %08x, %08x\n", __func__, magic, version);
-            return 0;
-        }
+    if (magic != LLAMA_STATE_SEQ_MAGIC || (version != LLAMA_STATE_SEQ_VERSION && version != LLAMA_STATE_SEQ_VERSION_UNALIGNED)) {
+        LLAMA_LOG_ERROR("%s: unknown (magic, version) for sequence state file: %08x, %08x\n", __func__, magic, version);
+        return 0;
     }
 
     // load the prompt
@@ -1735,19 +2007,20 @@ static size_t llama_state_seq_load_file_internal(struct llama_context * ctx, con
     }
 
     // restore the context state
-    {
-        const size_t state_size = file.size() - file.tell();
-        llama_data_read_file data_ctx(&file);
-        const size_t nread = llama_state_seq_set_data_internal(ctx, data_ctx, dest_seq_id);
-        if (!nread) {
-            LLAMA_LOG_ERROR("%s: failed to restore sequence state\n", __func__);
-            return 0;
-        }
-        GGML_ASSERT(nread <= state_size);
-        GGML_ASSERT(nread + sizeof(uint32_t) * 3 + sizeof(llama_token) * *n_token_count_out == file.tell());
+    const size_t state_offset = file.tell();
+    const size_t state_size   = file.size() - state_offset;
+    const size_t alignment    = version == LLAMA_STATE_SEQ_VERSION ? LLAMA_STATE_FILE_ALIGNMENT : 1;
+
+    auto data_ctx = llama_data_read_from_file(&file, alignment);
+    const size_t nread = llama_state_seq_set_data_internal(ctx, *data_ctx, dest_seq_id);
+    if (!nread) {
+        LLAMA_LOG_ERROR("%s: failed to restore sequence state\n", __func__);
+        return 0;
     }
+    GGML_ASSERT(nread <= state_size);
+    GGML_ASSERT(state_offset == sizeof(uint32_t) * 3 + sizeof(llama_token) * *n_token_count_out);
 
-    return file.tell();
+    return state_offset + nread;
 }
 
 size_t llama_state_seq_save_file(struct llama_context * ctx, const char * filepath, llama_seq_id seq_id, const llama_token * tokens, size_t n_token_count) {
@@ -6,6 +6,9 @@
 #include "llama-model.h"
 #include "llama-kv-cache.h"
 #include "llama-adapter.h"
+#include "llama-imatrix.h"
+#include "llama-graph-sampling.h"
+#include "llama-graph-cache.h"
 
 #include "ggml-cpp.h"
 
@@ -26,6 +29,9 @@ struct llama_context {
     struct llama_sbatch       sbatch;  // TODO: revisit if needed
     struct llama_kv_cache     kv_self;
     struct llama_adapter_cvec cvec;
+    struct llama_imatrix      imatrix;
+    struct llama_graph_sampling sampling;
+    struct llama_graph_cache    graph_cache;
 
     std::unordered_map<struct llama_adapter_lora *, float> lora;
 
@@ -37,6 +43,10 @@ struct llama_context {
     ggml_threadpool_t threadpool       = nullptr;
     ggml_threadpool_t threadpool_batch = nullptr;
 
+    // threadpool and number of threads last set on the backends, which the worker threads of the scheduler may still use
+    ggml_threadpool_t threadpool_cur = nullptr;
+    int               n_threads_cur  = 0;
+
     bool has_evaluated_once = false;
 
     mutable int64_t t_start_us;
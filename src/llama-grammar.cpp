@@ -6,6 +6,7 @@
 
 #include <cmath>
 #include <algorithm>
+#include <cstdint>
 #include <stdexcept>
 
 //
@@ -903,6 +904,193 @@ llama_grammar_candidates llama_grammar_reject_candidates_for_stack(
     return rejects;
 }
 
+enum llama_grammar_token_status : uint8_t {
+    LLAMA_GRAMMAR_TOKEN_ACCEPTED  = 1,
+    LLAMA_GRAMMAR_TOKEN_UNCERTAIN = 2,
+};
+
+// same walk as llama_grammar_reject_candidates_for_stack, but the stacks are only the part above an unknown
+// context: a candidate that is consumed on some path is accepted, a candidate that reaches the bottom of a
+// stack with input left is uncertain, the others are rejected
+static void llama_grammar_match_candidates_local(
+        const llama_grammar_rules      & rules,
+        const llama_grammar_stacks     & stacks,
+        const llama_grammar_candidates & candidates,
+              std::vector<uint8_t>     & status) {
+    llama_grammar_candidates next_candidates;
+    llama_grammar_stacks     next_stacks;
+
+    for (const auto & stack : stacks) {
+        if (stack.empty()) {
+            // end of the rule - the rest of the token is matched by the context
+            for (const auto & tok : candidates) {
+                const bool done = *tok.code_points == 0 && tok.partial_utf8.n_remain == 0;
+                status[tok.index] |= done ? LLAMA_GRAMMAR_TOKEN_ACCEPTED : LLAMA_GRAMMAR_TOKEN_UNCERTAIN;
+            }
+            continue;
+        }
+
+        const llama_grammar_element * stack_pos = stack.back();
+
+        next_candidates.clear();
+
+        for (const auto & tok : candidates) {
+            if (status[tok.index] & LLAMA_GRAMMAR_TOKEN_ACCEPTED) {
+                continue;
+            }
+
+            if (*tok.code_points == 0) {
+                if (tok.partial_utf8.n_remain == 0 || llama_grammar_match_partial_char(stack_pos, tok.partial_utf8)) {
+                    status[tok.index] |= LLAMA_GRAMMAR_TOKEN_ACCEPTED;
+                }
+            } else if (llama_grammar_match_char(stack_pos, *tok.code_points).first) {
+                next_candidates.push_back({ tok.index, tok.code_points + 1, tok.partial_utf8 });
+            }
+        }
+
+        if (next_candidates.empty()) {
+            continue;
+        }
+
+        const auto * stack_pos_after = llama_grammar_match_char(stack_pos, 0).second;
+
+        llama_grammar_stack stack_after(stack.begin(), stack.end() - 1);
+        if (!llama_grammar_is_end_of_sequence(stack_pos_after)) {
+            stack_after.push_back(stack_pos_after);
+        }
+
+        next_stacks.clear();
+        llama_grammar_advance_stack(rules, stack_after, next_stacks);
+
+        llama_grammar_match_candidates_local(rules, next_stacks, next_candidates, status);
+    }
+}
+
+llama_grammar_token_cache::llama_grammar_token_cache(const llama_vocab & vocab, const llama_grammar_rules & rules) {
+    n_vocab = vocab.n_tokens();
+
+    offsets.reserve(n_vocab);
+    partials.reserve(n_vocab);
+    ids.reserve(n_vocab);
+
+    for (uint32_t id = 0; id < n_vocab; ++id) {
+        if (vocab.is_eog(id)) {
+            eog_ids.push_back(id);
+            continue;
+        }
+
+        const std::string & piece = vocab.token_to_piece(id);
+        if (piece.empty() || piece[0] == 0) {
+            continue;
+        }
+
+        const auto decoded = decode_utf8(piece, { 0, 0 });
+
+        offsets.push_back(code_points.size());
+        partials.push_back(decoded.second);
+        ids.push_back(id);
+
+        code_points.insert(code_points.end(), decoded.first.begin(), decoded.first.end());
+    }
+
+    size_t n_pos = 0;
+    for (const auto & rule : rules) {
+        rule_offsets.push_back(n_pos);
+        n_pos += rule.size();
+    }
+}
+
+const llama_grammar_token_mask & llama_grammar_token_cache::get(const llama_grammar_rules & rules, const llama_grammar_stack & stack) {
+    GGML_ASSERT(rules.size() == rule_offsets.size());
+    GGML_ASSERT(!stack.empty());
+
+    const size_t n = std::min(stack.size(), n_depth);
+
+    llama_grammar_stack  stack_top(stack.end() - n, stack.end());
+    std::vector<uint32_t> key;
+    key.reserve(n);
+
+    for (const llama_grammar_element * pos : stack_top) {
+        size_t ip = SIZE_MAX;
+        for (size_t ir = 0; ir < rules.size(); ++ir) {
+            const uintptr_t begin = (uintptr_t) rules[ir].data();
+            const uintptr_t cur   = (uintptr_t) pos;
+            if (cur >= begin && cur < begin + rules[ir].size()*sizeof(llama_grammar_element)) {
+                ip = rule_offsets[ir] + (cur - begin)/sizeof(llama_grammar_element);
+                break;
+            }
+        }
+        GGML_ASSERT(ip != SIZE_MAX);
+        key.push_back(ip);
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    auto & mask = masks[key];
+    if (mask) {
+        return *mask;
+    }
+
+    llama_grammar_candidates candidates;
+    candidates.reserve(ids.size());
+    for (size_t i = 0; i < ids.size(); ++i) {
+        candidates.push_back({ i, code_points.data() + offsets[i], partials[i] });
+    }
+
+    std::vector<uint8_t> status(ids.size(), 0);
+    llama_grammar_match_candidates_local(rules, { stack_top }, candidates, status);
+
+    mask = std::make_unique<llama_grammar_token_mask>();
+    mask->accepted .resize((n_vocab + 63)/64, 0);
+    mask->uncertain.resize((n_vocab + 63)/64, 0);
+
+    for (size_t i = 0; i < ids.size(); ++i) {
+        const uint32_t id = ids[i];
+        if (status[i] & LLAMA_GRAMMAR_TOKEN_ACCEPTED) {
+            mask->accepted [id / 64] |= uint64_t(1) << (id % 64);
+        } else if (status[i] & LLAMA_GRAMMAR_TOKEN_UNCERTAIN) {
+            mask->uncertain[id / 64] |= uint64_t(1) << (id % 64);
+        }
+    }
+
+    return *mask;
+}
+
+size_t llama_grammar_token_cache::n_masks() const {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    return masks.size();
+}
+
+// the masks only depend on the rules and the vocab, so grammars parsed from the same string share them
+static std::shared_ptr<llama_grammar_token_cache> llama_grammar_token_cache_get(
+        const llama_vocab         & vocab,
+        const llama_grammar_rules & rules,
+        const std::string         & grammar_str) {
+    static std::mutex mutex;
+    static std::map<std::pair<const llama_vocab *, std::string>, std::weak_ptr<llama_grammar_token_cache>> caches;
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    for (auto it = caches.begin(); it != caches.end();) {
+        if (it->second.expired()) {
+            it = caches.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    auto & entry = caches[{ &vocab, grammar_str }];
+
+    auto cache = entry.lock();
+    if (!cache) {
+        cache = std::make_shared<llama_grammar_token_cache>(vocab, rules);
+        entry = cache;
+    }
+
+    return cache;
+}
+
 ////////////////////
 
 struct llama_grammar * llama_grammar_init_impl(
@@ -957,10 +1145,15 @@ struct llama_grammar * llama_grammar_init_impl(
         }
     } while (true);
 
+    std::shared_ptr<llama_grammar_token_cache> token_cache;
+    if (vocab) {
+        token_cache = std::make_shared<llama_grammar_token_cache>(*vocab, vec_rules);
+    }
+
     // Important: vec_rules has to be moved here, not copied, because stacks contains
     // pointers to elements of vec_rules. If vec_rules were copied into llama_grammar
     // then the pointers would be invalidated when the local vec_rules goes out of scope.
-    return new llama_grammar { vocab, std::move(vec_rules), std::move(stacks), {}, };
+    return new llama_grammar { vocab, std::move(vec_rules), std::move(stacks), {}, std::move(token_cache), };
 }
 
 struct llama_grammar * llama_grammar_init_impl(const struct llama_vocab * vocab, const char * grammar_str, const char * grammar_root) {
@@ -1035,10 +1228,15 @@ struct llama_grammar * llama_grammar_init_impl(const struct llama_vocab * vocab,
         }
     } while (true);
 
+    std::shared_ptr<llama_grammar_token_cache> token_cache;
+    if (vocab) {
+        token_cache = llama_grammar_token_cache_get(*vocab, vec_rules, grammar_str);
+    }
+
     // Important: vec_rules has to be moved here, not copied, because stacks contains
     // pointers to elements of vec_rules. If vec_rules were copied into llama_grammar
     // then the pointers would be invalidated when the local vec_rules goes out of scope.
-    return new llama_grammar { vocab, std::move(vec_rules), std::move(stacks), {}, };
+    return new llama_grammar { vocab, std::move(vec_rules), std::move(stacks), {}, std::move(token_cache), };
 }
 
 void llama_grammar_free_impl(struct llama_grammar * grammar) {
@@ -1055,6 +1253,7 @@ struct llama_grammar * llama_grammar_clone_impl(const struct llama_grammar & gra
         grammar.rules,
         grammar.stacks,
         grammar.partial_utf8,
+        grammar.token_cache,
     };
 
     // redirect elements in stacks to point to new rules
@@ -1084,6 +1283,19 @@ void llama_grammar_apply_impl(const struct llama_grammar & grammar, llama_token_
         }
     }
 
+    // at a token boundary, most candidates are decided by the masks of the positions at the top of the stacks
+    // only the uncertain ones are matched against the full stacks
+    std::vector<const llama_grammar_token_mask *> masks;
+
+    const bool use_masks = grammar.token_cache && grammar.partial_utf8.n_remain == 0;
+    if (use_masks) {
+        for (const auto & stack : grammar.stacks) {
+            if (!stack.empty()) {
+                masks.push_back(&grammar.token_cache->get(grammar.rules, stack));
+            }
+        }
+    }
+
     std::vector<std::pair<std::vector<uint32_t>, llama_partial_utf8>> candidates_decoded;
     candidates_decoded.reserve(cur_p->size);
 
@@ -1101,6 +1313,25 @@ void llama_grammar_apply_impl(const struct llama_grammar & grammar, llama_token_
         } else if (piece.empty() || piece[0] == 0) {
             cur_p->data[i].logit = -INFINITY;
         } else {
+            if (use_masks) {
+                bool accepted  = false;
+                bool uncertain = false;
+                for (const auto * mask : masks) {
+                    if (mask->is_accepted(id)) {
+                        accepted = true;
+                        break;
+                    }
+                    uncertain = uncertain || mask->is_uncertain(id);
+                }
+                if (accepted) {
+                    continue;
+                }
+                if (!uncertain) {
+                    cur_p->data[i].logit = -INFINITY;
+                    continue;
+                }
+            }
+
             candidates_decoded.push_back(decode_utf8(piece, grammar.partial_utf8));
             candidates_grammar.push_back({ i, candidates_decoded.back().first.data(), candidates_decoded.back().second });
         }
@@ -1112,6 +1343,93 @@ void llama_grammar_apply_impl(const struct llama_grammar & grammar, llama_token_
     }
 }
 
+void llama_grammar_get_bitmask_impl(const struct llama_grammar & grammar, uint64_t * bitmask) {
+    GGML_ASSERT(grammar.vocab != nullptr);
+
+    const uint32_t n_vocab = grammar.vocab->n_tokens();
+    const uint32_t n_words = (n_vocab + 63)/64;
+
+    bool allow_eog = false;
+    for (const auto & stack : grammar.stacks) {
+        if (stack.empty()) {
+            allow_eog = true;
+            break;
+        }
+    }
+
+    // tokens left to match against the full stacks, one bit per token
+    std::vector<uint64_t> pending(n_words, ~uint64_t(0));
+    if (n_vocab % 64) {
+        pending[n_words - 1] = (uint64_t(1) << (n_vocab % 64)) - 1;
+    }
+
+    std::fill(bitmask, bitmask + n_words, 0);
+
+    if (grammar.token_cache && grammar.partial_utf8.n_remain == 0) {
+        std::vector<const llama_grammar_token_mask *> masks;
+        for (const auto & stack : grammar.stacks) {
+            if (!stack.empty()) {
+                masks.push_back(&grammar.token_cache->get(grammar.rules, stack));
+            }
+        }
+
+        for (uint32_t iw = 0; iw < n_words; ++iw) {
+            uint64_t accepted  = 0;
+            uint64_t uncertain = 0;
+            for (const auto * mask : masks) {
+                accepted  |= mask->accepted [iw];
+                uncertain |= mask->uncertain[iw];
+            }
+            bitmask[iw]  = accepted;
+            pending[iw] &= uncertain & ~accepted;
+        }
+
+        for (const llama_token id : grammar.token_cache->eog_tokens()) {
+            pending[id / 64] |= uint64_t(1) << (id % 64);
+        }
+    }
+
+    std::vector<llama_token> pending_ids;
+    for (uint32_t iw = 0; iw < n_words; ++iw) {
+        if (pending[iw] == 0) {
+            continue;
+        }
+        for (uint32_t ib = 0; ib < 64; ++ib) {
+            if ((pending[iw] >> ib) & 1) {
+                pending_ids.push_back(64*iw + ib);
+            }
+        }
+    }
+
+    std::vector<std::pair<std::vector<uint32_t>, llama_partial_utf8>> candidates_decoded;
+    candidates_decoded.reserve(pending_ids.size());
+
+    llama_grammar_candidates candidates_grammar;
+    candidates_grammar.reserve(pending_ids.size());
+
+    for (const llama_token id : pending_ids) {
+        const std::string & piece = grammar.vocab->token_to_piece(id);
+
+        if (grammar.vocab->is_eog(id)) {
+            if (allow_eog) {
+                bitmask[id / 64] |= uint64_t(1) << (id % 64);
+            }
+        } else if (!piece.empty() && piece[0] != 0) {
+            bitmask[id / 64] |= uint64_t(1) << (id % 64);
+
+            candidates_decoded.push_back(decode_utf8(piece, grammar.partial_utf8));
+            candidates_grammar.push_back({ (size_t) id, candidates_decoded.back().first.data(), candidates_decoded.back().second });
+        }
+    }
+
+    if (!candidates_grammar.empty()) {
+        const auto rejects = llama_grammar_reject_candidates(grammar.rules, grammar.stacks, candidates_grammar);
+        for (const auto & reject : rejects) {
+            bitmask[reject.index / 64] &= ~(uint64_t(1) << (reject.index % 64));
+        }
+    }
+}
+
 void llama_grammar_accept_impl(struct llama_grammar & grammar, llama_token token) {
     GGML_ASSERT(grammar.vocab != nullptr);
 
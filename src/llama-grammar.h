@@ -3,6 +3,8 @@
 #include "llama.h"
 
 #include <map>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 
@@ -105,6 +107,52 @@ struct llama_grammar_parser {
     void print(FILE * file);
 };
 
+// tokens accepted or rejected at the top of a stack, whatever lies below its top elements
+// only the uncertain tokens - those that go past these elements - have to be matched against the full stack
+struct llama_grammar_token_mask {
+    std::vector<uint64_t> accepted;  // bitset over the vocab
+    std::vector<uint64_t> uncertain; // bitset over the vocab
+
+    bool is_accepted (llama_token id) const { return (accepted [id / 64] >> (id % 64)) & 1; }
+    bool is_uncertain(llama_token id) const { return (uncertain[id / 64] >> (id % 64)) & 1; }
+};
+
+// lazily computed token masks, keyed by the positions of the top elements of the stacks, valid at token boundaries
+// shared by the grammars parsed from the same string for the same vocab
+struct llama_grammar_token_cache {
+    // number of stack elements a mask depends on
+    // repetitions and small alternates are rules of their own, a single element leaves most tokens uncertain
+    static constexpr size_t n_depth = 6;
+
+    llama_grammar_token_cache(const llama_vocab & vocab, const llama_grammar_rules & rules);
+
+    // mask of the top elements of a non-empty stack of rules (or of a copy of them)
+    const llama_grammar_token_mask & get(const llama_grammar_rules & rules, const llama_grammar_stack & stack);
+
+    size_t n_masks() const;
+
+    // EOG tokens are not part of the masks, they are allowed iff a stack is empty
+    const std::vector<llama_token> & eog_tokens() const { return eog_ids; }
+
+private:
+    uint32_t n_vocab;
+
+    std::vector<llama_token> eog_ids;
+
+    // the tokens decoded from a token boundary, excluding the ones handled before the grammar (EOG, empty)
+    std::vector<uint32_t>           code_points; // 0-terminated
+    std::vector<size_t>             offsets;
+    std::vector<llama_partial_utf8> partials;
+    std::vector<llama_token>        ids;
+
+    // offset of each rule in the flat list of positions
+    std::vector<size_t> rule_offsets;
+
+    mutable std::mutex mutex;
+
+    std::map<std::vector<uint32_t>, std::unique_ptr<llama_grammar_token_mask>> masks;
+};
+
 struct llama_grammar {
     // note: allow null vocab for testing (not great)
     const llama_vocab * vocab;
@@ -114,6 +162,9 @@ struct llama_grammar {
 
     // buffer for partially generated UTF-8 sequence from accepted tokens
     llama_partial_utf8 partial_utf8;
+
+    // null without a vocab
+    std::shared_ptr<llama_grammar_token_cache> token_cache;
 };
 
 //
@@ -138,6 +189,11 @@ void llama_grammar_apply_impl(
         const struct llama_grammar & grammar,
             llama_token_data_array * cur_p);
 
+// sets bit (id % 64) of bitmask[id / 64] iff token id is allowed, bitmask has (n_vocab + 63)/64 words
+void llama_grammar_get_bitmask_impl(
+        const struct llama_grammar & grammar,
+                          uint64_t * bitmask);
+
 void llama_grammar_accept_impl(
               struct llama_grammar & grammar,
                        llama_token   token);
@@ -0,0 +1,85 @@
+#include "llama-graph-cache.h"
+
+#include "llama-impl.h"
+#include "llama-hparams.h"
+#include "llama-kv-cache.h"
+
+#include "ggml.h"
+
+bool llama_graph_cache_key::operator==(const llama_graph_cache_key & other) const {
+    return n_tokens     == other.n_tokens     &&
+           n_seq_tokens == other.n_seq_tokens &&
+           n_seqs       == other.n_seqs       &&
+           n_outputs    == other.n_outputs    &&
+           n_kv         == other.n_kv         &&
+           equal_seqs   == other.equal_seqs   &&
+           embd         == other.embd         &&
+           embeddings   == other.embeddings   &&
+           causal_attn  == other.causal_attn;
+}
+
+struct ggml_cgraph * llama_graph_cache::get(const llama_graph_cache_key & key) const {
+    if (!gf || !(this->key == key)) {
+        return nullptr;
+    }
+
+    return gf;
+}
+
+void llama_graph_cache::store(const llama_graph_cache_key & key, struct ggml_cgraph * gf, const llama_kv_cache & kv, const llama_hparams & hparams, bool flash_attn) {
+    invalidate();
+
+    if (!enabled) {
+        return;
+    }
+
+    // the only nodes that depend on the head are the copies of the new K and V into the cache (see llm_build_kv_store)
+    // both the copy and its destination are views of the cache tensor of the layer
+    for (int i = 0; i < ggml_graph_n_nodes(gf); ++i) {
+        ggml_tensor * node = ggml_graph_node(gf, i);
+        if (node->op != GGML_OP_CPY || node->view_src == nullptr) {
+            continue;
+        }
+
+        size_t stride = 0;
+        for (size_t il = 0; il < kv.k_l.size(); ++il) {
+            if (node->view_src == kv.k_l[il]) {
+                stride = ggml_row_size(kv.k_l[il]->type, hparams.n_embd_k_gqa(il));
+                break;
+            }
+            if (node->view_src == kv.v_l[il]) {
+                // the V cache is transposed when not using flash attention
+                stride = flash_attn ? ggml_row_size(kv.v_l[il]->type, hparams.n_embd_v_gqa(il)) : ggml_element_size(kv.v_l[il]);
+                break;
+            }
+        }
+
+        if (stride == 0) {
+            continue;
+        }
+
+        ggml_tensor * dst = node->src[1];
+        GGML_ASSERT(dst->view_src == node->view_src && dst->view_offs == node->view_offs);
+
+        views.push_back({ node, node->view_offs, stride });
+        views.push_back({ dst,  dst->view_offs,  stride });
+    }
+
+    this->key  = key;
+    this->gf   = gf;
+    this->head = kv.head;
+}
+
+void llama_graph_cache::rebind(uint32_t head) {
+    GGML_ASSERT(gf != nullptr);
+
+    for (const auto & v : views) {
+        v.t->view_offs = v.offs + ((int64_t) head - (int64_t) this->head)*(int64_t) v.stride;
+        v.t->data      = (char *) v.t->view_src->data + v.t->view_offs;
+    }
+}
+
+void llama_graph_cache::invalidate() {
+    gf = nullptr;
+    views.clear();
+}
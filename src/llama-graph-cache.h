@@ -0,0 +1,75 @@
+#pragma once
+
+#include "llama.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+struct llama_hparams;
+struct llama_kv_cache;
+
+struct ggml_cgraph;
+struct ggml_tensor;
+
+//
+// llama_graph_cache
+//
+
+// the shape of a decoder ubatch - ubatches with the same shape produce the same graph, up to the position of the KV cache stores
+struct llama_graph_cache_key {
+    uint32_t n_tokens     = 0;
+    uint32_t n_seq_tokens = 0;
+    uint32_t n_seqs       = 0;
+    int32_t  n_outputs    = 0;
+    uint32_t n_kv         = 0;
+
+    bool equal_seqs  = false;
+    bool embd        = false; // input embeddings instead of tokens
+    bool embeddings  = false;
+    bool causal_attn = false;
+
+    bool operator==(const llama_graph_cache_key & other) const;
+};
+
+// keeps the last decoder graph together with its split plan and allocation in the scheduler
+// on a hit, only the destinations of the KV cache stores are moved to the new head and the inputs are set again
+struct llama_graph_cache {
+    // disabled for recurrent caches, encoder-decoder models, pipeline parallelism and the imatrix accumulation
+    bool enabled = false;
+
+    // the graph that was last stored under the same key, nullptr otherwise
+    struct ggml_cgraph * get(const llama_graph_cache_key & key) const;
+
+    // remember gf, built with the KV cache stores at head
+    // the scheduler must not be reset until the graph is invalidated
+    void store(const llama_graph_cache_key & key, struct ggml_cgraph * gf, const llama_kv_cache & kv, const llama_hparams & hparams, bool flash_attn);
+
+    // move the KV cache stores of the cached graph to head
+    void rebind(uint32_t head);
+
+    // must be called whenever the graph meta buffer is reused or the structure of the graph changes (adapters, sampling)
+    void invalidate();
+
+    bool valid() const { return gf != nullptr; }
+
+    uint32_t n_hit  = 0;
+    uint32_t n_miss = 0;
+
+private:
+    llama_graph_cache_key key;
+
+    struct ggml_cgraph * gf = nullptr;
+
+    // head of the KV cache when the graph was built
+    uint32_t head = 0;
+
+    // a view into the KV cache, its offset for the head of the build and its size in bytes per cell
+    struct kv_view {
+        struct ggml_tensor * t;
+        size_t offs;
+        size_t stride;
+    };
+
+    std::vector<kv_view> views;
+};
@@ -0,0 +1,148 @@
+#include "llama-graph-sampling.h"
+
+#include "llama-impl.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+void llama_graph_sampling::set_params(const llama_graph_sampling_params * p, int32_t n_vocab) {
+    active = p != nullptr;
+    if (active && p->top_k <= 0) {
+        // the candidates of the full vocabulary would cost more than the plain logits
+        LLAMA_LOG_WARN("%s: top_k = %d, graph sampling requires top_k > 0 - disabled\n", __func__, p->top_k);
+        active = false;
+    }
+    if (!active) {
+        k = 0;
+        return;
+    }
+
+    params = *p;
+
+    k = std::min(params.top_k, n_vocab);
+
+    rng.seed(params.seed == LLAMA_DEFAULT_SEED ? std::random_device()() : params.seed);
+}
+
+void llama_graph_sampling::build(ggml_context * ctx, ggml_cgraph * gf) {
+    t_ids   = nullptr;
+    t_probs = nullptr;
+    t_idx   = nullptr;
+    t_noise = nullptr;
+
+    ggml_tensor * logits = ggml_graph_node(gf, -1);
+
+    // the logits are extracted as usual if the graph does not end with them
+    skip = strcmp(logits->name, "result_output") != 0;
+    if (skip) {
+        return;
+    }
+
+    const int64_t n_vocab   = logits->ne[0];
+    const int64_t n_outputs = logits->ne[1];
+
+    if (n_outputs == 0) {
+        return;
+    }
+
+    GGML_ASSERT(k > 0 && k <= n_vocab);
+
+    ggml_tensor * cur = logits;
+    if (!ggml_is_contiguous(cur)) {
+        cur = ggml_cont(ctx, cur);
+    }
+    if (params.temp > 0.0f && params.temp != 1.0f) {
+        cur = ggml_scale(ctx, cur, 1.0f/params.temp);
+    }
+
+    // [k, n_outputs], sorted by decreasing logit
+    t_ids = ggml_cont(ctx, ggml_top_k(ctx, cur, k));
+
+    // gather the logits of the candidates: [1, n_vocab, n_outputs] x [k, n_outputs] -> [1, k, n_outputs]
+    ggml_tensor * vals = ggml_get_rows(ctx, ggml_reshape_3d(ctx, cur, 1, n_vocab, n_outputs), t_ids);
+    vals = ggml_reshape_2d(ctx, vals, k, n_outputs);
+
+    t_probs = ggml_soft_max(ctx, vals);
+
+    ggml_set_name(t_ids,   "result_sampled_ids");
+    ggml_set_name(t_probs, "result_sampled_probs");
+    ggml_set_output(t_ids);
+    ggml_set_output(t_probs);
+
+    ggml_build_forward_expand(gf, t_ids);
+    ggml_build_forward_expand(gf, t_probs);
+
+    if (params.dist && params.temp > 0.0f) {
+        // Gumbel-max trick: argmax(logits + g) with g ~ Gumbel(0, 1) is distributed as softmax(logits)
+        t_noise = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, k, n_outputs);
+        ggml_set_name(t_noise, "sampling_noise");
+        ggml_set_input(t_noise);
+
+        t_idx = ggml_argmax(ctx, ggml_add(ctx, vals, t_noise));
+        ggml_set_name(t_idx, "result_sampled_idx");
+        ggml_set_output(t_idx);
+
+        ggml_build_forward_expand(gf, t_idx);
+    }
+}
+
+void llama_graph_sampling::set_input() {
+    if (!t_noise) {
+        return;
+    }
+
+    std::uniform_real_distribution<float> dist(0.0f, 1.0f);
+
+    noise.resize(ggml_nelements(t_noise));
+    for (auto & g : noise) {
+        const float u = std::max(dist(rng), 1e-20f);
+        g = -logf(-logf(u));
+    }
+
+    ggml_backend_tensor_set(t_noise, noise.data(), 0, ggml_nbytes(t_noise));
+}
+
+void llama_graph_sampling::reserve(size_t n_outputs) {
+    if (out_idx.size() < n_outputs || out_ids.size() < n_outputs*k) {
+        out_ids  .resize(n_outputs*k);
+        out_probs.resize(n_outputs*k);
+        out_idx  .resize(n_outputs);
+    }
+}
+
+void llama_graph_sampling::extract(ggml_backend_sched_t sched, int32_t i0, int32_t n_outputs) {
+    if (!t_ids || n_outputs == 0) {
+        return;
+    }
+
+    GGML_ASSERT((size_t) (i0 + n_outputs) <= out_idx.size());
+    GGML_ASSERT(t_ids->ne[1] == n_outputs);
+
+    ggml_backend_t backend_ids   = ggml_backend_sched_get_tensor_backend(sched, t_ids);
+    ggml_backend_t backend_probs = ggml_backend_sched_get_tensor_backend(sched, t_probs);
+    GGML_ASSERT(backend_ids != nullptr && backend_probs != nullptr);
+
+    ggml_backend_tensor_get_async(backend_ids,   t_ids,   out_ids.data()   + (size_t) i0*k, 0, ggml_nbytes(t_ids));
+    ggml_backend_tensor_get_async(backend_probs, t_probs, out_probs.data() + (size_t) i0*k, 0, ggml_nbytes(t_probs));
+
+    if (t_idx) {
+        ggml_backend_t backend_idx = ggml_backend_sched_get_tensor_backend(sched, t_idx);
+        GGML_ASSERT(backend_idx != nullptr);
+        ggml_backend_tensor_get_async(backend_idx, t_idx, out_idx.data() + i0, 0, ggml_nbytes(t_idx));
+    } else {
+        std::fill(out_idx.begin() + i0, out_idx.begin() + i0 + n_outputs, 0);
+    }
+}
+
+void llama_graph_sampling::swap_outputs(int32_t i, int32_t j) {
+    std::swap_ranges(out_ids.begin()   + (size_t) i*k, out_ids.begin()   + (size_t) (i + 1)*k, out_ids.begin()   + (size_t) j*k);
+    std::swap_ranges(out_probs.begin() + (size_t) i*k, out_probs.begin() + (size_t) (i + 1)*k, out_probs.begin() + (size_t) j*k);
+    std::swap(out_idx[i], out_idx[j]);
+}
+
+llama_token llama_graph_sampling::token(int32_t j) const {
+    const int32_t idx = out_idx[j];
+    GGML_ASSERT(idx >= 0 && idx < k);
+    return out_ids[(size_t) j*k + idx];
+}
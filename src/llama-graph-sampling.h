@@ -0,0 +1,71 @@
+#pragma once
+
+#include "llama.h"
+
+#include "ggml-backend.h"
+
+#include <random>
+#include <vector>
+
+//
+// llama_graph_sampling
+//
+
+// sampling stages appended to the decoder graph: temperature, top-k, softmax and an optional categorical draw
+// only the candidates (and the drawn token) of each output leave the backend
+struct llama_graph_sampling {
+    // number of graph nodes added by build() in the worst case
+    static constexpr size_t max_nodes() { return 16; }
+
+    void set_params(const llama_graph_sampling_params * params, int32_t n_vocab);
+
+    bool enabled() const { return active; }
+
+    // false if the last built graph does not end with the logits - no candidates are computed for it
+    bool supported() const { return !skip; }
+
+    // appends the sampling stages to the logits, which must be the last node of gf [n_vocab, n_outputs]
+    // otherwise the graph is left unchanged and supported() returns false
+    // the candidates are marked as outputs of the graph
+    void build(struct ggml_context * ctx, struct ggml_cgraph * gf);
+
+    // fill the noise used for the draw - call after the graph has been allocated
+    void set_input();
+
+    // reserve host memory for the candidates of n_outputs outputs
+    void reserve(size_t n_outputs);
+
+    // copy the candidates of the last built graph to the host, starting at output i0
+    void extract(ggml_backend_sched_t sched, int32_t i0, int32_t n_outputs);
+
+    void swap_outputs(int32_t i, int32_t j);
+
+    int32_t n_candidates() const { return k; }
+
+    const llama_token * ids  (int32_t j) const { return out_ids.data()   + (size_t) j*k; }
+    const float       * probs(int32_t j) const { return out_probs.data() + (size_t) j*k; }
+
+    llama_token token(int32_t j) const;
+
+private:
+    bool active = false;
+    bool skip   = false;
+
+    llama_graph_sampling_params params = {};
+
+    std::mt19937 rng;
+
+    // number of candidates per output
+    int32_t k = 0;
+
+    struct ggml_tensor * t_ids   = nullptr; // I32 [k, n_outputs]
+    struct ggml_tensor * t_probs = nullptr; // F32 [k, n_outputs]
+    struct ggml_tensor * t_idx   = nullptr; // I32 [n_outputs], index of the drawn candidate
+    struct ggml_tensor * t_noise = nullptr; // F32 [k, n_outputs], Gumbel noise for the draw
+
+    std::vector<float> noise;
+
+    std::vector<llama_token> out_ids;
+    std::vector<float>       out_probs;
+    std::vector<int32_t>     out_idx;
+};
@@ -0,0 +1,286 @@
+#include "llama-imatrix.h"
+
+#include "llama-impl.h"
+#include "llama-model.h"
+
+#include <cstring>
+#include <map>
+
+// upper bound of the number of nodes (and leafs) added to the graph per weight
+static const size_t LLAMA_IMATRIX_NODES_PER_ENTRY = 24;
+
+size_t llama_imatrix::max_nodes() const {
+    return entries.size()*LLAMA_IMATRIX_NODES_PER_ENTRY;
+}
+
+bool llama_imatrix::init(const llama_model & model, bool process_output) {
+    const auto & hparams = model.hparams;
+
+    GGML_ASSERT(entries.empty());
+    GGML_ASSERT(ctxs.empty());
+    GGML_ASSERT(bufs.empty());
+
+    // create a context for each buffer type
+    std::map<ggml_backend_buffer_type_t, ggml_context *> ctx_map;
+    std::map<ggml_context *, ggml_tensor *> eye_map;
+    auto ctx_for_buft = [&](ggml_backend_buffer_type_t buft) -> ggml_context * {
+        auto it = ctx_map.find(buft);
+        if (it == ctx_map.end()) {
+            struct ggml_init_params params = {
+                /*.mem_size   =*/ (2*model.tensors_by_name.size() + 1)*ggml_tensor_overhead(),
+                /*.mem_buffer =*/ NULL,
+                /*.no_alloc   =*/ true,
+            };
+
+            ggml_context * ctx = ggml_init(params);
+            if (!ctx) {
+                return nullptr;
+            }
+
+            ctx_map[buft] = ctx;
+            ctxs.emplace_back(ctx);
+
+            return ctx;
+        }
+
+        return it->second;
+    };
+
+    for (const auto & it : model.tensors_by_name) {
+        const std::string & name = it.first;
+        const ggml_tensor  * w   = it.second;
+
+        // only the repeating layers and the output are of interest for quantization
+        if (name.rfind("blk.", 0) != 0 && (name != "output.weight" || !process_output)) {
+            continue;
+        }
+        if (ggml_n_dims(w) < 2) {
+            continue;
+        }
+
+        // place the accumulators next to the layer they belong to
+        int il = hparams.n_layer - 1;
+        if (sscanf(name.c_str(), "blk.%d.", &il) != 1 || il < 0 || il >= (int) hparams.n_layer) {
+            il = hparams.n_layer - 1;
+        }
+
+        ggml_context * ctx = ctx_for_buft(model.select_buft(il));
+        if (!ctx) {
+            LLAMA_LOG_ERROR("%s: failed to allocate context for imatrix\n", __func__);
+            return false;
+        }
+
+        entry e;
+        e.name   = name;
+        e.values = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, w->ne[0], w->ne[2]);
+        ggml_format_name(e.values, "imatrix.%s", name.c_str());
+
+        if (w->ne[2] > 1) {
+            e.counts = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, 1, w->ne[2]);
+            ggml_format_name(e.counts, "imatrix_counts.%s", name.c_str());
+
+            ggml_tensor * & eye = eye_map[ctx];
+            if (eye == nullptr) {
+                const int64_t n_expert = std::max<int64_t>(hparams.n_expert, w->ne[2]);
+                eye = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_expert, n_expert);
+                ggml_set_name(eye, "imatrix_eye");
+                eyes.push_back(eye);
+            }
+            GGML_ASSERT(eye->ne[0] >= w->ne[2]);
+            e.eye = eye;
+        }
+
+        entry_idx[w] = entries.size();
+        entries.push_back(std::move(e));
+    }
+
+    // allocate tensors / buffers and zero
+    bufs.reserve(ctx_map.size());
+    for (auto it : ctx_map) {
+        ggml_backend_buffer_type_t buft = it.first;
+        ggml_context * ctx = it.second;
+        ggml_backend_buffer_t buf = ggml_backend_alloc_ctx_tensors_from_buft(ctx, buft);
+        if (!buf) {
+            LLAMA_LOG_ERROR("%s: failed to allocate buffer for imatrix\n", __func__);
+            return false;
+        }
+        ggml_backend_buffer_clear(buf, 0);
+        bufs.emplace_back(buf);
+    }
+
+    set_eyes();
+
+    LLAMA_LOG_INFO("%s: collecting activation statistics for %zu weights\n", __func__, entries.size());
+
+    return true;
+}
+
+void llama_imatrix::set_eyes() {
+    for (ggml_tensor * eye : eyes) {
+        const int64_t n = eye->ne[0];
+        std::vector<float> data(n*n, 0.0f);
+        for (int64_t i = 0; i < n; ++i) {
+            data[i*n + i] = 1.0f;
+        }
+        ggml_backend_tensor_set(eye, data.data(), 0, ggml_nbytes(eye));
+    }
+}
+
+ggml_cgraph * llama_imatrix::build(ggml_context * ctx, ggml_cgraph * gf, size_t graph_size) {
+    for (auto & e : entries) {
+        e.n_rows_pending = 0;
+    }
+
+    const int n_nodes = ggml_graph_n_nodes(gf);
+
+    ggml_cgraph * res = ggml_new_graph_custom(ctx, graph_size, false);
+
+    // keep the order of the original nodes, the output is added last
+    for (int i = 0; i < n_nodes - 1; ++i) {
+        ggml_build_forward_expand(res, ggml_graph_node(gf, i));
+    }
+
+    // latest value of each accumulator, in case a weight is used more than once in the graph
+    std::unordered_map<ggml_tensor *, ggml_tensor *> latest;
+    auto accumulate = [&](ggml_tensor * acc, ggml_tensor * cur) {
+        auto it = latest.find(acc);
+        ggml_tensor * prev = it == latest.end() ? acc : it->second;
+        cur = ggml_cpy(ctx, ggml_add(ctx, prev, cur), acc);
+        ggml_build_forward_expand(res, cur);
+        latest[acc] = cur;
+    };
+
+    for (int i = 0; i < n_nodes; ++i) {
+        ggml_tensor * t = ggml_graph_node(gf, i);
+        if (t->op != GGML_OP_MUL_MAT && t->op != GGML_OP_MUL_MAT_ID) {
+            continue;
+        }
+
+        const auto it = entry_idx.find(t->src[0]);
+        if (it == entry_idx.end()) {
+            continue;
+        }
+        entry & e = entries[it->second];
+
+        ggml_tensor * src1 = t->src[1];
+        if (src1->type != GGML_TYPE_F32 || src1->ne[0] != e.values->ne[0]) {
+            continue;
+        }
+
+        const int64_t n_per_row = src1->ne[0];
+
+        if (t->op == GGML_OP_MUL_MAT) {
+            // small batches are ignored
+            if (src1->ne[1] < 16 || e.values->ne[1] != 1) {
+                continue;
+            }
+
+            const int64_t n_rows = ggml_nrows(src1);
+            if (!ggml_is_contiguous(src1)) {
+                src1 = ggml_cont(ctx, src1);
+            }
+
+            // [n_per_row, n_rows] -> [n_rows, n_per_row] -> [1, n_per_row]
+            ggml_tensor * cur = ggml_sqr(ctx, ggml_reshape_2d(ctx, src1, n_per_row, n_rows));
+            cur = ggml_sum_rows(ctx, ggml_cont(ctx, ggml_transpose(ctx, cur)));
+            cur = ggml_reshape_2d(ctx, cur, n_per_row, 1);
+
+            accumulate(e.values, cur);
+
+            e.n_rows_pending += n_rows;
+        } else {
+            //   ids  -> [n_expert_used, n_tokens]
+            //   src1 -> [n_per_row, n_expert_used or 1, n_tokens]
+            ggml_tensor * ids = t->src[2];
+
+            const int64_t n_as     = e.values->ne[1];
+            const int64_t n_ids    = ids->ne[0];
+            const int64_t n_tokens = ids->ne[1];
+
+            if (src1->ne[2] != n_tokens || (src1->ne[1] != n_ids && src1->ne[1] != 1)) {
+                continue;
+            }
+            if (!ggml_is_contiguous(src1)) {
+                src1 = ggml_cont(ctx, src1);
+            }
+
+            // one-hot encoding of the selected experts: [n_as, n_ids*n_tokens]
+            ggml_tensor * eye = e.eye;
+            if (eye->ne[0] != n_as) {
+                eye = ggml_view_2d(ctx, eye, n_as, n_as, eye->nb[1], 0);
+            }
+            ggml_tensor * sel = ggml_get_rows(ctx, eye, ggml_reshape_1d(ctx, ggml_cont(ctx, ids), n_ids*n_tokens));
+
+            ggml_tensor * x = ggml_sqr(ctx, src1);
+            if (src1->ne[1] == 1) {
+                // the same input is used for all selected experts - sum the selections per token: [n_as, n_tokens]
+                sel = ggml_reshape_3d(ctx, sel, n_as, n_ids, n_tokens);
+                sel = ggml_sum_rows(ctx, ggml_cont(ctx, ggml_permute(ctx, sel, 1, 0, 2, 3)));
+                sel = ggml_reshape_2d(ctx, sel, n_as, n_tokens);
+                x   = ggml_reshape_2d(ctx, x, n_per_row, n_tokens);
+            } else {
+                x   = ggml_reshape_2d(ctx, x, n_per_row, n_ids*n_tokens);
+            }
+
+            // contract over the rows: [n_rows, n_per_row] x [n_rows, n_as] -> [n_per_row, n_as]
+            ggml_tensor * selT = ggml_cont(ctx, ggml_transpose(ctx, sel));
+            ggml_tensor * cur  = ggml_mul_mat(ctx, ggml_cont(ctx, ggml_transpose(ctx, x)), selT);
+
+            accumulate(e.values, cur);
+            accumulate(e.counts, ggml_sum_rows(ctx, selT));
+        }
+    }
+
+    ggml_build_forward_expand(res, ggml_graph_node(gf, n_nodes - 1));
+
+    return res;
+}
+
+void llama_imatrix::commit() {
+    for (auto & e : entries) {
+        e.n_rows += e.n_rows_pending;
+        e.n_rows_pending = 0;
+    }
+}
+
+void llama_imatrix::read(llama_imatrix_callback callback, void * user_data) {
+    std::vector<float>   values;
+    std::vector<float>   counts_f32;
+    std::vector<int64_t> counts;
+
+    for (auto & e : entries) {
+        const int64_t n_per_row = e.values->ne[0];
+        const int64_t n_mat     = e.values->ne[1];
+
+        counts.resize(n_mat);
+        if (e.counts) {
+            counts_f32.resize(n_mat);
+            ggml_backend_tensor_get(e.counts, counts_f32.data(), 0, ggml_nbytes(e.counts));
+            for (int64_t i = 0; i < n_mat; ++i) {
+                counts[i] = (int64_t) counts_f32[i];
+            }
+        } else {
+            std::fill(counts.begin(), counts.end(), e.n_rows);
+        }
+
+        bool has_data = false;
+        for (int64_t c : counts) {
+            has_data |= c > 0;
+        }
+        if (!has_data) {
+            continue;
+        }
+
+        values.resize(n_per_row*n_mat);
+        ggml_backend_tensor_get(e.values, values.data(), 0, ggml_nbytes(e.values));
+
+        callback(e.name.c_str(), values.data(), counts.data(), n_per_row, n_mat, user_data);
+
+        e.n_rows = 0;
+    }
+
+    for (auto & buf : bufs) {
+        ggml_backend_buffer_clear(buf.get(), 0);
+    }
+    set_eyes();
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include "llama.h"
+
+#include "ggml-cpp.h"
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct llama_model;
+
+//
+// llama_imatrix
+//
+
+// accumulates, as part of the compute graph, the activation statistics used to build an importance matrix:
+// the per-column sums of squared activations that enter the matrix multiplications with the model weights
+struct llama_imatrix {
+    // number of graph nodes added by build() in the worst case
+    size_t max_nodes() const;
+
+    // returns a copy of gf with the accumulation of the statistics of all weight matrix multiplications in gf
+    // the last node of gf stays the last node of the returned graph
+    struct ggml_cgraph * build(struct ggml_context * ctx, struct ggml_cgraph * gf, size_t graph_size);
+
+    // account for the rows of the last built graph - call after it has been computed successfully
+    void commit();
+
+    // pass the accumulated statistics to the callback and reset them
+    void read(llama_imatrix_callback callback, void * user_data);
+
+    // the output tensor is only accumulated with process_output
+    bool init(const llama_model & model, bool process_output);
+
+    bool enabled() const { return !entries.empty(); }
+
+private:
+    struct entry {
+        std::string name;
+
+        struct ggml_tensor * values = nullptr; // F32 [n_per_row, n_mat]
+        struct ggml_tensor * counts = nullptr; // F32 [1, n_mat], MoE weights only
+        struct ggml_tensor * eye    = nullptr; // F32 [n_mat, n_mat] identity used to one-hot encode the expert ids, MoE weights only
+
+        // number of accumulated activation rows, for weights that are not indexed by the expert ids
+        int64_t n_rows         = 0;
+        int64_t n_rows_pending = 0;
+    };
+
+    void set_eyes();
+
+    std::vector<ggml_context_ptr> ctxs;
+    std::vector<ggml_backend_buffer_ptr> bufs;
+
+    std::vector<struct ggml_tensor *> eyes;
+
+    std::vector<entry> entries;
+    std::unordered_map<const struct ggml_tensor *, size_t> entry_idx; // model weight -> entry
+};
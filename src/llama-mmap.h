@@ -43,6 +43,9 @@ struct llama_mmap {
 
     void unmap_fragment(size_t first, size_t last);
 
+    // size of the pages of the system
+    static size_t page_size();
+
     static const bool SUPPORTED;
 
 private:
@@ -7,12 +7,15 @@
 #include "ggml-cpp.h"
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cmath>
 #include <cstring>
 #include <functional>
 #include <map>
 #include <sstream>
 #include <stdexcept>
+#include <thread>
 
 const char * llm_type_name(llm_type type) {
     switch (type) {
@@ -334,7 +337,12 @@ static buft_list_t make_gpu_buft_list(ggml_backend_dev_t dev, enum llama_split_m
 
 struct llama_model::impl {
     impl() {}
-    ~impl() {}
+    ~impl() {
+        prefetch_stop = true;
+        for (auto & worker : prefetch_workers) {
+            worker.join();
+        }
+    }
 
     uint64_t n_elements = 0;
 
@@ -349,6 +357,12 @@ struct llama_model::impl {
     llama_mlocks mlock_bufs;
     llama_mlocks mlock_mmaps;
 
+    // background reading of the memory mapped weights
+    std::vector<std::thread> prefetch_workers;
+    std::atomic<bool>        prefetch_stop{false};
+    std::atomic<size_t>      prefetch_bytes_done{0};
+    size_t                   prefetch_bytes_total = 0;
+
     // contexts where the model tensors metadata is stored
     std::vector<ggml_context_ptr> ctxs;
 
@@ -1325,6 +1339,24 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
     // assign the output layer
     pimpl->dev_output = get_layer_buft_list(n_layer);
 
+    // tensor parallelism: with the row split mode on devices that do not implement a split buffer type (e.g. RPC),
+    // the projections of the offloaded layers are split across all the devices when the model is loaded
+    bool use_tp = split_mode == LLAMA_SPLIT_MODE_ROW && n_devices() > 1;
+    for (auto * dev : devices) {
+        use_tp = use_tp && pimpl->gpu_buft_list.at(dev).front().second == ggml_backend_dev_buffer_type(dev);
+    }
+
+    // the weights to split, they are loaded in CPU memory first
+    struct tp_weight {
+        ggml_tensor * t;
+        llm_tensor    kind;
+        int           il;
+    };
+    std::vector<tp_weight> tp_weights;
+
+    // without mmap, the weights to split are loaded in a temporary buffer that is freed once the shards are filled
+    ggml_context * ctx_tp_tmp = nullptr;
+
     // one ggml context per buffer type
     int max_n_tensors = ml.n_tensors;
     max_n_tensors += 1;         // duplicated output tensor
@@ -1467,7 +1499,47 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
                 }
             }
 
-            ggml_context * ctx = ctx_for_buft(buft);
+            bool tp = false;
+            if (use_tp && info.layer == LLM_TENSOR_LAYER_REPEATING && pimpl->dev_layer.at(tn.bid).dev != cpu_dev &&
+                !bias && ne.size() == 2 && !(flags & TENSOR_DUPLICATED)) {
+                switch (tn.tensor) {
+                    case LLM_TENSOR_ATTN_Q:
+                    case LLM_TENSOR_ATTN_K:
+                    case LLM_TENSOR_ATTN_V:
+                    case LLM_TENSOR_ATTN_OUT:
+                    case LLM_TENSOR_FFN_GATE:
+                    case LLM_TENSOR_FFN_UP:
+                    case LLM_TENSOR_FFN_DOWN:
+                        tp = true;
+                        break;
+                    default:
+                        break;
+                }
+            }
+
+            if (tp) {
+                buft = ggml_backend_dev_buffer_type(cpu_dev);
+            }
+
+            ggml_context * ctx = nullptr;
+            if (tp && !ml.use_mmap) {
+                if (!ctx_tp_tmp) {
+                    ggml_init_params params = {
+                        /*.mem_size   =*/ ctx_size,
+                        /*.mem_buffer =*/ NULL,
+                        /*.no_alloc   =*/ true,
+                    };
+
+                    ctx_tp_tmp = ggml_init(params);
+                    if (!ctx_tp_tmp) {
+                        throw std::runtime_error(format("failed to create ggml context"));
+                    }
+                    pimpl->ctxs.emplace_back(ctx_tp_tmp);
+                }
+                ctx = ctx_tp_tmp;
+            } else {
+                ctx = ctx_for_buft(buft);
+            }
 
             // if duplicated, check if the original tensor was allocated in the same buffer type context and avoid creating a new one
             if (flags & TENSOR_DUPLICATED) {
@@ -1476,7 +1548,12 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
                     return t;
                 }
             }
-            return ml.create_tensor(ctx, tn, ne, flags);
+
+            ggml_tensor * t = ml.create_tensor(ctx, tn, ne, flags);
+            if (t && tp) {
+                tp_weights.push_back({ t, tn.tensor, tn.bid });
+            }
+            return t;
         };
 
         layers.resize(n_layer);
@@ -3407,7 +3484,8 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
 
     ml.done_getting_tensors();
 
-    ml.init_mappings(true, use_mlock ? &pimpl->mlock_mmaps : nullptr);
+    // with deferred prefetching, the pages of the weights are read on first use or by llama_model_prefetch
+    ml.init_mappings(!params.defer_prefetch || use_mlock, use_mlock ? &pimpl->mlock_mmaps : nullptr);
     pimpl->mappings.reserve(ml.mappings.size());
 
     // create the backend buffers
@@ -3526,6 +3604,159 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
         }
     }
 
+    ggml_backend_buffer_ptr buf_tp_tmp;
+    if (ctx_tp_tmp) {
+        ggml_backend_buffer_type_t buft = ggml_backend_dev_buffer_type(cpu_dev);
+        buf_tp_tmp.reset(ggml_backend_alloc_ctx_tensors_from_buft(ctx_tp_tmp, buft));
+        if (!buf_tp_tmp) {
+            throw std::runtime_error(format("unable to allocate %s buffer", ggml_backend_buft_name(buft)));
+        }
+
+        llama_buf_map bufs;
+        for (uint32_t idx = 0; idx < ml.files.size(); idx++) {
+            bufs.emplace(idx, buf_tp_tmp.get());
+        }
+        if (!ml.load_all_data(ctx_tp_tmp, bufs, NULL, params.progress_callback, params.progress_callback_user_data)) {
+            return false;
+        }
+    }
+
+    // split the weights for tensor parallelism, in proportion to the splits of the devices
+    // the rows of Q, K, V, gate and up are split (dim 1) and the outputs of the shards are concatenated
+    // the columns of the attention output and down are split (dim 0) and the partial outputs of the shards are added
+    // gate, up and down use the same split points, so that the FFN can run on each device without exchanging the activations
+    if (!tp_weights.empty()) {
+        const int n_dev = n_devices();
+
+        // the split points of n items, in multiples of blck
+        auto get_bounds = [&](int64_t n, int64_t blck) {
+            std::vector<int64_t> bounds(n_dev + 1, 0);
+            for (int i = 1; i < n_dev; ++i) {
+                const int64_t b = std::llround(splits[i - 1]*(n/blck))*blck;
+                bounds[i] = std::min(n, std::max(bounds[i - 1], b));
+            }
+            bounds[n_dev] = n;
+            return bounds;
+        };
+
+        std::vector<ggml_context *> tp_ctxs(n_dev);
+        for (int i = 0; i < n_dev; ++i) {
+            ggml_init_params params = {
+                /*.mem_size   =*/ ggml_tensor_overhead()*tp_weights.size(),
+                /*.mem_buffer =*/ NULL,
+                /*.no_alloc   =*/ true,
+            };
+
+            tp_ctxs[i] = ggml_init(params);
+            if (!tp_ctxs[i]) {
+                throw std::runtime_error(format("failed to create ggml context"));
+            }
+            pimpl->ctxs.emplace_back(tp_ctxs[i]);
+        }
+
+        std::vector<std::vector<int64_t>> tp_bounds;
+        tp_bounds.reserve(tp_weights.size());
+
+        for (const auto & w : tp_weights) {
+            const auto & layer = layers[w.il];
+
+            int     dim  = 1;
+            int64_t blck = 1;
+            switch (w.kind) {
+                case LLM_TENSOR_ATTN_OUT:
+                case LLM_TENSOR_FFN_DOWN:
+                    dim  = 0;
+                    blck = ggml_blck_size(w.t->type);
+                    break;
+                case LLM_TENSOR_FFN_GATE:
+                case LLM_TENSOR_FFN_UP:
+                    if (layer.ffn_down && layer.ffn_down->ne[0] == w.t->ne[1]) {
+                        blck = ggml_blck_size(layer.ffn_down->type);
+                    }
+                    break;
+                default:
+                    break;
+            }
+
+            tp_bounds.push_back(get_bounds(w.t->ne[dim], blck));
+            const auto & bounds = tp_bounds.back();
+
+            llama_tensor_shards & ts = tensor_shards[w.t];
+            ts.dim = dim;
+            for (int i = 0; i < n_dev; ++i) {
+                const int64_t n = bounds[i + 1] - bounds[i];
+                if (n == 0) {
+                    continue;
+                }
+                ggml_tensor * shard = dim == 0 ?
+                    ggml_new_tensor_2d(tp_ctxs[i], w.t->type, n, w.t->ne[1]) :
+                    ggml_new_tensor_2d(tp_ctxs[i], w.t->type, w.t->ne[0], n);
+                ggml_format_name(shard, "%s.tp%d", ggml_get_name(w.t), i);
+                ts.shards.push_back(shard);
+            }
+        }
+
+        for (int i = 0; i < n_dev; ++i) {
+            if (ggml_get_first_tensor(tp_ctxs[i]) == nullptr) {
+                continue;
+            }
+            ggml_backend_buffer_type_t buft = ggml_backend_dev_buffer_type(devices[i]);
+            ggml_backend_buffer_t buf = ggml_backend_alloc_ctx_tensors_from_buft(tp_ctxs[i], buft);
+            if (buf == nullptr) {
+                throw std::runtime_error(format("unable to allocate %s buffer", ggml_backend_buft_name(buft)));
+            }
+            ggml_backend_buffer_set_usage(buf, GGML_BACKEND_BUFFER_USAGE_WEIGHTS);
+            pimpl->bufs.emplace_back(buf);
+
+            LLAMA_LOG_INFO("%s: %12s tensor parallel buffer size = %8.2f MiB\n", __func__, ggml_backend_buffer_name(buf), ggml_backend_buffer_get_size(buf) / 1024.0 / 1024.0);
+        }
+
+        // copy the slices of the weights to the shards
+        std::vector<uint8_t> tmp;
+        for (size_t iw = 0; iw < tp_weights.size(); ++iw) {
+            const ggml_tensor * t = tp_weights[iw].t;
+            GGML_ASSERT(ggml_backend_buffer_is_host(t->buffer));
+
+            const llama_tensor_shards & ts = tensor_shards.at(t);
+            const auto & bounds = tp_bounds[iw];
+
+            size_t is = 0;
+            for (int i = 0; i < n_dev; ++i) {
+                if (bounds[i + 1] == bounds[i]) {
+                    continue;
+                }
+                ggml_tensor * shard = ts.shards[is++];
+
+                if (ts.dim == 1) {
+                    ggml_backend_tensor_set(shard, (const char *) t->data + bounds[i]*t->nb[1], 0, ggml_nbytes(shard));
+                } else {
+                    const size_t offs     = ggml_row_size(t->type, bounds[i]);
+                    const size_t row_size = shard->nb[1];
+                    tmp.resize(ggml_nbytes(shard));
+                    for (int64_t ir = 0; ir < t->ne[1]; ++ir) {
+                        memcpy(tmp.data() + ir*row_size, (const char *) t->data + ir*t->nb[1] + offs, row_size);
+                    }
+                    ggml_backend_tensor_set(shard, tmp.data(), 0, tmp.size());
+                }
+
+                tensors_by_name.emplace_back(ggml_get_name(shard), shard);
+            }
+        }
+
+        LLAMA_LOG_INFO("%s: tensor parallelism: split %zu weights across %d devices\n", __func__, tp_weights.size(), n_dev);
+
+        if (buf_tp_tmp) {
+            // only the shards are used by the graphs
+            for (const auto & w : tp_weights) {
+                w.t->buffer = nullptr;
+                w.t->data   = nullptr;
+            }
+            LLAMA_LOG_INFO("%s: tensor parallelism: freed %.2f MiB of unsplit weights\n", __func__,
+                    ggml_backend_buffer_get_size(buf_tp_tmp.get()) / 1024.0 / 1024.0);
+            buf_tp_tmp.reset();
+        }
+    }
+
     if (use_mmap_buffer) {
         for (auto & mapping : ml.mappings) {
             pimpl->mappings.emplace_back(std::move(mapping));
@@ -3535,6 +3766,90 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
     return true;
 }
 
+bool llama_model::prefetch(int n_threads) {
+    if (!pimpl->prefetch_workers.empty() || pimpl->mappings.empty()) {
+        return false;
+    }
+
+    // memory ranges of the weights that live in the mappings, grouped by stage: input, repeating layers, output
+    const int n_stages = hparams.n_layer + 2;
+    std::vector<std::vector<std::pair<const uint8_t *, size_t>>> stages(n_stages);
+
+    size_t n_bytes_total = 0;
+    for (const auto & it : tensors_by_name) {
+        const ggml_tensor * t = it.second;
+        if (t->data == nullptr || t->buffer == nullptr || !ggml_backend_buffer_is_host(t->buffer)) {
+            continue;
+        }
+
+        const uint8_t * data = (const uint8_t *) t->data;
+        bool mapped = false;
+        for (const auto & mapping : pimpl->mappings) {
+            const uint8_t * addr = (const uint8_t *) mapping->addr();
+            mapped |= data >= addr && data + ggml_nbytes(t) <= addr + mapping->size();
+        }
+        if (!mapped) {
+            continue;
+        }
+
+        int stage = n_stages - 1;
+        int il = -1;
+        if (sscanf(it.first.c_str(), "blk.%d.", &il) == 1 && il >= 0 && il < (int) hparams.n_layer) {
+            stage = il + 1;
+        } else if (it.first.find("token") == 0 || it.first.find("pos_embd") == 0) {
+            stage = 0;
+        }
+
+        stages[stage].emplace_back(data, ggml_nbytes(t));
+        n_bytes_total += ggml_nbytes(t);
+    }
+
+    if (n_bytes_total == 0) {
+        return false;
+    }
+
+    pimpl->prefetch_bytes_total = n_bytes_total;
+
+    // the workers take the stages in order, so that the first layers are resident as early as possible
+    auto next_stage = std::make_shared<std::atomic<int>>(0);
+    auto stages_ptr = std::make_shared<decltype(stages)>(std::move(stages));
+
+    const size_t page_size = llama_mmap::page_size();
+
+    n_threads = std::max(1, n_threads);
+    for (int i = 0; i < n_threads; ++i) {
+        pimpl->prefetch_workers.emplace_back([this, next_stage, stages_ptr, page_size]() {
+            uint8_t sum = 0;
+            while (!pimpl->prefetch_stop) {
+                const int stage = (*next_stage)++;
+                if (stage >= (int) stages_ptr->size()) {
+                    break;
+                }
+                for (const auto & range : (*stages_ptr)[stage]) {
+                    // touch every page of the range to fault it in
+                    for (size_t off = 0; off < range.second && !pimpl->prefetch_stop; off += page_size) {
+                        sum += *(volatile const uint8_t *) (range.first + off);
+                    }
+                    pimpl->prefetch_bytes_done += range.second;
+                }
+            }
+            GGML_UNUSED(sum);
+        });
+    }
+
+    LLAMA_LOG_INFO("%s: prefetching %.2f MiB of weights in %d threads\n", __func__, n_bytes_total/1024.0/1024.0, n_threads);
+
+    return true;
+}
+
+float llama_model::prefetch_progress() const {
+    if (pimpl->prefetch_bytes_total == 0) {
+        return 1.0f;
+    }
+
+    return std::min(1.0f, (float) pimpl->prefetch_bytes_done / pimpl->prefetch_bytes_total);
+}
+
 std::string llama_model::arch_name() const {
     return llm_arch_name(arch);
 }
@@ -3740,6 +4055,15 @@ ggml_backend_buffer_type_t llama_model::select_buft(int il) const {
             });
 }
 
+const llama_tensor_shards * llama_model::get_shards(const struct ggml_tensor * w) const {
+    auto it = tensor_shards.find(w);
+    if (it == tensor_shards.end()) {
+        return nullptr;
+    }
+
+    return &it->second;
+}
+
 const struct ggml_tensor * llama_model::get_tensor(const char * name) const {
     auto it = std::find_if(tensors_by_name.begin(), tensors_by_name.end(),
             [name](const std::pair<std::string, struct ggml_tensor *> & it) {
@@ -3770,6 +4094,7 @@ struct llama_model_params llama_model_default_params() {
         /*.use_mmap                    =*/ true,
         /*.use_mlock                   =*/ false,
         /*.check_tensors               =*/ false,
+        /*.defer_prefetch              =*/ false,
     };
 
 #ifdef GGML_USE_METAL
@@ -3991,6 +4316,14 @@ llama_token llama_model_decoder_start_token(const struct llama_model * model) {
     return model->hparams.dec_start_token_id;
 }
 
+bool llama_model_prefetch(struct llama_model * model, int32_t n_threads) {
+    return model->prefetch(n_threads);
+}
+
+float llama_model_prefetch_progress(const struct llama_model * model) {
+    return model->prefetch_progress();
+}
+
 bool llama_model_is_recurrent(const struct llama_model * model) {
     switch (model->arch) {
         case LLM_ARCH_MAMBA:  return true;
@@ -286,6 +286,15 @@ struct llama_layer {
     struct llama_layer_convnext convnext;
 };
 
+// a weight split in one shard per device for tensor parallelism
+struct llama_tensor_shards {
+    // 0: along the input features (ne[0]), the partial products are summed
+    // 1: along the output features (ne[1]), the products are concatenated
+    int dim;
+
+    std::vector<struct ggml_tensor *> shards;
+};
+
 struct llama_model {
     llm_type type = LLM_TYPE_UNKNOWN;
     llm_arch arch = LLM_ARCH_UNKNOWN;
@@ -329,6 +338,10 @@ struct llama_model {
     // for quantize-stats only
     std::vector<std::pair<std::string, struct ggml_tensor *>> tensors_by_name;
 
+    // tensor parallelism, with LLAMA_SPLIT_MODE_ROW on devices without a split buffer type
+    // the attention and FFN weights of the offloaded layers are split across the devices, the original tensors stay on the CPU
+    std::unordered_map<const struct ggml_tensor *, llama_tensor_shards> tensor_shards;
+
     int64_t t_load_us  = 0;
     int64_t t_start_us = 0;
 
@@ -362,6 +375,13 @@ struct llama_model {
 
     const struct ggml_tensor * get_tensor(const char * name) const;
 
+    // the shards of a weight, nullptr if it is not split
+    const llama_tensor_shards * get_shards(const struct ggml_tensor * w) const;
+
+    // read the memory mapped weights in background threads, layer by layer
+    bool  prefetch(int n_threads);
+    float prefetch_progress() const;
+
 private:
     struct impl;
     std::unique_ptr<impl> pimpl;
@@ -9,7 +9,9 @@
 #include <cstring>
 #include <cinttypes>
 #include <fstream>
+#include <map>
 #include <mutex>
+#include <queue>
 #include <thread>
 #include <unordered_map>
 
@@ -463,6 +465,339 @@ static size_t llama_tensor_quantize_impl(enum ggml_type new_type, const float *
     return new_size;
 }
 
+static bool llama_tensor_allows_quantization(const llama_model_quantize_params * params, llm_arch arch, const ggml_tensor * tensor) {
+    const std::string name = ggml_get_name(tensor);
+
+    // This used to be a regex, but <regex> has an extreme cost to compile times.
+    bool quantize = name.rfind("weight") == name.size() - 6; // ends with 'weight'?
+
+    // quantize only 2D and 3D tensors (experts)
+    quantize &= (ggml_n_dims(tensor) >= 2);
+
+    // do not quantize norm tensors
+    quantize &= name.find("_norm.weight") == std::string::npos;
+
+    quantize &= params->quantize_output_tensor || name != "output.weight";
+    quantize &= !params->only_copy;
+
+    // do not quantize expert gating tensors
+    // NOTE: can't use LLM_TN here because the layer number is not known
+    quantize &= name.find("ffn_gate_inp.weight") == std::string::npos;
+
+    // do not quantize positional embeddings and token types (BERT)
+    quantize &= name != LLM_TN(arch)(LLM_TENSOR_POS_EMBD,    "weight");
+    quantize &= name != LLM_TN(arch)(LLM_TENSOR_TOKEN_TYPES, "weight");
+
+    // do not quantize Mamba's small yet 2D weights
+    // NOTE: can't use LLM_TN here because the layer number is not known
+    quantize &= name.find("ssm_conv1d.weight") == std::string::npos;
+
+    // do not quantize RWKV's time_mix_first tensors
+    quantize &= name.find("time_mix_first.weight") == std::string::npos;
+    quantize &= name.find("time_mix_w1.weight") == std::string::npos;
+    quantize &= name.find("time_mix_w2.weight") == std::string::npos;
+    quantize &= name.find("time_mix_decay_w1.weight") == std::string::npos;
+    quantize &= name.find("time_mix_decay_w2.weight") == std::string::npos;
+    quantize &= name.find("time_mix_lerp_fused.weight") == std::string::npos;
+
+    // do not quantize relative position bias (T5)
+    quantize &= name.find("attn_rel_b.weight") == std::string::npos;
+
+    return quantize;
+}
+
+//
+// budget-driven type search
+//
+
+// candidate types for the budget search, ordered by increasing size
+static const ggml_type k_budget_candidate_types[] = {
+    GGML_TYPE_IQ2_XXS,
+    GGML_TYPE_IQ2_XS,
+    GGML_TYPE_IQ2_S,
+    GGML_TYPE_Q2_K,
+    GGML_TYPE_IQ3_XXS,
+    GGML_TYPE_IQ3_S,
+    GGML_TYPE_Q3_K,
+    GGML_TYPE_IQ4_XS,
+    GGML_TYPE_Q4_K,
+    GGML_TYPE_Q5_K,
+    GGML_TYPE_Q6_K,
+    GGML_TYPE_Q8_0,
+};
+
+// max number of rows per tensor that are trial-quantized for each candidate type
+static const int64_t k_budget_sample_rows = 256;
+
+struct quantize_budget_tensor {
+    std::string name;
+
+    std::vector<ggml_type> types; // candidate types, increasing size
+    std::vector<size_t>    sizes; // padded size in bytes of the full tensor for each candidate
+    std::vector<double>    errs;  // estimated importance-weighted squared error of the full tensor for each candidate
+
+    size_t cur = 0; // index of the currently selected candidate
+};
+
+static size_t llama_tensor_padded_size(const ggml_tensor * tensor, ggml_type type) {
+    const size_t size = ggml_row_size(type, tensor->ne[0]) * (ggml_nelements(tensor) / tensor->ne[0]);
+    return GGML_PAD(size, GGUF_DEFAULT_ALIGNMENT);
+}
+
+// trial-quantize a subset of the rows of the tensor with each candidate type and measure the error against the original data
+static void llama_tensor_budget_measure(
+        quantize_budget_tensor & bt, const ggml_tensor * tensor, const float * imatrix, std::vector<std::thread> & workers, const int nthread) {
+    const int64_t n_per_row = tensor->ne[0];
+    const int64_t nrows     = tensor->ne[1];
+    const int64_t n_expert  = tensor->ne[2];
+
+    const int64_t n_sample = std::min(nrows, std::max((int64_t) 16, k_budget_sample_rows / n_expert));
+
+    // gather the sampled rows of each expert as F32
+    std::vector<float> f32_rows(n_expert * n_sample * n_per_row);
+    {
+        const ggml_type_traits * traits = ggml_get_type_traits(tensor->type);
+        if (tensor->type != GGML_TYPE_F32 && traits->to_float == NULL) {
+            throw std::runtime_error(format("cannot dequantize/convert tensor type %s", ggml_type_name(tensor->type)));
+        }
+        for (int64_t i02 = 0; i02 < n_expert; ++i02) {
+            for (int64_t i = 0; i < n_sample; ++i) {
+                const int64_t i01 = i * nrows / n_sample;
+                const char * src = (const char *) tensor->data + i02*tensor->nb[2] + i01*tensor->nb[1];
+                float * dst = f32_rows.data() + (i02*n_sample + i)*n_per_row;
+                if (tensor->type == GGML_TYPE_F32) {
+                    memcpy(dst, src, n_per_row*sizeof(float));
+                } else {
+                    traits->to_float(src, dst, n_per_row);
+                }
+            }
+        }
+    }
+
+    const double scale = (double) nrows / n_sample;
+
+    bt.errs.assign(bt.types.size(), 0.0);
+
+    std::mutex mutex;
+    size_t counter = 0;
+    bool valid = true;
+    auto compute = [&]() {
+        std::vector<no_init<uint8_t>> q_buf;
+        std::vector<float> dq_buf(n_sample * n_per_row);
+        while (true) {
+            std::unique_lock<std::mutex> lock(mutex);
+            const size_t i_type = counter++;
+            if (i_type >= bt.types.size()) {
+                break;
+            }
+            lock.unlock();
+
+            const ggml_type type = bt.types[i_type];
+            const size_t row_size = ggml_row_size(type, n_per_row);
+            if (q_buf.size() < row_size * n_sample) {
+                q_buf.resize(row_size * n_sample);
+            }
+
+            double err = 0.0;
+            for (int64_t i02 = 0; i02 < n_expert; ++i02) {
+                const float * x  = f32_rows.data() + i02*n_sample*n_per_row;
+                const float * qw = imatrix ? imatrix + i02*n_per_row : nullptr;
+
+                const size_t q_size = ggml_quantize_chunk(type, x, q_buf.data(), 0, n_sample, n_per_row, qw);
+                if (!ggml_validate_row_data(type, q_buf.data(), q_size)) {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    valid = false;
+                    return;
+                }
+                ggml_get_type_traits(type)->to_float(q_buf.data(), dq_buf.data(), n_sample*n_per_row);
+
+                for (int64_t i = 0; i < n_sample; ++i) {
+                    for (int64_t j = 0; j < n_per_row; ++j) {
+                        const double d = x[i*n_per_row + j] - dq_buf[i*n_per_row + j];
+                        err += (qw ? qw[j] : 1.0f) * d * d;
+                    }
+                }
+            }
+            bt.errs[i_type] = err * scale;
+        }
+    };
+    const int nthread_use = std::max(1, std::min(nthread, (int) bt.types.size()));
+    for (int it = 0; it < nthread_use - 1; ++it) {
+        workers.emplace_back(compute);
+    }
+    compute();
+    for (auto & w : workers) { w.join(); }
+    workers.clear();
+    if (!valid) {
+        throw std::runtime_error("quantized data validation failed");
+    }
+}
+
+// pick the most profitable upgrade (error reduction per extra byte) of the tensor that fits in the remaining budget
+// returns false if there is none
+static bool llama_tensor_budget_next(const quantize_budget_tensor & bt, size_t remaining, size_t & next, double & gain) {
+    bool found = false;
+    for (size_t i = bt.cur + 1; i < bt.types.size(); ++i) {
+        const size_t dsize = bt.sizes[i] - bt.sizes[bt.cur];
+        const double derr  = bt.errs[bt.cur] - bt.errs[i];
+        if (dsize > remaining || derr <= 0.0) {
+            continue;
+        }
+        const double g = dsize > 0 ? derr / dsize : INFINITY;
+        if (!found || g > gain) {
+            found = true;
+            next  = i;
+            gain  = g;
+        }
+    }
+    return found;
+}
+
+// search the per-tensor quantization types that minimize the total measured error while keeping the output under the
+// size budget given by params->target_size or params->target_bpw
+static std::unordered_map<std::string, ggml_type> llama_tensor_budget_search(
+        llama_model_loader & ml,
+        const std::vector<const llama_model_loader::llama_tensor_weight *> & tensors,
+        const llama_model_quantize_params * params,
+        const std::unordered_map<std::string, std::vector<float>> * imatrix_data,
+        llm_arch arch,
+        std::vector<std::thread> & workers,
+        const int nthread) {
+    const int64_t t_start_us = ggml_time_us();
+
+    int64_t n_elements = 0;
+    size_t  size_fixed = 0;
+
+    std::vector<quantize_budget_tensor> budget_tensors;
+    std::vector<no_init<uint8_t>> read_data;
+
+    for (const auto * it : tensors) {
+        ggml_tensor * tensor = it->tensor;
+        const std::string name = ggml_get_name(tensor);
+
+        n_elements += ggml_nelements(tensor);
+
+        if (!llama_tensor_allows_quantization(params, arch, tensor)) {
+            size_fixed += GGML_PAD(ggml_nbytes(tensor), GGUF_DEFAULT_ALIGNMENT);
+            continue;
+        }
+
+        // user-requested types are not part of the search
+        if (params->token_embedding_type < GGML_TYPE_COUNT && name == "token_embd.weight") {
+            size_fixed += llama_tensor_padded_size(tensor, params->token_embedding_type);
+            continue;
+        }
+        if (params->output_tensor_type < GGML_TYPE_COUNT && name == "output.weight") {
+            size_fixed += llama_tensor_padded_size(tensor, params->output_tensor_type);
+            continue;
+        }
+
+        const float * imatrix = nullptr;
+        if (imatrix_data) {
+            auto it_imatrix = imatrix_data->find(name);
+            if (it_imatrix != imatrix_data->end() && it_imatrix->second.size() == (size_t)tensor->ne[0]*tensor->ne[2]) {
+                imatrix = it_imatrix->second.data();
+            }
+        }
+
+        quantize_budget_tensor bt;
+        bt.name = name;
+        for (ggml_type type : k_budget_candidate_types) {
+            if (tensor->ne[0] % ggml_blck_size(type) != 0) {
+                continue;
+            }
+            // same as the check in the main loop: very low-bit types produce garbage without an importance matrix
+            if (!imatrix && (ggml_quantize_requires_imatrix(type) || type == GGML_TYPE_IQ2_S)) {
+                continue;
+            }
+            bt.types.push_back(type);
+            bt.sizes.push_back(llama_tensor_padded_size(tensor, type));
+        }
+        if (bt.types.empty()) {
+            // no block-compatible candidate - keep the tensor as it is
+            size_fixed += GGML_PAD(ggml_nbytes(tensor), GGUF_DEFAULT_ALIGNMENT);
+            continue;
+        }
+
+        void * data_org = tensor->data;
+        if (!ml.use_mmap) {
+            if (read_data.size() < ggml_nbytes(tensor)) {
+                read_data.resize(ggml_nbytes(tensor));
+            }
+            tensor->data = read_data.data();
+        }
+        ml.load_data_for(tensor);
+
+        llama_tensor_budget_measure(bt, tensor, imatrix, workers, nthread);
+
+        tensor->data = data_org;
+
+        LLAMA_LOG_DEBUG("%s: %36s - %zu candidates, err %s = %.4e .. %s = %.4e\n", __func__, name.c_str(), bt.types.size(),
+                ggml_type_name(bt.types.front()), bt.errs.front(), ggml_type_name(bt.types.back()), bt.errs.back());
+
+        budget_tensors.push_back(std::move(bt));
+    }
+
+    size_t budget = params->target_size > 0 ? params->target_size : (size_t) (params->target_bpw * n_elements / 8);
+    budget = budget > size_fixed ? budget - size_fixed : 0;
+
+    // start from the smallest candidate of each tensor
+    size_t size_cur = 0;
+    for (const auto & bt : budget_tensors) {
+        size_cur += bt.sizes[0];
+    }
+    if (size_cur > budget) {
+        LLAMA_LOG_WARN("%s: the budget cannot be met, using the smallest candidate types (%.2f MiB over)\n",
+                __func__, (size_cur - budget)/1024.0/1024.0);
+    }
+
+    // greedily apply the upgrade with the best error reduction per byte until the budget is exhausted
+    using upgrade = std::pair<double, std::pair<size_t, size_t>>; // gain, (tensor index, candidate index)
+    std::priority_queue<upgrade> queue;
+    for (size_t i = 0; i < budget_tensors.size(); ++i) {
+        size_t next = 0;
+        double gain = 0.0;
+        if (llama_tensor_budget_next(budget_tensors[i], budget - std::min(budget, size_cur), next, gain)) {
+            queue.push({gain, {i, next}});
+        }
+    }
+    while (!queue.empty()) {
+        const size_t i = queue.top().second.first;
+        size_t    next = queue.top().second.second;
+        queue.pop();
+
+        auto & bt = budget_tensors[i];
+        const size_t remaining = budget - std::min(budget, size_cur);
+        if (next > bt.cur && bt.sizes[next] - bt.sizes[bt.cur] <= remaining) {
+            size_cur += bt.sizes[next] - bt.sizes[bt.cur];
+            bt.cur = next;
+        }
+
+        double gain = 0.0;
+        if (llama_tensor_budget_next(bt, budget - std::min(budget, size_cur), next, gain)) {
+            queue.push({gain, {i, next}});
+        }
+    }
+
+    std::unordered_map<std::string, ggml_type> result;
+    std::map<ggml_type, int> n_per_type;
+    double err_total = 0.0;
+    for (const auto & bt : budget_tensors) {
+        result[bt.name] = bt.types[bt.cur];
+        n_per_type[bt.types[bt.cur]]++;
+        err_total += bt.errs[bt.cur];
+    }
+
+    const size_t size_total = size_cur + size_fixed;
+    LLAMA_LOG_INFO("%s: searched %zu tensors in %.2f s: %.2f MiB (%.4f bpw), total error = %.4e\n", __func__,
+            budget_tensors.size(), (ggml_time_us() - t_start_us)/1e6, size_total/1024.0/1024.0, size_total*8.0/n_elements, err_total);
+    for (const auto & it : n_per_type) {
+        LLAMA_LOG_INFO("%s: - type %7s: %4d tensors\n", __func__, ggml_type_name(it.first), it.second);
+    }
+
+    return result;
+}
+
 static void llama_model_quantize_impl(const std::string & fname_inp, const std::string & fname_out, const llama_model_quantize_params * params) {
     ggml_type default_type;
     llama_ftype ftype = params->ftype;
@@ -641,6 +976,16 @@ static void llama_model_quantize_impl(const std::string & fname_inp, const std::
     std::vector<std::thread> workers;
     workers.reserve(nthread);
 
+    // per-tensor types chosen by the budget search
+    std::unordered_map<std::string, ggml_type> budget_types;
+    if ((params->target_bpw > 0.0f || params->target_size > 0) && !params->only_copy) {
+        if (params->pure) {
+            LLAMA_LOG_WARN("%s: target size is ignored with pure quantization\n", __func__);
+        } else {
+            budget_types = llama_tensor_budget_search(ml, tensors, params, imatrix_data, model.arch, workers, nthread);
+        }
+    }
+
     int idx = 0;
 
     std::vector<no_init<uint8_t>> read_data;
@@ -732,40 +1077,7 @@ static void llama_model_quantize_impl(const std::string & fname_inp, const std::
                llama_format_tensor_shape(tensor).c_str(),
                ggml_type_name(tensor->type));
 
-        // This used to be a regex, but <regex> has an extreme cost to compile times.
-        bool quantize = name.rfind("weight") == name.size() - 6; // ends with 'weight'?
-
-        // quantize only 2D and 3D tensors (experts)
-        quantize &= (ggml_n_dims(tensor) >= 2);
-
-        // do not quantize norm tensors
-        quantize &= name.find("_norm.weight") == std::string::npos;
-
-        quantize &= params->quantize_output_tensor || name != "output.weight";
-        quantize &= !params->only_copy;
-
-        // do not quantize expert gating tensors
-        // NOTE: can't use LLM_TN here because the layer number is not known
-        quantize &= name.find("ffn_gate_inp.weight") == std::string::npos;
-
-        // do not quantize positional embeddings and token types (BERT)
-        quantize &= name != LLM_TN(model.arch)(LLM_TENSOR_POS_EMBD,    "weight");
-        quantize &= name != LLM_TN(model.arch)(LLM_TENSOR_TOKEN_TYPES, "weight");
-
-        // do not quantize Mamba's small yet 2D weights
-        // NOTE: can't use LLM_TN here because the layer number is not known
-        quantize &= name.find("ssm_conv1d.weight") == std::string::npos;
-
-        // do not quantize RWKV's time_mix_first tensors
-        quantize &= name.find("time_mix_first.weight") == std::string::npos;
-        quantize &= name.find("time_mix_w1.weight") == std::string::npos;
-        quantize &= name.find("time_mix_w2.weight") == std::string::npos;
-        quantize &= name.find("time_mix_decay_w1.weight") == std::string::npos;
-        quantize &= name.find("time_mix_decay_w2.weight") == std::string::npos;
-        quantize &= name.find("time_mix_lerp_fused.weight") == std::string::npos;
-
-        // do not quantize relative position bias (T5)
-        quantize &= name.find("attn_rel_b.weight") == std::string::npos;
+        bool quantize = llama_tensor_allows_quantization(params, model.arch, tensor);
 
         enum ggml_type new_type;
         void * new_data;
@@ -775,7 +1087,10 @@ static void llama_model_quantize_impl(const std::string & fname_inp, const std::
             new_type = default_type;
 
             // get more optimal quantization type based on the tensor shape, layer, etc.
-            if (!params->pure && ggml_is_quantized(default_type)) {
+            auto it_budget = budget_types.find(name);
+            if (it_budget != budget_types.end()) {
+                new_type = it_budget->second;
+            } else if (!params->pure && ggml_is_quantized(default_type)) {
                 new_type = llama_tensor_get_type(qs, new_type, tensor, ftype);
             }
             if (params->token_embedding_type < GGML_TYPE_COUNT && strcmp(tensor->name, "token_embd.weight") == 0) {
@@ -912,6 +1227,8 @@ struct llama_model_quantize_params llama_model_quantize_default_params() {
         /*.only_copy                   =*/ false,
         /*.pure                        =*/ false,
         /*.keep_split                  =*/ false,
+        /*.target_bpw                  =*/ 0.0f,
+        /*.target_size                 =*/ 0,
         /*.imatrix                     =*/ nullptr,
         /*.kv_overrides                =*/ nullptr,
     };
@@ -200,6 +200,124 @@ static void llama_sampler_temp_impl(llama_token_data_array * cur_p, float temp)
     }
 }
 
+// scratch buffers reused across calls, so that the samplers do not allocate on every token
+struct llama_sampler_scratch {
+    std::vector<float>   logits; // SoA copy of the candidate logits
+    std::vector<float>   exps;   // exp of the scaled logits
+    std::vector<int32_t> bucket; // bucket of each candidate in the top-k selection
+
+    std::vector<llama_token_data> tokens;
+};
+
+static llama_sampler_scratch & llama_sampler_get_scratch() {
+    thread_local llama_sampler_scratch scratch;
+    return scratch;
+}
+
+// the loops below are written without branches and with independent accumulators so that the compiler can vectorize them
+
+static constexpr int LLAMA_SAMPLER_N_LANES = 8;
+
+static float llama_sampler_max_f32(const float * x, size_t n) {
+    float acc[LLAMA_SAMPLER_N_LANES];
+    std::fill(acc, acc + LLAMA_SAMPLER_N_LANES, -INFINITY);
+
+    size_t i = 0;
+    for (; i + LLAMA_SAMPLER_N_LANES <= n; i += LLAMA_SAMPLER_N_LANES) {
+        for (int j = 0; j < LLAMA_SAMPLER_N_LANES; ++j) {
+            acc[j] = x[i + j] > acc[j] ? x[i + j] : acc[j];
+        }
+    }
+    for (; i < n; ++i) {
+        acc[0] = x[i] > acc[0] ? x[i] : acc[0];
+    }
+
+    return *std::max_element(acc, acc + LLAMA_SAMPLER_N_LANES);
+}
+
+static float llama_sampler_sum_f32(const float * x, size_t n) {
+    float acc[LLAMA_SAMPLER_N_LANES] = {0.0f};
+
+    size_t i = 0;
+    for (; i + LLAMA_SAMPLER_N_LANES <= n; i += LLAMA_SAMPLER_N_LANES) {
+        for (int j = 0; j < LLAMA_SAMPLER_N_LANES; ++j) {
+            acc[j] += x[i + j];
+        }
+    }
+    for (; i < n; ++i) {
+        acc[0] += x[i];
+    }
+
+    float sum = 0.0f;
+    for (int j = 0; j < LLAMA_SAMPLER_N_LANES; ++j) {
+        sum += acc[j];
+    }
+
+    return sum;
+}
+
+// exp(x) for x <= 0 with a relative error below 2e-7, flushes to 0 below -87 (including -INFINITY)
+// the range check is done on the bit pattern: float selects are not vectorized without -fno-trapping-math
+static inline float llama_sampler_expf(float x) {
+    constexpr uint32_t u_min = 0xC2AE0000; // -87.0f, larger patterns are more negative
+
+    uint32_t u;
+    std::memcpy(&u, &x, sizeof(u));
+
+    const uint32_t mask = (uint32_t) -(int32_t) (u <= u_min);
+
+    u = std::min(u, u_min);
+    std::memcpy(&x, &u, sizeof(x));
+
+    // x = n*ln(2) + r, |r| <= ln(2)/2, n is rounded to nearest by adding 1.5*2^23
+    const float t = x*1.44269504088896341f + 12582912.0f;
+    const float n = t - 12582912.0f;
+    const float r = x - n*0.693359375f - n*-2.12194440e-4f;
+
+    float p = 1.9875691500e-4f;
+    p = p*r + 1.3981999507e-3f;
+    p = p*r + 8.3334519073e-3f;
+    p = p*r + 4.1665795894e-2f;
+    p = p*r + 1.6666665459e-1f;
+    p = p*r + 5.0000001201e-1f;
+    p = p*r*r + r + 1.0f;
+
+    // 2^n
+    int32_t bits;
+    std::memcpy(&bits, &t, sizeof(bits));
+    bits = (bits - 0x4B400000 + 127) << 23;
+
+    float e;
+    std::memcpy(&e, &bits, sizeof(e));
+
+    float res = p*e;
+    std::memcpy(&u, &res, sizeof(u));
+    u &= mask;
+    std::memcpy(&res, &u, sizeof(res));
+
+    return res;
+}
+
+// y[i] = exp((x[i] - max)*scale), returns the sum of y
+static float llama_sampler_exp_sum_f32(float * y, const float * x, size_t n, float max, float scale) {
+    for (size_t i = 0; i < n; ++i) {
+        y[i] = llama_sampler_expf((x[i] - max)*scale);
+    }
+
+    return llama_sampler_sum_f32(y, n);
+}
+
+// copy the logits of the candidates to a contiguous array
+static float * llama_sampler_gather_logits(const llama_token_data_array * cur_p, std::vector<float> & dst) {
+    if (dst.size() < cur_p->size) {
+        dst.resize(cur_p->size);
+    }
+    for (size_t i = 0; i < cur_p->size; ++i) {
+        dst[i] = cur_p->data[i].logit;
+    }
+    return dst.data();
+}
+
 static void llama_sampler_softmax_impl(llama_token_data_array * cur_p) {
     GGML_ASSERT(cur_p->size > 0);
 
@@ -211,22 +329,147 @@ static void llama_sampler_softmax_impl(llama_token_data_array * cur_p) {
         cur_p->sorted = true;
     }
 
-    float max_l = cur_p->data[0].logit;
-    float cum_sum = 0.0f;
+    auto & scratch = llama_sampler_get_scratch();
 
-    for (size_t i = 0; i < cur_p->size; ++i) {
-        float p = expf(cur_p->data[i].logit - max_l);
-        cur_p->data[i].p = p;
-        cum_sum += p;
+    const float * logits = llama_sampler_gather_logits(cur_p, scratch.logits);
+
+    if (scratch.exps.size() < cur_p->size) {
+        scratch.exps.resize(cur_p->size);
     }
+    float * exps = scratch.exps.data();
+
+    const float cum_sum = llama_sampler_exp_sum_f32(exps, logits, cur_p->size, cur_p->data[0].logit, 1.0f);
+    const float inv_sum = 1.0f/cum_sum;
 
     for (size_t i = 0; i < cur_p->size; ++i) {
-        cur_p->data[i].p /= cum_sum;
+        cur_p->data[i].p = exps[i]*inv_sum;
+    }
+}
+
+static constexpr int LLAMA_SAMPLER_N_BUCKETS = 256;
+
+// gathers the logits into scratch.logits and computes their histogram over [min, max] into scratch.bucket and histo
+// -INFINITY (e.g. masked by a grammar) is ignored for the range
+// returns the max logit
+static float llama_sampler_histogram(const llama_token_data_array * cur_p, llama_sampler_scratch & scratch, int * histo) {
+    const size_t n = cur_p->size;
+
+    if (scratch.logits.size() < n) {
+        scratch.logits.resize(n);
+    }
+    if (scratch.bucket.size() < n) {
+        scratch.bucket.resize(n);
+    }
+    float   * logits = scratch.logits.data();
+    int32_t * bucket = scratch.bucket.data();
+
+    // gather the logits and find their range in the same pass
+    float max_acc[LLAMA_SAMPLER_N_LANES];
+    float min_acc[LLAMA_SAMPLER_N_LANES];
+    std::fill(max_acc, max_acc + LLAMA_SAMPLER_N_LANES, -INFINITY);
+    std::fill(min_acc, min_acc + LLAMA_SAMPLER_N_LANES,  INFINITY);
+
+    size_t i = 0;
+    for (; i + LLAMA_SAMPLER_N_LANES <= n; i += LLAMA_SAMPLER_N_LANES) {
+        for (int j = 0; j < LLAMA_SAMPLER_N_LANES; ++j) {
+            const float v = cur_p->data[i + j].logit;
+            logits[i + j] = v;
+            max_acc[j] = v > max_acc[j] ? v : max_acc[j];
+            min_acc[j] = v < min_acc[j] && v > -INFINITY ? v : min_acc[j];
+        }
+    }
+    for (; i < n; ++i) {
+        const float v = cur_p->data[i].logit;
+        logits[i] = v;
+        max_acc[0] = v > max_acc[0] ? v : max_acc[0];
+        min_acc[0] = v < min_acc[0] && v > -INFINITY ? v : min_acc[0];
+    }
+
+    const float max_l = *std::max_element(max_acc, max_acc + LLAMA_SAMPLER_N_LANES);
+    const float min_l = *std::min_element(min_acc, min_acc + LLAMA_SAMPLER_N_LANES);
+
+    const float range = max_l - min_l;
+    const float scale = range > 0.0f && std::isfinite(range) ? (LLAMA_SAMPLER_N_BUCKETS - 1)/range : 0.0f;
+    const float shift = std::isfinite(min_l) ? min_l : 0.0f;
+
+    std::fill(histo, histo + LLAMA_SAMPLER_N_BUCKETS, 0);
+    for (i = 0; i < n; ++i) {
+        float f = (logits[i] - shift)*scale;
+        f = f > 0.0f ? f : 0.0f; // also maps NaN to 0
+        f = f < LLAMA_SAMPLER_N_BUCKETS - 1 ? f : LLAMA_SAMPLER_N_BUCKETS - 1;
+        bucket[i] = (int32_t) f;
+        ++histo[bucket[i]];
+    }
+
+    return max_l;
+}
+
+// copies the candidates in the buckets >= ib to scratch.tokens, overwrites scratch.bucket
+static void llama_sampler_compact(const llama_token_data_array * cur_p, llama_sampler_scratch & scratch, int ib) {
+    const size_t n = cur_p->size;
+
+    int32_t * bucket = scratch.bucket.data();
+
+    // branchless compaction of the indices, in place
+    size_t m = 0;
+    for (size_t i = 0; i < n; ++i) {
+        const int32_t b = bucket[i];
+        bucket[m] = i;
+        m += b >= ib;
+    }
+
+    auto & tokens = scratch.tokens;
+    tokens.resize(m);
+    for (size_t i = 0; i < m; ++i) {
+        tokens[i] = cur_p->data[bucket[i]];
+    }
+}
+
+// move the candidates with the k largest logits to the front of the array, sorted in descending order
+static void llama_sampler_top_k_select(llama_token_data_array * cur_p, int32_t k) {
+    auto comp = [](const llama_token_data & a, const llama_token_data & b) {
+        return a.logit > b.logit;
+    };
+
+    const size_t n = cur_p->size;
+
+    if (k <= 128) {
+        // a single pass that rarely touches the heap
+        std::partial_sort(cur_p->data, cur_p->data + k, cur_p->data + n, comp);
+        return;
+    }
+
+    if (n <= 1024 || (size_t) k > n/2) {
+        std::sort(cur_p->data, cur_p->data + n, comp);
+        return;
+    }
+
+    // only the candidates in the buckets that contain the top k are sorted
+    auto & scratch = llama_sampler_get_scratch();
+
+    int histo[LLAMA_SAMPLER_N_BUCKETS];
+    llama_sampler_histogram(cur_p, scratch, histo);
+
+    int nhave = 0;
+    int ib = LLAMA_SAMPLER_N_BUCKETS - 1;
+    for (; ib > 0; --ib) {
+        nhave += histo[ib];
+        if (nhave >= k) {
+            break;
+        }
     }
+
+    llama_sampler_compact(cur_p, scratch, ib);
+
+    auto & tokens = scratch.tokens;
+    GGML_ASSERT(tokens.size() >= (size_t) k);
+
+    std::partial_sort(tokens.begin(), tokens.begin() + k, tokens.end(), comp);
+
+    std::memcpy(cur_p->data, tokens.data(), k*sizeof(llama_token_data));
 }
 
 static void llama_sampler_top_k_impl(llama_token_data_array * cur_p, int32_t k) {
-    // TODO: move bucket sort to separate function so that top_p/typical/softmax first is equally fast
     // if (k >= (int32_t)cur_p->size) {
     //     return;
     // }
@@ -239,63 +482,7 @@ static void llama_sampler_top_k_impl(llama_token_data_array * cur_p, int32_t k)
 
     // Sort scores in descending order
     if (!cur_p->sorted) {
-        auto comp = [](const llama_token_data & a, const llama_token_data & b) {
-            return a.logit > b.logit;
-        };
-        if (k <= 128) {
-            std::partial_sort(cur_p->data, cur_p->data + k, cur_p->data + cur_p->size, comp);
-        } else {
-            constexpr int   nbuckets     = 128;
-            constexpr float bucket_low   = -10.0f;
-            constexpr float bucket_high  =  10.0f;
-            constexpr float bucket_scale = nbuckets/(bucket_high - bucket_low);
-            constexpr float bucket_inter = -bucket_low * bucket_scale;
-
-            std::vector<int> bucket_idx(cur_p->size);
-            std::vector<int> histo(nbuckets, 0);
-
-            for (int i = 0; i < (int)cur_p->size; ++i) {
-                const float val = cur_p->data[i].logit;
-                int ib = int(bucket_scale * val + bucket_inter); //nbuckets * (val - bucket_low) / (bucket_high - bucket_low);
-                ib = std::max(0, std::min(nbuckets - 1, ib));
-                bucket_idx[i] = ib;
-                ++histo[ib];
-            }
-            int nhave = 0;
-            int ib = nbuckets - 1;
-            for ( ; ib >= 0; --ib) {
-                nhave += histo[ib];
-                if (nhave >= k) {
-                    break;
-                }
-            }
-            std::vector<llama_token_data> tmp_tokens(nhave);
-            auto * ptr = tmp_tokens.data();
-            std::vector<llama_token_data*> bucket_ptrs;
-            bucket_ptrs.reserve(nbuckets - ib);
-            for (int j = nbuckets - 1; j >= ib; --j) {
-                bucket_ptrs.push_back(ptr);
-                ptr += histo[j];
-            }
-            for (int i = 0; i < (int)cur_p->size; ++i) {
-                int j = bucket_idx[i];
-                if (j >= ib) {
-                    *bucket_ptrs[nbuckets - 1 - j]++ = cur_p->data[i];
-                }
-            }
-
-            ptr = tmp_tokens.data();
-            int ndone = 0;
-            for (int j = nbuckets - 1; j > ib; --j) {
-                std::sort(ptr, ptr + histo[j], comp);
-                ptr += histo[j];
-                ndone += histo[j];
-            }
-            std::partial_sort(ptr, ptr + k - ndone, ptr + histo[ib], comp);
-
-            std::memcpy(cur_p->data, tmp_tokens.data(), k*sizeof(llama_token_data));
-
-        }
+        llama_sampler_top_k_select(cur_p, k);
         cur_p->sorted = true;
     }
     cur_p->size = k;
@@ -376,11 +563,10 @@ llama_token llama_sampler_sample(struct llama_sampler * smpl, struct llama_conte
 
     const int n_vocab = llama_vocab_n_tokens(vocab);
 
-    // TODO: do not allocate each time
-    std::vector<llama_token_data> cur;
-    cur.reserve(n_vocab);
+    thread_local std::vector<llama_token_data> cur;
+    cur.resize(n_vocab);
     for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
-        cur.emplace_back(llama_token_data{token_id, logits[token_id], 0.0f});
+        cur[token_id] = llama_token_data{token_id, logits[token_id], 0.0f};
     }
 
     llama_token_data_array cur_p = {
@@ -419,13 +605,22 @@ static void llama_sampler_chain_accept(struct llama_sampler * smpl, llama_token
     chain->n_sample++;
 }
 
+static size_t llama_sampler_chain_apply_fused(const std::vector<llama_sampler *> & samplers, size_t i0, llama_token_data_array * cur_p);
+
 static void llama_sampler_chain_apply(struct llama_sampler * smpl, llama_token_data_array * cur_p) {
     auto * chain = (llama_sampler_chain *) smpl->ctx;
 
     time_meas tm(chain->t_sample_us, chain->params.no_perf);
 
-    for (auto * smpl : chain->samplers) {
-        llama_sampler_apply(smpl, cur_p);
+    for (size_t i = 0; i < chain->samplers.size(); ) {
+        const size_t n_fused = llama_sampler_chain_apply_fused(chain->samplers, i, cur_p);
+        if (n_fused > 0) {
+            i += n_fused;
+            continue;
+        }
+
+        llama_sampler_apply(chain->samplers[i], cur_p);
+        i++;
     }
 }
 
@@ -697,6 +892,77 @@ static const char * llama_sampler_top_p_name(const struct llama_sampler * /*smpl
     return "top-p";
 }
 
+// top-p without sorting all candidates: the probabilities are accumulated per bucket of the logit histogram, from the
+// top, until they reach p - only the candidates in these buckets are sorted
+// returns false if the result cannot be determined this way
+static bool llama_sampler_top_p_select(llama_token_data_array * cur_p, float p, size_t min_keep) {
+    auto & scratch = llama_sampler_get_scratch();
+
+    const size_t n = cur_p->size;
+
+    int histo[LLAMA_SAMPLER_N_BUCKETS];
+    const float max_l = llama_sampler_histogram(cur_p, scratch, histo);
+
+    if (scratch.exps.size() < n) {
+        scratch.exps.resize(n);
+    }
+    const float * exps = scratch.exps.data();
+
+    const float sum     = llama_sampler_exp_sum_f32(scratch.exps.data(), scratch.logits.data(), n, max_l, 1.0f);
+    const float inv_sum = 1.0f/sum;
+
+    float bucket_sum[LLAMA_SAMPLER_N_BUCKETS] = {0.0f};
+    for (size_t i = 0; i < n; ++i) {
+        bucket_sum[scratch.bucket[i]] += exps[i];
+    }
+
+    float  cum_sum = 0.0f;
+    size_t nhave   = 0;
+    int    ib      = LLAMA_SAMPLER_N_BUCKETS - 1;
+    for (; ib > 0; --ib) {
+        cum_sum += bucket_sum[ib]*inv_sum;
+        nhave   += histo[ib];
+        if (cum_sum >= p && nhave >= min_keep) {
+            break;
+        }
+    }
+    if (ib == 0) {
+        return false;
+    }
+
+    // the probabilities are needed after the compaction
+    for (size_t i = 0; i < n; ++i) {
+        cur_p->data[i].p = exps[i]*inv_sum;
+    }
+
+    llama_sampler_compact(cur_p, scratch, ib);
+
+    auto & tokens = scratch.tokens;
+    std::sort(tokens.begin(), tokens.end(), [](const llama_token_data & a, const llama_token_data & b) {
+        return a.logit > b.logit;
+    });
+
+    cum_sum = 0.0f;
+    size_t last_idx = 0;
+    for (size_t i = 0; i < tokens.size(); ++i) {
+        cum_sum += tokens[i].p;
+        if (cum_sum >= p && i + 1 >= min_keep) {
+            last_idx = i + 1;
+            break;
+        }
+    }
+    if (last_idx == 0) {
+        // rounding - the cut is in a lower bucket
+        return false;
+    }
+
+    std::memcpy(cur_p->data, tokens.data(), last_idx*sizeof(llama_token_data));
+    cur_p->size   = last_idx;
+    cur_p->sorted = true;
+
+    return true;
+}
+
 static void llama_sampler_top_p_apply(struct llama_sampler * smpl, llama_token_data_array * cur_p) {
     const auto * ctx = (llama_sampler_top_p *) smpl->ctx;
 
@@ -704,6 +970,10 @@ static void llama_sampler_top_p_apply(struct llama_sampler * smpl, llama_token_d
         return;
     }
 
+    if (!cur_p->sorted && cur_p->size > 1024 && llama_sampler_top_p_select(cur_p, ctx->p, ctx->min_keep)) {
+        return;
+    }
+
     llama_sampler_softmax_impl(cur_p);
 
     // Compute the cumulative probabilities
@@ -775,24 +1045,27 @@ static void llama_sampler_min_p_apply(struct llama_sampler * smpl, llama_token_d
 
     // if the cur_p aren't sorted, try the unsorted implementation first
     if (!cur_p->sorted) {
-        std::vector<llama_token_data> filtered_tokens;
+        auto & scratch = llama_sampler_get_scratch();
 
-        float max_logit = -FLT_MAX;
-        for (size_t i = 0; i < cur_p->size; ++i) {
-            max_logit = std::max(max_logit, cur_p->data[i].logit);
-        }
+        const float * logits = llama_sampler_gather_logits(cur_p, scratch.logits);
+
+        const float max_logit = llama_sampler_max_f32(logits, cur_p->size);
         const float min_logit = max_logit + logf(ctx->p); // min logit for p_i >= p * p_max
 
+        size_t n_keep = 0;
         for (size_t i = 0; i < cur_p->size; ++i) {
-            if (cur_p->data[i].logit >= min_logit) {
-                filtered_tokens.push_back(cur_p->data[i]);
-            }
+            n_keep += logits[i] >= min_logit;
         }
 
         // if we have enough values the operation was a success
-        if (filtered_tokens.size() >= ctx->min_keep) {
-            memcpy(cur_p->data, filtered_tokens.data(), filtered_tokens.size()*sizeof(llama_token_data));
-            cur_p->size = filtered_tokens.size();
+        if (n_keep >= ctx->min_keep) {
+            // compact in place, the order of the kept candidates is preserved
+            size_t j = 0;
+            for (size_t i = 0; i < cur_p->size; ++i) {
+                cur_p->data[j] = cur_p->data[i];
+                j += logits[i] >= min_logit;
+            }
+            cur_p->size = n_keep;
             min_p_applied = true;
         }
     }
@@ -877,18 +1150,21 @@ static void llama_sampler_typical_apply(struct llama_sampler * smpl, llama_token
         entropy += -cur_p->data[i].p * logf(cur_p->data[i].p);
     }
 
+    auto & scratch = llama_sampler_get_scratch();
+
     // Compute the absolute difference between negative log probability and entropy for each candidate
-    std::vector<float> shifted_scores;
+    auto & shifted_scores = scratch.exps;
+    shifted_scores.resize(cur_p->size);
     for (size_t i = 0; i < cur_p->size; ++i) {
-        float shifted_score = fabsf(-logf(cur_p->data[i].p) - entropy);
-        shifted_scores.push_back(shifted_score);
+        shifted_scores[i] = fabsf(-logf(cur_p->data[i].p) - entropy);
     }
 
     // Sort tokens based on the shifted_scores and their corresponding indices
-    std::vector<size_t> indices(cur_p->size);
+    auto & indices = scratch.bucket;
+    indices.resize(cur_p->size);
     std::iota(indices.begin(), indices.end(), 0);
 
-    std::sort(indices.begin(), indices.end(), [&](size_t a, size_t b) {
+    std::sort(indices.begin(), indices.end(), [&](int32_t a, int32_t b) {
         return shifted_scores[a] < shifted_scores[b];
     });
 
@@ -908,15 +1184,15 @@ static void llama_sampler_typical_apply(struct llama_sampler * smpl, llama_token
     }
 
     // Resize the output vector to keep only the locally typical tokens
-    std::vector<llama_token_data> cur_p_new;
+    auto & cur_p_new = scratch.tokens;
+    cur_p_new.resize(last_idx);
     for (size_t i = 0; i < last_idx; ++i) {
-        size_t idx = indices[i];
-        cur_p_new.push_back(cur_p->data[idx]);
+        cur_p_new[i] = cur_p->data[indices[i]];
     }
 
     // Replace the data in cur_p with the cur_p_new data
     std::copy(cur_p_new.begin(), cur_p_new.end(), cur_p->data);
-    cur_p->size = cur_p_new.size();
+    cur_p->size = last_idx;
     cur_p->sorted = false;
 }
 
@@ -1198,6 +1474,151 @@ struct llama_sampler * llama_sampler_init_xtc(float p, float t, size_t min_keep,
     };
 }
 
+// fused top-k pipeline
+
+// applies a top-k sampler together with the samplers that follow it in the chain and only need its k candidates:
+// temperatures are folded into a single scale, and the exps of the scaled logits are computed once and shared by
+// top-p, softmax and the final draw
+// returns the number of samplers that were applied, 0 if samplers[i0] does not start such a sequence
+static size_t llama_sampler_chain_apply_fused(const std::vector<llama_sampler *> & samplers, size_t i0, llama_token_data_array * cur_p) {
+    if (samplers[i0]->iface != &llama_sampler_top_k_i || i0 + 1 >= samplers.size() || cur_p->size == 0) {
+        return 0;
+    }
+
+    const int32_t k = ((const llama_sampler_top_k *) samplers[i0]->ctx)->k;
+    if (k <= 0) {
+        return 0;
+    }
+
+    llama_sampler_top_k_impl(cur_p, k);
+
+    auto & scratch = llama_sampler_get_scratch();
+
+    float inv_temp = 1.0f; // not yet applied to the logits
+
+    // scratch.exps[i] = exp((logit_i - logit_0)*inv_temp) for the current candidates
+    bool  exps_valid = false;
+    float exps_sum   = 0.0f;
+
+    auto compute_exps = [&]() {
+        if (exps_valid) {
+            return;
+        }
+        const float * logits = llama_sampler_gather_logits(cur_p, scratch.logits);
+        if (scratch.exps.size() < cur_p->size) {
+            scratch.exps.resize(cur_p->size);
+        }
+        exps_sum   = llama_sampler_exp_sum_f32(scratch.exps.data(), logits, cur_p->size, cur_p->data[0].logit, inv_temp);
+        exps_valid = true;
+    };
+
+    auto set_probs = [&]() {
+        compute_exps();
+        const float inv_sum = 1.0f/exps_sum;
+        for (size_t i = 0; i < cur_p->size; ++i) {
+            cur_p->data[i].p = scratch.exps[i]*inv_sum;
+        }
+    };
+
+    auto truncate = [&](size_t size) {
+        if (size < cur_p->size && exps_valid) {
+            exps_sum = 0.0f;
+            for (size_t i = 0; i < size; ++i) {
+                exps_sum += scratch.exps[i];
+            }
+        }
+        cur_p->size = size;
+    };
+
+    size_t i = i0 + 1;
+    for (; i < samplers.size(); ++i) {
+        const auto * smpl = samplers[i];
+
+        if (smpl->iface == &llama_sampler_temp_i || smpl->iface == &llama_sampler_temp_ext_i) {
+            float temp;
+            if (smpl->iface == &llama_sampler_temp_i) {
+                temp = ((const llama_sampler_temp *) smpl->ctx)->temp;
+            } else {
+                const auto * ctx = (const llama_sampler_temp_ext *) smpl->ctx;
+                if (ctx->delta > 0) {
+                    break;
+                }
+                temp = ctx->temp;
+            }
+            if (temp <= 0.0f) {
+                break;
+            }
+            inv_temp  /= temp;
+            exps_valid = false;
+        } else if (smpl->iface == &llama_sampler_top_p_i) {
+            const auto * ctx = (const llama_sampler_top_p *) smpl->ctx;
+            if (ctx->p >= 1.0f) {
+                continue;
+            }
+
+            set_probs();
+
+            float  cum_sum  = 0.0f;
+            size_t last_idx = cur_p->size;
+            for (size_t j = 0; j < cur_p->size; ++j) {
+                cum_sum += cur_p->data[j].p;
+                if (cum_sum >= ctx->p && j + 1 >= ctx->min_keep) {
+                    last_idx = j + 1;
+                    break;
+                }
+            }
+
+            truncate(last_idx);
+        } else if (smpl->iface == &llama_sampler_min_p_i) {
+            const auto * ctx = (const llama_sampler_min_p *) smpl->ctx;
+            if (ctx->p <= 0.0f) {
+                continue;
+            }
+
+            const float min_logit = cur_p->data[0].logit*inv_temp + logf(ctx->p);
+
+            size_t j = 1;
+            for (; j < cur_p->size; ++j) {
+                if (cur_p->data[j].logit*inv_temp < min_logit && j >= ctx->min_keep) {
+                    break;
+                }
+            }
+
+            truncate(j);
+        } else if (smpl->iface == &llama_sampler_softmax_i) {
+            set_probs();
+        } else if (smpl->iface == &llama_sampler_typical_i && ((const llama_sampler_typical *) smpl->ctx)->p >= 1.0f) {
+            continue;
+        } else if (smpl->iface == &llama_sampler_xtc_i) {
+            const auto * ctx = (const llama_sampler_xtc *) smpl->ctx;
+            // no-op that does not draw from the RNG of the sampler
+            if (ctx->probability <= 0.0f || ctx->threshold > 0.5f || cur_p->size < 2) {
+                continue;
+            }
+            break;
+        } else if (smpl->iface == &llama_sampler_dist_i) {
+            auto * ctx = (llama_sampler_dist *) smpl->ctx;
+
+            set_probs();
+
+            cur_p->selected = llama_sample_dist(cur_p, ctx->rng);
+
+            ++i;
+            break;
+        } else {
+            break;
+        }
+    }
+
+    if (inv_temp != 1.0f) {
+        for (size_t j = 0; j < cur_p->size; ++j) {
+            cur_p->data[j].logit *= inv_temp;
+        }
+    }
+
+    return i - i0;
+}
+
 // mirostat
 
 struct llama_sampler_mirostat {
@@ -1509,6 +1930,28 @@ struct llama_sampler * llama_sampler_init_grammar(const struct llama_vocab * voc
     };
 }
 
+bool llama_sampler_grammar_get_bitmask(const struct llama_sampler * smpl, uint64_t * bitmask, size_t n_words) {
+    if (smpl->iface != &llama_sampler_grammar_i) {
+        return false;
+    }
+
+    const auto * ctx = (const llama_sampler_grammar *) smpl->ctx;
+
+    const size_t n_vocab = llama_vocab_n_tokens(ctx->vocab);
+    if (n_words < (n_vocab + 63)/64) {
+        return false;
+    }
+
+    if (!ctx->grammar) {
+        std::fill(bitmask, bitmask + n_words, ~uint64_t(0));
+        return true;
+    }
+
+    llama_grammar_get_bitmask_impl(*ctx->grammar, bitmask);
+
+    return true;
+}
+
 // penalties
 
 struct llama_sampler_penalties {
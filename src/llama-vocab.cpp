@@ -6,62 +6,172 @@
 #include "unicode.h"
 
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <cassert>
 #include <cfloat>
 #include <climits>
 #include <cstdarg>
 #include <cstring>
+#include <exception>
 #include <forward_list>
+#include <functional>
+#include <list>
 #include <map>
+#include <mutex>
 #include <queue>
 #include <set>
+#include <string_view>
+#include <thread>
 #include <unordered_map>
 
 //
 // helpers
 //
 
-struct naive_trie {
-    naive_trie() : has_value(false), value(0) {
-    }
-    void insert(const char * key, size_t len, int32_t value = 0) {
-        if (len == 0) {
-            this->has_value = true;
-            this->value = value;
-            return;
-        }
-        char c = key[0];
-        auto res = children.find(c);
-        if (res != children.end()) {
-            res->second.insert(key + 1, len - 1, value);
-        } else {
-            auto res = children.insert(std::make_pair(c, naive_trie()));
-            res.first->second.insert(key + 1, len - 1, value);
+// double-array trie over the bytes of the keys, built once and read-only afterwards
+// the children of node s are at base[s] + c and are recognized by check[child] == s
+struct llama_trie {
+    static constexpr int32_t root = 0;
+
+    // the last value wins for duplicate keys
+    void build(std::vector<std::pair<std::string, int32_t>> entries) {
+        std::stable_sort(entries.begin(), entries.end(), [](const auto & a, const auto & b) { return a.first < b.first; });
+
+        // keep the last of the duplicates
+        std::vector<std::pair<std::string, int32_t>> keys;
+        keys.reserve(entries.size());
+        for (auto & entry : entries) {
+            if (!keys.empty() && keys.back().first == entry.first) {
+                keys.back().second = entry.second;
+            } else {
+                keys.push_back(std::move(entry));
+            }
         }
-    }
-    std::pair<const char *, size_t> get_longest_prefix(const char * key, size_t len, size_t offset = 0) const {
-        if (len == 0 || offset == len) {
-            return std::make_pair(key, offset);
+
+        nodes.assign(1, node{});
+        nodes[root].check = -2;
+
+        size_t next_free = 1;
+
+        struct range {
+            int32_t node;
+            size_t  begin;
+            size_t  end;
+            size_t  depth;
+        };
+
+        std::vector<range> stack = { { root, 0, keys.size(), 0 } };
+        std::vector<std::pair<uint8_t, size_t>> children; // label, begin of the sub-range
+
+        while (!stack.empty()) {
+            const range r = stack.back();
+            stack.pop_back();
+
+            size_t begin = r.begin;
+            if (begin < r.end && keys[begin].first.size() == r.depth) {
+                nodes[r.node].value = keys[begin].second;
+                begin++;
+            }
+            if (begin == r.end) {
+                continue;
+            }
+
+            children.clear();
+            for (size_t i = begin; i < r.end; ++i) {
+                const uint8_t c = keys[i].first[r.depth];
+                if (children.empty() || children.back().first != c) {
+                    children.emplace_back(c, i);
+                }
+            }
+
+            // first fit: the lowest base for which all the children land on free slots
+            while (next_free < nodes.size() && nodes[next_free].check != -1) {
+                next_free++;
+            }
+            int32_t base = 0;
+            for (size_t pos = std::max<size_t>(next_free, children[0].first + 1); ; ++pos) {
+                if (pos < nodes.size() && nodes[pos].check != -1) {
+                    continue;
+                }
+                base = pos - children[0].first;
+                bool fit = true;
+                for (const auto & child : children) {
+                    const size_t t = base + child.first;
+                    if (t < nodes.size() && nodes[t].check != -1) {
+                        fit = false;
+                        break;
+                    }
+                }
+                if (fit) {
+                    break;
+                }
+            }
+
+            const size_t n_needed = base + children.back().first + 1;
+            if (nodes.size() < n_needed) {
+                nodes.resize(std::max(n_needed, nodes.size() + nodes.size()/2));
+            }
+
+            nodes[r.node].base = base;
+            for (size_t i = 0; i < children.size(); ++i) {
+                const int32_t t = base + children[i].first;
+                nodes[t].check = r.node;
+                stack.push_back({ t, children[i].second, i + 1 < children.size() ? children[i + 1].second : r.end, r.depth + 1 });
+            }
         }
-        char c = key[offset];
-        auto res = children.find(c);
-        if (res != children.end()) {
-            return res->second.get_longest_prefix(key, len, offset + 1);
+
+        while (!nodes.empty() && nodes.back().check == -1) {
+            nodes.pop_back();
         }
+        nodes.shrink_to_fit();
+    }
+
+    // the child of the node for the byte c, -1 if there is none
+    int32_t traverse(int32_t s, char c) const {
+        const size_t t = (size_t) nodes[s].base + (uint8_t) c;
+        return t < nodes.size() && nodes[t].check == s ? (int32_t) t : -1;
+    }
 
-        return std::make_pair(key, offset);
+    bool has_value(int32_t s) const {
+        return nodes[s].value >= 0;
     }
-    const struct naive_trie * traverse(const char c) const {
-        auto res = children.find(c);
-        if (res != children.end()) {
-            return &res->second;
+
+    int32_t value(int32_t s) const {
+        return nodes[s].value;
+    }
+
+    // the value of the key, -1 if it is not in the trie
+    int32_t find(const char * key, size_t len) const {
+        int32_t s = root;
+        for (size_t i = 0; i < len && s >= 0; ++i) {
+            s = traverse(s, key[i]);
         }
+        return s >= 0 ? value(s) : -1;
+    }
+
+    // length of the longest prefix of the key that is a path of the trie (not necessarily a key)
+    size_t get_longest_prefix(const char * key, size_t len) const {
+        int32_t s = root;
+        size_t offset = 0;
+        while (offset < len && (s = traverse(s, key[offset])) >= 0) {
+            offset++;
+        }
+        return offset;
+    }
 
-        return NULL;
+    bool empty() const {
+        return nodes.size() <= 1 && !has_value(root);
     }
-    std::map<char, struct naive_trie> children;
-    bool has_value;
-    llama_token value;
+
+private:
+    struct node {
+        int32_t base  = 0;
+        int32_t check = -1; // -1 for the free slots
+        int32_t value = -1; // -1 if no key ends here
+    };
+
+    std::vector<node> nodes = std::vector<node>(1);
 };
 
 //
@@ -267,11 +377,79 @@ struct llm_bigram_bpe {
     using queue = llama_priority_queue<llm_bigram_bpe, queue_storage, comparator>;
     llm_symbol::index left;
     llm_symbol::index right;
-    std::string text;
+    llama_token merged;
     int rank;
     size_t size;
 };
 
+// LRU cache of the tokens of the pre-tokenized words, sharded to keep the lock contention low
+struct llm_tokenizer_bpe_cache {
+    static constexpr size_t n_shards  = 16;
+    static constexpr size_t n_words   = 4096; // per shard
+    static constexpr size_t max_bytes = 64;   // longer words are not cached
+
+    // appends the tokens of the word to the output
+    bool get(const std::string & word, std::vector<llama_token> & output) {
+        if (word.size() > max_bytes) {
+            return false;
+        }
+
+        auto & shard = shard_of(word);
+
+        std::lock_guard<std::mutex> lock(shard.mutex);
+
+        auto it = shard.map.find(word);
+        if (it == shard.map.end()) {
+            return false;
+        }
+
+        // move to the front
+        shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+
+        const auto & tokens = it->second->second;
+        output.insert(output.end(), tokens.begin(), tokens.end());
+
+        return true;
+    }
+
+    void put(const std::string & word, const llama_token * tokens, size_t n_tokens) {
+        if (word.size() > max_bytes) {
+            return;
+        }
+
+        auto & shard = shard_of(word);
+
+        std::lock_guard<std::mutex> lock(shard.mutex);
+
+        if (shard.map.find(word) != shard.map.end()) {
+            return;
+        }
+
+        if (shard.lru.size() >= n_words) {
+            shard.map.erase(shard.lru.back().first);
+            shard.lru.pop_back();
+        }
+
+        shard.lru.emplace_front(word, std::vector<llama_token>(tokens, tokens + n_tokens));
+        shard.map.emplace(shard.lru.front().first, shard.lru.begin());
+    }
+
+private:
+    struct shard_t {
+        std::mutex mutex;
+
+        // most recently used first, the keys of the map point to the words in the list
+        std::list<std::pair<std::string, std::vector<llama_token>>> lru;
+        std::unordered_map<std::string_view, decltype(lru)::iterator> map;
+    };
+
+    shard_t & shard_of(const std::string & word) {
+        return shards[std::hash<std::string>{}(word) % n_shards];
+    }
+
+    std::array<shard_t, n_shards> shards;
+};
+
 struct llm_tokenizer_bpe : llm_tokenizer {
     llm_tokenizer_bpe(const llama_vocab & vocab) {
         GGML_ASSERT(vocab.get_type() == LLAMA_VOCAB_TYPE_BPE);
@@ -405,6 +583,9 @@ struct llm_tokenizer_bpe : llm_tokenizer {
     }
 
     std::vector<std::string> regex_exprs;
+
+    // shared by all sessions
+    mutable llm_tokenizer_bpe_cache cache;
 };
 
 struct llm_tokenizer_bpe_session {
@@ -448,121 +629,127 @@ struct llm_tokenizer_bpe_session {
     }
 
     void tokenize(const std::string & text, std::vector<llama_token> & output) {
-        int final_prev_index = -1;
         const auto word_collection = unicode_regex_split(text, tokenizer.regex_exprs);
 
-        symbols_final.clear();
-
         for (const auto & word : word_collection) {
-            work_queue = llm_bigram_bpe::queue();
-            symbols.clear();
+            if (tokenizer.cache.get(word, output)) {
+                continue;
+            }
+
+            const size_t n_output = output.size();
 
-            int index = 0;
-            size_t offset = 0;
+            tokenize_word(word, output);
 
-            //if (vocab.tokenizer_ignore_merges && vocab.token_to_id.find(word) != vocab.token_to_id.end()) {
-            if (vocab.get_ignore_merges() && vocab.text_to_token(word) != LLAMA_TOKEN_NULL) {
+            tokenizer.cache.put(word, output.data() + n_output, output.size() - n_output);
+        }
+    }
+
+private:
+    void tokenize_word(const std::string & word, std::vector<llama_token> & output) {
+        work_queue = llm_bigram_bpe::queue();
+        symbols.clear();
+        symbol_ids.clear();
+
+        int index = 0;
+        size_t offset = 0;
+
+        //if (vocab.tokenizer_ignore_merges && vocab.token_to_id.find(word) != vocab.token_to_id.end()) {
+        if (vocab.get_ignore_merges()) {
+            const llama_token token = vocab.text_to_token(word);
+            if (token != LLAMA_TOKEN_NULL) {
                 symbols.emplace_back(llm_symbol{-1, -1, word.c_str(), word.size()});
+                symbol_ids.push_back(token);
                 offset = word.size();
             }
+        }
 
-            while (offset < word.size()) {
-                llm_symbol sym;
-                size_t char_len = std::min(word.size() - offset, (size_t) unicode_len_utf8(word[offset]));
-                sym.text = word.c_str() + offset;
-                sym.n = char_len;
-                offset += sym.n;
-                sym.prev = index - 1;
-                sym.next = offset == word.size() ? -1 : index + 1;
-                index++;
-                symbols.emplace_back(sym);
-            }
-            for (int i = 1; i < (int) symbols.size(); ++i) {
-                add_new_bigram(i - 1, i);
-            }
-
-            // build token(s)
-            while (!work_queue.empty()) {
-                auto bigram = work_queue.pop_move();
+        while (offset < word.size()) {
+            llm_symbol sym;
+            size_t char_len = std::min(word.size() - offset, (size_t) unicode_len_utf8(word[offset]));
+            sym.text = word.c_str() + offset;
+            sym.n = char_len;
+            offset += sym.n;
+            sym.prev = index - 1;
+            sym.next = offset == word.size() ? -1 : index + 1;
+            index++;
+            symbols.emplace_back(sym);
+            symbol_ids.push_back(vocab.text_to_token(std::string(sym.text, sym.n)));
+        }
+        for (int i = 1; i < (int) symbols.size(); ++i) {
+            add_new_bigram(i - 1, i);
+        }
 
-                auto & left_symbol = symbols[bigram.left];
-                auto & right_symbol = symbols[bigram.right];
+        // build token(s)
+        while (!work_queue.empty()) {
+            auto bigram = work_queue.pop_move();
 
-                if (left_symbol.n == 0 || right_symbol.n == 0) {
-                    continue;
-                }
-                std::string left_token = std::string(left_symbol.text, left_symbol.n);
-                std::string right_token = std::string(right_symbol.text, right_symbol.n);
-                if (left_token + right_token != bigram.text) {
-                    continue;  // Skip this bigram if it's outdated
-                }
+            auto & left_symbol = symbols[bigram.left];
+            auto & right_symbol = symbols[bigram.right];
 
-                // merge the right sym into the left one
-                left_symbol.n += right_symbol.n;
-                right_symbol.n = 0;
+            if (left_symbol.n == 0 || right_symbol.n == 0) {
+                continue;
+            }
+            // the symbols are adjacent in the word, so the bigram is outdated iff one of them has grown
+            if (left_symbol.n + right_symbol.n != bigram.size) {
+                continue;
+            }
 
-                // remove the right sym from the chain
-                left_symbol.next = right_symbol.next;
-                if (right_symbol.next >= 0) {
-                    symbols[right_symbol.next].prev = bigram.left;
-                }
+            // merge the right sym into the left one
+            left_symbol.n += right_symbol.n;
+            right_symbol.n = 0;
+            symbol_ids[bigram.left] = bigram.merged;
 
-                add_new_bigram(left_symbol.prev, bigram.left);  // left side of current symbol
-                add_new_bigram(bigram.left, left_symbol.next);  // right side of current symbol
+            // remove the right sym from the chain
+            left_symbol.next = right_symbol.next;
+            if (right_symbol.next >= 0) {
+                symbols[right_symbol.next].prev = bigram.left;
             }
 
-            // add the finished tokens to the final list keeping correct order for next and prev
-            for (auto & sym : symbols) {
-                if (sym.n > 0) {
-                    sym.prev = final_prev_index;
-                    sym.next = -1;
-                    if (final_prev_index != -1) {
-                        symbols_final[final_prev_index].next = symbols_final.size();
-                    }
-                    symbols_final.emplace_back(sym);
-                    final_prev_index = symbols_final.size() - 1;
-                }
-            }
+            add_new_bigram(left_symbol.prev, bigram.left);  // left side of current symbol
+            add_new_bigram(bigram.left, left_symbol.next);  // right side of current symbol
         }
 
-        symbols = symbols_final;
-
-        if (!symbols.empty()) {
-            for (int i = 0; i != -1; i = symbols[i].next) {
-                auto & symbol = symbols[i];
-                if (symbol.n == 0) {
-                    continue;
-                }
+        for (size_t i = 0; i < symbols.size(); ++i) {
+            const auto & symbol = symbols[i];
+            if (symbol.n == 0) {
+                continue;
+            }
 
-                const std::string str = std::string(symbol.text, symbol.n);
-                const auto token = vocab.text_to_token(str);
+            if (symbol_ids[i] != LLAMA_TOKEN_NULL) {
+                output.push_back(symbol_ids[i]);
+                continue;
+            }
 
-                if (token == LLAMA_TOKEN_NULL) {
-                    for (auto j = str.begin(); j != str.end(); ++j) {
-                        std::string byte_str(1, *j);
-                        auto token_multibyte = vocab.text_to_token(byte_str);
-                        if (token_multibyte != LLAMA_TOKEN_NULL) {
-                            output.push_back(token_multibyte);
-                        }
-                    }
-                } else {
-                    output.push_back(token);
+            for (size_t j = 0; j < symbol.n; ++j) {
+                auto token_multibyte = vocab.text_to_token(std::string(1, symbol.text[j]));
+                if (token_multibyte != LLAMA_TOKEN_NULL) {
+                    output.push_back(token_multibyte);
                 }
             }
         }
     }
 
-private:
     void add_new_bigram(int left, int right) {
         if (left == -1 || right == -1) {
             return;
         }
-        std::string left_token  = std::string(symbols[left].text,  symbols[left].n);
-        std::string right_token = std::string(symbols[right].text, symbols[right].n);
+
+        llama_token merged = LLAMA_TOKEN_NULL;
 
         int rank_found = -1;
 
-        rank_found = vocab.find_bpe_rank(left_token, right_token);
+        if (symbol_ids[left] != LLAMA_TOKEN_NULL && symbol_ids[right] != LLAMA_TOKEN_NULL) {
+            rank_found = vocab.find_bpe_rank(symbol_ids[left], symbol_ids[right], merged);
+        } else {
+            // merges of texts that are not tokens
+            std::string left_token  = std::string(symbols[left].text,  symbols[left].n);
+            std::string right_token = std::string(symbols[right].text, symbols[right].n);
+
+            rank_found = vocab.find_bpe_rank(left_token, right_token);
+            if (rank_found >= 0) {
+                merged = vocab.text_to_token(left_token + right_token);
+            }
+        }
 
         if (rank_found < 0) {
             return;
@@ -570,11 +757,11 @@ private:
 
         llm_bigram_bpe bigram;
 
-        bigram.left  = left;
-        bigram.right = right;
-        bigram.text  = left_token + right_token;
-        bigram.size  = left_token.size() + right_token.size();
-        bigram.rank  = rank_found;
+        bigram.left   = left;
+        bigram.right  = right;
+        bigram.merged = merged;
+        bigram.size   = symbols[left].n + symbols[right].n;
+        bigram.rank   = rank_found;
 
         work_queue.push(bigram);
     }
@@ -582,8 +769,8 @@ private:
     const llama_vocab & vocab;
     const llm_tokenizer_bpe & tokenizer;
 
-    std::vector<llm_symbol> symbols;
-    std::vector<llm_symbol> symbols_final;
+    std::vector<llm_symbol>  symbols;
+    std::vector<llama_token> symbol_ids; // LLAMA_TOKEN_NULL if the text of the symbol is not a token
     llm_bigram_bpe::queue work_queue;
 };
 
@@ -732,6 +919,9 @@ struct llm_tokenizer_ugm : llm_tokenizer {
             prefix_replacements_size = precompiled_charsmap.size() - charsmap_offset;
         }
 
+        std::vector<std::pair<std::string, int32_t>> tokens;
+        std::vector<std::pair<std::string, int32_t>> user_defined_tokens;
+
         for (uint32_t id = 0; id < vocab.n_tokens(); ++id) {
             const auto & token_data = vocab.get_token_data(id);
 
@@ -743,14 +933,17 @@ struct llm_tokenizer_ugm : llm_tokenizer {
             if (vocab.is_normal(id) ||
                 vocab.is_user_defined(id) ||
                 vocab.is_unused(id)) {
-                token_matcher.insert(token_data.text.data(), token_data.text.size(), id);
+                tokens.emplace_back(token_data.text, id);
             }
 
             if (vocab.is_user_defined(id)) {
-                user_defined_token_matcher.insert(token_data.text.data(), token_data.text.size());
+                user_defined_tokens.emplace_back(token_data.text, 0);
             }
         }
 
+        token_matcher.build(std::move(tokens));
+        user_defined_token_matcher.build(std::move(user_defined_tokens));
+
         unknown_token_score = min_score - unknown_token_score_penalty;
     }
 
@@ -763,7 +956,7 @@ struct llm_tokenizer_ugm : llm_tokenizer {
     const uint32_t * xcda_array = NULL;
     size_t xcda_array_size = 0;
 
-    struct naive_trie user_defined_token_matcher;
+    llama_trie user_defined_token_matcher;
 
     float min_score = FLT_MAX;
     float max_score = -FLT_MAX;
@@ -771,7 +964,7 @@ struct llm_tokenizer_ugm : llm_tokenizer {
     float unknown_token_score_penalty = 10.0;
     float unknown_token_score;
 
-    struct naive_trie token_matcher;
+    llama_trie token_matcher;
 };
 
 struct llm_tokenizer_ugm_session {
@@ -815,16 +1008,17 @@ struct llm_tokenizer_ugm_session {
             // traverse the token matcher trie to find a matching token
             bool single_codepoint_token_found = false;
             const struct best_tokenization & current_best = tokenization_results[input_offset];
-            const struct naive_trie * node = tokenizer.token_matcher.traverse(normalized[prefix_offset++]);
+            const llama_trie & trie = tokenizer.token_matcher;
+            int32_t node = trie.traverse(llama_trie::root, normalized[prefix_offset++]);
 
-            while (prefix_offset <= input_len && node != NULL) {
+            while (prefix_offset <= input_len && node >= 0) {
                 // check if we found valid token in prefix
-                if (node->has_value) {
+                if (trie.has_value(node)) {
                     // check if it corresponds to the whole UTF code point
                     if (prefix_offset - input_offset == n_utf8_code_units) {
                         single_codepoint_token_found = true;
                     }
-                    llama_token token_id = node->value;
+                    llama_token token_id = trie.value(node);
                     const auto & token_data = vocab.get_token_data(token_id);
 
                     // we set the user-defined token scores to 0 to make them more likely to be selected
@@ -839,7 +1033,7 @@ struct llm_tokenizer_ugm_session {
                         current_champ = challenger;
                     }
                 }
-                node = node->traverse(normalized[prefix_offset++]);
+                node = trie.traverse(node, normalized[prefix_offset++]);
             }
 
             // if we didn't find a valid token corresponding to the whole UTF code point
@@ -984,10 +1178,10 @@ private:
         }
 
         // if input prefix matches some user-defined token return this token as normalization result
-        auto user_defined_token_match =
+        const size_t user_defined_token_match =
            tokenizer.user_defined_token_matcher.get_longest_prefix(&input[input_offset], input.size() - input_offset);
-        if (user_defined_token_match.second > 0) {
-            return { &input[input_offset], user_defined_token_match.second, user_defined_token_match.second };
+        if (user_defined_token_match > 0) {
+            return { &input[input_offset], user_defined_token_match, user_defined_token_match };
         }
 
         size_t longest_prefix_length = 0;
@@ -1117,24 +1311,29 @@ struct llm_tokenizer_rwkv : llm_tokenizer {
         // For now, we decode the vocab here into the lookup we'll use for tokenization.
 
         // build trie
+        std::vector<std::pair<std::string, int32_t>> tokens;
+        tokens.reserve(vocab.n_tokens());
         for (uint32_t id = 0; id < vocab.n_tokens(); ++id) {
             const auto & data = vocab.get_token_data(id);
             const auto text = llama_unescape_rwkv_token(data.text);
-            token_matcher.insert((const char *) text.data(), text.size(), id);
+            tokens.emplace_back(std::string((const char *) text.data(), text.size()), id);
         }
+        token_matcher.build(std::move(tokens));
     }
 
-    struct naive_trie token_matcher;
+    llama_trie token_matcher;
 };
 
 struct llm_tokenizer_rwkv_session {
     llm_tokenizer_rwkv_session(const llama_vocab & vocab, const llm_tokenizer_rwkv & tokenizer) : vocab(vocab), tokenizer(tokenizer) {}
 
     void tokenize(const std::string & text, std::vector<llama_token> & output) {
+        const llama_trie & trie = tokenizer.token_matcher;
+
         uint32_t position = 0;
         while (position < text.size()) {
-            const struct naive_trie * node = tokenizer.token_matcher.traverse(text[position]);
-            if (node == NULL) {
+            int32_t node = trie.traverse(llama_trie::root, text[position]);
+            if (node < 0) {
                 // no matching token found, add unknown token
                 output.push_back(vocab.token_unk());
                 position += 1;
@@ -1144,12 +1343,12 @@ struct llm_tokenizer_rwkv_session {
             // traverse the trie to find the longest matching token
             uint32_t token_id = 0;
             uint32_t token_length = 0;
-            while (node != NULL) {
-                if (node->has_value) {
-                    token_id = node->value;
+            while (node >= 0) {
+                if (trie.has_value(node)) {
+                    token_id = trie.value(node);
                     token_length = position + 1;
                 }
-                node = node->traverse(text[++position]);
+                node = trie.traverse(node, text[++position]);
             }
 
             // add the longest matching token
@@ -1240,11 +1439,17 @@ struct llama_vocab::impl {
     bool escape_whitespaces         = true;
     bool treat_whitespace_as_suffix = false;
 
+    // the tokens of the text on both sides of a space that follows an ASCII letter or digit are independent
+    bool split_at_spaces = false;
+
     std::unordered_map<std::string, llama_token> token_to_id;
     std::vector<token_data>                      id_to_token;
 
     std::vector<llama_token> cache_special_tokens;
     std::vector<std::string> cache_token_to_piece; // llama_token_to_piece(special = true);
+
+    // text of the special tokens -> index in cache_special_tokens (the first one for duplicate texts)
+    llama_trie special_token_matcher;
     struct pair_hash {
         size_t operator()(const std::pair<std::string, std::string> & p) const {
             return std::hash<std::string>{}(p.first) ^  //create some hash for pair
@@ -1253,6 +1458,13 @@ struct llama_vocab::impl {
     };
     std::unordered_map<std::pair<std::string, std::string>, int, pair_hash> bpe_ranks;
 
+    // the merges of pairs of tokens, keyed by (left << 32 | right)
+    struct bpe_merge {
+        int         rank;
+        llama_token merged; // LLAMA_TOKEN_NULL if the merged text is not a token
+    };
+    std::unordered_map<uint64_t, bpe_merge> bpe_ranks_id;
+
     // set of all tokens that cause "end of generation"
     std::set<llama_token> special_eog_ids;
 
@@ -1287,6 +1499,13 @@ struct llama_vocab::impl {
 
     void tokenizer_st_partition(std::forward_list<fragment_buffer_variant> & buffer, bool parse_special) const;
 
+    // tokenizes the text with tokenize_chunk, in chunks on up to n_threads threads if the text can be split safely
+    void tokenize_chunks(
+            const std::string & text,
+       std::vector<llama_token> & output,
+                      int32_t   n_threads,
+            const std::function<void(const std::string &, std::vector<llama_token> &)> & tokenize_chunk) const;
+
     std::string token_to_piece_for_cache(
                   llama_token   token,
                          bool   special) const;
@@ -1295,7 +1514,8 @@ struct llama_vocab::impl {
     std::vector<llama_token> tokenize(
             const std::string & raw_text,
                          bool   add_special,
-                         bool   parse_special = false) const;
+                         bool   parse_special = false,
+                      int32_t   n_threads = 1) const;
 
     int32_t tokenize(
                    const char * text,
@@ -1675,6 +1895,43 @@ void llama_vocab::impl::load(llama_model_loader & ml, const LLM_KV & kv) {
     }
     GGML_ASSERT(id_to_token.size() == token_to_id.size());
 
+    for (const auto & it : bpe_ranks) {
+        const llama_token left  = vocab.text_to_token(it.first.first);
+        const llama_token right = vocab.text_to_token(it.first.second);
+        if (left == LLAMA_TOKEN_NULL || right == LLAMA_TOKEN_NULL) {
+            continue;
+        }
+        const uint64_t key = (uint64_t) left << 32 | (uint32_t) right;
+        bpe_ranks_id.emplace(key, bpe_merge{ it.second, vocab.text_to_token(it.first.first + it.first.second) });
+    }
+
+    // the BPE pre-tokenizers and the WPM words never join a letter or a digit with the space after it
+    // the SPM merges do not either, unless a token has a "▁" (U+2581) after another character
+    switch (type) {
+        case LLAMA_VOCAB_TYPE_BPE:
+        case LLAMA_VOCAB_TYPE_WPM:
+            {
+                split_at_spaces = true;
+            } break;
+        case LLAMA_VOCAB_TYPE_SPM:
+            {
+                split_at_spaces = true;
+                for (const auto & token_data : id_to_token) {
+                    const std::string & text = token_data.text;
+                    size_t pos = 0;
+                    while (text.compare(pos, 3, "\xe2\x96\x81") == 0) {
+                        pos += 3;
+                    }
+                    if (text.find("\xe2\x96\x81", pos) != std::string::npos) {
+                        split_at_spaces = false;
+                        break;
+                    }
+                }
+            } break;
+        default:
+            split_at_spaces = false;
+    }
+
     init_tokenizer(type);
 
     // determine the newline token: LLaMA "<0x0A>" == 10 == '\n', Falcon 193 == '\n'
@@ -1966,6 +2223,13 @@ void llama_vocab::impl::load(llama_model_loader & ml, const LLM_KV & kv) {
             }
         );
 
+        std::vector<std::pair<std::string, int32_t>> texts;
+        texts.reserve(cache_special_tokens.size());
+        for (int32_t i = (int32_t) cache_special_tokens.size() - 1; i >= 0; --i) {
+            texts.emplace_back(id_to_token[cache_special_tokens[i]].text, i);
+        }
+        special_token_matcher.build(std::move(texts));
+
         LLAMA_LOG_INFO("%s: special tokens cache size = %u\n", __func__, (uint32_t) cache_special_tokens.size());
     }
 
@@ -2147,11 +2411,54 @@ void llama_vocab::impl::init_tokenizer(enum llama_vocab_type type) {
 // #define PRETOKENIZERDEBUG
 
 void llama_vocab::impl::tokenizer_st_partition(std::forward_list<fragment_buffer_variant> & buffer, bool parse_special) const {
+    if (buffer.empty() || buffer.front().type != FRAGMENT_BUFFER_VARIANT_TYPE_RAW_TEXT) {
+        return;
+    }
+
+    // all the raw text fragments are views of the same source text
+    const std::string & source_text = buffer.front().raw_text;
+
+    // the occurrences of all the special tokens in a single pass over the text: (index in cache_special_tokens, offset)
+    std::vector<std::pair<int32_t, size_t>> occurrences;
+    for (size_t pos = 0; pos < source_text.size(); ++pos) {
+        int32_t node = llama_trie::root;
+        for (size_t i = pos; i < source_text.size(); ++i) {
+            node = special_token_matcher.traverse(node, source_text[i]);
+            if (node < 0) {
+                break;
+            }
+            if (special_token_matcher.has_value(node)) {
+                occurrences.emplace_back(special_token_matcher.value(node), pos);
+            }
+        }
+    }
+
+    if (occurrences.empty()) {
+        return;
+    }
+
+    // grouped by token, in order of offset
+    std::stable_sort(occurrences.begin(), occurrences.end(), [](const auto & a, const auto & b) { return a.first < b.first; });
+
     // for each special token
-    for (const llama_token special_id : cache_special_tokens) {
+    for (size_t i_special = 0; i_special < cache_special_tokens.size(); ++i_special) {
+        const llama_token special_id = cache_special_tokens[i_special];
+
         const auto & data = vocab.get_token_data(special_id);
         const auto & text = data.text;
 
+        // tokens with the same text share the occurrences of the first one
+        const int32_t key = special_token_matcher.find(text.data(), text.size());
+
+        const auto occ_begin = std::lower_bound(occurrences.begin(), occurrences.end(), key,
+                [](const std::pair<int32_t, size_t> & a, int32_t k) { return a.first < k; });
+        const auto occ_end   = std::upper_bound(occ_begin, occurrences.end(), key,
+                [](int32_t k, const std::pair<int32_t, size_t> & a) { return k < a.first; });
+
+        if (occ_begin == occ_end) {
+            continue;
+        }
+
         if (!parse_special && (data.attr & (LLAMA_TOKEN_ATTR_CONTROL | LLAMA_TOKEN_ATTR_UNKNOWN))) {
             // Ignore control and unknown tokens when parse_special == false
             continue;
@@ -2162,12 +2469,14 @@ void llama_vocab::impl::tokenizer_st_partition(std::forward_list<fragment_buffer
 
         // for each text fragment
         std::forward_list<fragment_buffer_variant>::iterator it = buffer.begin();
+        std::forward_list<fragment_buffer_variant>::iterator it_prev = buffer.before_begin();
         while (it != buffer.end()) {
             auto & fragment = (*it);
 
             // if a fragment is text ( not yet processed )
             if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_RAW_TEXT) {
                 const auto & raw_text = fragment.raw_text;
+                GGML_ASSERT(&raw_text == &source_text);
 
                 auto raw_text_base_offset = fragment.offset;
                 auto raw_text_base_length = fragment.length;
@@ -2175,12 +2484,15 @@ void llama_vocab::impl::tokenizer_st_partition(std::forward_list<fragment_buffer
                 // loop over the text
                 while (true) {
                     // find the first occurrence of a given special token in this fragment
-                    //  passing offset argument only limit the "search area" but match coordinates
+                    //  the search area is limited to the fragment, but match coordinates
                     //  are still relative to the source full raw_text
-                    auto match = raw_text.find(text, raw_text_base_offset);
+                    const auto occ = std::lower_bound(occ_begin, occ_end, raw_text_base_offset,
+                            [](const std::pair<int32_t, size_t> & a, size_t offset) { return a.second < offset; });
 
                     // no occurrences found, stop processing this fragment for a given special token
-                    if (match == std::string::npos) break;
+                    if (occ == occ_end) break;
+
+                    const size_t match = occ->second;
 
                     // check if match is within bounds of offset <-> length
                     if (match + text.length() > raw_text_base_offset + raw_text_base_length) break;
@@ -2188,7 +2500,9 @@ void llama_vocab::impl::tokenizer_st_partition(std::forward_list<fragment_buffer
 #ifdef PRETOKENIZERDEBUG
                     LLAMA_LOG_WARN("FF: (%ld %ld %ld) '%s'\n", raw_text->length(), raw_text_base_offset, raw_text_base_length, raw_text->substr(raw_text_base_offset, raw_text_base_length).c_str());
 #endif
-                    auto source = std::distance(buffer.begin(), it);
+                    // the fragment being split and the one before it
+                    const auto source      = it;
+                    const auto source_prev = it_prev;
 
                     // if match is further than base offset
                     //  then we have some text to the left of it
@@ -2205,7 +2519,7 @@ void llama_vocab::impl::tokenizer_st_partition(std::forward_list<fragment_buffer
 
                         if (left_reminder_length > 0) {
                             buffer.emplace_after(it, raw_text, left_reminder_offset, left_reminder_length);
-                            it++;
+                            it_prev = it++;
                         }
 
 #ifdef PRETOKENIZERDEBUG
@@ -2215,7 +2529,7 @@ void llama_vocab::impl::tokenizer_st_partition(std::forward_list<fragment_buffer
 
                     // special token
                     buffer.emplace_after(it, special_id);
-                    it++;
+                    it_prev = it++;
 
                     // right
                     if (match + text.length() < raw_text_base_offset + raw_text_base_length) {
@@ -2231,18 +2545,17 @@ void llama_vocab::impl::tokenizer_st_partition(std::forward_list<fragment_buffer
 
                         if (right_reminder_length > 0) {
                             buffer.emplace_after(it, raw_text, right_reminder_offset, right_reminder_length);
-                            it++;
+                            it_prev = it++;
                         }
 
 #ifdef PRETOKENIZERDEBUG
                         LLAMA_LOG_WARN("FR: (%ld %ld) '%s'\n", right_reminder_offset, right_reminder_length, raw_text->substr(right_reminder_offset, right_reminder_length).c_str());
 #endif
 
-                        if (source == 0) {
-                            buffer.erase_after(buffer.before_begin());
-                        } else {
-                            buffer.erase_after(std::next(buffer.begin(), (source - 1)));
+                        if (it_prev == source) {
+                            it_prev = source_prev;
                         }
+                        buffer.erase_after(source_prev);
 
                         // repeat for the right side
                         raw_text_base_offset = right_reminder_offset;
@@ -2252,20 +2565,96 @@ void llama_vocab::impl::tokenizer_st_partition(std::forward_list<fragment_buffer
                         LLAMA_LOG_WARN("RR: (%ld %ld) '%s'\n", raw_text_base_offset, raw_text_base_length, raw_text->substr(raw_text_base_offset, raw_text_base_length).c_str());
 #endif
                     } else {
-                        if (source == 0) {
-                            buffer.erase_after(buffer.before_begin());
-                        } else {
-                            buffer.erase_after(std::next(buffer.begin(), (source - 1)));
+                        if (it_prev == source) {
+                            it_prev = source_prev;
                         }
+                        buffer.erase_after(source_prev);
                         break;
                     }
                 }
             }
-            it++;
+            it_prev = it++;
         }
     }
 }
 
+void llama_vocab::impl::tokenize_chunks(
+        const std::string & text,
+   std::vector<llama_token> & output,
+                  int32_t   n_threads,
+        const std::function<void(const std::string &, std::vector<llama_token> &)> & tokenize_chunk) const {
+    // smaller chunks are not worth the threads
+    const size_t n_chunk_min = 64*1024;
+
+    const size_t n_chunks_max = std::min<size_t>(4*std::max(n_threads, 1), text.size()/n_chunk_min);
+
+    if (!split_at_spaces || n_threads <= 1 || n_chunks_max < 2) {
+        tokenize_chunk(text, output);
+        return;
+    }
+
+    auto is_alnum = [](char c) {
+        return ('0' <= c && c <= '9') || ('A' <= c && c <= 'Z') || ('a' <= c && c <= 'z');
+    };
+
+    // each chunk starts at the first space after its target offset that follows an ASCII letter or digit
+    std::vector<size_t> bounds = { 0 };
+    for (size_t i = 1; i < n_chunks_max; ++i) {
+        size_t pos = std::max(bounds.back() + 1, i*text.size()/n_chunks_max);
+        while (pos < text.size() && !(text[pos] == ' ' && is_alnum(text[pos - 1]))) {
+            pos++;
+        }
+        if (pos >= text.size()) {
+            break;
+        }
+        bounds.push_back(pos);
+    }
+    bounds.push_back(text.size());
+
+    const size_t n_chunks = bounds.size() - 1;
+    if (n_chunks < 2) {
+        tokenize_chunk(text, output);
+        return;
+    }
+
+    std::vector<std::vector<llama_token>> results(n_chunks);
+    std::vector<std::exception_ptr> errors(n_chunks);
+
+    std::atomic<size_t> next{0};
+
+    auto worker = [&]() {
+        std::string chunk;
+        for (size_t i = next++; i < n_chunks; i = next++) {
+            try {
+                chunk.assign(text, bounds[i], bounds[i + 1] - bounds[i]);
+                tokenize_chunk(chunk, results[i]);
+            } catch (...) {
+                errors[i] = std::current_exception();
+            }
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < std::min<size_t>(n_threads, n_chunks); ++i) {
+        workers.emplace_back(worker);
+    }
+    worker();
+    for (auto & w : workers) {
+        w.join();
+    }
+
+    // report the same error as the serial path: the one of the first chunk that failed
+    for (const auto & error : errors) {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+    for (const auto & result : results) {
+        output.insert(output.end(), result.begin(), result.end());
+    }
+}
+
 // NOTE: avoid ever using this except for building the token_to_piece caches
 std::string llama_vocab::impl::token_to_piece_for_cache(llama_token token, bool special) const {
     std::string piece;
@@ -2314,7 +2703,8 @@ static std::string llama_decode_text(const std::string & text) {
 std::vector<llama_token> llama_vocab::impl::tokenize(
         const std::string & raw_text,
         bool add_special,
-        bool parse_special) const {
+        bool parse_special,
+        int32_t n_threads) const {
     GGML_ASSERT(tokenizer && "Tokenizer not initialized. Call llama_vocab::init_tokenizer() first.");
 
     std::vector<llama_token> output;
@@ -2355,9 +2745,12 @@ std::vector<llama_token> llama_vocab::impl::tokenize(
 #ifdef PRETOKENIZERDEBUG
                         LLAMA_LOG_WARN("TT: (%ld %ld %ld) '%s'\n", text.length(), fragment.offset, fragment.length, text.c_str());
 #endif
-                        llama_escape_whitespace(text);
-                        llm_tokenizer_spm_session session(vocab);
-                        session.tokenize(text, output);
+                        tokenize_chunks(text, output, n_threads, [&](const std::string & chunk, std::vector<llama_token> & out) {
+                            std::string chunk_escaped = chunk;
+                            llama_escape_whitespace(chunk_escaped);
+                            llm_tokenizer_spm_session session(vocab);
+                            session.tokenize(chunk_escaped, out);
+                        });
                         is_prev_special = false;
                     } else { // if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_TOKEN)
                         output.push_back(fragment.token);
@@ -2379,7 +2772,8 @@ std::vector<llama_token> llama_vocab::impl::tokenize(
             } break;
         case LLAMA_VOCAB_TYPE_BPE:
             {
-                llm_tokenizer_bpe_session session(vocab, *static_cast<const llm_tokenizer_bpe *>(tokenizer.get()));
+                const auto & tokenizer_bpe = *static_cast<const llm_tokenizer_bpe *>(tokenizer.get());
+                llm_tokenizer_bpe_session session(vocab, tokenizer_bpe);
                 // it calls some other methods that are not exist in llm_tokenizer,
                 // here just cast it to bpe tokenizer object
                 if (add_special) {
@@ -2392,7 +2786,10 @@ std::vector<llama_token> llama_vocab::impl::tokenize(
 #ifdef PRETOKENIZERDEBUG
                         LLAMA_LOG_WARN("TT: (%ld %ld %ld) '%s'\n", text.length(), fragment.offset, fragment.length, text.c_str());
 #endif
-                        session.tokenize(text, output);
+                        tokenize_chunks(text, output, n_threads, [&](const std::string & chunk, std::vector<llama_token> & out) {
+                            llm_tokenizer_bpe_session session_chunk(vocab, tokenizer_bpe);
+                            session_chunk.tokenize(chunk, out);
+                        });
                     } else { // if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_TOKEN)
                         session.append(fragment.token, output);
                     }
@@ -2410,8 +2807,6 @@ std::vector<llama_token> llama_vocab::impl::tokenize(
                     output.push_back(special_bos_id);
                 }
 
-                llm_tokenizer_wpm_session session(vocab);
-
                 for (const auto & fragment : fragment_buffer) {
                     if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_RAW_TEXT) {
                         std::string text = fragment.raw_text.substr(fragment.offset, fragment.length);
@@ -2419,7 +2814,10 @@ std::vector<llama_token> llama_vocab::impl::tokenize(
 #ifdef PRETOKENIZERDEBUG
                         LLAMA_LOG_WARN("TT: (%ld %ld %ld) '%s'\n", text.length(), fragment.offset, fragment.length, text.c_str());
 #endif
-                        session.tokenize(text, output);
+                        tokenize_chunks(text, output, n_threads, [&](const std::string & chunk, std::vector<llama_token> & out) {
+                            llm_tokenizer_wpm_session session(vocab);
+                            session.tokenize(chunk, out);
+                        });
                     } else { // if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_TOKEN)
                         output.push_back(fragment.token);
                     }
@@ -2950,14 +3348,28 @@ int llama_vocab::find_bpe_rank(const std::string & token_left, const std::string
     return it->second;
 }
 
+int llama_vocab::find_bpe_rank(llama_token token_left, llama_token token_right, llama_token & token_merged) const {
+    const uint64_t key = (uint64_t) token_left << 32 | (uint32_t) token_right;
+
+    auto it = pimpl->bpe_ranks_id.find(key);
+    if (it == pimpl->bpe_ranks_id.end()) {
+        return -1;
+    }
+
+    token_merged = it->second.merged;
+
+    return it->second.rank;
+}
+
 int32_t llama_vocab::tokenize(
                   const char * text,
                      int32_t   text_len,
                  llama_token * tokens,
                      int32_t   n_tokens_max,
                         bool   add_special,
-                        bool   parse_special) const {
-    auto res = tokenize(std::string(text, text_len), add_special, parse_special);
+                        bool   parse_special,
+                     int32_t   n_threads) const {
+    auto res = tokenize(std::string(text, text_len), add_special, parse_special, n_threads);
     if (n_tokens_max < (int) res.size()) {
         // LLAMA_LOG_ERROR("%s: too many tokens\n", __func__);
         return -((int) res.size());
@@ -2973,8 +3385,9 @@ int32_t llama_vocab::tokenize(
 std::vector<llama_token> llama_vocab::tokenize(
         const std::string & raw_text,
         bool add_special,
-        bool parse_special) const {
-    return pimpl->tokenize(raw_text, add_special, parse_special);
+        bool parse_special,
+        int32_t n_threads) const {
+    return pimpl->tokenize(raw_text, add_special, parse_special, n_threads);
 }
 
 const std::string & llama_vocab::token_to_piece(llama_token token) const {
@@ -3229,6 +3642,18 @@ int32_t llama_tokenize(
     return vocab->tokenize(text, text_len, tokens, n_tokens_max, add_special, parse_special);
 }
 
+int32_t llama_tokenize_parallel(
+    const struct llama_vocab * vocab,
+                  const char * text,
+                     int32_t   text_len,
+                 llama_token * tokens,
+                     int32_t   n_tokens_max,
+                        bool   add_special,
+                        bool   parse_special,
+                     int32_t   n_threads) {
+    return vocab->tokenize(text, text_len, tokens, n_tokens_max, add_special, parse_special, n_threads);
+}
+
 int32_t llama_token_to_piece(
     const struct llama_vocab * vocab,
                  llama_token   token,
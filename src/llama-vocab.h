@@ -81,18 +81,24 @@ struct llama_vocab {
 
     int find_bpe_rank(const std::string & token_left, const std::string & token_right) const;
 
+    // same as above for a pair of tokens, also returns the merged token (LLAMA_TOKEN_NULL if the merged text is not a token)
+    int find_bpe_rank(llama_token token_left, llama_token token_right, llama_token & token_merged) const;
+
     int32_t tokenize(
                    const char * text,
                       int32_t   text_len,
                   llama_token * tokens,
                       int32_t   n_tokens_max,
                          bool   add_special,
-                         bool   parse_special) const;
+                         bool   parse_special,
+                      int32_t   n_threads = 1) const;
 
+    // n_threads > 1: long texts are split at boundaries that do not change the result and tokenized in parallel
     std::vector<llama_token> tokenize(
             const std::string & raw_text,
                          bool   add_special,
-                         bool   parse_special = false) const;
+                         bool   parse_special = false,
+                      int32_t   n_threads = 1) const;
 
     // does not write null-terminator to buf
     int32_t token_to_piece(
@@ -198,13 +198,40 @@ static void llm_build_kv_store(
     ggml_build_forward_expand(graph, ggml_cpy(ctx, v_cur, v_cache_view));
 }
 
+// do mat_mul with a weight split for tensor parallelism
+// the scheduler runs the product of each shard on its device and copies the results back to gather or add them
+static struct ggml_tensor * llm_build_tp_mm(
+         struct ggml_context * ctx0,
+  const llama_tensor_shards & ts,
+          struct ggml_tensor * cur) {
+    struct ggml_tensor * res = nullptr;
+    int64_t offs = 0;
+    for (auto * shard : ts.shards) {
+        struct ggml_tensor * part;
+        if (ts.dim == 0) {
+            // the input features that match the columns of the shard
+            struct ggml_tensor * x = ggml_view_4d(ctx0, cur, shard->ne[0], cur->ne[1], cur->ne[2], cur->ne[3],
+                    cur->nb[1], cur->nb[2], cur->nb[3], offs*cur->nb[0]);
+            offs += shard->ne[0];
+
+            part = ggml_mul_mat(ctx0, shard, ggml_cont(ctx0, x));
+            res  = res ? ggml_add(ctx0, res, part) : part;
+        } else {
+            part = ggml_mul_mat(ctx0, shard, cur);
+            res  = res ? ggml_concat(ctx0, res, part, 0) : part;
+        }
+    }
+    return res;
+}
+
 // do mat_mul, while optionally apply lora
 static struct ggml_tensor * llm_build_lora_mm(
         struct llama_context & lctx,
          struct ggml_context * ctx0,
           struct ggml_tensor * w,
           struct ggml_tensor * cur) {
-    struct ggml_tensor * res = ggml_mul_mat(ctx0, w, cur);
+    const llama_tensor_shards * ts = lctx.model.get_shards(w);
+    struct ggml_tensor * res = ts ? llm_build_tp_mm(ctx0, *ts, cur) : ggml_mul_mat(ctx0, w, cur);
     for (auto & it : lctx.lora) {
         struct llama_adapter_lora_weight * lw = it.first->get_weight(w);
         if (lw == nullptr) {
@@ -305,6 +332,53 @@ static struct ggml_tensor * llm_build_ffn(
           llm_ffn_gate_type   type_gate,
          const llm_build_cb & cb,
                         int   il) {
+    // tensor parallelism: when up, gate and down are split at the same points, each device computes the FFN
+    // of its slice of the hidden features and only the partial outputs are added together
+    {
+        const llama_tensor_shards * ts_up   = up   ? lctx.model.get_shards(up)   : nullptr;
+        const llama_tensor_shards * ts_gate = gate ? lctx.model.get_shards(gate) : nullptr;
+        const llama_tensor_shards * ts_down = down ? lctx.model.get_shards(down) : nullptr;
+
+        bool local = ts_up && ts_gate && ts_down && ts_down->dim == 0 &&
+            type_gate == LLM_FFN_PAR && type_op != LLM_FFN_SWIGLU &&
+            !up_b && !up_s && !gate_b && !gate_s && !act_scales &&
+            ts_up->shards.size() == ts_down->shards.size() && ts_gate->shards.size() == ts_down->shards.size();
+
+        for (size_t i = 0; local && i < ts_down->shards.size(); ++i) {
+            local = ts_up->shards[i]->ne[1] == ts_down->shards[i]->ne[0] && ts_gate->shards[i]->ne[1] == ts_down->shards[i]->ne[0];
+        }
+
+        for (auto & it : lctx.lora) {
+            local = local && !it.first->get_weight(up) && !it.first->get_weight(gate) && !it.first->get_weight(down);
+        }
+
+        if (local) {
+            struct ggml_tensor * res = nullptr;
+            for (size_t i = 0; i < ts_down->shards.size(); ++i) {
+                struct ggml_tensor * part = llm_build_ffn(ctx, lctx, cur,
+                        ts_up->shards[i],   NULL, NULL,
+                        ts_gate->shards[i], NULL, NULL,
+                        ts_down->shards[i], NULL, NULL,
+                        NULL,
+                        type_op, type_gate, cb, il);
+                res = res ? ggml_add(ctx, res, part) : part;
+            }
+            cur = res;
+
+            if (down_b) {
+                cb(cur, "ffn_down", il);
+                cur = ggml_add(ctx, cur, down_b);
+            }
+
+            if (down_s) {
+                cur = ggml_mul(ctx, cur, down_s);
+                cb(cur, "ffn_down_s", il);
+            }
+
+            return cur;
+        }
+    }
+
     struct ggml_tensor * tmp = up ? llm_build_lora_mm(lctx, ctx, up, cur) : cur;
     cb(tmp, "ffn_up", il);
 
@@ -1142,6 +1216,9 @@ struct llm_build_context {
 
         ctx0 = ggml_init(params);
 
+        // the meta buffer is reused, so the previous graph is gone
+        lctx.graph_cache.invalidate();
+
         lctx.inp_tokens      = nullptr;
         lctx.inp_embd        = nullptr;
         lctx.inp_pos         = nullptr;
@@ -6429,7 +6506,7 @@ struct llm_build_context {
                     q = ggml_mul_mat(ctx0, model.layers[il].wq_b, q);
                     cb(q, "q", il);
                 } else {
-                    q = ggml_mul_mat(ctx0, model.layers[il].wq, cur);
+                    q = llm_build_lora_mm(lctx, ctx0, model.layers[il].wq, cur);
                     cb(q, "q", il);
                 }
 
@@ -8396,6 +8473,16 @@ static struct ggml_cgraph * llama_build_graph(
         result = llm.append_pooling(result);
     }
 
+    // add the accumulation of the activation statistics for the importance matrix
+    if (lctx.imatrix.enabled()) {
+        result = lctx.imatrix.build(llm.ctx0, result, model.max_nodes() + lctx.imatrix.max_nodes());
+    }
+
+    // add the sampling stages after the logits
+    if (lctx.sampling.enabled() && !lctx.cparams.embeddings && !lctx.is_encoding) {
+        lctx.sampling.build(llm.ctx0, result);
+    }
+
     llm.free();
 
     return result;
@@ -8407,15 +8494,23 @@ static enum ggml_status llama_graph_compute(
             ggml_cgraph * gf,
                     int   n_threads,
         ggml_threadpool * threadpool) {
-    if (lctx.backend_cpu != nullptr) {
-        auto * reg = ggml_backend_dev_backend_reg(ggml_backend_get_device(lctx.backend_cpu));
-        auto * set_threadpool_fn = (decltype(ggml_backend_cpu_set_threadpool) *) ggml_backend_reg_get_proc_address(reg, "ggml_backend_cpu_set_threadpool");
-        set_threadpool_fn(lctx.backend_cpu, threadpool);
-    }
+    if (threadpool != lctx.threadpool_cur || n_threads != lctx.n_threads_cur) {
+        // the backends may still be computing the previous ubatches on the worker threads of the scheduler
+        ggml_backend_sched_synchronize(lctx.sched.get());
+
+        if (lctx.backend_cpu != nullptr) {
+            auto * reg = ggml_backend_dev_backend_reg(ggml_backend_get_device(lctx.backend_cpu));
+            auto * set_threadpool_fn = (decltype(ggml_backend_cpu_set_threadpool) *) ggml_backend_reg_get_proc_address(reg, "ggml_backend_cpu_set_threadpool");
+            set_threadpool_fn(lctx.backend_cpu, threadpool);
+        }
 
-    // set the number of threads for all the backends
-    for (const auto & set_n_threads_fn : lctx.set_n_threads_fns) {
-        set_n_threads_fn.second(set_n_threads_fn.first, n_threads);
+        // set the number of threads for all the backends
+        for (const auto & set_n_threads_fn : lctx.set_n_threads_fns) {
+            set_n_threads_fn.second(set_n_threads_fn.first, n_threads);
+        }
+
+        lctx.threadpool_cur = threadpool;
+        lctx.n_threads_cur  = n_threads;
     }
 
     auto status = ggml_backend_sched_graph_compute_async(lctx.sched.get(), gf);
@@ -8556,6 +8651,19 @@ static int llama_prepare_ubatch(
     return 0;
 }
 
+// the return value of llama_decode for a failed computation
+static int llama_decode_status(enum ggml_status status) {
+    switch (status) {
+        case GGML_STATUS_ABORTED:
+            return 2;
+        case GGML_STATUS_ALLOC_FAILED:
+            return -2;
+        case GGML_STATUS_FAILED:
+        default:
+            return -3;
+    }
+}
+
 // decode a batch of tokens by evaluating the transformer
 // in case of unsuccessful decoding (error or warning),
 // the kv_cache state will be returned to its original state
@@ -8607,6 +8715,11 @@ static int llama_decode_impl(
         }
     }
 
+    const bool graph_sampling = lctx.sampling.enabled() && !cparams.embeddings;
+    if (graph_sampling) {
+        lctx.sampling.reserve(n_outputs);
+    }
+
     while (lctx.sbatch.n_tokens > 0) {
         llama_ubatch ubatch;
         {
@@ -8623,10 +8736,33 @@ static int llama_decode_impl(
 
         //printf("kv_self.n = %5d, kv_self.used = %5d, kv_self.head = %5d\n", kv_self.n, kv_self.used, kv_self.head);
 
-        ggml_backend_sched_reset(lctx.sched.get());
+        llama_graph_cache_key gkey;
+        gkey.n_tokens     = ubatch.n_tokens;
+        gkey.n_seq_tokens = ubatch.n_seq_tokens;
+        gkey.n_seqs       = ubatch.n_seqs;
+        gkey.n_outputs    = lctx.n_outputs;
+        gkey.n_kv         = kv_self.n;
+        gkey.equal_seqs   = ubatch.equal_seqs;
+        gkey.embd         = ubatch.embd != nullptr;
+        gkey.embeddings   = cparams.embeddings;
+        gkey.causal_attn  = cparams.causal_attn;
+
+        // reuse the graph, the splits and the allocation of the previous ubatch if it had the same shape
+        ggml_cgraph * gf = lctx.graph_cache.get(gkey);
+        if (gf) {
+            lctx.graph_cache.n_hit++;
+            lctx.graph_cache.rebind(kv_self.head);
+        } else {
+            lctx.graph_cache.n_miss++;
+            ggml_backend_sched_reset(lctx.sched.get());
+        }
+
         ggml_backend_sched_set_eval_callback(lctx.sched.get(), lctx.cparams.cb_eval, lctx.cparams.cb_eval_user_data);
 
-        ggml_cgraph * gf = llama_build_graph(lctx, ubatch, false);
+        const bool reused = gf != nullptr;
+        if (!reused) {
+            gf = llama_build_graph(lctx, ubatch, false);
+        }
 
         // the output is always the last tensor in the graph
         struct ggml_tensor * res  = ggml_graph_node(gf, -1);
@@ -8646,6 +8782,9 @@ static int llama_decode_impl(
                 }
             }
             GGML_ASSERT(embd != nullptr && "missing embeddings tensor");
+        } else if (graph_sampling && lctx.sampling.supported()) {
+            res  = nullptr; // only the candidates are extracted
+            embd = nullptr;
         } else {
             embd = nullptr; // do not extract embeddings when not needed
             GGML_ASSERT(strcmp(res->name, "result_output") == 0 && "missing result_output tensor");
@@ -8653,24 +8792,27 @@ static int llama_decode_impl(
 
         // LLAMA_LOG_INFO("graph build time: %.3f ms (%d nodes, %d leafs)\n", (ggml_time_us() - t_start_us)/1000.0, gf->n_nodes, gf->n_leafs);
 
-        ggml_backend_sched_alloc_graph(lctx.sched.get(), gf);
+        if (!reused) {
+            ggml_backend_sched_alloc_graph(lctx.sched.get(), gf);
+
+            lctx.graph_cache.store(gkey, gf, kv_self, hparams, cparams.flash_attn);
+        }
 
         llama_set_inputs(lctx, ubatch);
 
+        if (graph_sampling) {
+            lctx.sampling.set_input();
+        }
+
         const auto compute_status = llama_graph_compute(lctx, gf, n_threads, threadpool);
         if (compute_status != GGML_STATUS_SUCCESS) {
+            lctx.graph_cache.invalidate();
             kv_slot_restorer.restore(kv_self);
-            switch (compute_status) {
-                case GGML_STATUS_ABORTED:
-                    return 2;
-                case GGML_STATUS_ALLOC_FAILED:
-                    return -2;
-                case GGML_STATUS_FAILED:
-                default:
-                    return -3;
-            }
+            return llama_decode_status(compute_status);
         }
 
+        lctx.imatrix.commit();
+
         // update the kv ring buffer
         {
             kv_self.head += ubatch.n_tokens;
@@ -8702,6 +8844,11 @@ static int llama_decode_impl(
             }
         }
 
+        // extract the sampled candidates
+        if (graph_sampling && lctx.sampling.supported() && lctx.n_outputs > 0) {
+            lctx.sampling.extract(lctx.sched.get(), n_outputs_prev, lctx.n_outputs);
+        }
+
         // extract embeddings
         if (embd) {
             ggml_backend_t backend_embd = ggml_backend_sched_get_tensor_backend(lctx.sched.get(), embd);
@@ -8760,6 +8907,17 @@ static int llama_decode_impl(
         n_outputs_prev += lctx.n_outputs;
     }
 
+    // the last ubatches may still be computing asynchronously, e.g. on the worker threads of the scheduler
+    // wait for them, so that a failure or an abort is reported for this batch
+    {
+        const auto sync_status = ggml_backend_sched_synchronize(lctx.sched.get());
+        if (sync_status != GGML_STATUS_SUCCESS) {
+            lctx.graph_cache.invalidate();
+            kv_slot_restorer.restore(kv_self);
+            return llama_decode_status(sync_status);
+        }
+    }
+
     // set output mappings
     {
         bool sorted_output = true;
@@ -8782,9 +8940,6 @@ static int llama_decode_impl(
     // set to total number of outputs in the batch, for use in llama_get_logits_ith
     lctx.n_outputs = n_outputs;
 
-    // wait for the computation to finish (automatically done when obtaining the model output)
-    //llama_synchronize(&lctx);
-
     // decide if we need to defrag the kv cache
     if (cparams.causal_attn && cparams.defrag_thold >= 0.0f) {
         const float fragmentation = kv_self.n >= 128 ? 1.0f - float(kv_self.used)/float(kv_self.n) : 0.0f;
@@ -8799,7 +8954,10 @@ static int llama_decode_impl(
 
     // Reset state for the next token before backend sync, to allow the CPU activities in the reset to
     // overlap with device computation.
-    ggml_backend_sched_reset(lctx.sched.get());
+    // the cached graph keeps its allocation in the scheduler until it is invalidated
+    if (!lctx.graph_cache.valid()) {
+        ggml_backend_sched_reset(lctx.sched.get());
+    }
 
     return 0;
 }
@@ -8920,6 +9078,8 @@ static int llama_encode_impl(
             return -3;
     }
 
+    lctx.imatrix.commit();
+
     // extract embeddings
     if (embd) {
         ggml_backend_t backend_embd = ggml_backend_sched_get_tensor_backend(lctx.sched.get(), embd);
@@ -9281,6 +9441,7 @@ int32_t llama_set_adapter_lora(
             struct llama_adapter_lora * adapter,
             float scale) {
     ctx->lora[adapter] = scale;
+    ctx->graph_cache.invalidate();
     return 0;
 }
 
@@ -9290,6 +9451,7 @@ int32_t llama_rm_adapter_lora(
     auto pos = ctx->lora.find(adapter);
     if (pos != ctx->lora.end()) {
         ctx->lora.erase(pos);
+        ctx->graph_cache.invalidate();
         return 0;
     }
 
@@ -9298,6 +9460,7 @@ int32_t llama_rm_adapter_lora(
 
 void llama_clear_adapter_lora(struct llama_context * ctx) {
     ctx->lora.clear();
+    ctx->graph_cache.invalidate();
 }
 
 int32_t llama_apply_adapter_cvec(
@@ -9307,6 +9470,7 @@ int32_t llama_apply_adapter_cvec(
                      int32_t   n_embd,
                      int32_t   il_start,
                      int32_t   il_end) {
+    ctx->graph_cache.invalidate();
     return ctx->cvec.apply(ctx->model, data, len, n_embd, il_start, il_end);
 }
 
@@ -9342,6 +9506,8 @@ struct llama_context_params llama_context_default_params() {
         /*.offload_kqv                 =*/ true,
         /*.flash_attn                  =*/ false,
         /*.no_perf                     =*/ true,
+        /*.collect_imatrix             =*/ false,
+        /*.collect_imatrix_output      =*/ false,
         /*.abort_callback              =*/ nullptr,
         /*.abort_callback_data         =*/ nullptr,
     };
@@ -9349,6 +9515,17 @@ struct llama_context_params llama_context_default_params() {
     return result;
 }
 
+struct llama_graph_sampling_params llama_graph_sampling_default_params() {
+    struct llama_graph_sampling_params result = {
+        /*.top_k =*/ 40,
+        /*.temp  =*/ 0.80f,
+        /*.dist  =*/ true,
+        /*.seed  =*/ LLAMA_DEFAULT_SEED,
+    };
+
+    return result;
+}
+
 struct llama_sampler_chain_params llama_sampler_chain_default_params() {
     struct llama_sampler_chain_params result = {
         /*.no_perf                     =*/ true,
@@ -9751,6 +9928,12 @@ struct llama_context * llama_init_from_model(
                 ggml_type_name(type_v), (float)memory_size_v / (1024.0f * 1024.0f));
         }
 
+        if (params.collect_imatrix && !ctx->imatrix.init(ctx->model, params.collect_imatrix_output)) {
+            LLAMA_LOG_ERROR("%s: failed to initialize the imatrix accumulators\n", __func__);
+            llama_free(ctx);
+            return nullptr;
+        }
+
         // graph outputs buffer
         {
             // resized during inference when a batch uses more outputs
@@ -9785,44 +9968,39 @@ struct llama_context * llama_init_from_model(
                 backend_ptrs.push_back(backend.get());
             }
 
-            const size_t max_nodes = model->max_nodes();
+            const size_t max_nodes = model->max_nodes() + ctx->imatrix.max_nodes() + llama_graph_sampling::max_nodes();
 
             // buffer used to store the computation graph and the tensor meta data
             ctx->buf_compute_meta.resize(ggml_tensor_overhead()*max_nodes + ggml_graph_overhead_custom(max_nodes, false));
+            if (ctx->imatrix.enabled()) {
+                // the graph is copied when adding the imatrix accumulation
+                ctx->buf_compute_meta.resize(ctx->buf_compute_meta.size() + ggml_graph_overhead_custom(max_nodes, false));
+            }
 
             // TODO: move these checks to ggml_backend_sched
             // enabling pipeline parallelism in the scheduler increases memory usage, so it is only done when necessary
+            // the devices without support for async compute or events are run on worker threads by the scheduler
             bool pipeline_parallel =
                 model->n_devices() > 1 &&
                 model->params.n_gpu_layers > (int)model->hparams.n_layer &&
                 model->params.split_mode == LLAMA_SPLIT_MODE_LAYER &&
                 params.offload_kqv;
 
-            // pipeline parallelism requires support for async compute and events in all devices
-            if (pipeline_parallel) {
-                for (auto & backend : ctx->backends) {
-                    auto dev_type = ggml_backend_dev_type(ggml_backend_get_device(backend.get()));
-                    if (dev_type == GGML_BACKEND_DEVICE_TYPE_CPU) {
-                        // ignore CPU backend
-                        continue;
-                    }
-                    auto * dev = ggml_backend_get_device(backend.get());
-                    ggml_backend_dev_props props;
-                    ggml_backend_dev_get_props(dev, &props);
-                    if (!props.caps.async || !props.caps.events) {
-                        // device does not support async compute or events
-                        pipeline_parallel = false;
-                        break;
-                    }
-                }
-            }
-
             ctx->sched.reset(ggml_backend_sched_new(backend_ptrs.data(), backend_buft.data(), backend_ptrs.size(), max_nodes, pipeline_parallel));
 
             if (pipeline_parallel) {
                 LLAMA_LOG_INFO("%s: pipeline parallelism enabled (n_copies=%d)\n", __func__, ggml_backend_sched_get_n_copies(ctx->sched.get()));
             }
 
+            // the input copies of the scheduler rotate with pipeline parallelism, so the splits of a graph cannot be reused
+            // the imatrix counts the accumulated rows when the graph is built, so it needs a new graph for every ubatch
+            ctx->graph_cache.enabled =
+                !ctx->kv_self.recurrent &&
+                !llama_model_has_encoder(model) &&
+                !ctx->imatrix.enabled() &&
+                ggml_backend_sched_get_n_copies(ctx->sched.get()) == 1 &&
+                getenv("LLAMA_GRAPH_REUSE_DISABLE") == nullptr;
+
             // initialize scheduler with the worst-case graph
             uint32_t n_seqs = 1; // TODO: worst-case number of sequences
             uint32_t n_tokens = std::min(cparams.n_ctx, cparams.n_ubatch);
@@ -10107,3 +10285,15 @@ void llama_perf_context_reset(struct llama_context * ctx) {
     ctx->t_eval_us   = ctx->n_eval = 0;
     ctx->t_p_eval_us = ctx->n_p_eval = 0;
 }
+
+void llama_perf_trace_start(struct llama_context * ctx, bool per_node) {
+    ggml_backend_sched_set_profile(ctx->sched.get(), per_node ? GGML_BACKEND_SCHED_PROFILE_NODES : GGML_BACKEND_SCHED_PROFILE_SPLITS);
+}
+
+void llama_perf_trace_stop(struct llama_context * ctx) {
+    ggml_backend_sched_set_profile(ctx->sched.get(), GGML_BACKEND_SCHED_PROFILE_NONE);
+}
+
+bool llama_perf_trace_write(struct llama_context * ctx, const char * fname) {
+    return ggml_backend_sched_write_trace(ctx->sched.get(), fname);
+}
@@ -6,10 +6,12 @@
 #include "unicode-data.h"
 
 #include <algorithm>
+#include <array>
 #include <cassert>
 #include <codecvt>
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
 #include <locale>
 #include <map>
 #include <regex>
@@ -215,8 +217,22 @@ static inline std::wstring unicode_wstring_from_utf8(const std::string & s) {
     return conv.from_bytes(s);
 }
 
+static const std::array<std::string, 256> & unicode_byte_to_utf8_table() {
+    static const std::array<std::string, 256> table = [] {
+        std::array<std::string, 256> res;
+        for (const auto & it : unicode_byte_to_utf8_map()) {
+            res[it.first] = it.second;
+        }
+        return res;
+    }();
+    return table;
+}
+
 static std::vector<std::string> unicode_byte_encoding_process(const std::vector<std::string> & bpe_words) {
+    const auto & byte_to_utf8 = unicode_byte_to_utf8_table();
+
     std::vector<std::string> bpe_encoded_words;
+    bpe_encoded_words.reserve(bpe_words.size());
     for (const auto & word : bpe_words) {
         std::string text_utf;
         auto utf_word =  unicode_cpts_from_utf8(word);
@@ -226,7 +242,7 @@ static std::vector<std::string> unicode_byte_encoding_process(const std::vector<
 
         std::string encoded_token;
         for (char & c : text_utf) {
-            encoded_token += unicode_byte_to_utf8(c);
+            encoded_token += byte_to_utf8[(uint8_t) c];
         }
         bpe_encoded_words.emplace_back(encoded_token);
     }
@@ -234,12 +250,10 @@ static std::vector<std::string> unicode_byte_encoding_process(const std::vector<
 }
 
 // GPT2 system regex:  's|'t|'re|'ve|'m|'ll|'d| ?\p{L}+| ?\p{N}+| ?[^\s\p{L}\p{N}]+|\s+(?!\S)|\s+
-static std::vector<size_t> unicode_regex_split_custom_gpt2(const std::string & text, const std::vector<size_t> & offsets) {
+static std::vector<size_t> unicode_regex_split_custom_gpt2(const std::vector<uint32_t> & cpts, const std::vector<size_t> & offsets) {
     std::vector<size_t> bpe_offsets; // store the offset of each word
     bpe_offsets.reserve(offsets.size()); // Reserve memory for the approximate size
 
-    const auto cpts = unicode_cpts_from_utf8(text);
-
     size_t start = 0;
     for (auto offset : offsets) {
         const size_t offset_ini = start;
@@ -352,12 +366,11 @@ static std::vector<size_t> unicode_regex_split_custom_gpt2(const std::string & t
 }
 
 // LLAMA3 system regex: "(?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\r\n\p{L}\p{N}]?\p{L}+|\p{N}{1,3}| ?[^\s\p{L}\p{N}]+[\r\n]*|\s*[\r\n]+|\s+(?!\S)|\s+"
-static std::vector<size_t> unicode_regex_split_custom_llama3(const std::string & text, const std::vector<size_t> & offsets) {
+// QWEN2 uses the same regex with \p{N} instead of \p{N}{1,3} (max_digits = 1)
+static std::vector<size_t> unicode_regex_split_custom_llama3(const std::vector<uint32_t> & cpts, const std::vector<size_t> & offsets, size_t max_digits) {
     std::vector<size_t> bpe_offsets; // store the offset of each word
     bpe_offsets.reserve(offsets.size()); // Reserve memory for the approximate size
 
-    const auto cpts = unicode_cpts_from_utf8(text);
-
     size_t start = 0;
     for (auto offset : offsets) {
         const size_t offset_ini = start;
@@ -429,7 +442,7 @@ static std::vector<size_t> unicode_regex_split_custom_llama3(const std::string &
             if (flags.is_number) {
                 size_t ini = pos;
                 while (_get_flags(pos).is_number) {
-                    if (++pos - ini >= 3 ) {
+                    if (++pos - ini >= max_digits) {
                         _add_token(pos);
                         ini = pos;
                     }
@@ -552,16 +565,251 @@ static std::vector<size_t> unicode_regex_split_stl(const std::string & text, con
     return bpe_offsets;
 }
 
-static std::vector<size_t> unicode_regex_split_custom(const std::string & text, const std::string & regex_expr, const std::vector<size_t> & offsets) {
+// codepoint classes as seen by the std::regex fallback, which matches \s, \p{..} and [..] against the collapsed text
+static bool unicode_cpt_is_space_stl(uint32_t cpt) {
+    if (cpt < 128) {
+        return cpt == ' ' || ('\t' <= cpt && cpt <= '\r');
+    }
+    return unicode_cpt_flags_from_cpt(cpt).is_whitespace;
+}
+
+static bool unicode_cpt_is_category_stl(uint32_t cpt, int category) {
+    const auto flags = unicode_cpt_flags_from_cpt(cpt);
+    return !flags.is_whitespace && flags.category_flag() == category;
+}
+
+static bool unicode_cpt_is_letter_stl(uint32_t cpt) {
+    if (cpt < 128) {
+        return ('A' <= cpt && cpt <= 'Z') || ('a' <= cpt && cpt <= 'z');
+    }
+    return unicode_cpt_is_category_stl(cpt, unicode_cpt_flags::LETTER);
+}
+
+static bool unicode_cpt_is_number_stl(uint32_t cpt) {
+    if (cpt < 128) {
+        return '0' <= cpt && cpt <= '9';
+    }
+    return unicode_cpt_is_category_stl(cpt, unicode_cpt_flags::NUMBER);
+}
+
+static bool unicode_cpt_is_punctuation_stl(uint32_t cpt) {
+    if (cpt < 128) {
+        return cpt != '$' && cpt != '+' && cpt != '<' && cpt != '=' && cpt != '>' && cpt != '^' && cpt != '`' && cpt != '|' && cpt != '~' &&
+            (('!' <= cpt && cpt <= '/') || (':' <= cpt && cpt <= '@') || ('[' <= cpt && cpt <= '`') || ('{' <= cpt && cpt <= '~'));
+    }
+    return unicode_cpt_is_category_stl(cpt, unicode_cpt_flags::PUNCTUATION);
+}
+
+// [\p{P}\$\+<=>\^~\|]
+static bool unicode_cpt_is_punctuation_or_math_stl(uint32_t cpt) {
+    return unicode_cpt_is_punctuation_stl(cpt) || cpt == '$' || cpt == '+' || cpt == '<' || cpt == '=' || cpt == '>' || cpt == '^' || cpt == '~' || cpt == '|';
+}
+
+// [\p{P}\$\+<=>\^~\|`]
+static bool unicode_cpt_is_punctuation_or_math_or_tick_stl(uint32_t cpt) {
+    return unicode_cpt_is_punctuation_or_math_stl(cpt) || cpt == '`';
+}
+
+static bool unicode_cpt_is_digit(uint32_t cpt) {
+    return '0' <= cpt && cpt <= '9';
+}
+
+// regex of the form "\s?X{n_min,n_max}" or "\s+$", where X is a single codepoint class
+struct unicode_regex_class {
+    bool (*is_x)(uint32_t cpt) = nullptr;
+
+    // [..] of literal codepoints, used if is_x is not set
+    std::vector<std::pair<uint32_t, uint32_t>> ranges;
+
+    bool   opt_space    = false;
+    bool   space_at_end = false;
+    size_t n_min = 1;
+    size_t n_max = 1;
+
+    bool is_match(uint32_t cpt) const {
+        if (is_x) {
+            return is_x(cpt);
+        }
+        // std::wregex sees the non-ASCII whitespaces as 0x0B
+        if (cpt > 0x7F && unicode_cpt_flags_from_cpt(cpt).is_whitespace) {
+            cpt = 0x0B;
+        }
+        for (const auto & range : ranges) {
+            if (range.first <= cpt && cpt <= range.second) {
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+static bool unicode_regex_class_parse(const std::string & regex_expr, unicode_regex_class & rc) {
+    static const size_t inf = SIZE_MAX;
+    static const struct {
+        const char * regex;
+        bool (*is_x)(uint32_t cpt);
+        bool   opt_space;
+        size_t n_min;
+        size_t n_max;
+    } known[] = {
+        { "\\s?\\p{L}+",                unicode_cpt_is_letter_stl,                      true,  1, inf },
+        { "\\s?\\p{P}+",                unicode_cpt_is_punctuation_stl,                 true,  1, inf },
+        { "\\p{N}",                     unicode_cpt_is_number_stl,                      false, 1, 1   },
+        { "\\p{N}+",                    unicode_cpt_is_number_stl,                      false, 1, inf },
+        { "[0-9][0-9][0-9]",            unicode_cpt_is_digit,                           false, 3, 3   },
+        { "[\\p{P}\\$\\+<=>\\^~\\|]+",  unicode_cpt_is_punctuation_or_math_stl,         false, 1, inf },
+        { "[\\p{P}\\$\\+<=>\\^~\\|`]+", unicode_cpt_is_punctuation_or_math_or_tick_stl, false, 1, inf },
+    };
+
+    for (const auto & k : known) {
+        if (regex_expr == k.regex) {
+            rc.is_x      = k.is_x;
+            rc.opt_space = k.opt_space;
+            rc.n_min     = k.n_min;
+            rc.n_max     = k.n_max;
+            return true;
+        }
+    }
+
+    if (regex_expr == "\\s+$") {
+        rc.space_at_end = true;
+        return true;
+    }
+
+    // "\s?[..]+" with literal codepoints and ranges only
+    size_t i = 0;
+    if (regex_expr.compare(0, 3, "\\s?") == 0) {
+        rc.opt_space = true;
+        i = 3;
+    }
+    if (i >= regex_expr.size() || regex_expr[i] != '[') {
+        return false;
+    }
+
+    const auto cpts = unicode_cpts_from_utf8(regex_expr.substr(i + 1));
+
+    size_t j = 0;
+    while (j < cpts.size() && cpts[j] != ']') {
+        const uint32_t cpt = cpts[j];
+        if (cpt == '\\' || cpt == '[' || cpt == '-' || (cpt == '^' && j == 0)) {
+            return false;
+        }
+        if (j + 2 < cpts.size() && cpts[j + 1] == '-' && cpts[j + 2] != ']') {
+            if (cpts[j + 2] < cpt || cpts[j + 2] == '\\' || cpts[j + 2] == '[') {
+                return false;
+            }
+            rc.ranges.emplace_back(cpt, cpts[j + 2]);
+            j += 3;
+        } else {
+            rc.ranges.emplace_back(cpt, cpt);
+            j += 1;
+        }
+    }
+
+    if (j >= cpts.size() || rc.ranges.empty()) {
+        return false;
+    }
+
+    j++; // ']'
+    if (j == cpts.size()) {
+        rc.n_max = 1;
+    } else if (j + 1 == cpts.size() && cpts[j] == '+') {
+        rc.n_max = inf;
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+// same splits as unicode_regex_split_stl: each leftmost match is a word, and so is the text between matches
+static std::vector<size_t> unicode_regex_split_custom_class(const std::vector<uint32_t> & cpts, const std::vector<size_t> & offsets, const unicode_regex_class & rc) {
+    std::vector<size_t> bpe_offsets; // store the offset of each word
+    bpe_offsets.reserve(offsets.size()); // Reserve memory for the approximate size
+
+    size_t start = 0;
+    for (auto offset : offsets) {
+        const size_t offset_ini = start;
+        const size_t offset_end = start + offset;
+        assert(offset_end <= cpts.size());
+        start = offset_end;
+
+        // regex: \s+$
+        if (rc.space_at_end) {
+            size_t pos = offset_end;
+            while (pos > offset_ini && unicode_cpt_is_space_stl(cpts[pos - 1])) {
+                pos--;
+            }
+            if (pos > offset_ini) {
+                bpe_offsets.push_back(pos - offset_ini);
+            }
+            if (offset_end > pos) {
+                bpe_offsets.push_back(offset_end - pos);
+            }
+            continue;
+        }
+
+        // length of the run of X starting at pos, up to n_max
+        auto _run = [&] (size_t pos) -> size_t {
+            size_t n = 0;
+            while (pos + n < offset_end && n < rc.n_max && rc.is_match(cpts[pos + n])) {
+                n++;
+            }
+            return n;
+        };
+
+        size_t prev_end = offset_ini;
+        for (size_t pos = offset_ini; pos < offset_end; ) {
+            size_t n = 0;
+            if (rc.opt_space && unicode_cpt_is_space_stl(cpts[pos])) {
+                n = _run(pos + 1);
+                n = n >= rc.n_min ? n + 1 : 0;
+            }
+            if (n == 0) {
+                n = _run(pos);
+                n = n >= rc.n_min ? n : 0;
+            }
+
+            if (n == 0) {
+                pos++;
+                continue;
+            }
+
+            if (pos > prev_end) {
+                bpe_offsets.push_back(pos - prev_end);
+            }
+            bpe_offsets.push_back(n);
+            pos += n;
+            prev_end = pos;
+        }
+
+        if (offset_end > prev_end) {
+            bpe_offsets.push_back(offset_end - prev_end);
+        }
+    }
+
+    return bpe_offsets;
+}
+
+static std::vector<size_t> unicode_regex_split_custom(const std::vector<uint32_t> & cpts, const std::string & regex_expr, const std::vector<size_t> & offsets) {
     std::vector<size_t> bpe_offsets;
 
     if (regex_expr == "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)") {
-        bpe_offsets = unicode_regex_split_custom_gpt2(text, offsets);
+        bpe_offsets = unicode_regex_split_custom_gpt2(cpts, offsets);
     } else if (
             regex_expr == "(?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+" ||
             regex_expr == "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+") {
 
-        bpe_offsets = unicode_regex_split_custom_llama3(text, offsets);
+        bpe_offsets = unicode_regex_split_custom_llama3(cpts, offsets, 3);
+    } else if (
+            regex_expr == "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+") {
+
+        bpe_offsets = unicode_regex_split_custom_llama3(cpts, offsets, 1);
+    } else {
+        unicode_regex_class rc;
+        if (unicode_regex_class_parse(regex_expr, rc)) {
+            bpe_offsets = unicode_regex_split_custom_class(cpts, offsets, rc);
+        }
     }
 
     return bpe_offsets;
@@ -618,6 +866,21 @@ std::vector<uint32_t> unicode_cpts_from_utf8(const std::string & utf8) {
     result.reserve(utf8.size());
     size_t offset = 0;
     while (offset < utf8.size()) {
+        // ASCII fast path: test 8 bytes at a time for the high bit
+        while (offset + 8 <= utf8.size()) {
+            uint64_t chunk;
+            memcpy(&chunk, utf8.data() + offset, sizeof(chunk));
+            if (chunk & 0x8080808080808080ULL) {
+                break;
+            }
+            for (size_t i = 0; i < 8; ++i) {
+                result.push_back((uint8_t) utf8[offset + i]);
+            }
+            offset += 8;
+        }
+        if (offset >= utf8.size()) {
+            break;
+        }
         result.push_back(unicode_cpt_from_utf8(utf8, offset));
     }
     return result;
@@ -639,8 +902,7 @@ unicode_cpt_flags unicode_cpt_flags_from_utf8(const std::string & utf8) {
 }
 
 std::string unicode_byte_to_utf8(uint8_t byte) {
-    static std::unordered_map<uint8_t, std::string> map = unicode_byte_to_utf8_map();
-    return map.at(byte);
+    return unicode_byte_to_utf8_table()[byte];
 }
 
 uint8_t unicode_utf8_to_byte(const std::string & utf8) {
@@ -660,7 +922,7 @@ uint32_t unicode_tolower(uint32_t cpt) {
     return cpt;  // Return the original code point if no lowercase mapping is found
 }
 
-std::vector<std::string> unicode_regex_split(const std::string & text, const std::vector<std::string> & regex_exprs) {
+std::vector<std::string> unicode_regex_split(const std::string & text, const std::vector<std::string> & regex_exprs, bool use_custom) {
     // unicode categories
     static const std::map<std::string, int> k_ucat_enum = {
         { "\\p{N}", unicode_cpt_flags::NUMBER },
@@ -732,11 +994,13 @@ std::vector<std::string> unicode_regex_split(const std::string & text, const std
 
     for (const auto & regex_expr : regex_exprs) {
         // first, see if we have an efficient custom regex implementation
-        auto tmp = unicode_regex_split_custom(text, regex_expr, bpe_offsets);
+        if (use_custom) {
+            auto tmp = unicode_regex_split_custom(cpts, regex_expr, bpe_offsets);
 
-        if (!tmp.empty()) {
-            bpe_offsets = std::move(tmp);
-            continue;
+            if (!tmp.empty()) {
+                bpe_offsets = std::move(tmp);
+                continue;
+            }
         }
 
         // fallback to general-purpose std::regex / std::wregex
@@ -826,17 +1090,48 @@ std::vector<std::string> unicode_regex_split(const std::string & text, const std
         }
     }
 
-    std::vector<std::string> bpe_words;
-    bpe_words.reserve(bpe_offsets.size()); // reserve memory for the approximate size
+    // if the codepoints re-encode to the original bytes (no overlong or out of range sequences),
+    // the words are byte-encoded directly from the text
+    bool canonical = true;
+    size_t n_bytes = 0;
+    for (const uint32_t cpt : cpts) {
+        canonical = canonical && cpt <= 0x10FFFF;
+        n_bytes += cpt < 0x80 ? 1 : cpt < 0x800 ? 2 : cpt < 0x10000 ? 3 : 4;
+    }
+    canonical = canonical && n_bytes == text.size();
+
+    if (!canonical) {
+        std::vector<std::string> bpe_words;
+        bpe_words.reserve(bpe_offsets.size()); // reserve memory for the approximate size
+
+        size_t start = 0;
+        for (size_t & offset : bpe_offsets) {
+            bpe_words.emplace_back();
+            for (size_t i = start; i < start + offset; ++i) {
+                bpe_words.back() += unicode_cpt_to_utf8(cpts[i]);
+            }
+            start += offset;
+        }
+
+        return unicode_byte_encoding_process(bpe_words);
+    }
+
+    const auto & byte_to_utf8 = unicode_byte_to_utf8_table();
+
+    std::vector<std::string> bpe_encoded_words;
+    bpe_encoded_words.reserve(bpe_offsets.size());
 
     size_t start = 0;
-    for (size_t & offset : bpe_offsets) {
-        bpe_words.emplace_back();
+    size_t pos   = 0;
+    for (const size_t offset : bpe_offsets) {
+        std::string & encoded = bpe_encoded_words.emplace_back();
         for (size_t i = start; i < start + offset; ++i) {
-            bpe_words.back() += unicode_cpt_to_utf8(cpts[i]);
+            for (size_t n = unicode_len_utf8(text[pos]); n > 0; --n) {
+                encoded += byte_to_utf8[(uint8_t) text[pos++]];
+            }
         }
         start += offset;
     }
 
-    return unicode_byte_encoding_process(bpe_words);
+    return bpe_encoded_words;
 }
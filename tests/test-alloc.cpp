@@ -0,0 +1,252 @@
+// checks the offsets planned by the graph allocator: random graphs are computed once with the tensors packed
+// in the compute buffer and once with every tensor in its own memory, and the outputs must be identical
+
+#include "ggml.h"
+#include "ggml-alloc.h"
+#include "ggml-backend.h"
+#include "ggml-cpu.h"
+
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+
+struct test_graph {
+    ggml_context * ctx = nullptr;
+    ggml_cgraph  * gf  = nullptr;
+
+    std::vector<ggml_tensor *> inputs;
+    std::vector<ggml_tensor *> outputs;
+};
+
+// the same seed always produces the same graph
+static test_graph build_graph(uint32_t seed, int n_ops) {
+    std::mt19937 rng(seed);
+
+    test_graph g;
+
+    ggml_init_params params = {
+        /*.mem_size   =*/ ggml_tensor_overhead()*(4*n_ops + 64) + ggml_graph_overhead(),
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ true,
+    };
+    g.ctx = ggml_init(params);
+
+    const int64_t ne0s[] = { 16, 32, 64 };
+
+    std::vector<ggml_tensor *> pool;
+
+    const int n_inputs = 2 + rng() % 4;
+    for (int i = 0; i < n_inputs; ++i) {
+        ggml_tensor * t = ggml_new_tensor_2d(g.ctx, GGML_TYPE_F32, ne0s[rng() % 3], 1 + rng() % 8);
+        ggml_set_input(t);
+        g.inputs.push_back(t);
+        pool.push_back(t);
+    }
+
+    auto pick = [&](int64_t ne0, int64_t ne1) -> ggml_tensor * {
+        std::vector<ggml_tensor *> cands;
+        for (auto * t : pool) {
+            if ((ne0 < 0 || t->ne[0] == ne0) && (ne1 < 0 || t->ne[1] == ne1)) {
+                cands.push_back(t);
+            }
+        }
+        if (cands.empty()) {
+            return nullptr;
+        }
+        // prefer recent tensors, so that the lifetimes are mostly short
+        const size_t n = cands.size();
+        const size_t i = rng() % 3 == 0 ? rng() % n : n - 1 - rng() % std::min<size_t>(n, 4);
+        return cands[i];
+    };
+
+    for (int i = 0; i < n_ops; ++i) {
+        ggml_tensor * a = pool[pool.size() - 1 - rng() % std::min<size_t>(pool.size(), 6)];
+        ggml_tensor * cur = nullptr;
+
+        switch (rng() % 8) {
+            case 0: cur = ggml_scale(g.ctx, a, 0.5f); break;
+            case 1: cur = ggml_silu(g.ctx, a); break;
+            case 2: cur = ggml_rms_norm(g.ctx, a, 1e-5f); break;
+            case 3: cur = ggml_soft_max(g.ctx, a); break;
+            case 4:
+                {
+                    ggml_tensor * b = pick(a->ne[0], rng() % 2 ? 1 : a->ne[1]);
+                    cur = ggml_add(g.ctx, a, b ? b : a);
+                } break;
+            case 5:
+                {
+                    ggml_tensor * b = pick(a->ne[0], a->ne[1]);
+                    cur = ggml_mul(g.ctx, a, b ? b : a);
+                } break;
+            case 6:
+                {
+                    ggml_tensor * b = pick(a->ne[0], -1);
+                    cur = ggml_mul_mat(g.ctx, a, b ? b : a);
+                } break;
+            case 7: cur = ggml_cont(g.ctx, ggml_transpose(g.ctx, a)); break;
+        }
+
+        if (rng() % 16 == 0) {
+            ggml_set_output(cur);
+            g.outputs.push_back(cur);
+        }
+
+        pool.push_back(cur);
+    }
+
+    ggml_tensor * last = pool.back();
+    if (g.outputs.empty() || g.outputs.back() != last) {
+        ggml_set_output(last);
+        g.outputs.push_back(last);
+    }
+
+    g.gf = ggml_new_graph(g.ctx);
+    for (auto * t : g.outputs) {
+        ggml_build_forward_expand(g.gf, t);
+    }
+
+    return g;
+}
+
+// with a shared allocator, the graph is allocated without an explicit reserve, like the scheduler does when the graph changes
+static std::vector<std::vector<float>> compute(ggml_backend_t backend, uint32_t seed, int n_ops, bool packed, size_t & buf_size,
+        ggml_gallocr_t galloc_shared = nullptr) {
+    test_graph g = build_graph(seed, n_ops);
+
+    ggml_gallocr_t galloc = nullptr;
+    ggml_backend_buffer_t buf = nullptr;
+
+    if (galloc_shared) {
+        if (!ggml_gallocr_alloc_graph(galloc_shared, g.gf)) {
+            fprintf(stderr, "%s: failed to allocate the graph\n", __func__);
+            exit(1);
+        }
+        buf_size = ggml_gallocr_get_buffer_size(galloc_shared, 0);
+    } else if (packed) {
+        galloc = ggml_gallocr_new(ggml_backend_get_default_buffer_type(backend));
+        if (!ggml_gallocr_reserve(galloc, g.gf) || !ggml_gallocr_alloc_graph(galloc, g.gf)) {
+            fprintf(stderr, "%s: failed to allocate the graph\n", __func__);
+            exit(1);
+        }
+        buf_size = ggml_gallocr_get_buffer_size(galloc, 0);
+    } else {
+        buf = ggml_backend_alloc_ctx_tensors(g.ctx, backend);
+        buf_size = ggml_backend_buffer_get_size(buf);
+    }
+
+    std::mt19937 rng(seed + 1);
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+    for (auto * t : g.inputs) {
+        std::vector<float> data(ggml_nelements(t));
+        for (auto & x : data) {
+            x = dist(rng);
+        }
+        // inputs that do not reach the outputs are not allocated
+        if (t->buffer) {
+            ggml_backend_tensor_set(t, data.data(), 0, ggml_nbytes(t));
+        }
+    }
+
+    ggml_backend_graph_compute(backend, g.gf);
+
+    std::vector<std::vector<float>> res;
+    for (auto * t : g.outputs) {
+        res.emplace_back(ggml_nelements(t));
+        ggml_backend_tensor_get(t, res.back().data(), 0, ggml_nbytes(t));
+    }
+
+    ggml_gallocr_free(galloc);
+    ggml_backend_buffer_free(buf);
+    ggml_free(g.ctx);
+
+    return res;
+}
+
+int main(void) {
+    ggml_backend_t backend = ggml_backend_cpu_init();
+    ggml_backend_cpu_set_n_threads(backend, 1);
+
+    size_t total_packed = 0;
+    size_t total_ref    = 0;
+
+    int n_failed = 0;
+
+    for (uint32_t seed = 0; seed < 200; ++seed) {
+        // small graphs exercise the exhaustive search
+        const int n_ops = seed % 4 == 0 ? 3 + seed % 7 : 16 + seed % 200;
+
+        size_t size_packed = 0;
+        size_t size_ref    = 0;
+
+        const auto res_packed = compute(backend, seed, n_ops, true,  size_packed);
+        const auto res_ref    = compute(backend, seed, n_ops, false, size_ref);
+
+        total_packed += size_packed;
+        total_ref    += size_ref;
+
+        bool ok = res_packed.size() == res_ref.size();
+        for (size_t i = 0; ok && i < res_ref.size(); ++i) {
+            ok = res_packed[i].size() == res_ref[i].size() &&
+                 memcmp(res_packed[i].data(), res_ref[i].data(), res_ref[i].size()*sizeof(float)) == 0;
+        }
+
+        if (!ok) {
+            fprintf(stderr, "%s: seed %u (%d ops): the outputs differ\n", __func__, seed, n_ops);
+            n_failed++;
+        }
+    }
+
+    printf("%s: compute buffers %.2f KiB in total, %.2f KiB without reuse\n", __func__, total_packed/1024.0, total_ref/1024.0);
+
+    // the graphs alternate in one allocator: the offsets are planned again only when the greedy allocation does not fit
+    // in the buffer, and the last plan is reused for a graph of the same shape
+    {
+        ggml_gallocr_t galloc = ggml_gallocr_new(ggml_backend_get_default_buffer_type(backend));
+
+        size_t size_first = 0;
+
+        for (int i = 0; i < 24; ++i) {
+            const uint32_t seed  = 1000 + i % 3;
+            const int      n_ops = 64 + 32*(i % 3);
+
+            size_t size_shared = 0;
+            size_t size_ref    = 0;
+
+            const auto res_shared = compute(backend, seed, n_ops, true,  size_shared, galloc);
+            const auto res_ref    = compute(backend, seed, n_ops, false, size_ref);
+
+            bool ok = res_shared.size() == res_ref.size();
+            for (size_t j = 0; ok && j < res_ref.size(); ++j) {
+                ok = res_shared[j].size() == res_ref[j].size() &&
+                     memcmp(res_shared[j].data(), res_ref[j].data(), res_ref[j].size()*sizeof(float)) == 0;
+            }
+
+            if (!ok) {
+                fprintf(stderr, "%s: shared allocator, step %d: the outputs differ\n", __func__, i);
+                n_failed++;
+            }
+
+            // the buffer only grows while the three graphs are seen for the first time
+            if (i == 3) {
+                size_first = size_shared;
+            } else if (i > 3 && size_shared != size_first) {
+                fprintf(stderr, "%s: shared allocator, step %d: the buffer size changed\n", __func__, i);
+                n_failed++;
+            }
+        }
+
+        ggml_gallocr_free(galloc);
+    }
+
+    ggml_backend_free(backend);
+
+    if (n_failed > 0) {
+        fprintf(stderr, "%s: %d graphs failed\n", __func__, n_failed);
+        return 1;
+    }
+
+    printf("%s: all graphs passed\n", __func__);
+
+    return 0;
+}
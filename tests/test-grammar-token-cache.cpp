@@ -0,0 +1,157 @@
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include "llama.h"
+#include "llama-grammar.h"
+
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+// the json grammar from grammars/json.gbnf
+static const char * grammar_json = R"""(
+root   ::= object
+value  ::= object | array | string | number | ("true" | "false" | "null") ws
+
+object ::=
+  "{" ws (
+            string ":" ws value
+    ("," ws string ":" ws value)*
+  )? "}" ws
+
+array  ::=
+  "[" ws (
+            value
+    ("," ws value)*
+  )? "]" ws
+
+string ::=
+  "\"" (
+    [^"\\\x7F\x00-\x1F] |
+    "\\" (["\\bfnrt] | "u" [0-9a-fA-F]{4}) # escapes
+  )* "\"" ws
+
+number ::= ("-"? ([0-9] | [1-9] [0-9]{0,15})) ("." [0-9]+)? ([eE] [-+]? [0-9] [1-9]{0,15})? ws
+
+ws ::= | " " | "\n" [ \t]{0,20}
+)""";
+
+// multi-byte chars, split across byte tokens
+static const char * grammar_utf8 = R"""(
+root ::= item+
+item ::= "日本" | [а-я]+ " " | "x" | "€"
+)""";
+
+// walk the grammar with random allowed tokens, checking that the masks and the bitmask reject the same candidates as the full stacks
+static void test_grammar(const llama_vocab * vocab, const char * grammar_str, uint32_t seed, int n_steps) {
+    const int n_vocab = llama_vocab_n_tokens(vocab);
+
+    llama_grammar * grammar = llama_grammar_init_impl(vocab, grammar_str, "root");
+    assert(grammar != nullptr);
+    assert(grammar->token_cache != nullptr);
+
+    llama_grammar * grammar_ref = llama_grammar_clone_impl(*grammar);
+    grammar_ref->token_cache.reset();
+
+    std::mt19937 rng(seed);
+
+    std::vector<llama_token_data> cur(n_vocab);
+    std::vector<llama_token_data> cur_ref(n_vocab);
+
+    std::vector<uint64_t> bitmask((n_vocab + 63)/64);
+
+    double t_cache = 0.0;
+    double t_ref   = 0.0;
+
+    for (int step = 0; step < n_steps; ++step) {
+        for (llama_token id = 0; id < n_vocab; ++id) {
+            cur[id] = cur_ref[id] = { id, 0.0f, 0.0f };
+        }
+
+        llama_token_data_array cur_p     = { cur.data(),     cur.size(),     -1, false };
+        llama_token_data_array cur_p_ref = { cur_ref.data(), cur_ref.size(), -1, false };
+
+        const auto t0 = std::chrono::high_resolution_clock::now();
+        llama_grammar_apply_impl(*grammar, &cur_p);
+        const auto t1 = std::chrono::high_resolution_clock::now();
+        llama_grammar_apply_impl(*grammar_ref, &cur_p_ref);
+        const auto t2 = std::chrono::high_resolution_clock::now();
+
+        t_cache += std::chrono::duration<double, std::milli>(t1 - t0).count();
+        t_ref   += std::chrono::duration<double, std::milli>(t2 - t1).count();
+
+        llama_grammar_get_bitmask_impl(*grammar, bitmask.data());
+
+        std::vector<llama_token> allowed;
+        for (llama_token id = 0; id < n_vocab; ++id) {
+            const bool ok     = cur[id].logit     != -INFINITY;
+            const bool ok_ref = cur_ref[id].logit != -INFINITY;
+            if (ok != ok_ref) {
+                fprintf(stderr, "%s: step %d: token %d ('%s') is %s with the masks but %s with the stacks\n",
+                        __func__, step, id, llama_vocab_get_text(vocab, id), ok ? "allowed" : "rejected", ok_ref ? "allowed" : "rejected");
+            }
+            assert(ok == ok_ref);
+            assert(ok == (bool) ((bitmask[id / 64] >> (id % 64)) & 1));
+            if (ok && !llama_vocab_is_eog(vocab, id)) {
+                allowed.push_back(id);
+            }
+        }
+
+        if (allowed.empty()) {
+            break;
+        }
+
+        const llama_token id = allowed[rng() % allowed.size()];
+
+        llama_grammar_accept_impl(*grammar,     id);
+        llama_grammar_accept_impl(*grammar_ref, id);
+    }
+
+    fprintf(stderr, "%s: seed %u: %zu masks, apply %.2f ms with the masks, %.2f ms with the stacks\n",
+            __func__, seed, grammar->token_cache->n_masks(), t_cache, t_ref);
+
+    llama_grammar_free_impl(grammar_ref);
+    llama_grammar_free_impl(grammar);
+}
+
+int main(int argc, char ** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <vocab-file>\n", argv[0]);
+        return 1;
+    }
+
+    llama_backend_init();
+
+    auto mparams = llama_model_default_params();
+    mparams.vocab_only = true;
+
+    llama_model * model = llama_model_load_from_file(argv[1], mparams);
+    if (model == NULL) {
+        fprintf(stderr, "%s: error: failed to load vocab '%s'\n", __func__, argv[1]);
+        return 1;
+    }
+
+    const llama_vocab * vocab = llama_model_get_vocab(model);
+
+    // keeps the masks alive across the walks
+    llama_grammar * grammar_keep = llama_grammar_init_impl(vocab, grammar_json, "root");
+
+    for (uint32_t seed = 0; seed < 4; ++seed) {
+        test_grammar(vocab, grammar_json, seed, 48);
+        test_grammar(vocab, grammar_utf8, seed, 24);
+    }
+
+    llama_grammar_free_impl(grammar_keep);
+
+    llama_model_free(model);
+    llama_backend_free();
+
+    fprintf(stderr, "All tests passed.\n");
+
+    return 0;
+}
@@ -0,0 +1,126 @@
+// checks the activation statistics accumulated by the context: decoding the same ubatch twice, with the KV cache cleared
+// in between, must double the counts and the values of every weight, also when the graph of the ubatch is reused
+
+#include "llama.h"
+#include "get-model.h"
+
+#include <cmath>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <vector>
+
+struct imatrix_entry {
+    std::vector<float>   values;
+    std::vector<int64_t> counts;
+};
+
+using imatrix_stats = std::map<std::string, imatrix_entry>;
+
+static void collect(const char * name, const float * values, const int64_t * counts, int64_t n_per_row, int64_t n_mat, void * user_data) {
+    auto & e = (*(imatrix_stats *) user_data)[name];
+    e.values.assign(values, values + n_per_row*n_mat);
+    e.counts.assign(counts, counts + n_mat);
+}
+
+static imatrix_stats decode_and_read(llama_context * ctx, std::vector<llama_token> & tokens, int n_decode) {
+    for (int i = 0; i < n_decode; ++i) {
+        llama_kv_cache_clear(ctx);
+        if (llama_decode(ctx, llama_batch_get_one(tokens.data(), tokens.size())) != 0) {
+            fprintf(stderr, "%s: llama_decode failed\n", __func__);
+            exit(1);
+        }
+    }
+
+    imatrix_stats stats;
+    if (llama_imatrix_read(ctx, collect, &stats) < 0) {
+        fprintf(stderr, "%s: llama_imatrix_read failed\n", __func__);
+        exit(1);
+    }
+
+    return stats;
+}
+
+int main(int argc, char ** argv) {
+    auto * model_path = get_model_or_exit(argc, argv);
+
+    llama_backend_init();
+
+    auto * model = llama_model_load_from_file(model_path, llama_model_default_params());
+    if (model == nullptr) {
+        fprintf(stderr, "%s: failed to load the model\n", __func__);
+        return 1;
+    }
+
+    // the statistics of small batches are not accumulated
+    const int n_tokens = 32;
+
+    auto cparams = llama_context_default_params();
+    cparams.n_ctx           = 2*n_tokens;
+    cparams.n_batch         = n_tokens;
+    cparams.n_ubatch        = n_tokens;
+    cparams.collect_imatrix = true;
+
+    auto * ctx = llama_init_from_model(model, cparams);
+    if (ctx == nullptr) {
+        fprintf(stderr, "%s: failed to create the context\n", __func__);
+        return 1;
+    }
+
+    const int n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(model));
+
+    std::vector<llama_token> tokens(n_tokens);
+    for (int i = 0; i < n_tokens; ++i) {
+        tokens[i] = (i*7 + 1) % n_vocab;
+    }
+
+    const imatrix_stats once  = decode_and_read(ctx, tokens, 1);
+    const imatrix_stats twice = decode_and_read(ctx, tokens, 2);
+
+    int ret = 0;
+
+    if (once.empty()) {
+        fprintf(stderr, "%s: no statistics were accumulated\n", __func__);
+        ret = 1;
+    }
+
+    for (const auto & it : once) {
+        const auto it2 = twice.find(it.first);
+        if (it2 == twice.end()) {
+            fprintf(stderr, "%s: %s: missing after two ubatches\n", __func__, it.first.c_str());
+            ret = 1;
+            continue;
+        }
+
+        const imatrix_entry & e1 = it.second;
+        const imatrix_entry & e2 = it2->second;
+
+        for (size_t i = 0; i < e1.counts.size(); ++i) {
+            if (e2.counts[i] != 2*e1.counts[i]) {
+                fprintf(stderr, "%s: %s: count %zu is %lld after two ubatches, expected %lld\n", __func__, it.first.c_str(),
+                        i, (long long) e2.counts[i], (long long) 2*e1.counts[i]);
+                ret = 1;
+                break;
+            }
+        }
+
+        for (size_t i = 0; i < e1.values.size(); ++i) {
+            if (fabsf(e2.values[i] - 2.0f*e1.values[i]) > 1e-4f*fabsf(e1.values[i]) + 1e-6f) {
+                fprintf(stderr, "%s: %s: value %zu is %f after two ubatches, expected %f\n", __func__, it.first.c_str(),
+                        i, e2.values[i], 2.0f*e1.values[i]);
+                ret = 1;
+                break;
+            }
+        }
+    }
+
+    if (ret == 0) {
+        printf("%s: the statistics of %zu weights are doubled\n", __func__, once.size());
+    }
+
+    llama_free(ctx);
+    llama_model_free(model);
+    llama_backend_free();
+
+    return ret;
+}
@@ -1,12 +1,18 @@
 #include "ggml.h"
+#include "ggml-backend.h"
+#include "ggml-cpu.h"
 #include "llama.h"
 
+// internal, see tests/CMakeLists.txt
+#include "llama-graph-sampling.h"
+
 #ifdef NDEBUG
 #undef NDEBUG
 #endif
 
 #include <algorithm>
 #include <cmath>
+#include <cstring>
 #include <string>
 #include <vector>
 
@@ -256,6 +262,159 @@ static void test_sampler_queue(const size_t n_vocab, const std::string & sampler
            samplers_sequence.c_str(), n_vocab, top_k, top_p, min_p);
 }
 
+// the chain fuses top-k with the samplers that follow it - the result must match applying the samplers one by one
+static void test_sampler_chain_fused(const size_t n_vocab, const std::vector<llama_sampler *> & samplers, float frac_masked) {
+    std::vector<llama_token_data> data(n_vocab);
+    for (size_t i = 0; i < n_vocab; i++) {
+        const bool masked = (float) rand()/RAND_MAX < frac_masked;
+        data[i] = llama_token_data{(llama_token) i, masked ? -INFINITY : 4.0f*((float) rand()/RAND_MAX - 0.5f), 0.0f};
+    }
+
+    auto * chain = llama_sampler_chain_init(llama_sampler_chain_default_params());
+    for (auto * smpl : samplers) {
+        llama_sampler_chain_add(chain, llama_sampler_clone(smpl));
+    }
+
+    std::vector<llama_token_data> cur_ref = data;
+    llama_token_data_array cur_p_ref = { cur_ref.data(), cur_ref.size(), -1, false };
+    for (auto * smpl : samplers) {
+        llama_sampler_apply(smpl, &cur_p_ref);
+        llama_sampler_free(smpl);
+    }
+
+    std::vector<llama_token_data> cur = data;
+    llama_token_data_array cur_p = { cur.data(), cur.size(), -1, false };
+    llama_sampler_apply(chain, &cur_p);
+    llama_sampler_free(chain);
+
+    GGML_ASSERT(cur_p.size == cur_p_ref.size);
+    GGML_ASSERT(cur_p.selected == cur_p_ref.selected);
+    for (size_t i = 0; i < cur_p.size; i++) {
+        GGML_ASSERT(cur_p.data[i].id == cur_p_ref.data[i].id);
+        GGML_ASSERT(fabs(cur_p.data[i].p     - cur_p_ref.data[i].p)     < 1e-5);
+        GGML_ASSERT(cur_p.data[i].logit == cur_p_ref.data[i].logit || fabs(cur_p.data[i].logit - cur_p_ref.data[i].logit) < 1e-4);
+    }
+
+    printf("Sampler chain OK with n_vocab=%06zu n_samplers=%zu size=%zu\n", n_vocab, samplers.size(), cur_p.size);
+}
+
+// the sampling stages appended to the graph must return the top-k candidates of every output with their probabilities
+static void test_graph_sampling(int32_t n_vocab, int32_t n_outputs, const llama_graph_sampling_params & params) {
+    llama_graph_sampling sampling;
+    sampling.set_params(&params, n_vocab);
+    GGML_ASSERT(sampling.enabled());
+
+    const int32_t k = sampling.n_candidates();
+    GGML_ASSERT(k == std::min(params.top_k, n_vocab));
+
+    std::vector<float> logits((size_t) n_vocab*n_outputs);
+    for (auto & l : logits) {
+        l = 8.0f*((float) rand()/RAND_MAX - 0.5f);
+    }
+
+    ggml_init_params ip = {
+        /*.mem_size   =*/ ggml_tensor_overhead()*(8 + llama_graph_sampling::max_nodes()) + ggml_graph_overhead(),
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ true,
+    };
+    ggml_context * ctx = ggml_init(ip);
+
+    ggml_tensor * inp = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_vocab, n_outputs);
+    ggml_set_input(inp);
+
+    ggml_tensor * cur = ggml_scale(ctx, inp, 1.0f);
+    ggml_set_name(cur, "result_output");
+
+    ggml_cgraph * gf = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf, cur);
+
+    sampling.build(ctx, gf);
+    GGML_ASSERT(sampling.supported());
+
+    ggml_backend_t backend = ggml_backend_cpu_init();
+    ggml_backend_sched_t sched = ggml_backend_sched_new(&backend, NULL, 1, GGML_DEFAULT_GRAPH_SIZE, false);
+
+    GGML_ASSERT(ggml_backend_sched_alloc_graph(sched, gf));
+    ggml_backend_tensor_set(inp, logits.data(), 0, ggml_nbytes(inp));
+    sampling.set_input();
+    GGML_ASSERT(ggml_backend_sched_graph_compute(sched, gf) == GGML_STATUS_SUCCESS);
+
+    sampling.reserve(n_outputs);
+    sampling.extract(sched, 0, n_outputs);
+    ggml_backend_sched_synchronize(sched);
+
+    const float temp = params.temp > 0.0f ? params.temp : 1.0f;
+
+    for (int32_t j = 0; j < n_outputs; j++) {
+        std::vector<llama_token> ids_ref(n_vocab);
+        for (int32_t i = 0; i < n_vocab; i++) {
+            ids_ref[i] = i;
+        }
+        const float * lj = logits.data() + (size_t) j*n_vocab;
+        std::partial_sort(ids_ref.begin(), ids_ref.begin() + k, ids_ref.end(), [&](llama_token a, llama_token b) { return lj[a] > lj[b]; });
+
+        double sum = 0.0;
+        for (int32_t i = 0; i < k; i++) {
+            sum += exp((lj[ids_ref[i]] - lj[ids_ref[0]])/temp);
+        }
+
+        const llama_token * ids   = sampling.ids(j);
+        const float       * probs = sampling.probs(j);
+        for (int32_t i = 0; i < k; i++) {
+            GGML_ASSERT(ids[i] == ids_ref[i]);
+            GGML_ASSERT(fabs(probs[i] - exp((lj[ids_ref[i]] - lj[ids_ref[0]])/temp)/sum) < 1e-5);
+        }
+
+        const llama_token id = sampling.token(j);
+        if (params.dist && params.temp > 0.0f) {
+            GGML_ASSERT(std::find(ids, ids + k, id) != ids + k);
+        } else {
+            GGML_ASSERT(id == ids_ref[0]);
+        }
+    }
+
+    ggml_backend_sched_free(sched);
+    ggml_backend_free(backend);
+    ggml_free(ctx);
+
+    printf("Graph sampling OK with n_vocab=%06d n_outputs=%d top_k=%d temp=%.1f dist=%d\n", n_vocab, n_outputs, params.top_k, params.temp, params.dist);
+}
+
+// graph sampling is disabled without top_k, and skipped for graphs that do not end with the logits
+static void test_graph_sampling_unsupported() {
+    llama_graph_sampling sampling;
+
+    llama_graph_sampling_params params = { 0, 1.0f, true, 42 };
+    sampling.set_params(&params, 1000);
+    GGML_ASSERT(!sampling.enabled());
+
+    params.top_k = 40;
+    sampling.set_params(&params, 1000);
+    GGML_ASSERT(sampling.enabled());
+
+    ggml_init_params ip = {
+        /*.mem_size   =*/ ggml_tensor_overhead()*(8 + llama_graph_sampling::max_nodes()) + ggml_graph_overhead(),
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ true,
+    };
+    ggml_context * ctx = ggml_init(ip);
+
+    ggml_tensor * cur = ggml_scale(ctx, ggml_new_tensor_2d(ctx, GGML_TYPE_F32, 1000, 4), 1.0f);
+    ggml_set_name(cur, "result_norm");
+
+    ggml_cgraph * gf = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf, cur);
+
+    const int n_nodes = ggml_graph_n_nodes(gf);
+    sampling.build(ctx, gf);
+    GGML_ASSERT(!sampling.supported());
+    GGML_ASSERT(ggml_graph_n_nodes(gf) == n_nodes);
+
+    ggml_free(ctx);
+
+    printf("Graph sampling skipped OK\n");
+}
+
 static void bench(llama_sampler * cnstr, const char * cnstr_name, const std::vector<llama_token_data> & data, int n_iter) {
     std::vector<llama_token_data> cur(data.size());
     std::copy(data.begin(), data.end(), cur.begin());
@@ -277,24 +436,44 @@ static void bench(llama_sampler * cnstr, const char * cnstr_name, const std::vec
 #define BENCH(__cnstr, __data, __n_iter) bench((__cnstr), #__cnstr, (__data), (__n_iter))
 
 static void test_perf() {
-    const int n_vocab = 1 << 17;
+    for (int n_vocab : { 32000, 128000, 256000 }) {
+        std::vector<llama_token_data> data;
 
-    std::vector<llama_token_data> data;
+        data.reserve(n_vocab);
+        for (int i = 0; i < n_vocab; i++) {
+            const float logit = 2.0f*((double)(rand())/RAND_MAX - 0.5);
+            data.emplace_back(llama_token_data{i, logit, 0.0f});
+        }
 
-    data.reserve(n_vocab);
-    for (int i = 0; i < n_vocab; i++) {
-        const float logit = 2.0f*((double)(rand())/RAND_MAX - 0.5);
-        data.emplace_back(llama_token_data{i, logit, 0.0f});
+        printf("\nn_vocab = %d\n", n_vocab);
+
+        BENCH(llama_sampler_init_top_k  (40),                     data, 32);
+        BENCH(llama_sampler_init_top_k  (1000),                   data, 32);
+        BENCH(llama_sampler_init_top_p  (0.8f, 1),                data, 32);
+        BENCH(llama_sampler_init_min_p  (0.2f, 1),                data, 32);
+        BENCH(llama_sampler_init_typical(0.5f, 1),                data, 32);
+        BENCH(llama_sampler_init_xtc    (1.0f, 0.1f, 1, 1),       data, 32);
+        BENCH(llama_sampler_init_temp   (0.8f),                   data, 32);
+        BENCH(llama_sampler_init_dist   (1),                      data, 32);
+
+        {
+            auto * chain = llama_sampler_chain_init(llama_sampler_chain_default_params());
+            llama_sampler_chain_add(chain, llama_sampler_init_top_k  (40));
+            llama_sampler_chain_add(chain, llama_sampler_init_typical(1.0f, 1));
+            llama_sampler_chain_add(chain, llama_sampler_init_top_p  (0.95f, 1));
+            llama_sampler_chain_add(chain, llama_sampler_init_min_p  (0.05f, 1));
+            llama_sampler_chain_add(chain, llama_sampler_init_xtc    (0.0f, 0.1f, 1, 1));
+            llama_sampler_chain_add(chain, llama_sampler_init_temp   (0.8f));
+            llama_sampler_chain_add(chain, llama_sampler_init_dist   (1));
+            bench(chain, "chain(top_k, typ_p, top_p, min_p, xtc, temp, dist)", data, 32);
+        }
     }
-
-    BENCH(llama_sampler_init_top_k  (40),                     data, 32);
-    BENCH(llama_sampler_init_top_p  (0.8f, 1),                data, 32);
-    BENCH(llama_sampler_init_min_p  (0.2f, 1),                data, 32);
-    BENCH(llama_sampler_init_typical(0.5f, 1),                data, 32);
-    BENCH(llama_sampler_init_xtc    (1.0f, 0.1f, 1, 1),       data, 32);
 }
 
-int main(void) {
+int main(int argc, char ** argv) {
+    // the benchmarks over vocabs up to 256k take several seconds, so they are not part of the ctest run
+    const bool perf = argc > 1 && strcmp(argv[1], "--perf") == 0;
+
     ggml_time_init();
 
     test_temp({0.1f, 0.2f, 0.3f, 0.4f}, {0.4f, 0.3f, 0.2f, 0.1f}, 1.0f);
@@ -376,9 +555,45 @@ int main(void) {
     test_sampler_queue(10000, "mkp", 100, 0.8f, 0.1f);
     test_sampler_queue(10000, "mpk", 100, 0.8f, 0.1f);
 
+    for (size_t n_vocab : { 1000, 50000 }) {
+        for (float frac_masked : { 0.0f, 0.9f }) {
+            test_sampler_chain_fused(n_vocab, {
+                llama_sampler_init_top_k(40),
+                llama_sampler_init_top_p(0.9f, 1),
+                llama_sampler_init_min_p(0.05f, 1),
+                llama_sampler_init_temp (0.7f),
+                llama_sampler_init_dist (42),
+            }, frac_masked);
+            test_sampler_chain_fused(n_vocab, {
+                llama_sampler_init_top_k   (1000),
+                llama_sampler_init_typical (1.0f, 1),
+                llama_sampler_init_temp_ext(1.5f, 0.0f, 1.0f),
+                llama_sampler_init_min_p   (0.1f, 1),
+                llama_sampler_init_top_p   (0.5f, 1),
+                llama_sampler_init_xtc     (0.0f, 0.1f, 1, 1),
+                llama_sampler_init_dist    (7),
+            }, frac_masked);
+            test_sampler_chain_fused(n_vocab, {
+                llama_sampler_init_top_k(100),
+                llama_sampler_init_temp (0.5f),
+                llama_sampler_init_top_p(0.99f, 1),
+                llama_sampler_init_xtc  (1.0f, 0.01f, 1, 3),
+                llama_sampler_init_dist (3),
+            }, frac_masked);
+        }
+    }
+
+    test_graph_sampling(1000,  1, { 40, 1.0f, false, 42 });
+    test_graph_sampling(1000,  4, { 40, 0.7f, true,  42 });
+    test_graph_sampling(50000, 3, {  5, 0.0f, true,  42 });
+    test_graph_sampling(16,    2, { 40, 1.5f, true,  42 });
+    test_graph_sampling_unsupported();
+
     printf("OK\n");
 
-    test_perf();
+    if (perf) {
+        test_perf();
+    }
 
     return 0;
 }
@@ -0,0 +1,248 @@
+// checks the reuse of the split plan by the scheduler: the same graph is rebuilt for every step in the same meta buffer,
+// like llama_decode does, and computed with a persistent scheduler and with a fresh one, and the outputs must be identical
+// the weights alternate between two devices that cannot use the buffers of each other, so that the splits need input copies
+
+#include "ggml.h"
+#include "ggml-alloc.h"
+#include "ggml-backend.h"
+#include "ggml-cpu.h"
+#include "../ggml/src/ggml-backend-impl.h"
+
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+
+static const int n_devices = 2;
+static const int n_layers  = 8;
+static const int n_embd    = 64;
+static const int n_steps   = 16;
+
+// the plan must be rebuilt at these steps: the first one, a different pinning of the tensors and a different shape
+static bool pin_other(int step) { return step >= 6 && step < 12; }
+static int  n_tokens (int step) { return step < 12 ? 8 : 12; }
+static bool changed  (int step) { return step == 0 || step == 6 || step == 12; }
+
+struct test_model {
+    ggml_context * ctx = nullptr;
+    ggml_backend_buffer_t buf[n_devices] = {};
+
+    ggml_tensor * w[n_layers];
+    ggml_tensor * b[n_layers];
+};
+
+static int layer_device(int il) {
+    return (il/2) % n_devices;
+}
+
+static void init_model(test_model & model, ggml_backend_buffer_type_t * bufts) {
+    ggml_init_params params = {
+        /*.mem_size   =*/ ggml_tensor_overhead()*2*n_layers,
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ true,
+    };
+    model.ctx = ggml_init(params);
+
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+
+    for (int il = 0; il < n_layers; ++il) {
+        model.w[il] = ggml_new_tensor_2d(model.ctx, GGML_TYPE_F32, n_embd, n_embd);
+        model.b[il] = ggml_new_tensor_1d(model.ctx, GGML_TYPE_F32, n_embd);
+    }
+
+    for (int d = 0; d < n_devices; ++d) {
+        size_t size = 0;
+        for (int il = 0; il < n_layers; ++il) {
+            if (layer_device(il) == d) {
+                size += GGML_PAD(ggml_nbytes(model.w[il]), 64) + GGML_PAD(ggml_nbytes(model.b[il]), 64);
+            }
+        }
+        model.buf[d] = ggml_backend_buft_alloc_buffer(bufts[d], size + 64);
+
+        ggml_tallocr alloc = ggml_tallocr_new(model.buf[d]);
+        for (int il = 0; il < n_layers; ++il) {
+            if (layer_device(il) != d) {
+                continue;
+            }
+            for (ggml_tensor * t : { model.w[il], model.b[il] }) {
+                ggml_tallocr_alloc(&alloc, t);
+
+                std::vector<float> data(ggml_nelements(t));
+                for (auto & x : data) {
+                    x = dist(rng)/8.0f;
+                }
+                ggml_backend_tensor_set(t, data.data(), 0, ggml_nbytes(t));
+            }
+        }
+    }
+}
+
+static ggml_cgraph * build_graph(const test_model & model, ggml_backend_sched_t sched, ggml_backend_t * backends,
+        std::vector<uint8_t> & buf_meta, int step, ggml_tensor ** inp, ggml_tensor ** out) {
+    ggml_init_params params = {
+        /*.mem_size   =*/ buf_meta.size(),
+        /*.mem_buffer =*/ buf_meta.data(),
+        /*.no_alloc   =*/ true,
+    };
+    ggml_context * ctx = ggml_init(params);
+
+    ggml_cgraph * gf = ggml_new_graph(ctx);
+
+    ggml_tensor * cur = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_embd, n_tokens(step));
+    ggml_set_input(cur);
+    ggml_backend_sched_set_tensor_backend(sched, cur, backends[0]);
+    *inp = cur;
+
+    for (int il = 0; il < n_layers; ++il) {
+        ggml_tensor * inpL = cur;
+
+        // the norm of every other layer is pinned, either to the device of the layer or to the other one
+        cur = ggml_rms_norm(ctx, cur, 1e-5f);
+        if (il % 2 == 1) {
+            const int d = layer_device(il);
+            ggml_backend_sched_set_tensor_backend(sched, cur, backends[pin_other(step) ? (d + 1) % n_devices : d]);
+        }
+
+        cur = ggml_mul_mat(ctx, model.w[il], cur);
+        cur = ggml_add(ctx, cur, model.b[il]);
+        cur = ggml_silu(ctx, cur);
+        cur = ggml_add(ctx, cur, inpL);
+    }
+
+    ggml_set_output(cur);
+    *out = cur;
+
+    ggml_build_forward_expand(gf, cur);
+
+    ggml_free(ctx);
+
+    return gf;
+}
+
+static std::vector<float> compute(const test_model & model, ggml_backend_sched_t sched, ggml_backend_t * backends,
+        std::vector<uint8_t> & buf_meta, int step, const std::vector<float> & input, int64_t & t_alloc_us) {
+    ggml_backend_sched_reset(sched);
+
+    ggml_tensor * inp;
+    ggml_tensor * out;
+    ggml_cgraph * gf = build_graph(model, sched, backends, buf_meta, step, &inp, &out);
+
+    const int64_t t_start_us = ggml_time_us();
+
+    if (!ggml_backend_sched_alloc_graph(sched, gf)) {
+        fprintf(stderr, "%s: failed to allocate the graph\n", __func__);
+        exit(1);
+    }
+
+    t_alloc_us = ggml_time_us() - t_start_us;
+
+    ggml_backend_tensor_set(inp, input.data(), 0, ggml_nbytes(inp));
+
+    if (ggml_backend_sched_graph_compute(sched, gf) != GGML_STATUS_SUCCESS) {
+        fprintf(stderr, "%s: failed to compute the graph\n", __func__);
+        exit(1);
+    }
+
+    std::vector<float> output(ggml_nelements(out));
+    ggml_backend_tensor_get(out, output.data(), 0, ggml_nbytes(out));
+
+    return output;
+}
+
+// each device only supports its own buffer type
+static bool test_dev_supports_buft(ggml_backend_dev_t dev, ggml_backend_buffer_type_t buft) {
+    return buft->device == dev;
+}
+
+int main(void) {
+    ggml_time_init();
+
+    ggml_backend_t backends[n_devices];
+
+    ggml_backend_device        devs[n_devices];
+    ggml_backend_buffer_type   bufts_data[n_devices];
+    ggml_backend_buffer_type_t bufts[n_devices];
+
+    for (int d = 0; d < n_devices; ++d) {
+        backends[d] = ggml_backend_cpu_init();
+        ggml_backend_cpu_set_n_threads(backends[d], 1);
+
+        devs[d] = *ggml_backend_get_device(backends[d]);
+        devs[d].iface.supports_buft = test_dev_supports_buft;
+        backends[d]->device = &devs[d];
+
+        bufts_data[d] = *ggml_backend_cpu_buffer_type();
+        bufts_data[d].device = &devs[d];
+        bufts[d] = &bufts_data[d];
+    }
+
+    test_model model;
+    init_model(model, bufts);
+
+    ggml_backend_sched_t sched = ggml_backend_sched_new(backends, bufts, n_devices, GGML_DEFAULT_GRAPH_SIZE, false);
+
+    std::vector<uint8_t> buf_meta    (ggml_tensor_overhead()*GGML_DEFAULT_GRAPH_SIZE + ggml_graph_overhead());
+    std::vector<uint8_t> buf_meta_ref(ggml_tensor_overhead()*GGML_DEFAULT_GRAPH_SIZE + ggml_graph_overhead());
+
+    std::mt19937 rng(1234);
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+
+    int64_t t_changed_us   = 0;
+    int64_t t_unchanged_us = 0;
+    int     n_changed      = 0;
+
+    int ret = 0;
+
+    for (int step = 0; step < n_steps; ++step) {
+        std::vector<float> input((size_t) n_embd*n_tokens(step));
+        for (auto & x : input) {
+            x = dist(rng);
+        }
+
+        int64_t t_alloc_us = 0;
+        int64_t t_ref_us   = 0;
+
+        const auto res = compute(model, sched, backends, buf_meta, step, input, t_alloc_us);
+
+        // the reference is computed by a scheduler that has never seen the graph
+        ggml_backend_sched_t sched_ref = ggml_backend_sched_new(backends, bufts, n_devices, GGML_DEFAULT_GRAPH_SIZE, false);
+        const auto res_ref = compute(model, sched_ref, backends, buf_meta_ref, step, input, t_ref_us);
+        ggml_backend_sched_free(sched_ref);
+
+        if (changed(step)) {
+            t_changed_us += t_alloc_us;
+            n_changed++;
+        } else {
+            t_unchanged_us += t_alloc_us;
+        }
+
+        if (res.size() != res_ref.size() || memcmp(res.data(), res_ref.data(), res_ref.size()*sizeof(float)) != 0) {
+            fprintf(stderr, "%s: step %d: the outputs differ\n", __func__, step);
+            ret = 1;
+        }
+    }
+
+    printf("%s: %d steps, %d splits\n", __func__, n_steps, ggml_backend_sched_get_n_splits(sched));
+    printf("%s: alloc_graph %.2f us for a new plan, %.2f us for a reused plan\n", __func__,
+            (double) t_changed_us/n_changed, (double) t_unchanged_us/(n_steps - n_changed));
+
+    if (ggml_backend_sched_get_n_splits(sched) < 2) {
+        fprintf(stderr, "%s: the graph is not split between the devices\n", __func__);
+        ret = 1;
+    }
+
+    if (ret == 0) {
+        printf("%s: the outputs are identical\n", __func__);
+    }
+
+    ggml_backend_sched_free(sched);
+
+    ggml_free(model.ctx);
+    for (int d = 0; d < n_devices; ++d) {
+        ggml_backend_buffer_free(model.buf[d]);
+        ggml_backend_free(backends[d]);
+    }
+
+    return ret;
+}
@@ -0,0 +1,333 @@
+// checks the pipeline parallelism of the scheduler with backends that do not support async compute:
+// a batch is split in micro-batches that are computed by a chain of CPU backends, one stage per backend,
+// once with a sequential scheduler and once with a pipelined one, and the outputs must be identical
+// the pipelined computation is also profiled, which must not change the outputs either
+// the stages that share a buffer type also share a compute buffer, so they must not be run on worker threads
+// a computation aborted on a worker thread must be reported once, by the compute if it has already failed or by the next synchronization
+
+#include "ggml.h"
+#include "ggml-alloc.h"
+#include "ggml-backend.h"
+#include "ggml-cpu.h"
+#include "../ggml/src/ggml-backend-impl.h"
+
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+static const int n_stages           = 3;
+static const int n_layers_per_stage = 4;
+static const int n_embd             = 256;
+static const int n_ubatch           = 32;
+static const int n_ubatches         = 12;
+
+struct test_model {
+    ggml_context * ctx = nullptr;
+    ggml_backend_buffer_t buf[n_stages] = {};
+
+    ggml_tensor * w[n_stages][n_layers_per_stage];
+    ggml_tensor * b[n_stages][n_layers_per_stage];
+};
+
+static void init_model(test_model & model, ggml_backend_buffer_type_t * bufts) {
+    ggml_init_params params = {
+        /*.mem_size   =*/ ggml_tensor_overhead()*2*n_stages*n_layers_per_stage,
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ true,
+    };
+    model.ctx = ggml_init(params);
+
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+
+    for (int s = 0; s < n_stages; ++s) {
+        for (int il = 0; il < n_layers_per_stage; ++il) {
+            model.w[s][il] = ggml_new_tensor_2d(model.ctx, GGML_TYPE_F32, n_embd, n_embd);
+            model.b[s][il] = ggml_new_tensor_1d(model.ctx, GGML_TYPE_F32, n_embd);
+        }
+    }
+
+    // the weights of each stage in the buffer of its backend
+    for (int s = 0; s < n_stages; ++s) {
+        size_t size = 0;
+        for (int il = 0; il < n_layers_per_stage; ++il) {
+            size += GGML_PAD(ggml_nbytes(model.w[s][il]), 64) + GGML_PAD(ggml_nbytes(model.b[s][il]), 64);
+        }
+        model.buf[s] = ggml_backend_buft_alloc_buffer(bufts[s], size + 64);
+
+        ggml_tallocr alloc = ggml_tallocr_new(model.buf[s]);
+        for (int il = 0; il < n_layers_per_stage; ++il) {
+            for (ggml_tensor * t : { model.w[s][il], model.b[s][il] }) {
+                ggml_tallocr_alloc(&alloc, t);
+
+                std::vector<float> data(ggml_nelements(t));
+                for (auto & x : data) {
+                    x = dist(rng)/16.0f;
+                }
+                ggml_backend_tensor_set(t, data.data(), 0, ggml_nbytes(t));
+            }
+        }
+    }
+}
+
+// a fresh graph for each micro-batch, built in the same meta buffer, like llama_decode does
+static ggml_cgraph * build_graph(const test_model & model, ggml_backend_sched_t sched, ggml_backend_t * backends,
+        std::vector<uint8_t> & buf_meta, ggml_tensor ** inp, ggml_tensor ** out) {
+    ggml_init_params params = {
+        /*.mem_size   =*/ buf_meta.size(),
+        /*.mem_buffer =*/ buf_meta.data(),
+        /*.no_alloc   =*/ true,
+    };
+    ggml_context * ctx = ggml_init(params);
+
+    ggml_cgraph * gf = ggml_new_graph(ctx);
+
+    ggml_tensor * cur = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_embd, n_ubatch);
+    ggml_set_input(cur);
+    ggml_backend_sched_set_tensor_backend(sched, cur, backends[0]);
+    *inp = cur;
+
+    for (int s = 0; s < n_stages; ++s) {
+        for (int il = 0; il < n_layers_per_stage; ++il) {
+            ggml_tensor * inpL = cur;
+
+            cur = ggml_rms_norm(ctx, cur, 1e-5f);
+            ggml_backend_sched_set_tensor_backend(sched, cur, backends[s]);
+            cur = ggml_mul_mat(ctx, model.w[s][il], cur);
+            ggml_backend_sched_set_tensor_backend(sched, cur, backends[s]);
+            cur = ggml_add(ctx, cur, model.b[s][il]);
+            ggml_backend_sched_set_tensor_backend(sched, cur, backends[s]);
+            cur = ggml_silu(ctx, cur);
+            ggml_backend_sched_set_tensor_backend(sched, cur, backends[s]);
+            cur = ggml_add(ctx, cur, inpL);
+            ggml_backend_sched_set_tensor_backend(sched, cur, backends[s]);
+        }
+    }
+
+    ggml_set_output(cur);
+    *out = cur;
+
+    ggml_build_forward_expand(gf, cur);
+
+    ggml_free(ctx);
+
+    return gf;
+}
+
+static std::vector<float> compute(const test_model & model, ggml_backend_t * backends, ggml_backend_buffer_type_t * bufts,
+        const std::vector<float> & input, bool parallel, int64_t & t_us, int64_t * busy_us, const char * trace = nullptr) {
+    ggml_backend_sched_t sched = ggml_backend_sched_new(backends, bufts, n_stages, GGML_DEFAULT_GRAPH_SIZE, parallel);
+    if (trace) {
+        ggml_backend_sched_set_profile(sched, GGML_BACKEND_SCHED_PROFILE_NODES);
+    }
+
+    std::vector<uint8_t> buf_meta(ggml_tensor_overhead()*GGML_DEFAULT_GRAPH_SIZE + ggml_graph_overhead());
+    std::vector<float> output(input.size());
+
+    const size_t n_ubatch_elements = (size_t) n_embd*n_ubatch;
+
+    const int64_t t_start_us = ggml_time_us();
+
+    for (int i = 0; i < n_ubatches; ++i) {
+        ggml_backend_sched_reset(sched);
+
+        ggml_tensor * inp;
+        ggml_tensor * out;
+        ggml_cgraph * gf = build_graph(model, sched, backends, buf_meta, &inp, &out);
+
+        if (!ggml_backend_sched_alloc_graph(sched, gf)) {
+            fprintf(stderr, "%s: failed to allocate the graph\n", __func__);
+            exit(1);
+        }
+
+        ggml_backend_tensor_set(inp, input.data() + i*n_ubatch_elements, 0, ggml_nbytes(inp));
+
+        if (ggml_backend_sched_graph_compute_async(sched, gf) != GGML_STATUS_SUCCESS) {
+            fprintf(stderr, "%s: failed to compute the graph\n", __func__);
+            exit(1);
+        }
+
+        ggml_backend_t backend_out = ggml_backend_sched_get_tensor_backend(sched, out);
+        ggml_backend_tensor_get_async(backend_out, out, output.data() + i*n_ubatch_elements, 0, ggml_nbytes(out));
+    }
+
+    ggml_backend_sched_synchronize(sched);
+
+    t_us = ggml_time_us() - t_start_us;
+
+    for (int s = 0; s < n_stages; ++s) {
+        busy_us[s] = ggml_backend_sched_get_busy_us(sched, backends[s]);
+    }
+
+    if (trace && !ggml_backend_sched_write_trace(sched, trace)) {
+        fprintf(stderr, "%s: failed to write the trace\n", __func__);
+        exit(1);
+    }
+
+    ggml_backend_sched_free(sched);
+
+    return output;
+}
+
+static bool abort_always(void * data) {
+    GGML_UNUSED(data);
+    return true;
+}
+
+// computes one micro-batch with the last stage aborted, returns the status of the compute and of the two synchronizations
+static void compute_aborted(const test_model & model, ggml_backend_t * backends, ggml_backend_buffer_type_t * bufts, enum ggml_status * status) {
+    ggml_backend_sched_t sched = ggml_backend_sched_new(backends, bufts, n_stages, GGML_DEFAULT_GRAPH_SIZE, true);
+
+    std::vector<uint8_t> buf_meta(ggml_tensor_overhead()*GGML_DEFAULT_GRAPH_SIZE + ggml_graph_overhead());
+    std::vector<float> input((size_t) n_embd*n_ubatch, 0.5f);
+
+    ggml_tensor * inp;
+    ggml_tensor * out;
+    ggml_cgraph * gf = build_graph(model, sched, backends, buf_meta, &inp, &out);
+
+    if (!ggml_backend_sched_alloc_graph(sched, gf)) {
+        fprintf(stderr, "%s: failed to allocate the graph\n", __func__);
+        exit(1);
+    }
+
+    ggml_backend_tensor_set(inp, input.data(), 0, ggml_nbytes(inp));
+
+    ggml_backend_cpu_set_abort_callback(backends[n_stages - 1], abort_always, nullptr);
+
+    status[0] = ggml_backend_sched_graph_compute_async(sched, gf);
+    status[1] = ggml_backend_sched_synchronize(sched);
+    status[2] = ggml_backend_sched_synchronize(sched);
+
+    ggml_backend_cpu_set_abort_callback(backends[n_stages - 1], nullptr, nullptr);
+
+    ggml_backend_sched_free(sched);
+}
+
+int main(void) {
+    ggml_time_init();
+
+    ggml_backend_t backends[n_stages];
+
+    // a distinct buffer type for each stage, otherwise the scheduler shares a compute buffer between the stages
+    ggml_backend_buffer_type   bufts_data[n_stages];
+    ggml_backend_buffer_type_t bufts[n_stages];
+    ggml_backend_buffer_type_t bufts_shared[n_stages];
+
+    for (int s = 0; s < n_stages; ++s) {
+        backends[s] = ggml_backend_cpu_init();
+        ggml_backend_cpu_set_n_threads(backends[s], 1);
+
+        bufts_data[s] = *ggml_backend_cpu_buffer_type();
+        bufts[s] = &bufts_data[s];
+        bufts_shared[s] = ggml_backend_cpu_buffer_type();
+    }
+
+    test_model model;
+    init_model(model, bufts);
+
+    std::mt19937 rng(1234);
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+    std::vector<float> input((size_t) n_embd*n_ubatch*n_ubatches);
+    for (auto & x : input) {
+        x = dist(rng);
+    }
+
+    int64_t t_seq_us = 0;
+    int64_t t_pp_us  = 0;
+    int64_t busy_seq_us[n_stages];
+    int64_t busy_pp_us[n_stages];
+    int64_t t_prof_us = 0;
+    int64_t busy_prof_us[n_stages];
+
+    const auto res_seq = compute(model, backends, bufts, input, false, t_seq_us, busy_seq_us);
+    const auto res_pp  = compute(model, backends, bufts, input, true,  t_pp_us,  busy_pp_us);
+
+    int64_t t_shared_us = 0;
+    int64_t busy_shared_us[n_stages];
+    const auto res_shared = compute(model, backends, bufts_shared, input, true, t_shared_us, busy_shared_us);
+
+    enum ggml_status status_aborted[3];
+    compute_aborted(model, backends, bufts, status_aborted);
+
+    const std::string trace = "test-sched-pipeline-trace.json";
+    const auto res_prof = compute(model, backends, bufts, input, true, t_prof_us, busy_prof_us, trace.c_str());
+
+    printf("%s: %d stages, %d micro-batches of %d tokens\n", __func__, n_stages, n_ubatches, n_ubatch);
+    printf("%s: sequential %.2f ms, pipelined %.2f ms, speedup %.2fx\n", __func__, t_seq_us/1000.0, t_pp_us/1000.0, (double) t_seq_us/t_pp_us);
+    for (int s = 0; s < n_stages; ++s) {
+        printf("%s: stage %d busy %.2f ms, utilisation %.1f%%\n", __func__, s, busy_pp_us[s]/1000.0, 100.0*busy_pp_us[s]/t_pp_us);
+    }
+
+    int ret = 0;
+
+    for (int s = 0; s < n_stages; ++s) {
+        if (busy_seq_us[s] != -1 || busy_pp_us[s] <= 0) {
+            fprintf(stderr, "%s: stage %d is not run on a worker thread with pipeline parallelism only\n", __func__, s);
+            ret = 1;
+        }
+    }
+
+    if (res_seq.size() != res_pp.size() || memcmp(res_seq.data(), res_pp.data(), res_seq.size()*sizeof(float)) != 0) {
+        fprintf(stderr, "%s: the outputs differ\n", __func__);
+        ret = 1;
+    } else {
+        printf("%s: the outputs are identical\n", __func__);
+    }
+
+    for (int s = 0; s < n_stages; ++s) {
+        if (busy_shared_us[s] != -1) {
+            fprintf(stderr, "%s: stage %d is run on a worker thread with a shared buffer type\n", __func__, s);
+            ret = 1;
+        }
+    }
+
+    if (res_seq.size() != res_shared.size() || memcmp(res_seq.data(), res_shared.data(), res_seq.size()*sizeof(float)) != 0) {
+        fprintf(stderr, "%s: the outputs with a shared buffer type differ\n", __func__);
+        ret = 1;
+    }
+
+    const int n_aborted = (status_aborted[0] == GGML_STATUS_ABORTED) + (status_aborted[1] == GGML_STATUS_ABORTED);
+    if (n_aborted != 1 || status_aborted[2] != GGML_STATUS_SUCCESS) {
+        fprintf(stderr, "%s: the aborted computation is reported as %d, %d, %d\n", __func__,
+                status_aborted[0], status_aborted[1], status_aborted[2]);
+        ret = 1;
+    }
+
+    if (res_seq.size() != res_prof.size() || memcmp(res_seq.data(), res_prof.data(), res_seq.size()*sizeof(float)) != 0) {
+        fprintf(stderr, "%s: the outputs of the profiled computation differ\n", __func__);
+        ret = 1;
+    }
+
+    // the trace has a node event for each node of each micro-batch
+    FILE * f = fopen(trace.c_str(), "rb");
+    int n_node_events = 0;
+    if (f) {
+        std::string json;
+        char buf[4096];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+            json.append(buf, n);
+        }
+        fclose(f);
+        for (size_t pos = 0; (pos = json.find("\"cat\":\"node\"", pos)) != std::string::npos; pos++) {
+            n_node_events++;
+        }
+    }
+    remove(trace.c_str());
+
+    const int n_nodes_expected = n_ubatches*n_stages*n_layers_per_stage*5;
+    if (n_node_events != n_nodes_expected) {
+        fprintf(stderr, "%s: the trace has %d node events instead of %d\n", __func__, n_node_events, n_nodes_expected);
+        ret = 1;
+    }
+
+    ggml_free(model.ctx);
+    for (int s = 0; s < n_stages; ++s) {
+        ggml_backend_buffer_free(model.buf[s]);
+        ggml_backend_free(backends[s]);
+    }
+
+    return ret;
+}
@@ -252,6 +252,28 @@ int main(int argc, char **argv) {
         threads[i].join();
     }
 
+    // chunked tokenization of a long text must match the serial one
+    if (!k_tests.empty()) {
+        std::string text;
+        while (text.size() < 512*1024) {
+            for (const auto & test_kv : k_tests) {
+                text += test_kv.first;
+                text += " ";
+            }
+        }
+
+        const llama_vocab * vocab = llama_model_get_vocab(model);
+
+        const std::vector<llama_token> res_serial   = common_tokenize(vocab, text, add_special, false);
+        const std::vector<llama_token> res_parallel = common_tokenize(vocab, text, add_special, false, 4);
+
+        if (res_serial != res_parallel) {
+            fprintf(stderr, "%s : failed test: parallel tokenization of %zu bytes differs from the serial one (%zu vs %zu tokens)\n",
+                    __func__, text.size(), res_parallel.size(), res_serial.size());
+            success = false;
+        }
+    }
+
     // single threaded tokenization
     if (!fname_text.empty()) {
         fprintf(stderr, "%s : tokenizing: '%s'\n", __func__, fname_text.c_str());
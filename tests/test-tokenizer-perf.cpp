@@ -0,0 +1,113 @@
+#include "llama.h"
+#include "common.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// mix of prose, code, numbers and non-latin scripts, repeated to the requested size
+static const char * text_sample =
+    "The quick brown fox jumps over the lazy dog. It's 3:45 PM and we've got 1,234,567.89 reasons to stay.\n"
+    "    def tokenize(self, text: str) -> list[int]:\n"
+    "        return [self.vocab.get(w, -1) for w in text.split()]  # TODO: handle   multiple spaces\n"
+    "\t\tif (x != y && z >= 0x7fff) { printf(\"%d\\n\", x); }\n\n\n"
+    "Retrieval-augmented generation (RAG) documents are often long: 2024-10-18T12:34:56Z, v1.2.3, #hashtag @user\n"
+    "Les élèves ont étudié l'histoire de la Révolution française pendant 2 heures.\n"
+    "Москва — столица России, население около 13 миллионов человек.\n"
+    "東京は日本の首都です。人口は約1400万人です。北京是中国的首都。서울은 한국의 수도입니다.\n"
+    "مرحبا بالعالم — Ελληνικά κείμενα — हिन्दी पाठ — 🦙🚀✨ emoji and ümlauts: ÄÖÜß\n";
+
+int main(int argc, char ** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <vocab-file> [text-file] [n_mb]\n", argv[0]);
+        return 1;
+    }
+
+    const std::string fname = argv[1];
+
+    std::string text;
+    if (argc > 2 && std::string(argv[2]) != "-") {
+        std::ifstream f(argv[2]);
+        if (!f) {
+            fprintf(stderr, "%s: error: failed to open '%s'\n", __func__, argv[2]);
+            return 1;
+        }
+        std::stringstream ss;
+        ss << f.rdbuf();
+        text = ss.str();
+    } else {
+        const size_t n_bytes = (argc > 3 ? std::atof(argv[3]) : 1.0)*1024*1024;
+        while (text.size() < n_bytes) {
+            text += text_sample;
+        }
+    }
+
+    llama_backend_init();
+
+    auto mparams = llama_model_default_params();
+    mparams.vocab_only = true;
+
+    llama_model * model = llama_model_load_from_file(fname.c_str(), mparams);
+    if (model == NULL) {
+        fprintf(stderr, "%s: error: failed to load vocab '%s'\n", __func__, fname.c_str());
+        return 1;
+    }
+
+    const llama_vocab * vocab = llama_model_get_vocab(model);
+
+    std::vector<llama_token> tokens;
+    std::vector<llama_token> tokens_ref;
+
+    // the first run fills the caches of the tokenizer
+    for (int run = 0; run < 3; ++run) {
+        const auto t_start = std::chrono::high_resolution_clock::now();
+
+        tokens = common_tokenize(vocab, text, false, true);
+
+        const auto t_end = std::chrono::high_resolution_clock::now();
+
+        const double t_s = std::chrono::duration<double>(t_end - t_start).count();
+
+        printf("%s: run %d: %zu bytes -> %zu tokens in %.3f ms, %.2f MB/s\n",
+                __func__, run, text.size(), tokens.size(), 1e3*t_s, text.size()/t_s/1024.0/1024.0);
+
+        if (run == 0) {
+            tokens_ref = tokens;
+        } else if (tokens != tokens_ref) {
+            fprintf(stderr, "%s: error: run %d differs from the first run\n", __func__, run);
+            return 1;
+        }
+    }
+
+    // chunked tokenization on several threads, must match the serial one
+    {
+        const int n_threads = std::max(4, (int) std::thread::hardware_concurrency());
+
+        const auto t_start = std::chrono::high_resolution_clock::now();
+
+        tokens = common_tokenize(vocab, text, false, true, n_threads);
+
+        const auto t_end = std::chrono::high_resolution_clock::now();
+
+        const double t_s = std::chrono::duration<double>(t_end - t_start).count();
+
+        printf("%s: %d threads: %zu bytes -> %zu tokens in %.3f ms, %.2f MB/s\n",
+                __func__, n_threads, text.size(), tokens.size(), 1e3*t_s, text.size()/t_s/1024.0/1024.0);
+
+        if (tokens != tokens_ref) {
+            fprintf(stderr, "%s: error: the parallel tokenization differs from the serial one\n", __func__);
+            return 1;
+        }
+    }
+
+    llama_model_free(model);
+    llama_backend_free();
+
+    return 0;
+}
@@ -0,0 +1,178 @@
+// compares the custom pre-tokenizer splitters in unicode.cpp with the std::regex fallback they replace
+
+#include "unicode.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+struct test_regex_set {
+    const char * name;
+    std::vector<std::string> regex_exprs;
+};
+
+// the regex sets of llama-vocab.cpp that have a custom splitter
+static const std::vector<test_regex_set> regex_sets = {
+    { "gpt-2", {
+        "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)",
+    }},
+    { "llama3", {
+        "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
+    }},
+    { "qwen2", {
+        "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
+    }},
+    { "deepseek-llm", {
+        "[\r\n]",
+        "\\s?[A-Za-zµÀ-ÖØ-öø-ƺƼ-ƿǄ-ʓʕ-ʯͰ-ͳͶͷͻ-ͽͿΆΈ-ΊΌΎ-ΡΣ-ϵϷ-ҁҊ-ԯԱ-ՖႠ-ჅᎠ-Ᏽᏸ-ᏽᲐ-ᲺᲽ-Ჿᴀ-ᴫᵫ-ᵷᵹ-ᶚḀ-ἕἘ-Ἕἠ-ὅὈ-Ὅὐ-ὗὙὛὝὟ-ώᾀ-ᾴᾶ-ᾼιῂ-ῄῆ-ῌῐ-ΐῖ-Ίῠ-Ῥῲ-ῴῶ-ῼℂℇℊ-ℓℕℙ-ℝℤΩℨK-ℭℯ-ℴℹℼ-ℿⅅ-ⅉⅎↃↄⰀ-ⱻⱾ-ⳤⳫ-ⳮⳲⳳꙀ-ꙭꚀ-ꚛꜢ-ꝯꝱ-ꞇꞋ-ꞎꭰ-ꮿﬀ-ﬆﬓ-ﬗＡ-Ｚａ-ｚ𐐀-𐑏𐒰-𐓓𐓘-𐓻𐲀-𐲲𐳀-𐳲𑢠-𑣟𞤀-𞥃]+",
+        "\\s?[!-/:-~！-／：-～‘-‟　-。]+",
+        "\\s+$",
+        "[一-龥ࠀ-一가-퟿]+",
+        "\\p{N}+",
+    }},
+    { "deepseek-coder", {
+        "[\r\n]",
+        "\\s?\\p{L}+",
+        "\\s?\\p{P}+",
+        "[一-龥ࠀ-一가-퟿]+",
+        "\\p{N}",
+    }},
+    { "falcon", {
+        "[\\p{P}\\$\\+<=>\\^~\\|`]+",
+        "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)",
+        "[0-9][0-9][0-9]",
+    }},
+    { "default", {
+        "[\\p{P}\\$\\+<=>\\^~\\|]+",
+        "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)",
+        "\\p{N}+",
+        "[0-9][0-9][0-9]",
+    }},
+};
+
+static const std::vector<std::string> edge_cases = {
+    "",
+    " ",
+    "  ",
+    "\n",
+    "\r\n",
+    " \n \n ",
+    "\t\t\r\n\r\n  \t",
+    "   leading and trailing   ",
+    "Hello world",
+    "Hello  world  ",
+    "'s 't 're 've 'm 'll 'd",
+    "'S 'T 'RE 'Ve 'M 'lL 'D",
+    "don't WON'T it's I'LL",
+    "' s''s'''",
+    "1 12 123 1234 12345 123456 1234567",
+    "3.14159, 2.71828; 1e-10",
+    "x=y+z*(a-b)/c^d~e|f<g>h$i`j",
+    "!!! ??? ... ,,, --- ___",
+    "\xc2\xa0nbsp\xc2\xa0\xc2\xa0",              // U+00A0
+    "\xe3\x80\x80ideographic\xe3\x80\x80space",  // U+3000
+    "next\xc2\x85line",                          // U+0085
+    "line\xe2\x80\xa8separator",                 // U+2028
+    "zero\xe2\x80\x8bwidth",                     // U+200B
+    "e\xcc\x81\xcc\x81 combining",               // U+0301
+    "\xd9\xa3\xd9\xa4\xd9\xa5 arabic-indic",     // U+0663..U+0665
+    "\xe2\x85\xa0\xe2\x85\xa1 roman",            // U+2160..U+2161
+    "Москва — столица России",
+    "東京は日本の首都です。北京是中国的首都。",
+    "서울은 한국의 수도입니다.",
+    "مرحبا بالعالم",
+    "Ελληνικά κείμενα",
+    "हिन्दी पाठ",
+    "🦙🚀✨ emoji 😀😀",
+    "ＡＢＣ！１２３？",
+    "\xf0\x9f\x98\x80\n\n\xf0\x9f\x98\x80  ",
+};
+
+// codepoints that are likely to hit the corner cases of the splitters
+static const std::vector<uint32_t> interesting_cpts = {
+    ' ', '\t', '\n', '\r', '\v', '\f', '\'', '"', '.', ',', '!', '?', '$', '+', '<', '=', '>', '^', '`', '|', '~', '-', '_',
+    '0', '1', '9', 'a', 's', 't', 'l', 'd', 'S', 'T', 'L', 'D', 'z', 'Z',
+    0x1C, 0x1F, 0x85, 0xA0, 0xB5, 0xC0, 0xD7, 0xF7, 0x1680, 0x2000, 0x200B, 0x2028, 0x2029, 0x202F, 0x205F, 0x3000,
+    0x301, 0x660, 0x669, 0x2160, 0x2018, 0x201F, 0x3002, 0x3001, 0x4E00, 0x9FA5, 0xAC00, 0xD7FF, 0x800, 0xFF01, 0xFF21,
+    0x10400, 0x1F600, 0x1F999, 0xE000, 0xFFFD, 0x10FFFF,
+};
+
+static std::string random_text(std::mt19937 & rng) {
+    std::uniform_int_distribution<size_t>   dist_len(1, 48);
+    std::uniform_int_distribution<int>      dist_kind(0, 3);
+    std::uniform_int_distribution<size_t>   dist_interesting(0, interesting_cpts.size() - 1);
+    std::uniform_int_distribution<uint32_t> dist_ascii(0x01, 0x7F);
+    std::uniform_int_distribution<uint32_t> dist_bmp(0x80, 0xFFFF);
+    std::uniform_int_distribution<uint32_t> dist_any(0x80, 0x10FFFF);
+
+    std::string text;
+    const size_t n = dist_len(rng);
+    for (size_t i = 0; i < n; ++i) {
+        uint32_t cpt = 0;
+        switch (dist_kind(rng)) {
+            case 0:  cpt = interesting_cpts[dist_interesting(rng)]; break;
+            case 1:  cpt = dist_ascii(rng); break;
+            case 2:  cpt = dist_bmp(rng);   break;
+            default: cpt = dist_any(rng);   break;
+        }
+        if (0xD800 <= cpt && cpt <= 0xDFFF) {
+            cpt = 0xFFFD; // no surrogates in UTF-8
+        }
+        text += unicode_cpt_to_utf8(cpt);
+    }
+    return text;
+}
+
+static void print_words(const char * label, const std::vector<std::string> & words) {
+    fprintf(stderr, "    %s:", label);
+    for (const auto & word : words) {
+        fprintf(stderr, " [%s]", word.c_str());
+    }
+    fprintf(stderr, "\n");
+}
+
+static bool test_split(const test_regex_set & set, const std::string & text) {
+    const auto words_custom = unicode_regex_split(text, set.regex_exprs);
+    const auto words_stl    = unicode_regex_split(text, set.regex_exprs, /*use_custom =*/ false);
+
+    if (words_custom == words_stl) {
+        return true;
+    }
+
+    fprintf(stderr, "%s : %s: split mismatch for codepoints:", __func__, set.name);
+    for (const uint32_t cpt : unicode_cpts_from_utf8(text)) {
+        fprintf(stderr, " %04X", cpt);
+    }
+    fprintf(stderr, "\n");
+    print_words("custom", words_custom);
+    print_words("stl   ", words_stl);
+
+    return false;
+}
+
+int main(int argc, char ** argv) {
+    const int n_random = argc > 1 ? std::stoi(argv[1]) : 500;
+
+    std::mt19937 rng(42);
+
+    std::vector<std::string> texts = edge_cases;
+    for (int i = 0; i < n_random; ++i) {
+        texts.push_back(random_text(rng));
+    }
+
+    int n_failed = 0;
+    for (const auto & set : regex_sets) {
+        int n_failed_set = 0;
+        for (const auto & text : texts) {
+            if (!test_split(set, text)) {
+                n_failed_set++;
+            }
+        }
+        fprintf(stderr, "%s : %-14s %zu texts, %d mismatches\n", __func__, set.name, texts.size(), n_failed_set);
+        n_failed += n_failed_set;
+    }
+
+    return n_failed == 0 ? 0 : 1;
+}